@@ -0,0 +1,109 @@
+/****************************************************************************
+** libebml : parse EBML files, see http://embl.sourceforge.net/
+**
+** <file/class description>
+**
+** Copyright (C) 2002-2010 Steve Lhomme.  All rights reserved.
+**
+** This file is part of libebml.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+** 
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+** 
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+** See http://www.matroska.org/license/lgpl/ for LGPL licensing information.
+**
+** Contact license@matroska.org if any conditions of this licensing are
+** not clear to you.
+**
+**********************************************************************/
+
+/*!
+	\file
+	\version \$Id$
+	\brief in-memory IOCallback storing the data in a list of fixed size chunks
+*/
+#ifndef LIBEBML_CHUNKEDMEMIOCALLBACK_H
+#define LIBEBML_CHUNKEDMEMIOCALLBACK_H
+
+#include <vector>
+
+#include "IOCallback.h"
+
+START_LIBEBML_NAMESPACE
+
+/*!
+	\class ChunkedMemIOCallback
+	\brief IOCallback writing to memory without ever moving what was written
+
+	The data goes to chunks of ChunkSize bytes allocated when needed, so that
+	growing costs one malloc() per chunk and no copy. Positions start at
+	BaseOffset: an element can be rendered here with the positions it will
+	have in the final file, then written there with WriteTo() in large
+	sequential writes, or taken with TakeChunks() for another thread or a
+	socket. Reset() keeps the chunks, and so does ReturnChunks() once the
+	taken ones are done with, so rendering one element after another only
+	allocates until the largest one fits.
+*/
+class EBML_DLL_API ChunkedMemIOCallback : public IOCallback
+{
+public:
+	struct Chunk {
+		binary * Buffer; ///< allocated with malloc(), ChunkSize bytes
+		size_t   Size;   ///< number of bytes used in the buffer
+	};
+
+	ChunkedMemIOCallback(size_t ChunkSize = 1024*1024, uint64 BaseOffset = 0);
+	virtual ~ChunkedMemIOCallback();
+
+	virtual uint32 read(void *Buffer, size_t Size);
+	/// the position can't go before the base offset
+	virtual void setFilePointer(int64 Offset, seek_mode Mode=seek_beginning);
+	virtual size_t write(const void *Buffer, size_t Size);
+	virtual uint64 getFilePointer() {return Position;}
+	virtual void close() {}
+
+	uint64 GetBaseOffset() const {return BaseOffset;}
+	/// number of bytes held after the base offset
+	uint64 GetDataSize() const {return DataSize;}
+
+	/// write the data held to another IOCallback, one chunk at a time
+	void WriteTo(IOCallback & Output) const;
+
+	/*!
+		\brief give the written chunks to the caller without copying them
+		The caller owns the buffers until it gives them back with
+		ReturnChunks() or frees them with FreeChunks(). What is written next
+		starts at the position following the data taken.
+	*/
+	void TakeChunks(std::vector<Chunk> & Taken);
+	/// keep the taken chunks for the data written next
+	void ReturnChunks(std::vector<Chunk> & Taken);
+	static void FreeChunks(std::vector<Chunk> & Taken);
+
+	/// drop the data and restart at another base offset, the chunks are kept
+	void Reset(uint64 NewBaseOffset);
+
+protected:
+	bool Reserve(uint64 NeededSize);
+
+	std::vector<binary *> Chunks;
+	size_t ChunkSize;
+	uint64 BaseOffset;
+	uint64 Position;  ///< absolute, BaseOffset included
+	uint64 DataSize;
+};
+
+END_LIBEBML_NAMESPACE
+
+#endif // LIBEBML_CHUNKEDMEMIOCALLBACK_H
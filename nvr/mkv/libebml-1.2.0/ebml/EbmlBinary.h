@@ -70,6 +70,7 @@ class EBML_DLL_API EbmlBinary : public EbmlElement {
 	
 		void SetBuffer(const binary *Buffer, const uint32 BufferSize) {
 			Data = (binary *) Buffer;
+			bDataPooled = false;
 			SetSize_(BufferSize);
 			SetValueIsSet();
 		}
@@ -77,8 +78,7 @@ class EBML_DLL_API EbmlBinary : public EbmlElement {
 		binary *GetBuffer() const {return Data;}
 		
 		void CopyBuffer(const binary *Buffer, const uint32 BufferSize) {
-			if (Data != NULL)
-				free(Data);
+			FreeData();
 			Data = (binary *)malloc(BufferSize * sizeof(binary));
 			memcpy(Data, Buffer, BufferSize);
 			SetSize_(BufferSize);
@@ -99,6 +99,9 @@ class EBML_DLL_API EbmlBinary : public EbmlElement {
 	protected:
 #endif
 		binary *Data; // the binary data inside the element
+		bool bDataPooled; // Data comes from EbmlElementPool::Allocate()
+
+		void FreeData();
 };
 
 END_LIBEBML_NAMESPACE
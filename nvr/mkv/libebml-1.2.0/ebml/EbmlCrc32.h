@@ -72,6 +72,14 @@ DECLARE_EBML_BINARY(EbmlCrc32)
 			Add data to the CRC table, in other words process some data bit by bit
 		*/
 		void Update(const binary *input, uint32 length);
+		/*!
+			Process some data on a raw (not finalized) CRC register with the fastest kernel available
+		*/
+		static uint32 UpdateCrc(uint32 crc, const binary *input, uint32 length);
+		/*!
+			Same as UpdateCrc() with the portable table, 4 bytes at a time
+		*/
+		static uint32 UpdateCrcWords(uint32 crc, const binary *input, uint32 length);
 		/*!
 			Use this with Update() to Finalize() or Complete the CRC32
 		*/
@@ -37,6 +37,7 @@
 #include "EbmlTypes.h"
 #include "EbmlId.h"
 #include "IOCallback.h"
+#include "EbmlElementPool.h"
 
 START_LIBEBML_NAMESPACE
 
@@ -366,6 +367,10 @@ class EBML_DLL_API EbmlElement {
 		EbmlElement(uint64 aDefaultSize, bool bValueSet = false);
 		virtual ~EbmlElement();
 
+		/// elements take their storage from the current EbmlElementPool, if any
+		static void * operator new(size_t Size) {return EbmlElementPool::Allocate(Size);}
+		static void operator delete(void * Ptr) {EbmlElementPool::Free(Ptr);}
+
 		/// Set the minimum length that will be used to write the element size (-1 = optimal)
 		void SetSizeLength(int NewSizeLength) {SizeLength = NewSizeLength;}
 		int GetSizeLength() const {return SizeLength;}
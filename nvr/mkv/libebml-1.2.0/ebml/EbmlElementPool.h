@@ -0,0 +1,134 @@
+/****************************************************************************
+** libebml : parse EBML files, see http://embl.sourceforge.net/
+**
+** <file/class description>
+**
+** Copyright (C) 2002-2010 Steve Lhomme.  All rights reserved.
+**
+** This file is part of libebml.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+** 
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+** 
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+** See http://www.matroska.org/license/lgpl/ for LGPL licensing information.
+**
+** Contact license@matroska.org if any conditions of this licensing are
+** not clear to you.
+**
+**********************************************************************/
+
+/*!
+	\file
+	\version \$Id$
+	\brief recycling allocator for elements and binary data created while parsing
+*/
+#ifndef LIBEBML_ELEMENT_POOL_H
+#define LIBEBML_ELEMENT_POOL_H
+
+#include <cstddef>
+
+#include "EbmlTypes.h"
+
+#if defined(_MSC_VER)
+#define EBML_POOL_THREAD_LOCAL __declspec(thread)
+#else
+#define EBML_POOL_THREAD_LOCAL __thread
+#endif
+
+START_LIBEBML_NAMESPACE
+
+/*!
+	\class EbmlElementPool
+	\brief Keep the storage of released elements/buffers and hand it out again
+
+	A pool is made current for the calling thread with an EbmlElementPool::Scope.
+	While it is current every EbmlElement (and EbmlBinary data) created on that
+	thread takes its storage from the pool; deleting the object gives the storage
+	back to the pool it came from, whatever pool is current at that time.
+
+	Free lists are kept per size class. Every element class has a fixed size, so
+	this amounts to one list per EbmlCallbacks; binary data uses power of two
+	classes so that frames of slightly different sizes share the same blocks.
+
+	A pool is not thread safe, it must only be used by one thread at a time.
+	It has to be created with new and given back with Dispose(), the last
+	outstanding block keeps it alive when it is disposed too early.
+*/
+class EBML_DLL_API EbmlElementPool {
+	public:
+		EbmlElementPool();
+
+		/// release the pool, the memory is really freed when all the blocks came back
+		void Dispose();
+
+		/// allocate from the current pool of this thread, or from the heap if there is none
+		static void * Allocate(size_t Size);
+		/// give a block obtained with Allocate() back
+		static void Free(void * Ptr);
+
+		static EbmlElementPool * GetCurrent() {return Current;}
+
+		/// number of requests served by the pool
+		uint64 GetRequestCount() const {return RequestCount;}
+		/// number of requests that had to go to the heap
+		uint64 GetHeapAllocationCount() const {return HeapAllocationCount;}
+		/// number of blocks currently handed out
+		uint32 GetOutstandingCount() const {return OutstandingCount;}
+		/// bytes kept in the free lists
+		size_t GetIdleBytes() const {return IdleBytes;}
+
+		/*!
+			\class Scope
+			\brief make a pool current for the calling thread until the end of the scope
+		*/
+		class EBML_DLL_API Scope {
+			public:
+				Scope(EbmlElementPool & aPool);
+				~Scope();
+			private:
+				EbmlElementPool * Previous;
+		};
+
+	private:
+		~EbmlElementPool();
+		EbmlElementPool(const EbmlElementPool &);
+		EbmlElementPool & operator=(const EbmlElementPool &);
+
+		enum {
+			SMALL_CLASS_STEP = 16,
+			SMALL_CLASS_LIMIT = 512,
+			SIZE_CLASS_COUNT = SMALL_CLASS_LIMIT / SMALL_CLASS_STEP + 20
+		};
+
+		struct BlockHeader;
+		static int GetSizeClass(size_t Size);
+		static size_t GetClassSize(int Class);
+		void * Get(size_t Size);
+		void Put(BlockHeader * Block);
+		void FreeIdleBlocks();
+
+		BlockHeader * FreeList[SIZE_CLASS_COUNT];
+		uint64 RequestCount;
+		uint64 HeapAllocationCount;
+		uint32 OutstandingCount;
+		size_t IdleBytes;
+		bool bDisposed;
+
+		static const size_t HeaderSize;
+		static EBML_POOL_THREAD_LOCAL EbmlElementPool * Current;
+};
+
+END_LIBEBML_NAMESPACE
+
+#endif // LIBEBML_ELEMENT_POOL_H
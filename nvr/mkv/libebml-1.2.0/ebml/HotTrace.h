@@ -0,0 +1,157 @@
+/****************************************************************************
+** libebml : parse EBML files, see http://embl.sourceforge.net/
+**
+** <file/class description>
+**
+** Copyright (C) 2002-2010 Steve Lhomme.  All rights reserved.
+**
+** This file is part of libebml.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+** 
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+** 
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+** See http://www.matroska.org/license/lgpl/ for LGPL licensing information.
+**
+** Contact license@matroska.org if any conditions of this licensing are
+** not clear to you.
+**
+**********************************************************************/
+
+/*!
+	\file
+	\version \$Id$
+	\brief per-thread event rings to trace the hot paths
+*/
+#ifndef LIBEBML_HOT_TRACE_H
+#define LIBEBML_HOT_TRACE_H
+
+#include "EbmlTypes.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif !defined(__GNUC__) || (!defined(__i386__) && !defined(__x86_64__))
+#include <time.h>
+#endif
+
+START_LIBEBML_NAMESPACE
+
+/*!
+	\class HotTrace
+	\brief Record how long the hot paths take, per thread, into fixed rings
+
+	Nothing is recorded until Enable() is called. The first event of a thread
+	gives it a ring of its last RING_SIZE events, after that recording takes
+	no lock and allocates nothing: two time stamps and a store into the ring.
+	When a ring is full its oldest events are overwritten. The ring of a
+	thread that ends is taken over by the next new thread.
+
+	Dump() writes what the rings hold in the Chrome trace event format, to be
+	loaded in chrome://tracing or Perfetto. It may be called while threads go
+	on recording.
+
+	Event names must be string literals, only the pointer is kept. Building
+	with EBML_NO_HOT_TRACE defined compiles the HOT_TRACE_* macros out.
+*/
+class EBML_DLL_API HotTrace {
+	public:
+		enum {
+			RING_SIZE = 1 << 15,    ///< events kept per thread, a power of two
+			MAX_THREAD_COUNT = 256  ///< rings at most, threads beyond are not recorded
+		};
+
+		/// start recording, the time base of the dump is taken on the first call
+		static void Enable();
+		/// stop recording, the events recorded so far are kept for Dump()
+		static void Disable();
+		static bool IsEnabled() {return bEnabled;}
+
+		/// name the calling thread in the dump
+		static void SetThreadName(const char * Name);
+
+		/// record an event of the calling thread from Begin to End, both taken with Now()
+		static void Record(const char * Name, uint64 Begin, uint64 End, uint64 Arg = 0);
+
+		/// write the events of all the threads as Chrome trace JSON
+		static bool Dump(const char * Path);
+
+		/// the current time in ticks of the cheapest clock available
+		static uint64 Now()
+		{
+#if defined(_MSC_VER)
+			return __rdtsc();
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+			uint32 Low, High;
+			__asm__ __volatile__("rdtsc" : "=a" (Low), "=d" (High));
+			return ((uint64)High << 32) | Low;
+#else
+			struct timespec Time;
+			clock_gettime(CLOCK_MONOTONIC, &Time);
+			return (uint64)Time.tv_sec * 1000000000ull + Time.tv_nsec;
+#endif
+		}
+
+	private:
+		static volatile bool bEnabled;
+};
+
+/*!
+	\class HotTraceScope
+	\brief record the time spent from its construction to the end of the scope
+*/
+class HotTraceScope {
+	public:
+		HotTraceScope(const char * aName)
+			:Name(aName)
+			,Begin(HotTrace::IsEnabled() ? HotTrace::Now() : 0)
+			,Arg(0)
+		{}
+
+		~HotTraceScope()
+		{
+			if (Begin != 0)
+				HotTrace::Record(Name, Begin, HotTrace::Now(), Arg);
+		}
+
+		/// a number shown with the event, e.g. a size
+		void SetArg(uint64 aArg) {Arg = aArg;}
+
+	private:
+		const char * Name;
+		uint64 Begin;
+		uint64 Arg;
+};
+
+END_LIBEBML_NAMESPACE
+
+#if defined(NO_NAMESPACE)
+#define HOT_TRACE_NAMESPACE
+#else
+#define HOT_TRACE_NAMESPACE LIBEBML_NAMESPACE::
+#endif
+
+#if !defined(EBML_NO_HOT_TRACE)
+/// trace the rest of the enclosing block, once per block
+#define HOT_TRACE_SCOPE(name)          HOT_TRACE_NAMESPACE HotTraceScope hotTraceScope(name)
+#define HOT_TRACE_ARG(arg)             hotTraceScope.SetArg(arg)
+/// the begin of an event ending in another function, 0 when not recording
+#define HOT_TRACE_NOW()                (HOT_TRACE_NAMESPACE HotTrace::IsEnabled() ? HOT_TRACE_NAMESPACE HotTrace::Now() : 0)
+#define HOT_TRACE_RECORD(name, begin)  do { if ((begin) != 0) HOT_TRACE_NAMESPACE HotTrace::Record(name, begin, HOT_TRACE_NAMESPACE HotTrace::Now()); } while (0)
+#else
+#define HOT_TRACE_SCOPE(name)          ((void)0)
+#define HOT_TRACE_ARG(arg)             ((void)0)
+#define HOT_TRACE_NOW()                ((uint64)0)
+#define HOT_TRACE_RECORD(name, begin)  ((void)(begin))
+#endif
+
+#endif // LIBEBML_HOT_TRACE_H
@@ -95,6 +95,11 @@ public:
 	bool IsOk() { return mOk; };	
 	const std::string &GetLastErrorStr() { return mLastErrorStr; };
 protected:
+	/*!
+		Make sure the memory block can hold NeededSize bytes
+	*/
+	bool Reserve(uint64 NeededSize);
+
 	bool mOk;
 	std::string mLastErrorStr;
 
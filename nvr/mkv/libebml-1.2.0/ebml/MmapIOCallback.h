@@ -0,0 +1,114 @@
+/****************************************************************************
+** libebml : parse EBML files, see http://embl.sourceforge.net/
+**
+** <file/class description>
+**
+** Copyright (C) 2002-2010 Steve Lhomme.  All rights reserved.
+**
+** This file is part of libebml.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+** 
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+** 
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+** See http://www.matroska.org/license/lgpl/ for LGPL licensing information.
+**
+** Contact license@matroska.org if any conditions of this licensing are
+** not clear to you.
+**
+**********************************************************************/
+
+/*!
+	\file
+	\version \$Id$
+	\brief read-only access to a whole file through a memory mapping
+*/
+#ifndef LIBEBML_MMAPIOCALLBACK_H
+#define LIBEBML_MMAPIOCALLBACK_H
+
+#include "IOCallback.h"
+#include "StdIOCallback.h"
+
+START_LIBEBML_NAMESPACE
+
+/*!
+	\class MmapIOCallback
+	\brief IOCallback reading a file through a read-only mapped window
+
+	Only a window of WindowSize bytes is mapped at a time, moved along as the
+	file is read, so that many files open at once don't use up the address
+	space. read() still copies, but the data of an element can be used in
+	place with GetData(). A window that can't be mapped is read with plain
+	reads instead, IsMapped() tells whether the first one was.
+*/
+class EBML_DLL_API MmapIOCallback:public IOCallback
+{
+	public:
+		enum advice {
+			advice_normal,
+			advice_sequential, ///< the range will be read in order
+			advice_random,     ///< the range will be read at random places
+			advice_willneed,   ///< the range will be read soon, start reading it ahead
+			advice_dontneed    ///< the range is not needed anymore
+		};
+
+		enum {
+			DEFAULT_WINDOW_SIZE = 4*1024*1024
+		};
+
+		/// throws CRTError when the file can't be opened
+		MmapIOCallback(const char*Path, size_t WindowSize = DEFAULT_WINDOW_SIZE);
+		virtual ~MmapIOCallback()throw();
+
+		virtual uint32 read(void*Buffer,size_t Size);
+		virtual void setFilePointer(int64 Offset,seek_mode Mode=seek_beginning);
+		/// the mapping is read-only, nothing is ever written
+		virtual size_t write(const void*Buffer,size_t Size);
+		virtual uint64 getFilePointer();
+		virtual void close();
+
+		bool IsMapped() const {return Mapping != NULL;}
+		/// size of the file when it was opened, nothing after it is read
+		uint64 GetSize() const {return FileSize;}
+
+		/*!
+			\brief the bytes of the file at the offset, in the window moved there if needed
+			NULL when the range ends after the file, is larger than the window,
+			or can't be mapped. The data stays valid until the window moves.
+		*/
+		const binary * GetData(uint64 Offset, size_t Size);
+
+		/// give a hint to the system about how a range of the window will be used
+		void Advise(uint64 Offset, uint64 Size, advice Advice);
+
+	private:
+		bool MapWindow(uint64 Offset, size_t Size);
+		void UnmapWindow();
+
+		binary * Mapping;
+		uint64   MappingOffset;  ///< of the window in the file
+		size_t   MappingSize;
+		size_t   WindowSize;
+		uint64   FileSize;
+		uint64   mCurrentPosition;
+#if defined(_WIN32)
+		void *   File;
+		void *   FileMapping;
+#else
+		int      File;
+#endif
+};
+
+END_LIBEBML_NAMESPACE
+
+#endif // LIBEBML_MMAPIOCALLBACK_H
@@ -0,0 +1,193 @@
+/****************************************************************************
+** libebml : parse EBML files, see http://embl.sourceforge.net/
+**
+** <file/class description>
+**
+** Copyright (C) 2002-2010 Steve Lhomme.  All rights reserved.
+**
+** This file is part of libebml.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+** 
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+** 
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+** See http://www.matroska.org/license/lgpl/ for LGPL licensing information.
+**
+** Contact license@matroska.org if any conditions of this licensing are
+** not clear to you.
+**
+**********************************************************************/
+
+/*!
+	\file
+	\version \$Id$
+*/
+#include <cassert>
+#include <cstring>
+
+#include "ebml/ChunkedMemIOCallback.h"
+#include "ebml/StdIOCallback.h"
+
+START_LIBEBML_NAMESPACE
+
+ChunkedMemIOCallback::ChunkedMemIOCallback(size_t aChunkSize, uint64 aBaseOffset)
+ :ChunkSize(aChunkSize)
+ ,BaseOffset(aBaseOffset)
+ ,Position(aBaseOffset)
+ ,DataSize(0)
+{
+	assert(ChunkSize != 0);
+}
+
+ChunkedMemIOCallback::~ChunkedMemIOCallback()
+{
+	for (size_t i=0; i<Chunks.size(); i++)
+		free(Chunks[i]);
+}
+
+void ChunkedMemIOCallback::Reset(uint64 NewBaseOffset)
+{
+	BaseOffset = Position = NewBaseOffset;
+	DataSize = 0;
+}
+
+bool ChunkedMemIOCallback::Reserve(uint64 NeededSize)
+{
+	while (uint64(Chunks.size()) * ChunkSize < NeededSize) {
+		binary * NewChunk = (binary *)malloc(ChunkSize);
+		if (NewChunk == NULL)
+			return false;
+		Chunks.push_back(NewChunk);
+	}
+	return true;
+}
+
+uint32 ChunkedMemIOCallback::read(void *Buffer, size_t Size)
+{
+	uint64 Offset = Position - BaseOffset;
+	if (Offset >= DataSize)
+		return 0;
+	if (Size > DataSize - Offset)
+		Size = size_t(DataSize - Offset);
+
+	binary * Output = (binary *)Buffer;
+	size_t Remaining = Size;
+	while (Remaining != 0) {
+		size_t Index = size_t(Offset / ChunkSize);
+		size_t InChunk = size_t(Offset % ChunkSize);
+		size_t Length = ChunkSize - InChunk;
+		if (Length > Remaining)
+			Length = Remaining;
+		memcpy(Output, Chunks[Index] + InChunk, Length);
+		Output += Length;
+		Offset += Length;
+		Remaining -= Length;
+	}
+	Position += Size;
+	return Size;
+}
+
+void ChunkedMemIOCallback::setFilePointer(int64 Offset, seek_mode Mode)
+{
+	int64 NewPosition;
+	if (Mode == seek_current)
+		NewPosition = int64(Position) + Offset;
+	else if (Mode == seek_end)
+		NewPosition = int64(BaseOffset + DataSize) + Offset;
+	else
+		NewPosition = Offset;
+
+	if (NewPosition < int64(BaseOffset))
+		throw CRTError("Can't seek before the start of the memory chunks", 0);
+	Position = NewPosition;
+}
+
+size_t ChunkedMemIOCallback::write(const void *Buffer, size_t Size)
+{
+	uint64 Offset = Position - BaseOffset;
+	if (!Reserve(Offset + Size))
+		return 0;
+
+	// like a file, writing after the end leaves a hole filled with 0
+	while (DataSize < Offset) {
+		size_t InChunk = size_t(DataSize % ChunkSize);
+		size_t Length = ChunkSize - InChunk;
+		if (Length > Offset - DataSize)
+			Length = size_t(Offset - DataSize);
+		memset(Chunks[size_t(DataSize / ChunkSize)] + InChunk, 0, Length);
+		DataSize += Length;
+	}
+
+	const binary * Input = (const binary *)Buffer;
+	size_t Remaining = Size;
+	while (Remaining != 0) {
+		size_t Index = size_t(Offset / ChunkSize);
+		size_t InChunk = size_t(Offset % ChunkSize);
+		size_t Length = ChunkSize - InChunk;
+		if (Length > Remaining)
+			Length = Remaining;
+		memcpy(Chunks[Index] + InChunk, Input, Length);
+		Input += Length;
+		Offset += Length;
+		Remaining -= Length;
+	}
+	Position += Size;
+	if (Offset > DataSize)
+		DataSize = Offset;
+	return Size;
+}
+
+void ChunkedMemIOCallback::WriteTo(IOCallback & Output) const
+{
+	uint64 Remaining = DataSize;
+	for (size_t i=0; Remaining != 0; i++) {
+		size_t Length = (Remaining < ChunkSize) ? size_t(Remaining) : ChunkSize;
+		Output.writeFully(Chunks[i], Length);
+		Remaining -= Length;
+	}
+}
+
+void ChunkedMemIOCallback::TakeChunks(std::vector<Chunk> & Taken)
+{
+	// the chunks reserved but never written stay for the next data
+	size_t Count = size_t((DataSize + ChunkSize - 1) / ChunkSize);
+	uint64 Remaining = DataSize;
+	for (size_t i=0; i<Count; i++) {
+		Chunk aChunk;
+		aChunk.Buffer = Chunks[i];
+		aChunk.Size = (Remaining < ChunkSize) ? size_t(Remaining) : ChunkSize;
+		Remaining -= aChunk.Size;
+		Taken.push_back(aChunk);
+	}
+	Chunks.erase(Chunks.begin(), Chunks.begin() + Count);
+
+	BaseOffset += DataSize;
+	Position = BaseOffset;
+	DataSize = 0;
+}
+
+void ChunkedMemIOCallback::ReturnChunks(std::vector<Chunk> & Taken)
+{
+	for (size_t i=0; i<Taken.size(); i++)
+		Chunks.push_back(Taken[i].Buffer);
+	Taken.clear();
+}
+
+void ChunkedMemIOCallback::FreeChunks(std::vector<Chunk> & Taken)
+{
+	for (size_t i=0; i<Taken.size(); i++)
+		free(Taken[i].Buffer);
+	Taken.clear();
+}
+
+END_LIBEBML_NAMESPACE
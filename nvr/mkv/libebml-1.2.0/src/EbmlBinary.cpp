@@ -42,11 +42,11 @@
 START_LIBEBML_NAMESPACE
 
 EbmlBinary::EbmlBinary()
- :EbmlElement(0, false), Data(NULL)
+ :EbmlElement(0, false), Data(NULL), bDataPooled(false)
 {}
 
 EbmlBinary::EbmlBinary(const EbmlBinary & ElementToClone)
- :EbmlElement(ElementToClone)
+ :EbmlElement(ElementToClone), bDataPooled(false)
 {
 	if (ElementToClone.Data == NULL)
 		Data = NULL;
@@ -58,8 +58,19 @@ EbmlBinary::EbmlBinary(const EbmlBinary & ElementToClone)
 }
 
 EbmlBinary::~EbmlBinary(void) {
-	if(Data)
-		free(Data);
+	FreeData();
+}
+
+void EbmlBinary::FreeData()
+{
+	if (Data != NULL) {
+		if (bDataPooled)
+			EbmlElementPool::Free(Data);
+		else
+			free(Data);
+		Data = NULL;
+	}
+	bDataPooled = false;
 }
 
 EbmlBinary::operator const binary &() const {return *Data;}
@@ -82,18 +93,14 @@ uint64 EbmlBinary::UpdateSize(bool bWithDefault, bool bForceRender)
 
 filepos_t EbmlBinary::ReadData(IOCallback & input, ScopeMode ReadFully)
 {
-	if (Data != NULL)
-		free(Data);
+	FreeData();
 	
     if (ReadFully == SCOPE_NO_DATA || !GetSize())
-	{
-		Data = NULL;
 		return GetSize();
-	}
 
-	Data = (binary *)malloc(GetSize() * sizeof(binary));
-    if (Data == NULL)
-        throw CRTError("Error allocating data");
+	// the data of every block is read here, recycle it when a pool is active
+	Data = (binary *)EbmlElementPool::Allocate(GetSize() * sizeof(binary));
+	bDataPooled = true;
 	SetValueIsSet();
 	return input.read(Data, GetSize());
 }
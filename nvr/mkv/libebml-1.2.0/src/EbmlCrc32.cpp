@@ -38,6 +38,13 @@
 #include "ebml/EbmlContexts.h"
 #include "ebml/MemIOCallback.h"
 
+#if defined(__GNUC__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_USE_CLMUL
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+
 #ifdef WORDS_BIGENDIAN
 # define CRC32_INDEX(c) (c >> 24)
 # define CRC32_SHIFTED(c) (c << 8)
@@ -52,6 +59,170 @@ START_LIBEBML_NAMESPACE
 
 DEFINE_EBML_CLASS_GLOBAL(EbmlCrc32, 0xBF, 1, "EBMLCrc32\0ratamadabapa");
 
+/*
+	CRC kernels working on the (not finalized) CRC register:
+	- slicing-by-8 handles 8 bytes per step with 8 tables of 256 entries
+	- on x86 with PCLMULQDQ blocks of 64 bytes are folded with carry-less
+	  multiplications, see "Fast CRC Computation for Generic Polynomials
+	  Using PCLMULQDQ Instruction" (Intel, 2009)
+*/
+#ifndef WORDS_BIGENDIAN
+static uint32 s_tab8[8][256];
+#endif
+
+typedef uint32 (*CrcKernel)(uint32 crc, const binary *input, uint32 length);
+
+#ifndef WORDS_BIGENDIAN
+static uint32 UpdateCrcSlicing8(uint32 crc, const binary *input, uint32 length)
+{
+	for(; !IsAligned<uint32>(input) && length > 0; length--)
+		crc = s_tab8[0][(crc ^ *input++) & 0xff] ^ (crc >> 8);
+
+	while (length >= 8)
+	{
+		uint32 one = *(const uint32 *)input ^ crc;
+		uint32 two = *(const uint32 *)(input + 4);
+		crc = s_tab8[7][ one        & 0xff] ^ s_tab8[6][(one >>  8) & 0xff]
+		    ^ s_tab8[5][(one >> 16) & 0xff] ^ s_tab8[4][ one >> 24        ]
+		    ^ s_tab8[3][ two        & 0xff] ^ s_tab8[2][(two >>  8) & 0xff]
+		    ^ s_tab8[1][(two >> 16) & 0xff] ^ s_tab8[0][ two >> 24        ];
+		length -= 8;
+		input += 8;
+	}
+
+	while (length--)
+		crc = s_tab8[0][(crc ^ *input++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+#endif // WORDS_BIGENDIAN
+
+#ifdef CRC32_USE_CLMUL
+__attribute__((target("pclmul,sse4.1")))
+static uint32 UpdateCrcClmul(uint32 crc, const binary *input, uint32 length)
+{
+	if (length < 64)
+		return UpdateCrcSlicing8(crc, input, length);
+
+	// constants of the bit-reflected CRC-32 polynomial
+	static const uint64 k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+	static const uint64 k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0ULL, 0x00ccaa009eULL };
+	static const uint64 k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124ULL, 0x0000000000ULL };
+	static const uint64 poly[2] __attribute__((aligned(16))) = { 0x01db710641ULL, 0x01f7011641ULL };
+
+	uint32 tail = length & 15;
+	length -= tail;
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(input + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(input + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(input + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(input + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	input += 64;
+	length -= 64;
+
+	// fold 4 blocks of 16 bytes in parallel
+	while (length >= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *)(input + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(input + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(input + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(input + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		input += 64;
+		length -= 64;
+	}
+
+	// fold into 128 bits
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// fold the remaining blocks of 16 bytes
+	while (length >= 16)
+	{
+		x2 = _mm_loadu_si128((const __m128i *)input);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		input += 16;
+		length -= 16;
+	}
+
+	// fold 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = (uint32)_mm_extract_epi32(x1, 1);
+
+	return UpdateCrcSlicing8(crc, input, tail);
+}
+#endif // CRC32_USE_CLMUL
+
+/*!
+	\brief build the tables and pick the fastest kernel for this CPU, once at load time
+*/
+static CrcKernel SelectCrcKernel()
+{
+#ifdef WORDS_BIGENDIAN
+	return EbmlCrc32::UpdateCrcWords;
+#else
+	for (uint32 n = 0; n < 256; n++) {
+		uint32 c = n;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? (0xEDB88320L ^ (c >> 1)) : (c >> 1);
+		s_tab8[0][n] = c;
+	}
+	for (uint32 n = 0; n < 256; n++)
+		for (int t = 1; t < 8; t++)
+			s_tab8[t][n] = (s_tab8[t-1][n] >> 8) ^ s_tab8[0][s_tab8[t-1][n] & 0xff];
+
+#ifdef CRC32_USE_CLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+		return UpdateCrcClmul;
+#endif
+	return UpdateCrcSlicing8;
+#endif // WORDS_BIGENDIAN
+}
+
+static const CrcKernel s_UpdateCrc = SelectCrcKernel();
+
 const uint32 EbmlCrc32::m_tab[] = {
 #ifdef WORDS_BIGENDIAN
 	0x00000000L, 0x96300777L, 0x2c610eeeL, 0xba510999L, 0x19c46d07L,
@@ -252,24 +423,7 @@ filepos_t EbmlCrc32::ReadData(IOCallback & input, ScopeMode ReadFully)
 
 bool EbmlCrc32::CheckCRC(uint32 inputCRC, const binary *input, uint32 length)
 {
-	uint32 crc = CRC32_NEGL;
-
-	for(; !IsAligned<uint32>(input) && length > 0; length--)
-		crc = m_tab[CRC32_INDEX(crc) ^ *input++] ^ CRC32_SHIFTED(crc);
-
-	while (length >= 4)
-	{
-		crc ^= *(const uint32 *)input;
-		crc = m_tab[CRC32_INDEX(crc)] ^ CRC32_SHIFTED(crc);
-		crc = m_tab[CRC32_INDEX(crc)] ^ CRC32_SHIFTED(crc);
-		crc = m_tab[CRC32_INDEX(crc)] ^ CRC32_SHIFTED(crc);
-		crc = m_tab[CRC32_INDEX(crc)] ^ CRC32_SHIFTED(crc);
-		length -= 4;
-		input += 4;
-	}
-
-	while (length--)
-		crc = m_tab[CRC32_INDEX(crc) ^ *input++] ^ CRC32_SHIFTED(crc);
+	uint32 crc = UpdateCrc(CRC32_NEGL, input, length);
 
 	//Now we finalize the CRC32
 	crc ^= CRC32_NEGL;
@@ -316,8 +470,19 @@ void EbmlCrc32::FillCRC32(const binary *s, uint32 n)
 
 void EbmlCrc32::Update(const binary *input, uint32 length)
 {
-	uint32 crc = m_crc;
+	m_crc = UpdateCrc(m_crc, input, length);
+}
 
+uint32 EbmlCrc32::UpdateCrc(uint32 crc, const binary *input, uint32 length)
+{
+	// the kernel may not be selected yet when used by another static initializer
+	if (s_UpdateCrc == NULL)
+		return UpdateCrcWords(crc, input, length);
+	return s_UpdateCrc(crc, input, length);
+}
+
+uint32 EbmlCrc32::UpdateCrcWords(uint32 crc, const binary *input, uint32 length)
+{
 	for(; !IsAligned<uint32>(input) && length > 0; length--)
 		crc = m_tab[CRC32_INDEX(crc) ^ *input++] ^ CRC32_SHIFTED(crc);
 
@@ -335,7 +500,7 @@ void EbmlCrc32::Update(const binary *input, uint32 length)
 	while (length--)
 		crc = m_tab[CRC32_INDEX(crc) ^ *input++] ^ CRC32_SHIFTED(crc);
 
-	m_crc = crc;
+	return crc;
 }
 
 void EbmlCrc32::Finalize()
@@ -0,0 +1,192 @@
+/****************************************************************************
+** libebml : parse EBML files, see http://embl.sourceforge.net/
+**
+** <file/class description>
+**
+** Copyright (C) 2002-2010 Steve Lhomme.  All rights reserved.
+**
+** This file is part of libebml.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+** 
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+** 
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+** See http://www.matroska.org/license/lgpl/ for LGPL licensing information.
+**
+** Contact license@matroska.org if any conditions of this licensing are
+** not clear to you.
+**
+**********************************************************************/
+
+/*!
+	\file
+	\version \$Id$
+*/
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+#include "ebml/EbmlElementPool.h"
+
+START_LIBEBML_NAMESPACE
+
+struct EbmlElementPool::BlockHeader {
+	EbmlElementPool * Owner; // NULL when allocated outside of any pool
+	BlockHeader * Next;      // link in the free list
+	int SizeClass;
+};
+
+// keep the data that follows the header aligned like malloc() does
+const size_t EbmlElementPool::HeaderSize = (sizeof(EbmlElementPool::BlockHeader) + 15) & ~size_t(15);
+
+EBML_POOL_THREAD_LOCAL EbmlElementPool * EbmlElementPool::Current = NULL;
+
+EbmlElementPool::EbmlElementPool()
+ :RequestCount(0)
+ ,HeapAllocationCount(0)
+ ,OutstandingCount(0)
+ ,IdleBytes(0)
+ ,bDisposed(false)
+{
+	for (int i=0; i<SIZE_CLASS_COUNT; i++)
+		FreeList[i] = NULL;
+}
+
+EbmlElementPool::~EbmlElementPool()
+{
+	assert(OutstandingCount == 0);
+	FreeIdleBlocks();
+}
+
+void EbmlElementPool::Dispose()
+{
+	assert(Current != this);
+	bDisposed = true;
+	FreeIdleBlocks();
+	if (OutstandingCount == 0)
+		delete this;
+}
+
+/*!
+	\return the index of the free list for a block of \a Size bytes, -1 if it's too big to be kept
+*/
+int EbmlElementPool::GetSizeClass(size_t Size)
+{
+	if (Size <= SMALL_CLASS_LIMIT)
+		return (Size == 0) ? 0 : int((Size - 1) / SMALL_CLASS_STEP);
+
+	int Class = SMALL_CLASS_LIMIT / SMALL_CLASS_STEP;
+	while (GetClassSize(Class) < Size) {
+		if (++Class == SIZE_CLASS_COUNT)
+			return -1;
+	}
+	return Class;
+}
+
+size_t EbmlElementPool::GetClassSize(int Class)
+{
+	if (Class < SMALL_CLASS_LIMIT / SMALL_CLASS_STEP)
+		return size_t(Class + 1) * SMALL_CLASS_STEP;
+	return size_t(SMALL_CLASS_LIMIT * 2) << (Class - SMALL_CLASS_LIMIT / SMALL_CLASS_STEP);
+}
+
+void * EbmlElementPool::Get(size_t Size)
+{
+	int Class = GetSizeClass(Size);
+	BlockHeader * Block;
+
+	RequestCount++;
+	if (Class >= 0 && FreeList[Class] != NULL) {
+		Block = FreeList[Class];
+		FreeList[Class] = Block->Next;
+		IdleBytes -= GetClassSize(Class);
+	} else {
+		Block = (BlockHeader *)malloc(HeaderSize + (Class >= 0 ? GetClassSize(Class) : Size));
+		if (Block == NULL)
+			throw std::bad_alloc();
+		HeapAllocationCount++;
+		Block->SizeClass = Class;
+	}
+	Block->Owner = this;
+	Block->Next = NULL;
+	OutstandingCount++;
+	return (binary *)Block + HeaderSize;
+}
+
+void EbmlElementPool::Put(BlockHeader * Block)
+{
+	assert(OutstandingCount != 0);
+	OutstandingCount--;
+
+	if (bDisposed || Block->SizeClass < 0) {
+		free(Block);
+		if (bDisposed && OutstandingCount == 0)
+			delete this;
+		return;
+	}
+
+	Block->Next = FreeList[Block->SizeClass];
+	FreeList[Block->SizeClass] = Block;
+	IdleBytes += GetClassSize(Block->SizeClass);
+}
+
+void EbmlElementPool::FreeIdleBlocks()
+{
+	for (int i=0; i<SIZE_CLASS_COUNT; i++) {
+		while (FreeList[i] != NULL) {
+			BlockHeader * Block = FreeList[i];
+			FreeList[i] = Block->Next;
+			free(Block);
+		}
+	}
+	IdleBytes = 0;
+}
+
+void * EbmlElementPool::Allocate(size_t Size)
+{
+	if (Current != NULL)
+		return Current->Get(Size);
+
+	BlockHeader * Block = (BlockHeader *)malloc(HeaderSize + Size);
+	if (Block == NULL)
+		throw std::bad_alloc();
+	Block->Owner = NULL;
+	Block->Next = NULL;
+	Block->SizeClass = -1;
+	return (binary *)Block + HeaderSize;
+}
+
+void EbmlElementPool::Free(void * Ptr)
+{
+	if (Ptr == NULL)
+		return;
+
+	BlockHeader * Block = (BlockHeader *)((binary *)Ptr - HeaderSize);
+	if (Block->Owner != NULL)
+		Block->Owner->Put(Block);
+	else
+		free(Block);
+}
+
+EbmlElementPool::Scope::Scope(EbmlElementPool & aPool)
+ :Previous(Current)
+{
+	Current = &aPool;
+}
+
+EbmlElementPool::Scope::~Scope()
+{
+	Current = Previous;
+}
+
+END_LIBEBML_NAMESPACE
@@ -0,0 +1,321 @@
+/****************************************************************************
+** libebml : parse EBML files, see http://embl.sourceforge.net/
+**
+** <file/class description>
+**
+** Copyright (C) 2002-2010 Steve Lhomme.  All rights reserved.
+**
+** This file is part of libebml.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+** 
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+** 
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+** See http://www.matroska.org/license/lgpl/ for LGPL licensing information.
+**
+** Contact license@matroska.org if any conditions of this licensing are
+** not clear to you.
+**
+**********************************************************************/
+
+/*!
+	\file
+	\version \$Id$
+*/
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#include "ebml/HotTrace.h"
+
+#if defined(_MSC_VER)
+#define EBML_TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define EBML_TRACE_THREAD_LOCAL __thread
+#endif
+
+using namespace std;
+
+START_LIBEBML_NAMESPACE
+
+namespace {
+
+struct TraceEvent {
+	const char * Name;
+	uint64 Begin;
+	uint64 End;
+	uint64 Arg;
+};
+
+enum {
+	THREAD_NAME_SIZE = 32
+};
+
+/*!
+	only the owning thread writes a ring, it publishes an event by moving
+	Head on once the event is complete
+*/
+struct TraceRing {
+	volatile uint32 Head;   ///< number of events recorded so far
+	volatile uint32 bFree;  ///< its thread ended, another one may take it over
+	uint32 Id;
+	char ThreadName[THREAD_NAME_SIZE];
+	TraceEvent Events[HotTrace::RING_SIZE];
+};
+
+TraceRing * volatile Rings[HotTrace::MAX_THREAD_COUNT];
+volatile uint32 RingCount = 0;
+
+EBML_TRACE_THREAD_LOCAL TraceRing * CurrentRing = NULL;
+EBML_TRACE_THREAD_LOCAL bool bNoRing = false;
+EBML_TRACE_THREAD_LOCAL char CurrentThreadName[THREAD_NAME_SIZE];
+
+// the time base, to turn ticks into time
+volatile bool bBaseTaken = false;
+uint64 BaseTicks = 0;
+uint64 BaseNanoseconds = 0;
+
+#if defined(__GNUC__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+template <typename T> inline void StoreRelease(volatile T & Target, T Value) {__atomic_store_n(&Target, Value, __ATOMIC_RELEASE);}
+inline bool CompareAndSwap(volatile uint32 & Target, uint32 Expected, uint32 Value) {return __atomic_compare_exchange_n(&Target, &Expected, Value, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);}
+template <typename T> inline T LoadAcquire(volatile T & Source) {return __atomic_load_n(&Source, __ATOMIC_ACQUIRE);}
+inline uint32 FetchAndAdd(volatile uint32 & Target, uint32 Value) {return __atomic_fetch_add(&Target, Value, __ATOMIC_RELAXED);}
+inline void AcquireFence() {__atomic_thread_fence(__ATOMIC_ACQUIRE);}
+#elif defined(__GNUC__)
+template <typename T> inline void StoreRelease(volatile T & Target, T Value) {__sync_synchronize(); Target = Value;}
+inline bool CompareAndSwap(volatile uint32 & Target, uint32 Expected, uint32 Value) {return __sync_bool_compare_and_swap(&Target, Expected, Value);}
+template <typename T> inline T LoadAcquire(volatile T & Source) {T Value = Source; __sync_synchronize(); return Value;}
+inline uint32 FetchAndAdd(volatile uint32 & Target, uint32 Value) {return __sync_fetch_and_add(&Target, Value);}
+inline void AcquireFence() {__sync_synchronize();}
+#else
+// volatile accesses have release/acquire semantics with MSVC
+template <typename T> inline void StoreRelease(volatile T & Target, T Value) {Target = Value;}
+inline bool CompareAndSwap(volatile uint32 & Target, uint32 Expected, uint32 Value) {return (uint32)InterlockedCompareExchange((volatile LONG *)&Target, (LONG)Value, (LONG)Expected) == Expected;}
+template <typename T> inline T LoadAcquire(volatile T & Source) {return Source;}
+inline uint32 FetchAndAdd(volatile uint32 & Target, uint32 Value) {return (uint32)InterlockedExchangeAdd((volatile LONG *)&Target, (LONG)Value);}
+inline void AcquireFence() {MemoryBarrier();}
+#endif
+
+uint64 GetMonotonicNanoseconds()
+{
+#if defined(_WIN32)
+	LARGE_INTEGER Counter, Frequency;
+	QueryPerformanceCounter(&Counter);
+	QueryPerformanceFrequency(&Frequency);
+	return (uint64)((double)Counter.QuadPart * 1000000000.0 / (double)Frequency.QuadPart);
+#else
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (uint64)Time.tv_sec * 1000000000ull + Time.tv_nsec;
+#endif
+}
+
+void CopyThreadName(char * Target, const char * Name)
+{
+	size_t Index = 0;
+	for (; (Name[Index] != '\0') && (Index < THREAD_NAME_SIZE - 1); Index++)
+	{
+		// the name goes into a JSON string as it is
+		Target[Index] = ((Name[Index] == '"') || (Name[Index] == '\\') || ((unsigned char)Name[Index] < ' ')) ? '_' : Name[Index];
+	}
+	Target[Index] = '\0';
+}
+
+#if !defined(_WIN32)
+// gives the ring of a thread back when the thread ends
+pthread_key_t RingKey;
+pthread_once_t RingKeyOnce = PTHREAD_ONCE_INIT;
+
+void ReleaseRing(void * Ring)
+{
+	StoreRelease(static_cast<TraceRing *>(Ring)->bFree, (uint32)1);
+}
+
+void CreateRingKey()
+{
+	pthread_key_create(&RingKey, ReleaseRing);
+}
+#endif
+
+TraceRing * TakeRing()
+{
+	// a ring given back keeps its events and goes on after them, under the name of the new thread
+	uint32 Count = LoadAcquire(RingCount);
+	for (uint32 Index = 0; (Index < Count) && (Index < HotTrace::MAX_THREAD_COUNT); Index++)
+	{
+		TraceRing * Ring = LoadAcquire(Rings[Index]);
+		if ((Ring != NULL) && (Ring->bFree != 0) && CompareAndSwap(Ring->bFree, 1, 0))
+			return Ring;
+	}
+
+	uint32 Index = FetchAndAdd(RingCount, 1);
+	if (Index >= HotTrace::MAX_THREAD_COUNT)
+		return NULL;
+
+	TraceRing * Ring = new (nothrow) TraceRing;
+	if (Ring == NULL)
+		return NULL;
+	Ring->Head = 0;
+	Ring->bFree = 0;
+	Ring->Id = Index + 1;
+	Ring->ThreadName[0] = '\0';
+	StoreRelease(Rings[Index], Ring);
+	return Ring;
+}
+
+TraceRing * CreateRing()
+{
+	TraceRing * Ring = TakeRing();
+	if (Ring == NULL)
+	{
+		bNoRing = true;
+		return NULL;
+	}
+	strcpy(Ring->ThreadName, CurrentThreadName);
+	CurrentRing = Ring;
+
+#if !defined(_WIN32)
+	pthread_once(&RingKeyOnce, CreateRingKey);
+	pthread_setspecific(RingKey, Ring);
+#endif
+	// else the ring of a thread that ended stays its own until the process ends
+	return Ring;
+}
+
+} // namespace
+
+volatile bool HotTrace::bEnabled = false;
+
+void HotTrace::Enable()
+{
+	if (!bBaseTaken)
+	{
+		BaseTicks = Now();
+		BaseNanoseconds = GetMonotonicNanoseconds();
+		bBaseTaken = true;
+	}
+	bEnabled = true;
+}
+
+void HotTrace::Disable()
+{
+	bEnabled = false;
+}
+
+void HotTrace::SetThreadName(const char * Name)
+{
+	CopyThreadName(CurrentThreadName, Name);
+	if (CurrentRing != NULL)
+		strcpy(CurrentRing->ThreadName, CurrentThreadName);
+}
+
+void HotTrace::Record(const char * Name, uint64 Begin, uint64 End, uint64 Arg)
+{
+	TraceRing * Ring = CurrentRing;
+	if (Ring == NULL)
+	{
+		if (bNoRing || ((Ring = CreateRing()) == NULL))
+			return;
+	}
+
+	uint32 Head = Ring->Head;
+	TraceEvent & Event = Ring->Events[Head & (RING_SIZE - 1)];
+	Event.Name = Name;
+	Event.Begin = Begin;
+	Event.End = End;
+	Event.Arg = Arg;
+	StoreRelease(Ring->Head, Head + 1);
+}
+
+bool HotTrace::Dump(const char * Path)
+{
+	if (!bBaseTaken)
+		return false;
+
+	FILE * File = fopen(Path, "w");
+	if (File == NULL)
+		return false;
+
+	// the rate of the ticks, measured against the monotonic clock since Enable()
+	uint64 Nanoseconds = GetMonotonicNanoseconds();
+	while (Nanoseconds - BaseNanoseconds < 1000000)
+		Nanoseconds = GetMonotonicNanoseconds();
+	uint64 Ticks = Now();
+	double MicrosecondsPerTick = (Ticks > BaseTicks) ? (double)(Nanoseconds - BaseNanoseconds) / (double)(Ticks - BaseTicks) / 1000.0 : 0.001;
+
+#if defined(_WIN32)
+	unsigned long ProcessId = GetCurrentProcessId();
+#else
+	unsigned long ProcessId = getpid();
+#endif
+
+	fprintf(File, "{\"traceEvents\":[\n");
+	bool bFirst = true;
+	vector<TraceEvent> Events(RING_SIZE);
+
+	uint32 Count = LoadAcquire(RingCount);
+	if (Count > MAX_THREAD_COUNT)
+		Count = MAX_THREAD_COUNT;
+	for (uint32 RingIndex = 0; RingIndex < Count; RingIndex++)
+	{
+		TraceRing * Ring = LoadAcquire(Rings[RingIndex]);
+		if (Ring == NULL)
+			continue;
+
+		if (Ring->ThreadName[0] != '\0')
+		{
+			fprintf(File, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+				bFirst ? "" : ",\n", ProcessId, Ring->Id, Ring->ThreadName);
+			bFirst = false;
+		}
+
+		uint32 Head = LoadAcquire(Ring->Head);
+		uint32 Oldest = (Head > RING_SIZE) ? Head - RING_SIZE : 0;
+		for (uint32 Index = Oldest; Index < Head; Index++)
+			Events[Index - Oldest] = Ring->Events[Index & (RING_SIZE - 1)];
+
+		// the thread went on meanwhile, drop the events it may have overwritten while copied
+		AcquireFence();
+		uint32 NewHead = LoadAcquire(Ring->Head);
+		uint32 First = (NewHead >= RING_SIZE) ? NewHead + 1 - RING_SIZE : 0;
+		if (First < Oldest)
+			First = Oldest;
+
+		for (uint32 Index = First; Index < Head; Index++)
+		{
+			const TraceEvent & Event = Events[Index - Oldest];
+			double Timestamp = (double)(int64)(Event.Begin - BaseTicks) * MicrosecondsPerTick;
+			double Duration = (double)(Event.End - Event.Begin) * MicrosecondsPerTick;
+			fprintf(File, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%lu,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+				bFirst ? "" : ",\n", Event.Name, ProcessId, Ring->Id, Timestamp, Duration);
+			if (Event.Arg != 0)
+				fprintf(File, ",\"args\":{\"n\":%llu}", (unsigned long long)Event.Arg);
+			fprintf(File, "}");
+			bFirst = false;
+		}
+	}
+
+	fprintf(File, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	return (fclose(File) == 0);
+}
+
+END_LIBEBML_NAMESPACE
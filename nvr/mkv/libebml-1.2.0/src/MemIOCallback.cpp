@@ -40,6 +40,10 @@ START_LIBEBML_NAMESPACE
 
 MemIOCallback::MemIOCallback(uint64 DefaultSize)
 {
+	dataBufferMemorySize = 0;
+	dataBufferPos = 0;
+	dataBufferTotalSize = 0;
+
 	//The default size of the buffer is 128 bytes
 	dataBuffer = (binary *)malloc(DefaultSize);
 	if (dataBuffer == NULL) {
@@ -52,8 +56,6 @@ MemIOCallback::MemIOCallback(uint64 DefaultSize)
 	}
 	
 	dataBufferMemorySize = DefaultSize;
-	dataBufferPos = 0;
-	dataBufferTotalSize = 0;
 	mOk = true;
 }
 
@@ -70,10 +72,13 @@ uint32 MemIOCallback::read(void *Buffer, size_t Size)
 	//If the size is larger than than the amount left in the buffer
 	if (Size + dataBufferPos > dataBufferTotalSize)
 	{
+		if (dataBufferPos >= dataBufferTotalSize)
+			return 0;
 		//We will only return the remaining data
-		memcpy(Buffer, dataBuffer + dataBufferPos, dataBufferTotalSize - dataBufferPos);
+		uint32 Remaining = uint32(dataBufferTotalSize - dataBufferPos);
+		memcpy(Buffer, dataBuffer + dataBufferPos, Remaining);
 		dataBufferPos = dataBufferTotalSize;
-		return dataBufferTotalSize - dataBufferPos;
+		return Remaining;
 	}
 		
 	//Well... We made it here, so do a quick and simple copy
@@ -93,13 +98,30 @@ void MemIOCallback::setFilePointer(int64 Offset, seek_mode Mode)
 		dataBufferPos = dataBufferTotalSize + Offset;
 }
 
-size_t MemIOCallback::write(const void *Buffer, size_t Size)
+bool MemIOCallback::Reserve(uint64 NeededSize)
 {
-	if (dataBufferMemorySize < dataBufferPos + Size)
-	{
-		//We need more memory!
-		dataBuffer = (binary *)realloc((void *)dataBuffer, dataBufferPos + Size);		
+	if (dataBufferMemorySize >= NeededSize)
+		return true;
+
+	//We need more memory! grow geometrically so that appending stays linear
+	uint64 NewSize = dataBufferMemorySize * 2;
+	if (NewSize < NeededSize)
+		NewSize = NeededSize;
+	binary *NewBuffer = (binary *)realloc((void *)dataBuffer, NewSize);
+	if (NewBuffer == NULL) {
+		mOk = false;
+		mLastErrorStr = "Failed to grow the memory block";
+		return false;
 	}
+	dataBuffer = NewBuffer;
+	dataBufferMemorySize = NewSize;
+	return true;
+}
+
+size_t MemIOCallback::write(const void *Buffer, size_t Size)
+{
+	if (!Reserve(dataBufferPos + Size))
+		return 0;
 	memcpy(dataBuffer+dataBufferPos, Buffer, Size);
 	dataBufferPos += Size;
 	if (dataBufferPos > dataBufferTotalSize)
@@ -110,13 +132,12 @@ size_t MemIOCallback::write(const void *Buffer, size_t Size)
 
 uint32 MemIOCallback::write(IOCallback & IOToRead, size_t Size)
 {
-	if (dataBufferMemorySize < dataBufferPos + Size)
-	{
-		//We need more memory!
-		dataBuffer = (binary *)realloc((void *)dataBuffer, dataBufferPos + Size);		
-	}
+	if (!Reserve(dataBufferPos + Size))
+		return 0;
 	IOToRead.readFully(&dataBuffer[dataBufferPos], Size);
-	dataBufferTotalSize = Size;
+	dataBufferPos += Size;
+	if (dataBufferPos > dataBufferTotalSize)
+		dataBufferTotalSize = dataBufferPos;
 	return Size;
 }
 
@@ -0,0 +1,294 @@
+/****************************************************************************
+** libebml : parse EBML files, see http://embl.sourceforge.net/
+**
+** <file/class description>
+**
+** Copyright (C) 2002-2010 Steve Lhomme.  All rights reserved.
+**
+** This file is part of libebml.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+** 
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+** 
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+** See http://www.matroska.org/license/lgpl/ for LGPL licensing information.
+**
+** Contact license@matroska.org if any conditions of this licensing are
+** not clear to you.
+**
+**********************************************************************/
+
+/*!
+	\file
+	\version \$Id$
+*/
+#include <cassert>
+#include <cstring>
+#if !defined(__GNUC__) || (__GNUC__ > 2)
+#include <sstream>
+#endif // GCC2
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "ebml/MmapIOCallback.h"
+
+using namespace std;
+
+START_LIBEBML_NAMESPACE
+
+// the window starts at a multiple of this
+static uint64 GetMappingGranularity()
+{
+#if defined(_WIN32)
+	SYSTEM_INFO Info;
+	GetSystemInfo(&Info);
+	return Info.dwAllocationGranularity;
+#else
+	return uint64(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+MmapIOCallback::MmapIOCallback(const char*Path, size_t aWindowSize)
+ :Mapping(NULL)
+ ,MappingOffset(0)
+ ,MappingSize(0)
+ ,WindowSize(aWindowSize)
+ ,FileSize(0)
+ ,mCurrentPosition(0)
+{
+	assert(Path!=0);
+
+	bool bOpened = false;
+#if defined(_WIN32)
+	FileMapping = NULL;
+	File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (File != INVALID_HANDLE_VALUE) {
+		LARGE_INTEGER Size;
+		if (GetFileSizeEx(File, &Size)) {
+			FileSize = Size.QuadPart;
+			bOpened = true;
+			if (FileSize != 0)
+				FileMapping = CreateFileMapping(File, NULL, PAGE_READONLY, 0, 0, NULL);
+		}
+	}
+#else
+	File = open(Path, O_RDONLY);
+	if (File >= 0) {
+		struct stat FileStat;
+		if (fstat(File, &FileStat) == 0) {
+			FileSize = FileStat.st_size;
+			bOpened = true;
+		}
+	}
+#endif
+
+	if (!bOpened) {
+		close();
+#if !defined(__GNUC__) || (__GNUC__ > 2)
+		stringstream Msg;
+		Msg<<"Can't open file \""<<Path<<"\"";
+		throw CRTError(Msg.str());
+#endif // GCC2
+	}
+
+	// without a mapping the file is still read, see IsMapped()
+	MapWindow(0, 0);
+}
+
+MmapIOCallback::~MmapIOCallback()throw()
+{
+	close();
+}
+
+bool MmapIOCallback::MapWindow(uint64 Offset, size_t Size)
+{
+	if (Mapping != NULL && Offset >= MappingOffset && Offset + Size <= MappingOffset + MappingSize)
+		return true;
+	if (Offset + Size > FileSize || FileSize == 0)
+		return false;
+
+	static const uint64 Granularity = GetMappingGranularity();
+	uint64 Start = Offset - Offset % Granularity;
+	size_t Length = (FileSize - Start < WindowSize) ? size_t(FileSize - Start) : WindowSize;
+	if (Offset + Size > Start + Length)
+		// larger than the window
+		return false;
+
+	UnmapWindow();
+#if defined(_WIN32)
+	if (FileMapping != NULL)
+		Mapping = (binary *)MapViewOfFile(FileMapping, FILE_MAP_READ, DWORD(Start >> 32), DWORD(Start), Length);
+#else
+	void * Result = mmap(NULL, Length, PROT_READ, MAP_SHARED, File, off_t(Start));
+	if (Result != MAP_FAILED)
+		Mapping = (binary *)Result;
+#endif
+	if (Mapping == NULL)
+		return false;
+
+	MappingOffset = Start;
+	MappingSize = Length;
+	return true;
+}
+
+void MmapIOCallback::UnmapWindow()
+{
+	if (Mapping != NULL)
+#if defined(_WIN32)
+		UnmapViewOfFile(Mapping);
+#else
+		munmap(Mapping, MappingSize);
+#endif
+	Mapping = NULL;
+	MappingOffset = 0;
+	MappingSize = 0;
+}
+
+const binary * MmapIOCallback::GetData(uint64 Offset, size_t Size)
+{
+	if (!MapWindow(Offset, Size))
+		return NULL;
+	return Mapping + (Offset - MappingOffset);
+}
+
+uint32 MmapIOCallback::read(void*Buffer,size_t Size)
+{
+	if (mCurrentPosition >= FileSize)
+		return 0;
+
+	if (Size > FileSize - mCurrentPosition)
+		Size = FileSize - mCurrentPosition;
+
+	const binary * Data = GetData(mCurrentPosition, Size);
+	if (Data != NULL)
+		memcpy(Buffer, Data, Size);
+	else {
+		// larger than the window, or the window can't be mapped
+#if defined(_WIN32)
+		OVERLAPPED Overlapped;
+		memset(&Overlapped, 0, sizeof(Overlapped));
+		Overlapped.Offset = DWORD(mCurrentPosition);
+		Overlapped.OffsetHigh = DWORD(mCurrentPosition >> 32);
+		DWORD Read = 0;
+		if (!ReadFile(File, Buffer, DWORD(Size), &Read, &Overlapped))
+			return 0;
+		Size = Read;
+#else
+		ssize_t Read = pread(File, Buffer, Size, off_t(mCurrentPosition));
+		if (Read < 0)
+			return 0;
+		Size = size_t(Read);
+#endif
+	}
+	mCurrentPosition += Size;
+	return Size;
+}
+
+void MmapIOCallback::setFilePointer(int64 Offset,seek_mode Mode)
+{
+	int64 NewPosition;
+
+	switch (Mode)
+	{
+		case seek_current:
+			NewPosition = int64(mCurrentPosition) + Offset;
+			break;
+		case seek_end:
+			NewPosition = int64(FileSize) + Offset;
+			break;
+		default:
+			NewPosition = Offset;
+			break;
+	}
+
+	if (NewPosition < 0)
+	{
+#if !defined(__GNUC__) || (__GNUC__ > 2)
+		ostringstream Msg;
+		Msg<<"Failed to seek mapping to offset "<<Offset<<" in mode "<<Mode;
+		throw CRTError(Msg.str());
+#endif // GCC2
+		return;
+	}
+
+	// like a file, it's allowed to go past the end, read() will return 0
+	mCurrentPosition = NewPosition;
+}
+
+size_t MmapIOCallback::write(const void*Buffer,size_t Size)
+{
+	return 0;
+}
+
+uint64 MmapIOCallback::getFilePointer()
+{
+	return mCurrentPosition;
+}
+
+void MmapIOCallback::close()
+{
+	UnmapWindow();
+#if defined(_WIN32)
+	if (FileMapping != NULL)
+		CloseHandle(FileMapping);
+	if (File != INVALID_HANDLE_VALUE)
+		CloseHandle(File);
+	FileMapping = NULL;
+	File = INVALID_HANDLE_VALUE;
+#else
+	if (File >= 0)
+		::close(File);
+	File = -1;
+#endif
+	FileSize = 0;
+}
+
+void MmapIOCallback::Advise(uint64 Offset, uint64 Size, advice Advice)
+{
+	if (Mapping == NULL || Offset >= MappingOffset + MappingSize || Offset + Size <= MappingOffset)
+		return;
+
+	// the part of the range in the window
+	if (Offset < MappingOffset) {
+		Size -= MappingOffset - Offset;
+		Offset = MappingOffset;
+	}
+	if (Size > MappingOffset + MappingSize - Offset)
+		Size = MappingOffset + MappingSize - Offset;
+
+#if !defined(_WIN32)
+	int Flag;
+	switch (Advice)
+	{
+		case advice_sequential: Flag = MADV_SEQUENTIAL; break;
+		case advice_random:     Flag = MADV_RANDOM;     break;
+		case advice_willneed:   Flag = MADV_WILLNEED;   break;
+		case advice_dontneed:   Flag = MADV_DONTNEED;   break;
+		default:                Flag = MADV_NORMAL;     break;
+	}
+
+	// madvise() wants a page aligned address
+	static const uint64 PageMask = uint64(sysconf(_SC_PAGESIZE)) - 1;
+	uint64 Start = (Offset - MappingOffset) & ~PageMask;
+	madvise(Mapping + Start, size_t(Size + (Offset - MappingOffset - Start)), Flag);
+#endif
+}
+
+END_LIBEBML_NAMESPACE
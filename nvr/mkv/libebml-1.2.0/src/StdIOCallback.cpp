@@ -41,6 +41,7 @@
 
 #include "ebml/StdIOCallback.h"
 #include "ebml/Debug.h"
+#include "ebml/HotTrace.h"
 #include "ebml/EbmlConfig.h"
 
 using namespace std;
@@ -156,6 +157,8 @@ void StdIOCallback::setFilePointer(int64 Offset,seek_mode Mode)
 
 size_t StdIOCallback::write(const void*Buffer,size_t Size)
 {
+	HOT_TRACE_SCOPE("io.write");
+	HOT_TRACE_ARG(Size);
 	assert(File!=0);
 	uint32 Result = fwrite(Buffer,1,Size,File);
 	mCurrentPosition += Result;
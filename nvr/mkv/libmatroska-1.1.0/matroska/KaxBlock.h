@@ -81,6 +81,10 @@ class MATROSKA_DLL_API DataBuffer {
 		}
 
 		virtual ~DataBuffer() {}
+
+		/// one DataBuffer is created per frame when reading, keep them in the current pool
+		static void * operator new(size_t Size) {return EbmlElementPool::Allocate(Size);}
+		static void operator delete(void * Ptr) {EbmlElementPool::Free(Ptr);}
 		virtual binary * Buffer() {assert(bValidValue); return myBuffer;}
 		virtual uint32   & Size() {return mySize;};
 		virtual const binary * Buffer() const {assert(bValidValue); return myBuffer;}
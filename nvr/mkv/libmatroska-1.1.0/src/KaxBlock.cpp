@@ -917,7 +917,9 @@ int64 KaxInternalBlock::GetDataPosition(size_t FrameNumber)
 {
 	int64 _Result = -1;
 
-	if (ValueIsSet() && FrameNumber < SizeList.size())
+	// SizeList and FirstFrameLocation are filled by a full read and by a
+	// SCOPE_PARTIAL_DATA read, which leaves the value unset
+	if (FrameNumber < SizeList.size())
 	{
 		_Result = FirstFrameLocation;
 	
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+#include "muxer.hpp"
+#include "demuxer.hpp"
+#include "bench_frames.hpp"
+
+// Writes a corpus of clips with the muxer, and then measures the demuxer over
+// it in both read modes: header parsing, sequential reading, seeking through
+// the cues and heap allocations, those of the head apart from those per frame.
+// The clips stay in the page cache, so this is the cost of the EBML and
+// Matroska layers rather than of the disk. POSIX only.
+//
+// usage: bench_demux [-dir path] [-reuse] [-opens n] [-seeks n]
+//
+// The results go to stdout as CSV, a header line and then a line per clip and
+// read mode, for comparing runs over time.
+
+class ClipSpec
+{
+public:
+	int  duration;  // sec
+	int  clusterDuration;  // sec, the video cue threshold with a key frame every sec
+	int  kbps;  // video only
+	bool hasAudio;  // G.711 at 8 kHz in 20 ms frames
+	bool hasOsd;  // a short text every sec
+};
+
+static const ClipSpec clipSpecs[] =
+{
+	{  60,  1,  512, false, false },
+	{  60,  5,  512, true,  false },
+	{  60,  5, 2048, true,  true  },
+	{ 120,  5, 8192, false, false },
+	{ 300,  1, 2048, false, false },
+	{ 300,  5, 2048, true,  true  },
+	{ 600,  5,  512, true,  true  },
+	{ 600, 10, 1024, true,  true  }
+};
+
+static const int      CLIP_COUNT = sizeof(clipSpecs) / sizeof(clipSpecs[0]);
+static const uint64_t NANOSEC = 1000000000ull;
+static const int      FPS = 30;
+static const size_t   AUDIO_FRAME_SIZE = 160;
+static const uint64_t AUDIO_FRAME_DURATION = NANOSEC / 50;
+static const uint64_t START_TIMECODE = 1300000000ull * NANOSEC;
+
+static const char *dir = ".";
+static bool        isReused = false;
+static int         openCount = 20;
+static int         seekCount = 200;
+static volatile unsigned char sink;
+
+static uint64_t GetMonotonicTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NANOSEC + (uint64_t)ts.tv_nsec;
+}
+
+static void GetClipName(int index, char *fileName)
+{
+	const ClipSpec &spec = clipSpecs[index];
+	sprintf(fileName, "%s/bench_%ds_c%d_%dk%s%s.mkv", dir, spec.duration, spec.clusterDuration, spec.kbps,
+	        spec.hasAudio ? "_a" : "", spec.hasOsd ? "_o" : "");
+}
+
+static bool WriteClip(const ClipSpec &spec, const char *fileName)
+{
+	Muxer *pMuxer = Muxer::GetInstance(Muxer::CONTAINER_FORMAT_MKV);
+	Muxer &muxer = *pMuxer;
+	bool isDone = true;
+
+	Muxer::FileConfig config;
+	config.videoCueThreshold = spec.clusterDuration;
+	config.maxDuration = spec.duration + 10;
+	muxer.SetFileConfig(config);
+
+	Muxer::Streams streams;
+	Muxer::VideoStream video;
+	Muxer::AudioStream audio;
+	Muxer::SubtitleStream osd;
+
+	streams.pVideo = &video;
+	streams.pAudio = spec.hasAudio ? &audio : NULL;
+	streams.pOther = spec.hasOsd ? &osd : NULL;
+	streams.dateUTC = (unsigned int)(START_TIMECODE / NANOSEC);
+	video.trackNumber = 1;
+	video.language = "eng";
+	video.SetCodec(Muxer::VideoStream::CODEC_ID_H264);
+	audio.trackNumber = 2;
+	audio.language = "eng";
+	audio.SetCodec(Muxer::AudioStream::CODEC_ID_G711_ULAW);
+	osd.trackNumber = 3;
+	osd.language = "eng";
+	osd.SetCodec(Muxer::SubtitleStream::CODEC_ID_OSD);
+
+	// a key frame every sec, about 8 times as big as the others
+	const uint64_t frameDuration = NANOSEC / FPS;
+	const size_t frameSize = std::max<size_t>((size_t)spec.kbps * 1000 / 8 / (FPS - 1 + 8), 64);
+	unsigned int seed = (unsigned int)spec.kbps;
+	uint64_t audioTimecode = 0ull;
+	uint64_t osdTimecode = 0ull;
+
+	for (int i = 0; i < spec.duration * FPS; i++)
+	{
+		uint64_t timecode = i * frameDuration;
+		bool isKey = (i % FPS) == 0;
+		seed = seed * 1103515245u + 12345u;
+		size_t size = (isKey ? frameSize * 8 : frameSize) * (28 + ((seed >> 16) % 9)) / 32;
+
+		Muxer::Frame frame;
+		frame.pStream = &video;
+		frame.isKey = isKey;
+		frame.timecode = START_TIMECODE + timecode;
+		frame.size = size;
+		frame.data = MakeVideoFrame(size, isKey, seed);
+		frame.pFreeBuffer = BenchFreeBuffer;
+
+		if ((i == 0) ? !muxer.StartMuxing(streams, frame, fileName) : !muxer.AppendFrame(frame))
+		{
+			isDone = false;
+			break;
+		}
+
+		if (spec.hasOsd && (osdTimecode < timecode + frameDuration))
+		{
+			char text[32];
+			int length = sprintf(text, "OSD %llu", (unsigned long long)(osdTimecode / NANOSEC));
+
+			frame.pStream = &osd;
+			frame.isKey = false;
+			frame.timecode = START_TIMECODE + osdTimecode;
+			frame.size = length;
+			frame.data = new unsigned char[length];
+			memcpy(frame.data, text, length);
+			muxer.AppendFrame(frame);
+			osdTimecode += NANOSEC;
+		}
+
+		for (; spec.hasAudio && (audioTimecode < timecode + frameDuration); audioTimecode += AUDIO_FRAME_DURATION)
+		{
+			frame.pStream = &audio;
+			frame.isKey = true;
+			frame.timecode = START_TIMECODE + audioTimecode;
+			frame.size = AUDIO_FRAME_SIZE;
+			frame.data = new unsigned char[AUDIO_FRAME_SIZE];
+			memset(frame.data, 0xff, AUDIO_FRAME_SIZE);
+			muxer.AppendFrame(frame);
+		}
+	}
+
+	isDone = muxer.StopMuxing() && isDone;
+	delete pMuxer;
+	return isDone;
+}
+
+static uint64_t GetPercentile(std::vector<uint64_t> &values, double percentile)
+{
+	if (values.empty())
+	{
+		return 0ull;
+	}
+	std::sort(values.begin(), values.end());
+	size_t index = (size_t)(percentile / 100.0 * (double)(values.size() - 1) + 0.5);
+	return values[std::min(index, values.size() - 1)];
+}
+
+static bool MeasureClip(const ClipSpec &spec, const char *fileName, Demuxer::ReadMode mode)
+{
+	struct stat status;
+	if (stat(fileName, &status) != 0)
+	{
+		return false;
+	}
+
+	// header parsing, up to the first cluster
+	std::vector<uint64_t> openTimes;
+	Demuxer *pDemuxer = DemuxerUtilities::CreateMkvDemuxer();
+	pDemuxer->SetReadMode(mode);
+	for (int i = 0; i < openCount; i++)
+	{
+		uint64_t begin = GetMonotonicTime();
+		const Demuxer::Streams *pStreams = pDemuxer->StartDemuxing(fileName);
+		openTimes.push_back(GetMonotonicTime() - begin);
+		pDemuxer->StopDemuxing();
+		if (pStreams == NULL)
+		{
+			delete pDemuxer;
+			return false;
+		}
+	}
+	delete pDemuxer;
+
+	// sequential reading, with a new demuxer to count its allocations alone,
+	// those of the head and the cues apart from those of the frames
+	pDemuxer = DemuxerUtilities::CreateMkvDemuxer();
+	pDemuxer->SetReadMode(mode);
+	Demuxer::Statistics headStatistics;
+	uint64_t frameCount = 0ull;
+	uint64_t begin = GetMonotonicTime();
+	if (pDemuxer->StartDemuxing(fileName) != NULL)
+	{
+		pDemuxer->GetStatistics(headStatistics);
+		const Demuxer::Frame *pFrame;
+		while ((pFrame = pDemuxer->GetOneFrame()) != NULL)
+		{
+			frameCount++;
+			if (pFrame->size != 0)
+			{
+				sink ^= pFrame->data[pFrame->size - 1];
+			}
+		}
+	}
+	double readTime = (double)(GetMonotonicTime() - begin) / NANOSEC;
+	pDemuxer->StopDemuxing();
+
+	Demuxer::Statistics statistics;
+	pDemuxer->GetStatistics(statistics);
+
+	// seeking to random times through the cues, up to the first frame
+	std::vector<uint64_t> seekTimes;
+	unsigned int seed = (unsigned int)spec.duration;
+	for (int i = 0; i < seekCount; i++)
+	{
+		seed = seed * 1103515245u + 12345u;
+		uint64_t timecode = START_TIMECODE + (uint64_t)((seed >> 8) % (unsigned int)(spec.duration * 1000)) * 1000000ull;
+
+		begin = GetMonotonicTime();
+		if ((pDemuxer->StartDemuxing(fileName, timecode) != NULL) && (pDemuxer->GetOneFrame() != NULL))
+		{
+			seekTimes.push_back(GetMonotonicTime() - begin);
+		}
+		pDemuxer->StopDemuxing();
+	}
+	delete pDemuxer;
+
+	uint64_t seekMax = GetPercentile(seekTimes, 100.0);
+	uint64_t frameAllocationCount = statistics.allocationCount - headStatistics.allocationCount;
+	printf("%s,%d,%d,%d,%d,%d,%s,%llu,%llu,%.1f,%.0f,%.1f,%.1f,%.1f,%.1f,%d,%llu,%.3f\n",
+	       strrchr(fileName, '/') + 1, spec.duration, spec.clusterDuration, spec.kbps, spec.hasAudio, spec.hasOsd,
+	       mode == Demuxer::READ_MODE_MMAP ? "mmap" : "stdio",
+	       (unsigned long long)status.st_size, frameCount,
+	       GetPercentile(openTimes, 50.0) / 1000.0,
+	       readTime > .0 ? frameCount / readTime : .0, readTime > .0 ? status.st_size / 1048576.0 / readTime : .0,
+	       GetPercentile(seekTimes, 50.0) / 1000.0, GetPercentile(seekTimes, 99.0) / 1000.0, seekMax / 1000.0,
+	       seekCount - (int)seekTimes.size(),
+	       (unsigned long long)headStatistics.allocationCount,
+	       frameCount != 0ull ? (double)frameAllocationCount / frameCount : .0);
+	fflush(stdout);
+	return true;
+}
+
+static bool ParseArguments(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *pValue = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (strcmp(argv[i], "-reuse") == 0)
+		{
+			isReused = true;
+			continue;
+		}
+		else if (pValue == NULL)
+		{
+			return false;
+		}
+		else if (strcmp(argv[i], "-dir") == 0)   dir = pValue;
+		else if (strcmp(argv[i], "-opens") == 0) openCount = atoi(pValue);
+		else if (strcmp(argv[i], "-seeks") == 0) seekCount = atoi(pValue);
+		else
+		{
+			return false;
+		}
+		i++;
+	}
+
+	return (openCount > 0) && (seekCount >= 0);
+}
+
+int main(int argc, char **argv)
+{
+	if (!ParseArguments(argc, argv))
+	{
+		printf("usage: %s [-dir path] [-reuse] [-opens n] [-seeks n]\n", argv[0]);
+		return -1;
+	}
+
+	char fileName[1024];
+	for (int i = 0; i < CLIP_COUNT; i++)
+	{
+		struct stat status;
+		GetClipName(i, fileName);
+		if ((!isReused || (stat(fileName, &status) != 0)) && !WriteClip(clipSpecs[i], fileName))
+		{
+			fprintf(stderr, "fail to write clip: %s\n", fileName);
+			return -1;
+		}
+	}
+
+	printf("clip,duration_s,cluster_s,kbps,audio,osd,mode,bytes,frames,open_p50_us,frames_per_s,mb_per_s,"
+	       "seek_p50_us,seek_p99_us,seek_max_us,seek_failed,head_allocs,allocs_per_frame\n");
+
+	int failedCount = 0;
+	for (int i = 0; i < CLIP_COUNT; i++)
+	{
+		GetClipName(i, fileName);
+		if (!MeasureClip(clipSpecs[i], fileName, Demuxer::READ_MODE_STDIO)
+		    || !MeasureClip(clipSpecs[i], fileName, Demuxer::READ_MODE_MMAP))
+		{
+			fprintf(stderr, "fail to demux clip: %s\n", fileName);
+			failedCount++;
+		}
+	}
+
+	return failedCount != 0 ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+#include <string.h>
+#include "bench_frames.hpp"
+
+bool BenchFreeBuffer(void *, unsigned char *pBuffer)
+{
+	if (pBuffer != NULL)
+	{
+		delete[] pBuffer;
+	}
+	return true;
+}
+
+unsigned char * MakeVideoFrame(size_t size, bool isKey, unsigned int &seed)
+{
+	static const unsigned char sps[] = { 0, 0, 0, 1, 0x67, 0x4d, 0x00, 0x1f, 0x9a, 0x66, 0x02, 0x80, 0x2d, 0xc8 };
+	static const unsigned char pps[] = { 0, 0, 0, 1, 0x68, 0xee, 0x3c, 0x80 };
+	unsigned char *pBuffer = new unsigned char[size];
+	size_t offset = 0;
+
+	if (isKey)
+	{
+		memcpy(pBuffer, sps, sizeof(sps));
+		memcpy(pBuffer + sizeof(sps), pps, sizeof(pps));
+		offset = sizeof(sps) + sizeof(pps);
+	}
+	pBuffer[offset++] = 0;
+	pBuffer[offset++] = 0;
+	pBuffer[offset++] = 0;
+	pBuffer[offset++] = 1;
+	pBuffer[offset++] = isKey ? 0x65 : 0x41;
+
+	// no start code emulation in the slice data
+	for (; offset < size; offset++)
+	{
+		seed = seed * 1103515245u + 12345u;
+		pBuffer[offset] = (unsigned char)((seed >> 16) | 0x01);
+	}
+	return pBuffer;
+}
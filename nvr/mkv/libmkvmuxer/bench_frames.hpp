@@ -0,0 +1,15 @@
+#ifndef BENCH_FRAMES_HPP
+#define BENCH_FRAMES_HPP
+
+#include <stdlib.h>
+
+// Synthetic frames shared by the benchmarks of the muxer, the demuxer and the
+// recorder, so that they all measure the same payload.
+
+// frees a buffer of MakeVideoFrame() or any other taken with new[]
+bool BenchFreeBuffer(void *pParam, unsigned char *pBuffer);
+
+// an Annex B access unit: sps, pps and an idr slice for a key frame, or a non-idr slice
+unsigned char * MakeVideoFrame(size_t size, bool isKey, unsigned int &seed);
+
+#endif
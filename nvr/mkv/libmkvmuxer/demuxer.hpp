@@ -3,6 +3,7 @@
 #define DEMUXER_HPP
 
 #include <stdlib.h>
+#include <vector>
 
 typedef unsigned long long uint64_t;
 
@@ -27,10 +28,35 @@ public:
 
 	virtual ~Demuxer() {}
 
+	// how the file is read, set it before StartDemuxing()
+	enum ReadMode
+	{
+		READ_MODE_STDIO   = 0,  // blocks are read into buffers of the demuxer
+		READ_MODE_MMAP    = 1,  // a window of the file is mapped read-only, frame data points into it
+		READ_MODE_DEFAULT = READ_MODE_STDIO
+	};
+
 	// public methods
 	virtual const Streams * StartDemuxing(const char *, uint64_t = 0ull) = 0;
 	virtual bool            StopDemuxing() = 0;
-	virtual const Frame   * GetOneFrame(Frame * = NULL) = 0;
+	virtual const Frame   * GetOneFrame(Frame * = NULL) = 0;  // frame data is valid until the next call
+
+	virtual bool            SetReadMode(ReadMode mode) { return mode == READ_MODE_DEFAULT; }
+	virtual bool            SetChecksumVerification(bool enabled) { return !enabled; }  // skip clusters with a wrong CRC-32
+
+	class Statistics;
+	virtual bool            GetStatistics(Statistics &) const { return false; }
+
+	// nanosec, in order, known after StartDemuxing(): a seek to a time starts
+	// from the last one before it, or from the first frame if none is
+	virtual bool            GetSeekPoints(std::vector<uint64_t> &) const { return false; }
+
+	// a clip still being written, with the clusters its writer committed so far
+	// (bytes and nanosec, in order): set right before StartDemuxing() they are
+	// taken instead of walking the file, and GetOneFrame() stops at their end
+	// without stopping the demuxing; extended with a later end, it reads on
+	virtual bool            SetLiveSegment(uint64_t, uint64_t, const std::vector<uint64_t> &, const std::vector<uint64_t> &) { return false; }  // end position, end timecode
+	virtual bool            ExtendLiveSegment(uint64_t, uint64_t, const std::vector<uint64_t> &, const std::vector<uint64_t> &) { return false; }  // only while demuxing it
 
 public:
 	class Stream;
@@ -63,6 +89,17 @@ public:
 		unsigned char *data;
 	};
 
+	class Statistics
+	{
+	public:
+		Statistics() : frameCount(0ull), allocationCount(0ull), recycledCount(0ull), corruptedClusterCount(0ull) {}
+
+		uint64_t frameCount;       // frames returned since created
+		uint64_t allocationCount;  // heap allocations done by the parser
+		uint64_t recycledCount;    // allocations served again from released elements/buffers
+		uint64_t corruptedClusterCount;  // clusters skipped because of a wrong checksum
+	};
+
 	class Streams
 	{
 	public:
@@ -233,6 +270,18 @@ class DemuxerUtilities
 {
 public:
 	static Demuxer * CreateMkvDemuxer();
+
+	// nanosec, from the head of the file and its last cluster only, so that
+	// a clip never closed, without any duration, is timed as well
+	static bool GetMkvTimeRange(const char *fileName, uint64_t &startTime, uint64_t &endTime);
+
+	// advisory locks of a file overwritten in place: the readers hold a shared
+	// one as long as they read it, the writer takes an exclusive one before
+	// reusing it. False when the other side holds the file, the lock is -1
+	// when the file can't be locked at all, e.g. when it doesn't exist yet
+	static bool LockForReading(const char *fileName, int &lock);
+	static bool LockForReuse(const char *fileName, int &lock);
+	static void Unlock(int &lock);
 };
 
 #endif  // DEMUXER_HPP
@@ -0,0 +1,84 @@
+#ifndef EXPORTER_HPP
+#define EXPORTER_HPP
+
+#include <stdlib.h>
+
+typedef unsigned long long uint64_t;
+
+/*
+ * Exporter: Copy a time range of consecutive clips into a single file
+ *
+ * The clusters are copied as they are, only their timecodes start over from
+ * the first frame exported. The first cluster is cut at the key frame before
+ * the start time, the last one at the end time, and the cues are rebuilt.
+ * A thinning export keeps only the key frames, of every nth GOP, and the
+ * audio if wanted, without decoding anything; the clips it writes are marked
+ * and copied as they are by later thinning exports.
+ *
+ * sample:
+ *   Exporter *pExporter = ExporterUtilities::CreateMkvExporter();
+ *   pExporter->SetConfig(config);  // optional, to thin or to keep the time
+ *   pExporter->StartExporting(filePath, startTime, endTime);
+ *   while (hasMoreClips)
+ *     pExporter->AppendFile(clipPath);
+ *   pExporter->StopExporting();
+ */
+class Exporter
+{
+protected:
+	Exporter() {}
+
+public:
+	class Config;
+	class Statistics;
+
+	virtual ~Exporter() {}
+
+	// public methods
+	virtual bool SetConfig(const Config &) = 0;  // before StartExporting()
+	virtual bool IsThinned(const char *) = 0;  // a clip written by a thinning export
+	virtual bool StartExporting(const char *, uint64_t startTime, uint64_t endTime) = 0;  // nanosec, up to the end time excluded
+	virtual bool AppendFile(const char *) = 0;  // the clips in time order, false if nothing is taken from it
+	virtual bool StopExporting() = 0;  // false if nothing was exported, the file is removed then
+	virtual bool GetStatistics(Statistics &) const = 0;
+
+public:
+	// public inner classes
+	class Config
+	{
+	public:
+		Config() : keptGopInterval(0), hasAudio(true), isTimeKept(false) {}
+
+		int  keptGopInterval;  // 0 for all the frames, n for only the key frame of every nth GOP
+		bool hasAudio;         // false to leave the audio tracks out
+		bool isTimeKept;       // the timecodes as in the clips instead of from 0
+	};
+
+	class Statistics
+	{
+	public:
+		Statistics()
+			: fileCount(0), skippedFileCount(0), clusterCount(0ull), trimmedClusterCount(0ull),
+			  corruptedClusterCount(0ull), droppedBlockCount(0ull), byteCount(0ull), startTime(0ull), endTime(0ull)
+		{
+		}
+
+		size_t   fileCount;            // clips taken
+		size_t   skippedFileCount;     // clips unreadable or with other tracks than the first one
+		uint64_t clusterCount;         // clusters written
+		uint64_t trimmedClusterCount;  // of which cut to the range
+		uint64_t corruptedClusterCount;  // skipped because of a wrong checksum
+		uint64_t droppedBlockCount;    // frames left out by the thinning
+		uint64_t byteCount;            // of the clusters written
+		uint64_t startTime;            // nanosec, the first frame exported, at 0 in the file unless the time is kept
+		uint64_t endTime;              // nanosec, the last frame exported
+	};
+};
+
+class ExporterUtilities
+{
+public:
+	static Exporter * CreateMkvExporter();
+};
+
+#endif  // EXPORTER_HPP
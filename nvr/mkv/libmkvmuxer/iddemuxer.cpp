@@ -1,3 +1,4 @@
+#include <stdio.h>
 
 #include "demuxer.hpp"
 
@@ -16,5 +17,14 @@ int main(int argc, char **argv)
 
 	pDemuxer->StopDemuxing();
 
+	Demuxer::Statistics statistics;
+	if (pDemuxer->GetStatistics(statistics) && (statistics.frameCount != 0))
+	{
+		printf("frames: %llu, allocations: %llu (%.3f per frame), recycled: %llu\n",
+		       statistics.frameCount, statistics.allocationCount,
+		       (double)statistics.allocationCount / statistics.frameCount, statistics.recycledCount);
+	}
+	delete pDemuxer;
+
 	return 0;
 }
@@ -1,9 +1,21 @@
 
+#include <vector>
+#include <algorithm>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+
 #include "ebml/StdIOCallback.h"
+#include "ebml/MmapIOCallback.h"
+#include "ebml/EbmlElementPool.h"
+#include "ebml/HotTrace.h"
 
 #include "ebml/EbmlHead.h"
 #include "ebml/EbmlSubHead.h"
 #include "ebml/EbmlVoid.h"
+#include "ebml/EbmlCrc32.h"
 #include "ebml/EbmlStream.h"
 #include "matroska/FileKax.h"
 #include "matroska/KaxSegment.h"
@@ -15,6 +27,7 @@
 #include "matroska/KaxClusterData.h"
 #include "matroska/KaxSeekHead.h"
 #include "matroska/KaxCues.h"
+#include "matroska/KaxCuesData.h"
 #include "matroska/KaxInfo.h"
 #include "matroska/KaxInfoData.h"
 #include "matroska/KaxTags.h"
@@ -138,14 +151,26 @@ public:
 	virtual const Streams * StartDemuxing(const char *, uint64_t = 0ull);
 	virtual bool            StopDemuxing();
 	virtual const Frame   * GetOneFrame(Frame * = NULL);
+	virtual bool            SetReadMode(ReadMode);
+	virtual bool            SetChecksumVerification(bool);
+	virtual bool            GetStatistics(Statistics &) const;
+	virtual bool            GetSeekPoints(std::vector<uint64_t> &) const;
+	virtual bool            SetLiveSegment(uint64_t, uint64_t, const std::vector<uint64_t> &, const std::vector<uint64_t> &);
+	virtual bool            ExtendLiveSegment(uint64_t, uint64_t, const std::vector<uint64_t> &, const std::vector<uint64_t> &);
 
 	static int TranslateCodecIdentifier(const char *, const Stream * = NULL);
 	static void FixCodecIdentifier(Stream *);
 
 protected:
+	friend class DemuxerUtilities;  // for DemuxerUtilities::GetMkvTimeRange()
+
 	enum
 	{
-		MAX_PRIVATE_DATA_SIZE = 120
+		MAX_PRIVATE_DATA_SIZE = 120,
+		TAIL_CHUNK_SIZE       = 64 * 1024,
+		MAX_TAIL_SCAN_SIZE    = 16 * 1024 * 1024,  // a few clusters at least
+		MAX_CLUSTER_HEAD_SIZE = 32,                // id, size, CRC-32 and timecode
+		VERIFY_BUFFER_SIZE    = 64 * 1024
 	};
 
 	class MyStreams : public Streams
@@ -164,7 +189,20 @@ protected:
 	class MyVideoStream : public VideoStream
 	{
 	public:
+		MyVideoStream() : isReadOnlyData(false), pSideBuffer(NULL), sideBufferSize(0) {}
+		virtual ~MyVideoStream()
+		{
+			if (pSideBuffer != NULL)
+			{
+				delete[] pSideBuffer;
+			}
+		}
 		virtual void FixFrameData(Frame &) const;
+
+		// frame data points into a read-only mapping: fix a copy in the side buffer
+		bool                   isReadOnlyData;
+		mutable unsigned char *pSideBuffer;
+		mutable size_t         sideBufferSize;
 	};
 
 protected:
@@ -181,9 +219,43 @@ protected:
 	MyStreams streams;
 	Frame     myFrame;
 
+	// elements and block buffers of every cluster are recycled through this pool,
+	// so that demuxing a long clip doesn't keep allocating
+	EbmlElementPool *pElementPool;
+	uint64_t         frameCount;
+
+	ReadMode         readMode;
+	bool             isChecksumVerified;
+	uint64_t         corruptedClusterCount;
+	unsigned char   *pVerifyBuffer;  // pieces of the cluster when it can't be used in place
+	size_t           verifyBufferSize;
+	unsigned char   *pFrameBuffer;   // a frame out of the mapped window
+	size_t           frameBufferSize;
+	MmapIOCallback  *pMappedFile;    // same object as pMKVFile in READ_MODE_MMAP
+	int              readLock;       // on the file as long as it is open, see DemuxerUtilities::LockForReading()
+	std::vector<uint64> cuePositions;  // cluster positions of the cue points, for read ahead
+	std::vector<uint64_t> seekPoints;  // nanosec, of the cue points and the repaired clusters
+
+	// the clusters committed so far of a clip being written, set for the next
+	// StartDemuxing() and then extended while demuxing
+	uint64           liveEndPosition;  // 0 for a whole clip
+	uint64_t         liveEndTimecode;
+	std::vector<uint64_t> liveClusterPositions;  // until taken by StartDemuxing()
+	std::vector<uint64_t> liveClusterTimecodes;
+	uint64           heldPosition;     // where the frames stopped at the end of the live segment
+
 protected:
 	// protected temporary members
 	void ResetAllMembers();
+	void ReadAheadCluster();
+	bool VerifyCluster(const EbmlCrc32 &);
+	bool ReadMappedFrame(uint64 position, Frame &frame);
+	bool ReadClusterTimecode(uint64 position, uint64_t &timecode);
+	bool FindLastTimecode(uint64_t minTimecode, uint64_t maxTimecode, uint64_t &timecode);
+	int  ReadLastBlockTimecode(uint64 position, uint64 fileSize);
+	uint64 RepairSegment(uint64 firstPosition, uint64 seekPosition, uint64_t seekTime);
+	uint64 TakeLiveSegment(uint64 firstPosition, uint64 seekPosition, uint64_t seekTime);
+	void   TakeLiveClusters(uint64 beginPosition, const std::vector<uint64_t> &positions, const std::vector<uint64_t> &timecodes);
 
 	IOCallback *pMKVFile;
 	EbmlStream *pRawdata;
@@ -195,10 +267,12 @@ protected:
 	int             relativeUpperLevel;
 	EbmlElement    *pElementLevel1;
 	EbmlElement    *pElementLevel2;
+	EbmlElement    *pElementLevel3;
 	uint64          clusterPosition;
 
 	KaxCluster     *pCluster;
-	unsigned int    clusterIndex;
+	bool            isClusterTimecodeSet;
+	bool            isClusterCorrupted;
 	KaxSimpleBlock *pSimpleBlock;
 	KaxBlockGroup  *pBlockGroup;
 	KaxBlock       *pBlock;
@@ -209,6 +283,83 @@ Demuxer * DemuxerUtilities::CreateMkvDemuxer()
 	return new MkvDemuxer();
 }
 
+#ifndef WIN32
+static bool LockFile(const char *fileName, int operation, int &lock)
+{
+	lock = open(fileName, O_RDONLY);
+	if (lock < 0)
+	{
+		// nothing to hold
+		return true;
+	}
+	if (flock(lock, operation | LOCK_NB) != 0)
+	{
+		close(lock);
+		lock = -1;
+		return false;
+	}
+	return true;
+}
+#endif
+
+bool DemuxerUtilities::LockForReading(const char *fileName, int &lock)
+{
+#ifndef WIN32
+	return LockFile(fileName, LOCK_SH, lock);
+#else
+	// the locks of windows aren't advisory
+	lock = -1;
+	return true;
+#endif
+}
+
+bool DemuxerUtilities::LockForReuse(const char *fileName, int &lock)
+{
+#ifndef WIN32
+	return LockFile(fileName, LOCK_EX, lock);
+#else
+	lock = -1;
+	return true;
+#endif
+}
+
+void DemuxerUtilities::Unlock(int &lock)
+{
+#ifndef WIN32
+	if (lock >= 0)
+	{
+		// the lock goes with the descriptor
+		close(lock);
+	}
+#endif
+	lock = -1;
+}
+
+bool DemuxerUtilities::GetMkvTimeRange(const char *fileName, uint64_t &startTime, uint64_t &endTime)
+{
+	MkvDemuxer demuxer;
+	const Demuxer::Streams *pStreams = demuxer.StartDemuxing(fileName);
+	if ((pStreams == NULL) || !demuxer.ReadClusterTimecode(demuxer.pCluster->GetElementPosition(), startTime))
+	{
+		// error: not a clip or no cluster at all
+		demuxer.StopDemuxing();
+		return false;
+	}
+
+	if (pStreams->duration > .0)
+	{
+		endTime = startTime + (uint64_t)(pStreams->duration * 1000000000.0);
+	}
+	else if (!demuxer.FindLastTimecode(startTime, startTime + 24 * 60 * 60 * 1000000000ull, endTime))
+	{
+		// the duration is written when the clip is closed, the first cluster is still there
+		endTime = startTime;
+	}
+
+	demuxer.StopDemuxing();
+	return true;
+}
+
 #if 1
 static int codecIdHashTable[] =
 {
@@ -353,6 +504,21 @@ void MkvDemuxer::MyVideoStream::FixFrameData(Frame &frame) const
 	    && (frame.pStream->codecType == Stream::CODEC_TYPE_VIDEO)
 	    && (frame.pStream->codec == VideoStream::CODEC_ID_H264))
 	{
+		if (isReadOnlyData)
+		{
+			if (sideBufferSize < frame.size)
+			{
+				if (pSideBuffer != NULL)
+				{
+					delete[] pSideBuffer;
+				}
+				pSideBuffer    = new unsigned char[frame.size];
+				sideBufferSize = frame.size;
+			}
+			memcpy(pSideBuffer, frame.data, frame.size);
+			frame.data = pSideBuffer;
+		}
+
 		unsigned char *ptr = frame.data;
 		int count = 1;
 		size_t size;
@@ -395,7 +561,9 @@ void MkvDemuxer::MyVideoStream::FixFrameData(Frame &frame) const
 }
 
 MkvDemuxer::MkvDemuxer()
-	: state(STOPPED)
+	: state(STOPPED), pElementPool(new EbmlElementPool()), frameCount(0ull), readMode(READ_MODE_DEFAULT),
+	  isChecksumVerified(false), corruptedClusterCount(0ull), pVerifyBuffer(NULL), verifyBufferSize(0),
+	  pFrameBuffer(NULL), frameBufferSize(0), readLock(-1), liveEndTimecode(0ull)
 {
 	ResetAllMembers();
 }
@@ -406,25 +574,535 @@ MkvDemuxer::~MkvDemuxer()
 	{
 		StopDemuxing();
 	}
+
+	pElementPool->Dispose();
+
+	if (pVerifyBuffer != NULL)
+	{
+		delete[] pVerifyBuffer;
+	}
+	if (pFrameBuffer != NULL)
+	{
+		delete[] pFrameBuffer;
+	}
+	DemuxerUtilities::Unlock(readLock);
+}
+
+bool MkvDemuxer::SetReadMode(ReadMode mode)
+{
+	if (state != STOPPED)
+	{
+		// error: only before starting
+		return false;
+	}
+
+	readMode = mode;
+	return true;
+}
+
+bool MkvDemuxer::SetChecksumVerification(bool enabled)
+{
+	if (state != STOPPED)
+	{
+		// error: only before starting
+		return false;
+	}
+
+	isChecksumVerified = enabled;
+	return true;
+}
+
+bool MkvDemuxer::GetStatistics(Statistics &statistics) const
+{
+	statistics.frameCount      = frameCount;
+	statistics.allocationCount = pElementPool->GetHeapAllocationCount();
+	statistics.recycledCount   = pElementPool->GetRequestCount() - pElementPool->GetHeapAllocationCount();
+	statistics.corruptedClusterCount = corruptedClusterCount;
+	return true;
+}
+
+bool MkvDemuxer::GetSeekPoints(std::vector<uint64_t> &points) const
+{
+	if (state != STARTED)
+	{
+		// error: only after starting
+		return false;
+	}
+
+	points = seekPoints;
+	std::sort(points.begin(), points.end());
+	points.erase(std::unique(points.begin(), points.end()), points.end());
+	return true;
+}
+
+// params: end position, end timecode, cluster positions, cluster timecodes
+bool MkvDemuxer::SetLiveSegment(uint64_t endPosition, uint64_t endTimecode, const std::vector<uint64_t> &positions, const std::vector<uint64_t> &timecodes)
+{
+	if ((endPosition == 0ull) || (positions.size() != timecodes.size()))
+	{
+		// error: invalid parameter
+		return false;
+	}
+
+	if (state != STOPPED)
+	{
+		// error: only before starting
+		return false;
+	}
+
+	liveEndPosition      = endPosition;
+	liveEndTimecode      = endTimecode;
+	liveClusterPositions = positions;
+	liveClusterTimecodes = timecodes;
+	return true;
+}
+
+// params: end position, end timecode, cluster positions, cluster timecodes
+bool MkvDemuxer::ExtendLiveSegment(uint64_t endPosition, uint64_t endTimecode, const std::vector<uint64_t> &positions, const std::vector<uint64_t> &timecodes)
+{
+	if ((state != STARTED) || (liveEndPosition == 0ull) || (endPosition < liveEndPosition) || (positions.size() != timecodes.size()))
+	{
+		// error: not demuxing a live segment, or another one
+		return false;
+	}
+
+	if ((pMappedFile != NULL) && (endPosition > pMappedFile->GetSize()))
+	{
+		// error: the mapping doesn't grow with the file
+		return false;
+	}
+
+	uint64 beginPosition = liveEndPosition;
+	liveEndPosition = endPosition;
+	liveEndTimecode = endTimecode;
+	TakeLiveClusters(beginPosition, positions, timecodes);
+	return true;
 }
 
 void MkvDemuxer::ResetAllMembers()
 {
-	pMKVFile = NULL;
-	pRawdata = NULL;
+	pMKVFile    = NULL;
+	pMappedFile = NULL;
+	pRawdata    = NULL;
+	cuePositions.clear();
+	seekPoints.clear();
+	liveEndPosition = 0ull;
+	heldPosition    = 0ull;
 	pSegment = NULL;
 
 	relativeUpperLevel = 0;
 	pElementLevel1     = NULL;
 	pElementLevel2     = NULL;
+	pElementLevel3     = NULL;
 	clusterPosition    = 0ull;
 
-	pCluster     = NULL;
+	pCluster             = NULL;
+	isClusterTimecodeSet = false;
+	isClusterCorrupted   = false;
 	pSimpleBlock = NULL;
 	pBlockGroup  = NULL;
 	pBlock       = NULL;
 }
 
+void MkvDemuxer::ReadAheadCluster()
+{
+	// the current cluster and the next one given by the cue index will be read
+	// soon, as far as the window moved to the cluster goes
+	uint64 begin = pCluster->GetElementPosition();
+	pMappedFile->GetData(begin, 0);
+	uint64 end   = pCluster->IsFiniteSize() ? pCluster->GetEndPosition() : pMappedFile->GetSize();
+
+	std::vector<uint64>::const_iterator next = std::upper_bound(cuePositions.begin(), cuePositions.end(), begin);
+	if ((next != cuePositions.end()) && (++next != cuePositions.end()) && (*next > end))
+	{
+		end = *next;
+	}
+	pMappedFile->Advise(begin, end - begin, MmapIOCallback::advice_willneed);
+}
+
+bool MkvDemuxer::VerifyCluster(const EbmlCrc32 &checksum)
+{
+	// the checksum covers everything following it up to the end of the cluster
+	if (!pCluster->IsFiniteSize())
+	{
+		return true;
+	}
+
+	uint64 begin = checksum.GetEndPosition();
+	uint64 end   = pCluster->GetEndPosition();
+	if (end < begin)
+	{
+		return false;
+	}
+	uint32 size = (uint32)(end - begin);
+
+	if (pMappedFile != NULL)
+	{
+		if (end > pMappedFile->GetSize())
+		{
+			return false;
+		}
+		const binary *pData = pMappedFile->GetData(begin, size);
+		if (pData != NULL)
+		{
+			return EbmlCrc32::CheckCRC(checksum.GetCrc32(), pData, size);
+		}
+		// larger than the window, read as in stdio mode
+	}
+
+	// in stdio mode the cluster is read twice: once here through a fixed size
+	// buffer, then block by block from the page cache. This is the cost of
+	// checking before any frame of the cluster is returned, only paid when
+	// verification is turned on, and the memory stays bounded
+	if (pVerifyBuffer == NULL)
+	{
+		verifyBufferSize = VERIFY_BUFFER_SIZE;
+		pVerifyBuffer    = new unsigned char[verifyBufferSize];
+	}
+
+	IOCallback &io = pRawdata->I_O();
+	io.setFilePointer(begin);
+	uint32 crc    = 0xFFFFFFFF;
+	bool   result = true;
+	while (result && (size > 0))
+	{
+		uint32 length = (size < verifyBufferSize) ? size : (uint32)verifyBufferSize;
+		result = (io.read(pVerifyBuffer, length) == length);
+		crc    = EbmlCrc32::UpdateCrc(crc, pVerifyBuffer, length);
+		size  -= length;
+	}
+	io.setFilePointer(begin);
+	return result && ((crc ^ 0xFFFFFFFF) == checksum.GetCrc32());
+}
+
+// a frame the mapped window can't hold is copied out of the file instead
+bool MkvDemuxer::ReadMappedFrame(uint64 position, Frame &frame)
+{
+	if (frameBufferSize < frame.size)
+	{
+		if (pFrameBuffer != NULL)
+		{
+			delete[] pFrameBuffer;
+		}
+		pFrameBuffer    = new unsigned char[frame.size];
+		frameBufferSize = frame.size;
+	}
+
+	IOCallback &io = pRawdata->I_O();
+	uint64 currentPosition = io.getFilePointer();
+	io.setFilePointer(position);
+	bool result = (io.read(pFrameBuffer, frame.size) == frame.size);
+	io.setFilePointer(currentPosition);
+	frame.data = pFrameBuffer;
+	return result;
+}
+
+// the length of an EBML variable size integer by its first byte, 0 if wrong
+static inline size_t GetVintLength(unsigned char first)
+{
+	size_t length = 1;
+	for (unsigned char mask = 0x80; (mask != 0) && !(first & mask); mask >>= 1)
+	{
+		length++;
+	}
+	return length <= 8 ? length : 0;
+}
+
+// Cluster id, size, an optional CRC-32 element and then ClusterTimecode,
+// the whole size of the cluster is 0 if unknown
+static bool ParseClusterHead(const unsigned char *p, const unsigned char *pEnd, uint64_t &timecode, uint64_t *pClusterSize = NULL)
+{
+	if ((pEnd - p < 8) || (p[0] != 0x1F) || (p[1] != 0x43) || (p[2] != 0xB6) || (p[3] != 0x75))
+	{
+		return false;
+	}
+	size_t length = GetVintLength(p[4]);
+	if ((length == 0) || (pEnd - p < 4 + (int)length))
+	{
+		return false;
+	}
+	if (pClusterSize != NULL)
+	{
+		uint64_t dataSize = p[4] & (0xFF >> length);
+		uint64_t unknownSize = 0xFF >> length;
+		for (size_t i = 1; i < length; i++)
+		{
+			dataSize = (dataSize << 8) | p[4 + i];
+			unknownSize = (unknownSize << 8) | 0xFF;
+		}
+		*pClusterSize = (dataSize != unknownSize) ? 4 + length + dataSize : 0;
+	}
+	p += 4 + length;
+	if ((pEnd - p >= 6) && (p[0] == 0xBF) && (p[1] == 0x84))
+	{
+		p += 6;
+	}
+	if ((pEnd - p < 2) || (p[0] != 0xE7) || !(p[1] & 0x80)
+	    || ((p[1] & 0x7F) > 8) || (pEnd - p < 2 + (p[1] & 0x7F)))
+	{
+		return false;
+	}
+
+	timecode = 0;
+	for (int i = 0; i < (p[1] & 0x7F); i++)
+	{
+		timecode = (timecode << 8) | p[2 + i];
+	}
+	return true;
+}
+
+// the timecode of a cluster from its head, without reading its blocks
+bool MkvDemuxer::ReadClusterTimecode(uint64 position, uint64_t &timecode)
+{
+	unsigned char buffer[MAX_CLUSTER_HEAD_SIZE];
+	pMKVFile->setFilePointer(position);
+	size_t size = pMKVFile->read(buffer, sizeof(buffer));
+	if (!ParseClusterHead(buffer, buffer + size, timecode))
+	{
+		return false;
+	}
+	timecode *= streams.timecodeScale;
+	return true;
+}
+
+// look for the head of the last cluster backwards from the end of the file,
+// and then for its last block, which holds even if the file was cut in the
+// middle of the cluster
+bool MkvDemuxer::FindLastTimecode(uint64_t minTimecode, uint64_t maxTimecode, uint64_t &timecode)
+{
+	if (pMKVFile == NULL)
+	{
+		return false;
+	}
+
+	pMKVFile->setFilePointer(0, seek_end);
+	uint64 fileSize = pMKVFile->getFilePointer();
+	std::vector<unsigned char> buffer(TAIL_CHUNK_SIZE + MAX_CLUSTER_HEAD_SIZE);
+
+	for (uint64 chunkEnd = fileSize; (chunkEnd > 0) && (fileSize - chunkEnd < MAX_TAIL_SCAN_SIZE); )
+	{
+		// the chunks overlap by a cluster head
+		uint64 chunkBegin = chunkEnd > TAIL_CHUNK_SIZE ? chunkEnd - TAIL_CHUNK_SIZE : 0;
+		size_t size = (size_t)((chunkEnd + MAX_CLUSTER_HEAD_SIZE < fileSize ? chunkEnd + MAX_CLUSTER_HEAD_SIZE : fileSize) - chunkBegin);
+		pMKVFile->setFilePointer(chunkBegin);
+		if (pMKVFile->read(&buffer[0], size) != size)
+		{
+			// error:
+			return false;
+		}
+
+		for (size_t i = (size_t)(chunkEnd - chunkBegin); i-- > 0; )
+		{
+			uint64_t value;
+			if (!ParseClusterHead(&buffer[i], &buffer[0] + size, value))
+			{
+				continue;
+			}
+
+			// the pattern may as well be in a frame
+			if ((value * streams.timecodeScale >= minTimecode) && (value * streams.timecodeScale <= maxTimecode))
+			{
+				timecode = (value + ReadLastBlockTimecode(chunkBegin + i, fileSize)) * streams.timecodeScale;
+				return true;
+			}
+		}
+
+		chunkEnd = chunkBegin;
+	}
+
+	return false;
+}
+
+// the latest timecode relative to the cluster among its whole blocks
+int MkvDemuxer::ReadLastBlockTimecode(uint64 position, uint64 fileSize)
+{
+	int latest = 0;
+	bool isCluster = true;
+	unsigned char head[16];  // id, size, track number and timecode of a block
+
+	while (position + 2 <= fileSize)
+	{
+		pMKVFile->setFilePointer(position);
+		size_t size = pMKVFile->read(head, sizeof(head));
+		size_t idLength = GetVintLength(head[0]);
+		size_t sizeLength = (idLength > 0) && (idLength < size) ? GetVintLength(head[idLength]) : 0;
+		if ((idLength == 0) || (idLength > 4) || (sizeLength == 0) || (idLength + sizeLength > size)
+		    || ((idLength == 4) && !isCluster))
+		{
+			// the end of the cluster, or of what was written
+			break;
+		}
+
+		uint64 dataSize = head[idLength] & (0xFF >> sizeLength);
+		for (size_t i = 1; i < sizeLength; i++)
+		{
+			dataSize = (dataSize << 8) | head[idLength + i];
+		}
+		position += idLength + sizeLength;
+
+		if (isCluster || (head[0] == 0xA0))
+		{
+			// enter the cluster and its block groups
+			isCluster = false;
+			continue;
+		}
+
+		size_t trackLength = GetVintLength(head[idLength + sizeLength]);
+		if (((head[0] == 0xA3) || (head[0] == 0xA1))
+		    && (position + dataSize <= fileSize) && (trackLength > 0)
+		    && (idLength + sizeLength + trackLength + 2 <= size))
+		{
+			const unsigned char *p = head + idLength + sizeLength + trackLength;
+			int timecode = (short)((p[0] << 8) | p[1]);
+			latest = timecode > latest ? timecode : latest;
+		}
+		position += dataSize;
+	}
+
+	return latest;
+}
+
+// a file never stopped by the muxer: walk the clusters written after its last
+// checkpoint up to the first one cut short, take them into the segment, the
+// duration and the cues, and return where to start for the seek time
+uint64 MkvDemuxer::RepairSegment(uint64 firstPosition, uint64 seekPosition, uint64_t seekTime)
+{
+	uint64 currentPosition = pMKVFile->getFilePointer();
+	uint64_t firstTimecode;
+	if (!ReadClusterTimecode(firstPosition, firstTimecode))
+	{
+		// error: not a cluster of ours, read what can be read
+		pMKVFile->setFilePointer(currentPosition);
+		return firstPosition;
+	}
+
+	pMKVFile->setFilePointer(0, seek_end);
+	uint64 fileSize  = pMKVFile->getFilePointer();
+	uint64 dataStart = pSegment->GetElementPosition() + pSegment->HeadSize();
+	uint64 position  = firstPosition;
+	bool   isCheckpointed = pSegment->IsFiniteSize() && (pSegment->GetEndPosition() > firstPosition) && (pSegment->GetEndPosition() <= fileSize);
+	if (isCheckpointed)
+	{
+		// the checkpoint covers everything before
+		position = pSegment->GetEndPosition();
+	}
+	if (seekPosition >= position)
+	{
+		// the cues are not trusted beyond the checkpoint
+		seekPosition = 0ull;
+	}
+
+	uint64   lastPosition = 0ull;
+	uint64_t lastTimecode = firstTimecode;
+	while (position < fileSize)
+	{
+		unsigned char head[MAX_CLUSTER_HEAD_SIZE];
+		uint64_t timecode, clusterSize;
+		pMKVFile->setFilePointer(position);
+		size_t size = pMKVFile->read(head, sizeof(head));
+		if (!ParseClusterHead(head, head + size, timecode, &clusterSize)
+		    || (clusterSize == 0) || (position + clusterSize > fileSize))
+		{
+			// the torn tail
+			break;
+		}
+
+		timecode *= streams.timecodeScale;
+		if ((timecode < lastTimecode) || (timecode > firstTimecode + 24 * 60 * 60 * 1000000000ull))
+		{
+			// the old contents of a preallocated file
+			break;
+		}
+
+		if (pMappedFile != NULL)
+		{
+			cuePositions.push_back(position);
+		}
+		seekPoints.push_back(timecode);
+		if ((seekTime != 0ull) && (timecode <= seekTime) && (position > seekPosition))
+		{
+			seekPosition = position;
+		}
+		lastPosition = position;
+		lastTimecode = timecode;
+		position    += clusterSize;
+	}
+
+	MESSAGE("\n- Segment repaired up to %llu\n", position);
+	pSegment->SetSizeInfinite(true);
+	pSegment->ForceSize(position - dataStart);
+	std::sort(cuePositions.begin(), cuePositions.end());
+	cuePositions.erase(std::lower_bound(cuePositions.begin(), cuePositions.end(), position), cuePositions.end());
+
+	if (lastPosition != 0ull)
+	{
+		uint64_t lastFrameTimecode = lastTimecode + ReadLastBlockTimecode(lastPosition, position) * streams.timecodeScale;
+		streams.duration = (double)(lastFrameTimecode - firstTimecode) / 1000000000;
+	}
+	else if (!isCheckpointed)
+	{
+		// no cluster is whole
+		streams.duration = .0;
+	}
+
+	pMKVFile->setFilePointer(currentPosition);
+	return (seekPosition > firstPosition) ? seekPosition : firstPosition;
+}
+
+// a file being written: take the clusters its writer committed instead of
+// walking them, and return where to start for the seek time
+uint64 MkvDemuxer::TakeLiveSegment(uint64 firstPosition, uint64 seekPosition, uint64_t seekTime)
+{
+	if (seekPosition >= liveEndPosition)
+	{
+		seekPosition = 0ull;
+	}
+
+	std::vector<uint64_t> positions, timecodes;
+	positions.swap(liveClusterPositions);
+	timecodes.swap(liveClusterTimecodes);
+	TakeLiveClusters(firstPosition, positions, timecodes);
+
+	for (size_t i = 0; i < positions.size(); i++)
+	{
+		if ((seekTime != 0ull) && (timecodes[i] <= seekTime) && (positions[i] > seekPosition) && (positions[i] < liveEndPosition))
+		{
+			seekPosition = positions[i];
+		}
+	}
+
+	MESSAGE("\n- Live segment up to %llu\n", liveEndPosition);
+	return (seekPosition > firstPosition) ? seekPosition : firstPosition;
+}
+
+// the segment ends with the last cluster committed, those from the begin
+// position on become seek points
+void MkvDemuxer::TakeLiveClusters(uint64 beginPosition, const std::vector<uint64_t> &positions, const std::vector<uint64_t> &timecodes)
+{
+	for (size_t i = 0; i < positions.size(); i++)
+	{
+		if ((positions[i] < beginPosition) || (positions[i] >= liveEndPosition))
+		{
+			continue;
+		}
+
+		if (pMappedFile != NULL)
+		{
+			cuePositions.push_back(positions[i]);
+		}
+		seekPoints.push_back(timecodes[i]);
+	}
+	std::sort(cuePositions.begin(), cuePositions.end());
+
+	uint64 dataStart = pSegment->GetElementPosition() + pSegment->HeadSize();
+	pSegment->SetSizeInfinite(true);
+	pSegment->ForceSize(liveEndPosition - dataStart);
+	if (!timecodes.empty() && (liveEndTimecode > timecodes[0]))
+	{
+		streams.duration = (double)(liveEndTimecode - timecodes[0]) / 1000000000;
+	}
+}
+
 bool MkvDemuxer::StopDemuxing()
 {
 	if ((state == STOPPED) || (state == STOPPING))
@@ -438,8 +1116,10 @@ bool MkvDemuxer::StopDemuxing()
 	if (pMKVFile != NULL)
 	{
 		delete pMKVFile;
-		pMKVFile = NULL;
+		pMKVFile    = NULL;
+		pMappedFile = NULL;
 	}
+	DemuxerUtilities::Unlock(readLock);
 
 	if (pRawdata != NULL)
 	{
@@ -466,6 +1146,8 @@ bool MkvDemuxer::StopDemuxing()
 
 const Demuxer::Streams * MkvDemuxer::StartDemuxing(const char *pFileName, uint64_t seekTime)
 {
+	HOT_TRACE_SCOPE("demux.start");
+
 	if (state != STOPPED)
 	{
 		// error: already started
@@ -473,6 +1155,10 @@ const Demuxer::Streams * MkvDemuxer::StartDemuxing(const char *pFileName, uint64
 	}
 	state = STARTING;
 
+	// the live segment set right before applies to this start only
+	uint64 endPosition = liveEndPosition;
+	liveEndPosition = 0ull;
+
 	if (pFileName == NULL)
 	{
 		// error: invalid parameter
@@ -480,14 +1166,52 @@ const Demuxer::Streams * MkvDemuxer::StartDemuxing(const char *pFileName, uint64
 		return NULL;
 	}
 
+	EbmlElementPool::Scope poolScope(*pElementPool);
+
 	// open the file
 	{
 		if (pMKVFile != NULL)
 		{
 			delete pMKVFile;
 			pMKVFile = NULL;
+			pMappedFile = NULL;
+		}
+		DemuxerUtilities::Unlock(readLock);
+		if (!DemuxerUtilities::LockForReading(pFileName, readLock))
+		{
+			// error: the file is being overwritten with another clip
+			state = STOPPED;
+			return NULL;
+		}
+		try
+		{
+			if (readMode == READ_MODE_MMAP)
+			{
+				pMappedFile = new MmapIOCallback(pFileName);
+				if (!pMappedFile->IsMapped())
+				{
+					// warning: out of address space, read it as in stdio mode
+					delete pMappedFile;
+					pMappedFile = NULL;
+				}
+			}
+			if (pMappedFile != NULL)
+			{
+				pMappedFile->Advise(0ull, pMappedFile->GetSize(), MmapIOCallback::advice_sequential);
+				pMKVFile = pMappedFile;
+			}
+			else
+			{
+				pMKVFile = new StdIOCallback(pFileName, MODE_READ);
+			}
+		}
+		catch (CRTError &)
+		{
+			// error: the file is gone, e.g. a live clip renamed once closed
+			DemuxerUtilities::Unlock(readLock);
+			state = STOPPED;
+			return NULL;
 		}
-		pMKVFile = new StdIOCallback(pFileName, MODE_READ);
 
 		if (pRawdata != NULL)
 		{
@@ -545,6 +1269,8 @@ const Demuxer::Streams * MkvDemuxer::StartDemuxing(const char *pFileName, uint64
 
 		EbmlElement *pElementLevel3 = NULL;
 		EbmlElement *pElementLevel4 = NULL;
+		bool         hasMetaSeek = false;  // written when the file is stopped
+		uint64       cuePosition = 0ull;
 
 		pCluster     = NULL;
 		pSimpleBlock = NULL;
@@ -557,6 +1283,38 @@ const Demuxer::Streams * MkvDemuxer::StartDemuxing(const char *pFileName, uint64
 			if (CHECK_TYPE(pElementLevel1, KaxCluster))
 			{
 				MESSAGE("\n- Segment Clusters found\n");
+				if (!hasMetaSeek)
+				{
+					// take in what follows the last checkpoint, and seek from there if later
+					uint64 position = pElementLevel1->GetElementPosition();
+					uint64 seekPosition;
+					if (endPosition > position)
+					{
+						// or what its writer committed, the rest may be written meanwhile
+						liveEndPosition = endPosition;
+						seekPosition = TakeLiveSegment(position, cuePosition, seekTime);
+					}
+					else
+					{
+						seekPosition = RepairSegment(position, cuePosition, seekTime);
+					}
+					if (seekPosition != position)
+					{
+						delete pElementLevel1;
+						pMKVFile->setFilePointer(seekPosition);
+						pElementLevel1 = pRawdata->FindNextElement(pSegment->Generic().Context, relativeUpperLevel, 0xFFFFFFFFL, false);
+						if ((pElementLevel1 == NULL) || !CHECK_TYPE(pElementLevel1, KaxCluster))
+						{
+							// error: the cluster is gone
+							if (pElementLevel1 != NULL)
+							{
+								delete pElementLevel1;
+								pElementLevel1 = NULL;
+							}
+							break;
+						}
+					}
+				}
 				pCluster = static_cast<KaxCluster *>(pElementLevel1);
 
 				// stop parsing
@@ -569,6 +1327,7 @@ const Demuxer::Streams * MkvDemuxer::StartDemuxing(const char *pFileName, uint64
 			{
 				// find all meta-seek information
 				MESSAGE("\n- Meta Seek found\n");
+				hasMetaSeek = true;
 			}
 			else if (CHECK_TYPE(pElementLevel1, KaxInfo))
 			{
@@ -638,6 +1397,7 @@ const Demuxer::Streams * MkvDemuxer::StartDemuxing(const char *pFileName, uint64
 								case track_video:
 									MESSAGE("video");
 									streams.pVideo = new MyVideoStream();
+									static_cast<MyVideoStream *>(streams.pVideo)->isReadOnlyData = (pMappedFile != NULL);
 									pTrackStream = streams.pVideo;
 									break;
 
@@ -717,6 +1477,38 @@ const Demuxer::Streams * MkvDemuxer::StartDemuxing(const char *pFileName, uint64
 				{
 					clusterPosition += pSegment->GetElementPosition() + pSegment->HeadSize();
 				}
+				if (!hasMetaSeek)
+				{
+					// the cues of a checkpoint: don't jump before RepairSegment() knows the first cluster
+					cuePosition     = clusterPosition;
+					clusterPosition = 0ull;
+				}
+
+				for (size_t i = 0; i < pCues->ListSize(); i++)
+				{
+					uint64 timecode;
+					if (CHECK_TYPE((*pCues)[i], KaxCuePoint) && static_cast<KaxCuePoint *>((*pCues)[i])->Timecode(timecode, streams.timecodeScale))
+					{
+						seekPoints.push_back(timecode);
+					}
+				}
+
+				if (pMappedFile != NULL)
+				{
+					// keep the cluster positions to read the next cluster ahead
+					for (size_t i = 0; i < pCues->ListSize(); i++)
+					{
+						if (CHECK_TYPE((*pCues)[i], KaxCuePoint))
+						{
+							const KaxCueTrackPositions *pPositions = static_cast<KaxCuePoint *>((*pCues)[i])->GetSeekPosition();
+							if (pPositions != NULL)
+							{
+								cuePositions.push_back(pPositions->ClusterPosition() + pSegment->GetElementPosition() + pSegment->HeadSize());
+							}
+						}
+					}
+					std::sort(cuePositions.begin(), cuePositions.end());
+				}
 			}
 			else if (CHECK_TYPE(pElementLevel1, KaxChapters))
 			{
@@ -740,6 +1532,8 @@ const Demuxer::Streams * MkvDemuxer::StartDemuxing(const char *pFileName, uint64
 
 const Demuxer::Frame * MkvDemuxer::GetOneFrame(Demuxer::Frame *pFrame)
 {
+	HOT_TRACE_SCOPE("demux.get_frame");
+
 	if (state < STARTED)
 	{
 		// error: not ready to get any frame
@@ -751,6 +1545,27 @@ const Demuxer::Frame * MkvDemuxer::GetOneFrame(Demuxer::Frame *pFrame)
 		pFrame = &myFrame;
 	}
 
+	EbmlElementPool::Scope poolScope(*pElementPool);
+
+	if (heldPosition != 0ull)
+	{
+		// held at the end of a live segment until it's set further
+		if (heldPosition >= liveEndPosition)
+		{
+			return NULL;
+		}
+
+		pMKVFile->setFilePointer(heldPosition);
+		heldPosition       = 0ull;
+		relativeUpperLevel = 0;
+		pElementLevel1     = pRawdata->FindNextElement(pSegment->Generic().Context, relativeUpperLevel, 0xFFFFFFFFL, false);
+		if (pElementLevel1 == NULL)
+		{
+			goto END_OF_FILE;
+		}
+		goto BEGIN_OF_SEGMENT_LOOP;
+	}
+
 	if ((pCluster == NULL) || (pRawdata == NULL) || (pSegment == NULL) || (pElementLevel1 == NULL))
 	{
 		// error: something wrong
@@ -767,84 +1582,160 @@ const Demuxer::Frame * MkvDemuxer::GetOneFrame(Demuxer::Frame *pFrame)
 		goto BEGIN_OF_CLUSTER_LOOP;
 	}
 
+	// the children of a cluster are read one by one, only the block of the
+	// returned frame is resident: its data is valid until the next call
 	PARSING_LOOP (pSegment, pElementLevel1, pElementLevel2, pRawdata, relativeUpperLevel)
 	{
+BEGIN_OF_SEGMENT_LOOP:
+		if (pSegment->IsFiniteSize() && (pElementLevel1->GetElementPosition() >= pSegment->GetEndPosition()))
+		{
+			// the old contents of a preallocated file follow the segment
+			delete pElementLevel1;
+			pElementLevel1 = NULL;
+			goto END_OF_FILE;
+		}
+
 		if (CHECK_TYPE(pElementLevel1, KaxCluster))
 		{
 			MESSAGE("\n- Segment Clusters found\n");
 			pCluster = static_cast<KaxCluster *>(pElementLevel1);
 
 BEGIN_OF_CLUSTER_LOOP:
-			FILL_ELEMENT(pCluster, KaxCluster, pElementLevel2, pRawdata, relativeUpperLevel);
+			isClusterTimecodeSet = false;
+			isClusterCorrupted   = false;
+			if (pMappedFile != NULL)
+			{
+				ReadAheadCluster();
+			}
 
-			if (CHECK_TYPE((*pCluster)[0], KaxClusterTimecode))
+			PARSING_LOOP (pCluster, pElementLevel2, pElementLevel3, pRawdata, relativeUpperLevel)
 			{
+				if (pSegment->IsFiniteSize() && (pElementLevel2->GetElementPosition() >= pSegment->GetEndPosition()))
 				{
-					uint64_t clusterTimecode = (uint64_t)*static_cast<KaxClusterTimecode *>((*pCluster)[0]);
-					pCluster->InitTimecode(clusterTimecode, streams.timecodeScale);
-					MESSAGE("\tcluster timecode: %llu.%llu\n", clusterTimecode*streams.timecodeScale/1000000000ull, clusterTimecode*streams.timecodeScale/1000000ull%1000ull);
+					// the old contents of a preallocated file follow the last cluster
+					delete pElementLevel2;
+					pElementLevel2 = NULL;
+					goto END_OF_FILE;
 				}
 
-				for (clusterIndex = 1; clusterIndex < pCluster->ListSize(); clusterIndex++)
+				if (CHECK_TYPE(pElementLevel2, EbmlCrc32))
 				{
-					if (CHECK_TYPE((*pCluster)[clusterIndex], KaxSimpleBlock))
+					if (isChecksumVerified)
 					{
-						pSimpleBlock = static_cast<KaxSimpleBlock *>((*pCluster)[clusterIndex]);
-						pSimpleBlock->SetParent(*pCluster);
-						pFrame->pStream  = streams.HasAudio() && (pSimpleBlock->TrackNum() == streams.pAudio->trackNumber) ? streams.pAudio
-						                   : streams.HasVideo() && (pSimpleBlock->TrackNum() == streams.pVideo->trackNumber) ? streams.pVideo
-										   : streams.HasOthers() && (pSimpleBlock->TrackNum() == streams.pOther->trackNumber) ? streams.pOther
-										   : NULL;
-						if (pFrame->pStream == NULL)
+						EbmlCrc32 *pChecksum = static_cast<EbmlCrc32 *>(pElementLevel2);
+						READ_DATA(pChecksum, pRawdata);
+						if (!VerifyCluster(*pChecksum))
 						{
-							// error track cluster: skip it
-							return NULL;
+							// error: damaged cluster, skip all its frames
+							MESSAGE("\tcluster checksum mismatch\n");
+							isClusterCorrupted = true;
+							corruptedClusterCount++;
 						}
-						pFrame->isKey    = pSimpleBlock->IsKeyframe();
-						pFrame->timecode = pSimpleBlock->GlobalTimecode();
-						pFrame->size     = pSimpleBlock->GetBuffer(0).Size();
-						pFrame->data     = pSimpleBlock->GetBuffer(0).Buffer();
-						pFrame->FixData();
-						CLUSTER_MESSAGE("\tsimple block: key=%d, size=%d, timecode=%llu.%llu\n", pFrame->isKey, pFrame->size, pFrame->timecode/1000000000ull, pFrame->timecode/1000000ull%1000ull);
-						return pFrame;
 					}
-					else if (CHECK_TYPE((*pCluster)[clusterIndex], KaxBlockGroup))
+				}
+				else if (isClusterCorrupted)
+				{
+					CLUSTER_MESSAGE("\tskip element of a damaged cluster\n");
+				}
+				else if (CHECK_TYPE(pElementLevel2, KaxClusterTimecode))
+				{
+					{
+						KaxClusterTimecode *pClusterTimecode = static_cast<KaxClusterTimecode *>(pElementLevel2);
+						READ_DATA(pClusterTimecode, pRawdata);
+						uint64_t clusterTimecode = (uint64_t)*pClusterTimecode;
+						pCluster->InitTimecode(clusterTimecode, streams.timecodeScale);
+						isClusterTimecodeSet = true;
+						MESSAGE("\tcluster timecode: %llu.%llu\n", clusterTimecode*streams.timecodeScale/1000000000ull, clusterTimecode*streams.timecodeScale/1000000ull%1000ull);
+					}
+				}
+				else if (!isClusterTimecodeSet)
+				{
+					// error mkv format: there must be a KaxClusterTimecode first
+					CLUSTER_MESSAGE("\tskip element before cluster timecode\n");
+				}
+				else if (CHECK_TYPE(pElementLevel2, KaxSimpleBlock))
+				{
+					pSimpleBlock = static_cast<KaxSimpleBlock *>(pElementLevel2);
+					if (pMappedFile != NULL)
+					{
+						// only the block header is read, the frame stays in the mapping
+						pSimpleBlock->ReadData(pRawdata->I_O(), SCOPE_PARTIAL_DATA);
+					}
+					else
+					{
+						READ_DATA(pSimpleBlock, pRawdata);
+					}
+					pSimpleBlock->SetParent(*pCluster);
+					pFrame->pStream  = streams.HasAudio() && (pSimpleBlock->TrackNum() == streams.pAudio->trackNumber) ? streams.pAudio
+					                   : streams.HasVideo() && (pSimpleBlock->TrackNum() == streams.pVideo->trackNumber) ? streams.pVideo
+									   : streams.HasOthers() && (pSimpleBlock->TrackNum() == streams.pOther->trackNumber) ? streams.pOther
+									   : NULL;
+					if (pFrame->pStream == NULL)
+					{
+						// error track cluster: skip it
+						return NULL;
+					}
+					pFrame->isKey    = pSimpleBlock->IsKeyframe();
+					pFrame->timecode = pSimpleBlock->GlobalTimecode();
+					if (pMappedFile != NULL)
 					{
-						pBlockGroup = static_cast<KaxBlockGroup *>((*pCluster)[clusterIndex]);
-						pBlock      = FIND_ELEMENT(pBlockGroup, KaxBlock);
-						pBlockGroup->SetParent(*pCluster);
-						pFrame->pStream  = streams.HasAudio() && (pBlock->TrackNum() == streams.pAudio->trackNumber) ? streams.pAudio
-						                   : streams.HasVideo() && (pBlock->TrackNum() == streams.pVideo->trackNumber) ? streams.pVideo
-										   : streams.HasOthers() && (pBlock->TrackNum() == streams.pOther->trackNumber) ? streams.pOther
-										   : NULL;
-						if (pFrame->pStream == NULL)
+						pFrame->size = (size_t)pSimpleBlock->GetFrameSize(0);
+						pFrame->data = const_cast<unsigned char *>(pMappedFile->GetData(pSimpleBlock->GetDataPosition(0), pFrame->size));
+						if ((pFrame->data == NULL) && !ReadMappedFrame(pSimpleBlock->GetDataPosition(0), *pFrame))
 						{
-							// error track cluster: skip it
+							// error: the frame is cut
 							return NULL;
 						}
-						pFrame->isKey    = FIND_ELEMENT(pBlockGroup, KaxBlock) == NULL;
-						pFrame->timecode = pBlock->GlobalTimecode();
-						pFrame->size     = pBlock->GetBuffer(0).Size();
-						pFrame->data     = pBlock->GetBuffer(0).Buffer();
-						pFrame->FixData();
-						CLUSTER_MESSAGE("\tblock: key=%d, size=%d, timecode=%llu.%llu\n", pFrame->isKey, pFrame->size, pFrame->timecode/1000000000ull, pFrame->timecode/1000000ull%1000ull);
-						return pFrame;
 					}
 					else
 					{
-						CLUSTER_MESSAGE("\tother element\n");
+						pFrame->size = pSimpleBlock->GetBuffer(0).Size();
+						pFrame->data = pSimpleBlock->GetBuffer(0).Buffer();
+					}
+					pFrame->FixData();
+					frameCount++;
+					CLUSTER_MESSAGE("\tsimple block: key=%d, size=%d, timecode=%llu.%llu\n", pFrame->isKey, pFrame->size, pFrame->timecode/1000000000ull, pFrame->timecode/1000000ull%1000ull);
+					return pFrame;
+				}
+				else if (CHECK_TYPE(pElementLevel2, KaxBlockGroup))
+				{
+					pBlockGroup = static_cast<KaxBlockGroup *>(pElementLevel2);
+					FILL_ELEMENT(pBlockGroup, KaxBlockGroup, pElementLevel3, pRawdata, relativeUpperLevel);
+					pBlock      = FIND_ELEMENT(pBlockGroup, KaxBlock);
+					if (pBlock == NULL)
+					{
+						// error mkv format: a block group without block
+						goto END_OF_LEVEL2;
+					}
+					pBlockGroup->SetParent(*pCluster);
+					pFrame->pStream  = streams.HasAudio() && (pBlock->TrackNum() == streams.pAudio->trackNumber) ? streams.pAudio
+					                   : streams.HasVideo() && (pBlock->TrackNum() == streams.pVideo->trackNumber) ? streams.pVideo
+									   : streams.HasOthers() && (pBlock->TrackNum() == streams.pOther->trackNumber) ? streams.pOther
+									   : NULL;
+					if (pFrame->pStream == NULL)
+					{
+						// error track cluster: skip it
+						return NULL;
 					}
+					pFrame->isKey    = FIND_ELEMENT(pBlockGroup, KaxBlock) == NULL;
+					pFrame->timecode = pBlock->GlobalTimecode();
+					pFrame->size     = pBlock->GetBuffer(0).Size();
+					pFrame->data     = pBlock->GetBuffer(0).Buffer();
+					pFrame->FixData();
+					frameCount++;
+					CLUSTER_MESSAGE("\tblock: key=%d, size=%d, timecode=%llu.%llu\n", pFrame->isKey, pFrame->size, pFrame->timecode/1000000000ull, pFrame->timecode/1000000ull%1000ull);
+					return pFrame;
+				}
+				else
+				{
+					CLUSTER_MESSAGE("\tother element\n");
+				}
 
 END_OF_LEVEL2:
-					pSimpleBlock = NULL;
-					pBlockGroup  = NULL;
-					pBlock       = NULL;
-				}
-			}
-			else
-			{
-				// error mkv format: there must be a KaxClusterTimecode first
-			}
+				pSimpleBlock = NULL;
+				pBlockGroup  = NULL;
+				pBlock       = NULL;
+			} END_LOOP (pCluster, pElementLevel2, pElementLevel3, pRawdata, relativeUpperLevel);
 		}
 		else
 		{
@@ -854,6 +1745,23 @@ END_OF_LEVEL2:
 	} END_LOOP (pSegment, pElementLevel1, pElementLevel2, pRawdata, relativeUpperLevel);
 
 END_OF_FILE:
+	if ((liveEndPosition != 0ull) && (pSegment != NULL))
+	{
+		// the clusters after the live segment are still being written
+		if (pCluster != NULL)
+		{
+			delete pCluster;
+			pCluster = NULL;
+		}
+		pElementLevel1 = NULL;
+		pElementLevel2 = NULL;
+		pSimpleBlock   = NULL;
+		pBlockGroup    = NULL;
+		pBlock         = NULL;
+		heldPosition   = pSegment->GetEndPosition();
+		return NULL;
+	}
+
 	StopDemuxing();
 	return NULL;
 }
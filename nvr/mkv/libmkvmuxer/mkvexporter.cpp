@@ -0,0 +1,1238 @@
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+
+#include "ebml/StdIOCallback.h"
+#include "ebml/HotTrace.h"
+
+#include "ebml/EbmlHead.h"
+#include "ebml/EbmlSubHead.h"
+#include "ebml/EbmlVoid.h"
+#include "ebml/EbmlCrc32.h"
+#include "matroska/FileKax.h"
+#include "matroska/KaxSegment.h"
+#include "matroska/KaxTracks.h"
+#include "matroska/KaxCluster.h"
+#include "matroska/KaxSeekHead.h"
+#include "matroska/KaxCues.h"
+#include "matroska/KaxCuesData.h"
+#include "matroska/KaxInfo.h"
+#include "matroska/KaxInfoData.h"
+#include "matroska/KaxVersion.h"
+
+#include "exporter.hpp"
+#include "demuxer.hpp"
+
+using namespace LIBMATROSKA_NAMESPACE;
+
+// The clips are walked cluster by cluster from their heads, which tell the
+// timecode and the size of a cluster without reading its blocks. A cluster in
+// the middle of the range is read and written in one piece, with only its
+// timecode rewritten in place, in as many bytes as before, and its CRC-32
+// computed again. The blocks are walked for the first cluster, cut at a key
+// frame, and for the last one of every clip, which may go past the end time.
+// A thinning export walks the blocks of every cluster to leave frames out.
+class MkvExporter : public Exporter
+{
+public:
+	MkvExporter();
+	virtual ~MkvExporter();
+
+	virtual bool SetConfig(const Config &);
+	virtual bool IsThinned(const char *);
+	virtual bool StartExporting(const char *, uint64_t, uint64_t);
+	virtual bool AppendFile(const char *);
+	virtual bool StopExporting();
+	virtual bool GetStatistics(Statistics &) const;
+
+protected:
+	enum
+	{
+		MAX_ELEMENT_HEAD_SIZE = 12,                 // 4-byte id and 8-byte size
+		MAX_CLUSTER_HEAD_SIZE = 32,                 // id, size, CRC-32 and timecode
+		MAX_HEAD_ELEMENT_SIZE = 1024 * 1024,        // of the info and the tracks
+		MAX_CLUSTER_SIZE      = 256 * 1024 * 1024,
+		META_SEEK_SIZE        = 128,                // the info, the tracks and the cues
+		CUE_POINT_SIZE        = 34,                 // reserved for every sec of the range, a point whose time,
+		                                            // track and cluster position take 2-byte heads and 8-byte values
+		MAX_CUES_SIZE         = 4 * 1024 * 1024,    // the cues go after the clusters if more
+		CRC32_ELEMENT_SIZE    = 6,
+		TIMECODE_ELEMENT_SIZE = 10                  // with an 8-byte value for the rebuilt clusters
+	};
+
+	enum ElementId
+	{
+		ID_EBML_HEAD        = 0x1A45DFA3,
+		ID_SEGMENT          = 0x18538067,
+		ID_SEEK_HEAD        = 0x114D9B74,
+		ID_INFO             = 0x1549A966,
+		ID_TIMECODE_SCALE   = 0x2AD7B1,
+		ID_WRITING_APP      = 0x5741,
+		ID_TRACKS           = 0x1654AE6B,
+		ID_TRACK_ENTRY      = 0xAE,
+		ID_TRACK_NUMBER     = 0xD7,
+		ID_TRACK_UID        = 0x73C5,
+		ID_TRACK_TYPE       = 0x83,
+		ID_CLUSTER          = 0x1F43B675,
+		ID_CLUSTER_TIMECODE = 0xE7,
+		ID_CRC32            = 0xBF,
+		ID_SIMPLE_BLOCK     = 0xA3,
+		ID_BLOCK_GROUP      = 0xA0,
+		ID_BLOCK            = 0xA1,
+		ID_BLOCK_DURATION   = 0x9B,
+		ID_REFERENCE_BLOCK  = 0xFB
+	};
+
+	enum TrimResult
+	{
+		CLUSTER_DROPPED = 0,
+		CLUSTER_KEPT,
+		CLUSTER_CUT
+	};
+
+	// what is needed from the head of a clip, up to its first cluster
+	class SourceFile
+	{
+	public:
+		SourceFile()
+			: firstClusterPosition(0ull), endPosition(0ull), timecodeScale(1000000ull), videoTrackNumber(0ull), isThinned(false)
+		{
+		}
+
+		uint64 firstClusterPosition;
+		uint64 endPosition;       // of the segment, or of the file if it was never closed
+		uint64 timecodeScale;     // nanosec
+		uint64 videoTrackNumber;
+		std::vector<uint64> audioTrackNumbers;
+		bool   isThinned;         // written by a thinning export
+		std::vector<unsigned char> tracks;  // the whole element, copied into the new file
+		std::string tracksSignature;       // the tracks without their random uids, to compare clips
+	};
+
+	// a cluster by its head: the CRC-32 first if any, then the timecode
+	class ClusterHead
+	{
+	public:
+		ClusterHead()
+			: position(0ull), size(0ull), timecode(0ull), crcOffset(0), timecodeOffset(0), timecodeSize(0), dataOffset(0)
+		{
+		}
+
+		uint64 position;
+		uint64 size;            // of the whole cluster
+		uint64 timecode;        // in the timecode scale
+		size_t crcOffset;       // of the CRC-32 value, 0 for none
+		size_t timecodeOffset;  // of the timecode value
+		size_t timecodeSize;
+		size_t dataOffset;      // of the first child after the timecode
+	};
+
+	// a block or a block group of a cluster, when the cluster is cut
+	class BlockInfo
+	{
+	public:
+		size_t offset;          // of the element
+		size_t size;            // of the whole element
+		size_t timecodeOffset;  // of the 16-bit timecode relative to the cluster
+		size_t durationOffset;  // of the value of the block duration, 0 for none
+		size_t durationSize;
+		uint64 trackNumber;
+		uint64 timecode;        // in the timecode scale
+		uint64 duration;
+		bool   isVideoKey;
+	};
+
+	enum State
+	{
+		STOPPED = 0,
+		STARTED
+	};
+
+	// protected methods
+	bool ReadSourceFile(IOCallback &, SourceFile &);
+	bool ReadClusterHead(IOCallback &, uint64 position, uint64 endPosition, ClusterHead &);
+	bool ReadCluster(IOCallback &, const ClusterHead &);
+	TrimResult TrimCluster(const ClusterHead &, const SourceFile &, bool isThinning, ClusterHead &newHead, uint64 &lastTimecode, bool &hasVideoKey);
+	bool IsBlockKept(const BlockInfo &, const SourceFile &);
+	bool StartsWithVideoKey(const ClusterHead &, const SourceFile &);
+	bool WriteHead(const SourceFile &);
+	void WriteCluster(std::vector<unsigned char> &, const ClusterHead &, uint64 timecode, bool isCued);
+	void ResetAllMembers();
+
+	// protected members
+	State       state;
+	Config      config;
+	std::string fileName;
+	uint64_t    startTime;
+	uint64_t    endTime;
+	Statistics  statistics;
+
+	SourceFile  firstFile;          // whose tracks are written
+	bool        isHeadWritten;
+	bool        isStartFound;       // the key frame to start from is written
+	uint64      baseTimecode;       // in the timecode scale, of the key frame at 0 in the new file
+	uint64_t    lastFrameTime;      // nanosec
+	uint64      videoKeyCount;      // met by the thinning, for the GOPs to keep
+	std::vector<std::pair<uint64, uint64> > cuePoints;  // timecode and position of the clusters in the segment
+
+	std::vector<unsigned char> clusterBuffer;  // the cluster being copied
+	std::vector<unsigned char> trimBuffer;     // the cluster being cut
+
+	IOCallback  *pFile;
+	EbmlHead    *pHead;
+	KaxSegment  *pSegment;
+	KaxSeekHead *pMetaSeek;
+	EbmlVoid    *pMetaSeekDummy;
+	EbmlVoid    *pAllCuesDummy;
+	uint64       tracksPosition;
+};
+
+Exporter * ExporterUtilities::CreateMkvExporter()
+{
+	return new MkvExporter();
+}
+
+static const char THINNED_WRITING_APP[] = "exporter, thinned";
+
+// the length of an EBML variable size integer by its first byte, 0 if wrong
+static inline size_t GetVintLength(unsigned char first)
+{
+	size_t length = 1;
+	for (unsigned char mask = 0x80; (mask != 0) && !(first & mask); mask >>= 1)
+	{
+		length++;
+	}
+	return length <= 8 ? length : 0;
+}
+
+// the id of an element, with its marker bits, and the size of its data,
+// which is all ones if unknown
+static bool ParseElementHead(const unsigned char *p, const unsigned char *pEnd, uint32 &id, uint64 &dataSize, size_t &headSize)
+{
+	if (pEnd - p < 2)
+	{
+		return false;
+	}
+	size_t idLength = GetVintLength(p[0]);
+	if ((idLength == 0) || (idLength > 4) || (pEnd - p < (int)idLength + 1))
+	{
+		return false;
+	}
+	size_t sizeLength = GetVintLength(p[idLength]);
+	if ((sizeLength == 0) || (pEnd - p < (int)(idLength + sizeLength)))
+	{
+		return false;
+	}
+
+	id = 0;
+	for (size_t i = 0; i < idLength; i++)
+	{
+		id = (id << 8) | p[i];
+	}
+
+	uint64 unknownSize = 0xFF >> sizeLength;
+	dataSize = p[idLength] & (0xFF >> sizeLength);
+	for (size_t i = 1; i < sizeLength; i++)
+	{
+		dataSize = (dataSize << 8) | p[idLength + i];
+		unknownSize = (unknownSize << 8) | 0xFF;
+	}
+	if (dataSize == unknownSize)
+	{
+		dataSize = ~0ull;
+	}
+	headSize = idLength + sizeLength;
+	return true;
+}
+
+static uint64 ReadUInteger(const unsigned char *p, size_t size)
+{
+	uint64 value = 0ull;
+	for (size_t i = 0; i < size; i++)
+	{
+		value = (value << 8) | p[i];
+	}
+	return value;
+}
+
+// in place, false if the value needs more bytes than the old one
+static bool WriteUInteger(unsigned char *p, size_t size, uint64 value)
+{
+	for (size_t i = size; i-- > 0; )
+	{
+		p[i] = (unsigned char)value;
+		value >>= 8;
+	}
+	return value == 0ull;
+}
+
+MkvExporter::MkvExporter()
+	: state(STOPPED), pFile(NULL), pHead(NULL), pSegment(NULL), pMetaSeek(NULL), pMetaSeekDummy(NULL), pAllCuesDummy(NULL)
+{
+	ResetAllMembers();
+}
+
+MkvExporter::~MkvExporter()
+{
+	if (state != STOPPED)
+	{
+		StopExporting();
+	}
+}
+
+void MkvExporter::ResetAllMembers()
+{
+	startTime      = 0ull;
+	endTime        = 0ull;
+	statistics     = Statistics();
+	firstFile      = SourceFile();
+	isHeadWritten  = false;
+	isStartFound   = false;
+	baseTimecode   = 0ull;
+	lastFrameTime  = 0ull;
+	videoKeyCount  = 0ull;
+	tracksPosition = 0ull;
+	cuePoints.clear();
+}
+
+bool MkvExporter::GetStatistics(Statistics &_statistics) const
+{
+	_statistics = statistics;
+	return true;
+}
+
+// kept for the next exports
+bool MkvExporter::SetConfig(const Config &_config)
+{
+	if (state != STOPPED)
+	{
+		// error: already started
+		return false;
+	}
+
+	if (_config.keptGopInterval < 0)
+	{
+		// error: invalid parameter
+		return false;
+	}
+
+	config = _config;
+	return true;
+}
+
+// from the head of the clip only
+bool MkvExporter::IsThinned(const char *pFileName)
+{
+	if (pFileName == NULL)
+	{
+		// error: invalid parameter
+		return false;
+	}
+
+	IOCallback *pSourceFile;
+	try
+	{
+		pSourceFile = new StdIOCallback(pFileName, MODE_READ);
+	}
+	catch (CRTError &)
+	{
+		// error: the clip is gone
+		return false;
+	}
+
+	SourceFile source;
+	bool result;
+	try
+	{
+		result = ReadSourceFile(*pSourceFile, source) && source.isThinned;
+	}
+	catch (std::runtime_error &)
+	{
+		// error: fail to read
+		result = false;
+	}
+
+	delete pSourceFile;
+	return result;
+}
+
+bool MkvExporter::StartExporting(const char *pFileName, uint64_t _startTime, uint64_t _endTime)
+{
+	if (state != STOPPED)
+	{
+		// error: already started
+		return false;
+	}
+
+	if ((pFileName == NULL) || (_startTime >= _endTime))
+	{
+		// error: invalid parameter
+		return false;
+	}
+
+	try
+	{
+		pFile = new StdIOCallback(pFileName, MODE_CREATE);
+	}
+	catch (CRTError &)
+	{
+		// error: unable to create the file
+		return false;
+	}
+
+	ResetAllMembers();
+	fileName  = pFileName;
+	startTime = _startTime;
+	endTime   = _endTime;
+	state     = STARTED;
+	return true;
+}
+
+// the EBML head and the segment, then the info and the tracks
+bool MkvExporter::ReadSourceFile(IOCallback &file, SourceFile &source)
+{
+	file.setFilePointer(0, seek_end);
+	uint64 fileSize = file.getFilePointer();
+
+	unsigned char head[MAX_ELEMENT_HEAD_SIZE];
+	uint32 id;
+	uint64 dataSize;
+	size_t headSize;
+
+	file.setFilePointer(0);
+	size_t size = file.read(head, sizeof(head));
+	if (!ParseElementHead(head, head + size, id, dataSize, headSize) || (id != ID_EBML_HEAD) || (dataSize == ~0ull))
+	{
+		// error: not a matroska file
+		return false;
+	}
+
+	uint64 position = headSize + dataSize;
+	file.setFilePointer(position);
+	size = file.read(head, sizeof(head));
+	if (!ParseElementHead(head, head + size, id, dataSize, headSize) || (id != ID_SEGMENT))
+	{
+		// error: no segment
+		return false;
+	}
+
+	uint64 segmentEnd = ((dataSize != ~0ull) && (position + headSize + dataSize <= fileSize)) ? position + headSize + dataSize : fileSize;
+	bool isClosed = false;
+	position += headSize;
+
+	while (true)
+	{
+		file.setFilePointer(position);
+		size = file.read(head, sizeof(head));
+		if (!ParseElementHead(head, head + size, id, dataSize, headSize))
+		{
+			// error: no cluster at all
+			return false;
+		}
+
+		if (id == ID_CLUSTER)
+		{
+			break;
+		}
+		else if (dataSize == ~0ull)
+		{
+			// error: unknown size before the clusters
+			return false;
+		}
+		else if (id == ID_SEEK_HEAD)
+		{
+			// the meta seek stays void until the muxer stops
+			isClosed = true;
+		}
+		else if ((id == ID_INFO) || (id == ID_TRACKS))
+		{
+			if (headSize + dataSize > MAX_HEAD_ELEMENT_SIZE)
+			{
+				// error: too large
+				return false;
+			}
+
+			std::vector<unsigned char> element((size_t)(headSize + dataSize));
+			file.setFilePointer(position);
+			if (file.read(&element[0], element.size()) != element.size())
+			{
+				// error: cut short
+				return false;
+			}
+
+			const unsigned char *p    = &element[0] + headSize;
+			const unsigned char *pEnd = &element[0] + element.size();
+			while (p < pEnd)
+			{
+				uint32 childId;
+				uint64 childSize;
+				size_t childHeadSize;
+				if (!ParseElementHead(p, pEnd, childId, childSize, childHeadSize) || (childSize > (uint64)(pEnd - p - childHeadSize)))
+				{
+					// error: broken element
+					return false;
+				}
+
+				if ((childId == ID_TIMECODE_SCALE) && (id == ID_INFO))
+				{
+					source.timecodeScale = ReadUInteger(p + childHeadSize, (size_t)childSize);
+				}
+				else if ((childId == ID_WRITING_APP) && (id == ID_INFO))
+				{
+					// a string may be padded with zeros
+					std::string writingApp((const char *)p + childHeadSize, (size_t)childSize);
+					source.isThinned = strcmp(writingApp.c_str(), THINNED_WRITING_APP) == 0;
+				}
+				else if ((childId == ID_TRACK_ENTRY) && (id == ID_TRACKS))
+				{
+					uint64 trackNumber = 0ull, trackType = 0ull;
+					const unsigned char *q    = p + childHeadSize;
+					const unsigned char *qEnd = q + childSize;
+					while (q < qEnd)
+					{
+						uint32 entryId;
+						uint64 entrySize;
+						size_t entryHeadSize;
+						if (!ParseElementHead(q, qEnd, entryId, entrySize, entryHeadSize) || (entrySize > (uint64)(qEnd - q - entryHeadSize)))
+						{
+							// error: broken track
+							return false;
+						}
+
+						if (entryId == ID_TRACK_NUMBER)
+						{
+							trackNumber = ReadUInteger(q + entryHeadSize, (size_t)entrySize);
+						}
+						else if (entryId == ID_TRACK_TYPE)
+						{
+							trackType = ReadUInteger(q + entryHeadSize, (size_t)entrySize);
+						}
+						if (entryId != ID_TRACK_UID)
+						{
+							source.tracksSignature.append((const char *)q, (size_t)(entryHeadSize + entrySize));
+						}
+						q += entryHeadSize + entrySize;
+					}
+
+					if ((trackType == track_video) && (source.videoTrackNumber == 0ull))
+					{
+						source.videoTrackNumber = trackNumber;
+					}
+					else if (trackType == track_audio)
+					{
+						source.audioTrackNumbers.push_back(trackNumber);
+					}
+				}
+				p += childHeadSize + childSize;
+			}
+
+			if (id == ID_TRACKS)
+			{
+				source.tracks.swap(element);
+			}
+		}
+
+		position += headSize + dataSize;
+	}
+
+	if ((source.tracks.empty()) || (source.videoTrackNumber == 0ull) || (source.timecodeScale == 0ull))
+	{
+		// error: no video track
+		return false;
+	}
+
+	// the contents of a preallocated file go past its segment, those of a
+	// file never closed are walked up to the first cluster cut short
+	source.firstClusterPosition = position;
+	source.endPosition = isClosed ? segmentEnd : fileSize;
+	return true;
+}
+
+bool MkvExporter::ReadClusterHead(IOCallback &file, uint64 position, uint64 endPosition, ClusterHead &cluster)
+{
+	unsigned char head[MAX_CLUSTER_HEAD_SIZE];
+	uint32 id;
+	uint64 dataSize;
+	size_t headSize;
+
+	if (position + MAX_ELEMENT_HEAD_SIZE > endPosition)
+	{
+		return false;
+	}
+
+	file.setFilePointer(position);
+	size_t size = file.read(head, sizeof(head));
+	if (!ParseElementHead(head, head + size, id, dataSize, headSize) || (id != ID_CLUSTER)
+	    || (dataSize == ~0ull) || (position + headSize + dataSize > endPosition) || (headSize + dataSize > MAX_CLUSTER_SIZE))
+	{
+		// the end of the clip, or of what was written
+		return false;
+	}
+
+	cluster.position  = position;
+	cluster.size      = headSize + dataSize;
+	cluster.crcOffset = 0;
+
+	size_t offset = headSize;
+	if ((size >= offset + CRC32_ELEMENT_SIZE) && (head[offset] == ID_CRC32) && (head[offset + 1] == 0x84))
+	{
+		cluster.crcOffset = offset + 2;
+		offset += CRC32_ELEMENT_SIZE;
+	}
+
+	uint64 timecodeSize;
+	if (!ParseElementHead(head + offset, head + size, id, timecodeSize, headSize) || (id != ID_CLUSTER_TIMECODE)
+	    || (timecodeSize == 0ull) || (timecodeSize > 8) || (offset + headSize + timecodeSize > size))
+	{
+		// error: not a cluster of ours
+		return false;
+	}
+
+	cluster.timecodeOffset = offset + headSize;
+	cluster.timecodeSize   = (size_t)timecodeSize;
+	cluster.timecode       = ReadUInteger(head + cluster.timecodeOffset, cluster.timecodeSize);
+	cluster.dataOffset     = cluster.timecodeOffset + cluster.timecodeSize;
+	return true;
+}
+
+// into the cluster buffer, false if cut short or corrupted
+bool MkvExporter::ReadCluster(IOCallback &file, const ClusterHead &cluster)
+{
+	HOT_TRACE_SCOPE("export.read_cluster");
+
+	clusterBuffer.resize((size_t)cluster.size);
+	file.setFilePointer(cluster.position);
+	if (file.read(&clusterBuffer[0], clusterBuffer.size()) != clusterBuffer.size())
+	{
+		return false;
+	}
+
+	// the checksum covers everything following it up to the end of the cluster
+	if (cluster.crcOffset != 0)
+	{
+		const unsigned char *p = &clusterBuffer[cluster.crcOffset];
+		uint32 crc = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24);
+		size_t begin = cluster.crcOffset + 4;
+		if (!EbmlCrc32::CheckCRC(crc, &clusterBuffer[begin], (uint32)(clusterBuffer.size() - begin)))
+		{
+			statistics.corruptedClusterCount++;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Keep the blocks of the cluster buffer from the last video key frame up to
+// the start time, or from the first one if it is later, and those before the
+// end time. The cluster then starts at the key frame, the blocks are moved
+// by as much, and a block group across it, e.g. a subtitle, is shortened.
+// When thinning, the frames left out are dropped as well. The new cluster
+// goes to the trim buffer.
+MkvExporter::TrimResult MkvExporter::TrimCluster(const ClusterHead &cluster, const SourceFile &source, bool isThinning,
+                                                 ClusterHead &newCluster, uint64 &lastTimecode, bool &hasVideoKey)
+{
+	HOT_TRACE_SCOPE("export.trim_cluster");
+
+	std::vector<BlockInfo> blocks;
+	const unsigned char *pBegin = &clusterBuffer[0];
+	const unsigned char *pEnd   = pBegin + clusterBuffer.size();
+	const unsigned char *p      = pBegin + cluster.dataOffset;
+
+	while (p < pEnd)
+	{
+		uint32 id;
+		uint64 dataSize;
+		size_t headSize;
+		if (!ParseElementHead(p, pEnd, id, dataSize, headSize) || (dataSize > (uint64)(pEnd - p - headSize)))
+		{
+			// error: broken cluster, keep what is whole
+			break;
+		}
+
+		BlockInfo block;
+		block.offset         = p - pBegin;
+		block.size           = (size_t)(headSize + dataSize);
+		block.timecodeOffset = 0;
+		block.durationOffset = 0;
+		block.durationSize   = 0;
+		block.duration       = 0ull;
+		block.isVideoKey     = false;
+
+		const unsigned char *pBlock = NULL;
+		const unsigned char *pBlockEnd = NULL;
+		bool hasReference = false;
+		if (id == ID_SIMPLE_BLOCK)
+		{
+			pBlock    = p + headSize;
+			pBlockEnd = pBlock + dataSize;
+		}
+		else if (id == ID_BLOCK_GROUP)
+		{
+			// the block and its duration
+			const unsigned char *q    = p + headSize;
+			const unsigned char *qEnd = q + dataSize;
+			while (q < qEnd)
+			{
+				uint32 childId;
+				uint64 childSize;
+				size_t childHeadSize;
+				if (!ParseElementHead(q, qEnd, childId, childSize, childHeadSize) || (childSize > (uint64)(qEnd - q - childHeadSize)))
+				{
+					break;
+				}
+				if (childId == ID_BLOCK)
+				{
+					pBlock    = q + childHeadSize;
+					pBlockEnd = pBlock + childSize;
+				}
+				else if ((childId == ID_BLOCK_DURATION) && (childSize > 0) && (childSize <= 8))
+				{
+					block.durationOffset = q + childHeadSize - pBegin;
+					block.durationSize   = (size_t)childSize;
+					block.duration       = ReadUInteger(q + childHeadSize, block.durationSize);
+				}
+				else if (childId == ID_REFERENCE_BLOCK)
+				{
+					hasReference = true;
+				}
+				q += childHeadSize + childSize;
+			}
+		}
+
+		p += block.size;
+
+		size_t trackLength;
+		if ((pBlock == NULL) || ((trackLength = GetVintLength(pBlock[0])) == 0) || (pBlockEnd - pBlock < (int)trackLength + 3))
+		{
+			// not a block, e.g. a void element: left out
+			continue;
+		}
+
+		uint64 trackNumber = pBlock[0] & (0xFF >> trackLength);
+		for (size_t i = 1; i < trackLength; i++)
+		{
+			trackNumber = (trackNumber << 8) | pBlock[i];
+		}
+		const unsigned char *pTimecode = pBlock + trackLength;
+		int relativeTimecode = (short)((pTimecode[0] << 8) | pTimecode[1]);
+		if ((relativeTimecode < 0) && ((uint64)-relativeTimecode > cluster.timecode))
+		{
+			continue;
+		}
+
+		block.timecodeOffset = pTimecode - pBegin;
+		block.trackNumber    = trackNumber;
+		block.timecode       = cluster.timecode + relativeTimecode;
+		block.isVideoKey     = (trackNumber == source.videoTrackNumber)
+		                       && ((id == ID_BLOCK_GROUP) ? !hasReference : (pTimecode[2] & 0x80) != 0);
+		blocks.push_back(block);
+	}
+
+	// where the new cluster starts
+	uint64 startTimecode = cluster.timecode;
+	if (!isStartFound)
+	{
+		bool hasKey = false;
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			if (blocks[i].isVideoKey && (!hasKey || (blocks[i].timecode * source.timecodeScale <= startTime)))
+			{
+				startTimecode = blocks[i].timecode;
+				hasKey = true;
+			}
+		}
+		if (!hasKey)
+		{
+			// no frame to start from
+			return CLUSTER_DROPPED;
+		}
+	}
+
+	// the blocks to keep
+	std::vector<const BlockInfo *> keptBlocks;
+	bool isChanged = startTimecode != cluster.timecode;
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		const BlockInfo &block = blocks[i];
+		if ((block.timecode * source.timecodeScale >= endTime)
+		    || ((block.timecode < startTimecode) && (block.timecode + block.duration <= startTimecode)))
+		{
+			isChanged = true;
+			continue;
+		}
+		if (isThinning && !IsBlockKept(block, source))
+		{
+			statistics.droppedBlockCount++;
+			continue;
+		}
+		keptBlocks.push_back(&block);
+	}
+	isChanged = isChanged || (blocks.size() != keptBlocks.size());
+
+	if (keptBlocks.empty())
+	{
+		return CLUSTER_DROPPED;
+	}
+
+	lastTimecode = 0ull;
+	hasVideoKey = false;
+	for (size_t i = 0; i < keptBlocks.size(); i++)
+	{
+		lastTimecode = keptBlocks[i]->timecode > lastTimecode ? keptBlocks[i]->timecode : lastTimecode;
+		hasVideoKey = hasVideoKey || keptBlocks[i]->isVideoKey;
+	}
+
+	if (!isChanged)
+	{
+		return CLUSTER_KEPT;
+	}
+
+	// id, 8-byte size, CRC-32 as before and an 8-byte timecode
+	size_t size = 4 + 8 + (cluster.crcOffset != 0 ? CRC32_ELEMENT_SIZE : 0) + TIMECODE_ELEMENT_SIZE;
+	for (size_t i = 0; i < keptBlocks.size(); i++)
+	{
+		size += keptBlocks[i]->size;
+	}
+
+	trimBuffer.resize(size);
+	unsigned char *q = &trimBuffer[0];
+	WriteUInteger(q, 4, ID_CLUSTER);
+	WriteUInteger(q + 4, 8, size - 12);
+	q[4] = 0x01;
+	q += 12;
+
+	newCluster.position  = cluster.position;
+	newCluster.size      = size;
+	newCluster.timecode  = startTimecode;
+	newCluster.crcOffset = 0;
+	if (cluster.crcOffset != 0)
+	{
+		q[0] = ID_CRC32;
+		q[1] = 0x84;
+		newCluster.crcOffset = q + 2 - &trimBuffer[0];
+		q += CRC32_ELEMENT_SIZE;
+	}
+	q[0] = ID_CLUSTER_TIMECODE;
+	q[1] = 0x88;
+	newCluster.timecodeOffset = q + 2 - &trimBuffer[0];
+	newCluster.timecodeSize   = 8;
+	WriteUInteger(q + 2, 8, startTimecode);
+	q += TIMECODE_ELEMENT_SIZE;
+	newCluster.dataOffset = q - &trimBuffer[0];
+
+	for (size_t i = 0; i < keptBlocks.size(); i++)
+	{
+		const BlockInfo &block = *keptBlocks[i];
+		memcpy(q, &clusterBuffer[block.offset], block.size);
+
+		uint64 timecode = block.timecode;
+		if (timecode < startTimecode)
+		{
+			// across the start: cut the duration as well
+			WriteUInteger(q + block.durationOffset - block.offset, block.durationSize, block.duration - (startTimecode - timecode));
+			timecode = startTimecode;
+		}
+		WriteUInteger(q + block.timecodeOffset - block.offset, 2, timecode - startTimecode);
+		q += block.size;
+	}
+
+	return CLUSTER_CUT;
+}
+
+// the key frame of every nth GOP, none of the other video frames, and the
+// audio if wanted; the other tracks, e.g. subtitles, are kept
+bool MkvExporter::IsBlockKept(const BlockInfo &block, const SourceFile &source)
+{
+	if (block.trackNumber == source.videoTrackNumber)
+	{
+		return (config.keptGopInterval == 0)
+		       || (block.isVideoKey && (videoKeyCount++ % config.keptGopInterval == 0));
+	}
+
+	if (std::find(source.audioTrackNumbers.begin(), source.audioTrackNumbers.end(), block.trackNumber) != source.audioTrackNumbers.end())
+	{
+		return config.hasAudio;
+	}
+
+	return true;
+}
+
+// whether the first video frame of the cluster buffer is a key frame, which
+// the demuxer seeks to from the cue of the cluster
+bool MkvExporter::StartsWithVideoKey(const ClusterHead &cluster, const SourceFile &source)
+{
+	const unsigned char *pEnd = &clusterBuffer[0] + clusterBuffer.size();
+	const unsigned char *p    = &clusterBuffer[0] + cluster.dataOffset;
+
+	while (p < pEnd)
+	{
+		uint32 id;
+		uint64 dataSize;
+		size_t headSize;
+		if (!ParseElementHead(p, pEnd, id, dataSize, headSize) || (dataSize > (uint64)(pEnd - p - headSize)))
+		{
+			// error: broken cluster
+			return false;
+		}
+
+		const unsigned char *pBlock = NULL;
+		const unsigned char *pBlockEnd = NULL;
+		bool hasReference = false;
+		if (id == ID_SIMPLE_BLOCK)
+		{
+			pBlock    = p + headSize;
+			pBlockEnd = pBlock + dataSize;
+		}
+		else if (id == ID_BLOCK_GROUP)
+		{
+			const unsigned char *q    = p + headSize;
+			const unsigned char *qEnd = q + dataSize;
+			while (q < qEnd)
+			{
+				uint32 childId;
+				uint64 childSize;
+				size_t childHeadSize;
+				if (!ParseElementHead(q, qEnd, childId, childSize, childHeadSize) || (childSize > (uint64)(qEnd - q - childHeadSize)))
+				{
+					break;
+				}
+				if (childId == ID_BLOCK)
+				{
+					pBlock    = q + childHeadSize;
+					pBlockEnd = pBlock + childSize;
+				}
+				else if (childId == ID_REFERENCE_BLOCK)
+				{
+					hasReference = true;
+				}
+				q += childHeadSize + childSize;
+			}
+		}
+		p += headSize + dataSize;
+
+		size_t trackLength;
+		if ((pBlock == NULL) || ((trackLength = GetVintLength(pBlock[0])) == 0) || (pBlockEnd - pBlock < (int)trackLength + 3))
+		{
+			continue;
+		}
+
+		uint64 trackNumber = pBlock[0] & (0xFF >> trackLength);
+		for (size_t i = 1; i < trackLength; i++)
+		{
+			trackNumber = (trackNumber << 8) | pBlock[i];
+		}
+		if (trackNumber == source.videoTrackNumber)
+		{
+			return (id == ID_BLOCK_GROUP) ? !hasReference : (pBlock[trackLength + 2] & 0x80) != 0;
+		}
+	}
+
+	return false;
+}
+
+// the EBML head, the segment with a meta seek to fill at the end, the info
+// and the tracks of the first clip, and then room for the cues, which the
+// demuxer looks for before the clusters
+bool MkvExporter::WriteHead(const SourceFile &source)
+{
+	pHead = new EbmlHead();
+	*static_cast<EbmlString *>(&GetChild<EDocType>(*pHead)) = "matroska";
+	*static_cast<EbmlUInteger *>(&GetChild<EDocTypeVersion>(*pHead)) = MATROSKA_VERSION;
+	*static_cast<EbmlUInteger *>(&GetChild<EDocTypeReadVersion>(*pHead)) = MATROSKA_VERSION;
+	pHead->Render(*pFile, true);
+
+	// the size is fixed at the end, 5 octets are wide enough for almost any file
+	pSegment = new KaxSegment();
+	pSegment->WriteHead(*pFile, 5, false);
+
+	pMetaSeek = new KaxSeekHead();
+	pMetaSeekDummy = new EbmlVoid();
+	pMetaSeekDummy->SetSize(META_SEEK_SIZE);
+	pMetaSeekDummy->Render(*pFile, false);
+
+	KaxInfo &segmentInfo = GetChild<KaxInfo>(*pSegment);
+	*static_cast<EbmlUInteger *>(&GetChild<KaxTimecodeScale>(segmentInfo)) = source.timecodeScale;
+	*static_cast<EbmlFloat *>(&GetChild<KaxDuration>(segmentInfo)) = 0.0;  // fix it at StopExporting()
+
+	std::string muxingAppString = "libebml v";
+	muxingAppString += EbmlCodeVersion.c_str();
+	muxingAppString += " + libmatroska v";
+	muxingAppString += KaxCodeVersion.c_str();
+	UTFstring muxingAppUTFstring;
+	muxingAppUTFstring.SetUTF8(muxingAppString);
+	*(EbmlUnicodeString *)&GetChild<KaxMuxingApp>(segmentInfo)  = muxingAppUTFstring;
+	UTFstring writingAppUTFstring;
+	writingAppUTFstring.SetUTF8(config.keptGopInterval > 0 ? THINNED_WRITING_APP : "exporter");
+	*(EbmlUnicodeString *)&GetChild<KaxWritingApp>(segmentInfo) = writingAppUTFstring;
+	GetChild<KaxDateUTC>(segmentInfo).SetEpochDate((int32)(statistics.startTime / 1000000000ull));
+
+	segmentInfo.Render(*pFile, true);
+	pMetaSeek->IndexThis(segmentInfo, *pSegment);
+
+	// the tracks are copied, uids and all
+	tracksPosition = pFile->getFilePointer();
+	pFile->writeFully(&source.tracks[0], source.tracks.size());
+
+	uint64 cuesSize = (endTime - statistics.startTime) / 1000000000ull * CUE_POINT_SIZE + 200;
+	pAllCuesDummy = new EbmlVoid();
+	pAllCuesDummy->SetSize(cuesSize < (uint64)MAX_CUES_SIZE ? cuesSize : (uint64)MAX_CUES_SIZE);
+	pAllCuesDummy->Render(*pFile, false);
+
+	firstFile     = source;
+	isHeadWritten = true;
+	return true;
+}
+
+// with its timecode replaced, in the same bytes, and its checksum computed
+// again; a cluster without a video key frame gets no cue
+void MkvExporter::WriteCluster(std::vector<unsigned char> &buffer, const ClusterHead &cluster, uint64 timecode, bool isCued)
+{
+	HOT_TRACE_SCOPE("export.write_cluster");
+
+	WriteUInteger(&buffer[cluster.timecodeOffset], cluster.timecodeSize, timecode);
+	if (cluster.crcOffset != 0)
+	{
+		EbmlCrc32 checksum;
+		size_t begin = cluster.crcOffset + 4;
+		checksum.FillCRC32(&buffer[begin], (uint32)(cluster.size - begin));
+		uint32 crc = checksum.GetCrc32();
+		buffer[cluster.crcOffset]     = (unsigned char)crc;
+		buffer[cluster.crcOffset + 1] = (unsigned char)(crc >> 8);
+		buffer[cluster.crcOffset + 2] = (unsigned char)(crc >> 16);
+		buffer[cluster.crcOffset + 3] = (unsigned char)(crc >> 24);
+	}
+
+	if (isCued)
+	{
+		cuePoints.push_back(std::make_pair(timecode, pSegment->GetRelativePosition(pFile->getFilePointer())));
+	}
+	pFile->writeFully(&buffer[0], (size_t)cluster.size);
+
+	statistics.clusterCount++;
+	statistics.byteCount += cluster.size;
+}
+
+bool MkvExporter::AppendFile(const char *pFileName)
+{
+	HOT_TRACE_SCOPE("export.append_file");
+
+	if (state != STARTED)
+	{
+		// error: not started
+		return false;
+	}
+
+	if (pFileName == NULL)
+	{
+		// error: invalid parameter
+		return false;
+	}
+
+	// a container isn't reused while its clip is copied
+	int readLock;
+	if (!DemuxerUtilities::LockForReading(pFileName, readLock))
+	{
+		// error: the clip is being overwritten with another one
+		statistics.skippedFileCount++;
+		return false;
+	}
+
+	IOCallback *pSourceFile;
+	try
+	{
+		pSourceFile = new StdIOCallback(pFileName, MODE_READ);
+	}
+	catch (CRTError &)
+	{
+		// error: the clip is gone, e.g. recycled
+		DemuxerUtilities::Unlock(readLock);
+		statistics.skippedFileCount++;
+		return false;
+	}
+
+	SourceFile source;
+	if (!ReadSourceFile(*pSourceFile, source)
+	    || (isHeadWritten && ((source.timecodeScale != firstFile.timecodeScale) || (source.tracksSignature != firstFile.tracksSignature))))
+	{
+		// error: not a clip, or not the same streams as those written
+		delete pSourceFile;
+		DemuxerUtilities::Unlock(readLock);
+		statistics.skippedFileCount++;
+		return false;
+	}
+
+	uint64 scale = source.timecodeScale;
+	uint64 clusterCount = statistics.clusterCount;
+	bool   isFailed = false;
+
+	// a clip thinned before is copied as it is
+	bool isThinning = !source.isThinned && ((config.keptGopInterval > 0) || !config.hasAudio);
+
+	try
+	{
+		ClusterHead current, next;
+		bool hasCurrent = ReadClusterHead(*pSourceFile, source.firstClusterPosition, source.endPosition, current);
+		uint64 firstTimecode = current.timecode;
+
+		while (hasCurrent && (current.timecode * scale < endTime))
+		{
+			// the old contents of a preallocated file end the clip as well
+			bool hasNext = ReadClusterHead(*pSourceFile, current.position + current.size, source.endPosition, next)
+			               && (next.timecode >= current.timecode)
+			               && ((next.timecode - firstTimecode) * scale <= 24 * 60 * 60 * 1000000000ull);
+
+			if ((!isStartFound && hasNext && (next.timecode * scale <= startTime))
+			    || (isStartFound && (current.timecode * scale <= lastFrameTime)))
+			{
+				// before the range, or already written from the previous clip
+			}
+			else if (ReadCluster(*pSourceFile, current))
+			{
+				// the first cluster and the last one of the clip are cut, and every one when thinning
+				ClusterHead trimmedCluster;
+				uint64 lastTimecode = current.timecode;
+				bool hasVideoKey;
+				TrimResult result = CLUSTER_KEPT;
+				if (!isStartFound || isThinning || !hasNext || (next.timecode * scale > endTime))
+				{
+					result = TrimCluster(current, source, isThinning, trimmedCluster, lastTimecode, hasVideoKey);
+				}
+				else
+				{
+					// a cluster copied as it is gets a cue only if it starts with a key frame
+					hasVideoKey = StartsWithVideoKey(current, source);
+				}
+
+				if (result != CLUSTER_DROPPED)
+				{
+					const ClusterHead &cluster = (result == CLUSTER_CUT) ? trimmedCluster : current;
+					if (!isStartFound)
+					{
+						// the key frame to start from is at 0, unless the time is kept
+						baseTimecode = config.isTimeKept ? 0ull : cluster.timecode;
+						statistics.startTime = cluster.timecode * scale;
+						isStartFound = true;
+					}
+					if (!isHeadWritten)
+					{
+						WriteHead(source);
+					}
+
+					WriteCluster((result == CLUSTER_CUT) ? trimBuffer : clusterBuffer, cluster, cluster.timecode - baseTimecode, hasVideoKey);
+					if (result == CLUSTER_CUT)
+					{
+						statistics.trimmedClusterCount++;
+					}
+					lastFrameTime = lastTimecode * scale;
+				}
+			}
+
+			current = next;
+			hasCurrent = hasNext;
+		}
+	}
+	catch (std::runtime_error &)
+	{
+		// error: fail to read or write, e.g. the disk is full
+		isFailed = true;
+	}
+
+	delete pSourceFile;
+	DemuxerUtilities::Unlock(readLock);
+
+	if (isFailed || (statistics.clusterCount == clusterCount))
+	{
+		statistics.skippedFileCount++;
+		return false;
+	}
+
+	statistics.fileCount++;
+	statistics.endTime = lastFrameTime;
+	return true;
+}
+
+bool MkvExporter::StopExporting()
+{
+	if (state == STOPPED)
+	{
+		// warning: already stopped
+		return false;
+	}
+	state = STOPPED;
+
+	bool result = isHeadWritten;
+	try
+	{
+		if (isHeadWritten)
+		{
+			// the duration from the first frame to the last one
+			KaxDuration &segDuration = GetChild<KaxDuration>(GetChild<KaxInfo>(*pSegment));
+			*static_cast<EbmlFloat *>(&segDuration) = (double)(lastFrameTime - statistics.startTime) / firstFile.timecodeScale;
+			uint64 currentPosition = pFile->getFilePointer();
+			pFile->setFilePointer(segDuration.GetElementPosition());
+			segDuration.Render(*pFile, false, true, true);
+			pFile->setFilePointer(currentPosition);
+
+			// a cue for every cluster
+			KaxCues allCues;
+			allCues.SetGlobalTimecodeScale(firstFile.timecodeScale);
+			for (size_t i = 0; i < cuePoints.size(); i++)
+			{
+				KaxCuePoint &cuePoint = AddNewChild<KaxCuePoint>(allCues);
+				*static_cast<EbmlUInteger *>(&GetChild<KaxCueTime>(cuePoint)) = cuePoints[i].first;
+				KaxCueTrackPositions &positions = GetChild<KaxCueTrackPositions>(cuePoint);
+				*static_cast<EbmlUInteger *>(&GetChild<KaxCueTrack>(positions)) = firstFile.videoTrackNumber;
+				*static_cast<EbmlUInteger *>(&GetChild<KaxCueClusterPosition>(positions)) = cuePoints[i].second;
+			}
+			if (pAllCuesDummy->ReplaceWith(allCues, *pFile, true, false) == INVALID_FILEPOS_T)
+			{
+				// warning: more clusters than expected, the cues follow them
+				pFile->setFilePointer(0, seek_end);
+				allCues.Render(*pFile, false);
+			}
+
+			// the meta seek tells a finished file, the tracks are indexed by hand as they were copied
+			KaxSeek &tracksSeek = AddNewChild<KaxSeek>(*pMetaSeek);
+			*static_cast<EbmlUInteger *>(&GetChild<KaxSeekPosition>(tracksSeek)) = pSegment->GetRelativePosition(tracksPosition);
+			binary tracksId[4];
+			WriteUInteger(tracksId, 4, ID_TRACKS);
+			GetChild<KaxSeekID>(tracksSeek).CopyBuffer(tracksId, 4);
+			pMetaSeek->IndexThis(allCues, *pSegment);
+			pMetaSeekDummy->ReplaceWith(*pMetaSeek, *pFile, true);
+
+			pFile->setFilePointer(0, seek_end);
+			pSegment->SetSizeInfinite(true);
+			if (pSegment->ForceSize(pFile->getFilePointer() - pSegment->GetElementPosition() - pSegment->HeadSize()))
+			{
+				pSegment->OverwriteHead(*pFile);
+			}
+		}
+		pFile->close();
+	}
+	catch (std::runtime_error &)
+	{
+		// error: fail to write
+		result = false;
+	}
+
+	delete pFile;
+	pFile = NULL;
+	if (!result)
+	{
+		boost::filesystem::remove(fileName);
+	}
+
+	delete pHead;
+	delete pSegment;
+	delete pMetaSeek;
+	delete pMetaSeekDummy;
+	delete pAllCuesDummy;
+	pHead          = NULL;
+	pSegment       = NULL;
+	pMetaSeek      = NULL;
+	pMetaSeekDummy = NULL;
+	pAllCuesDummy  = NULL;
+	return result;
+}
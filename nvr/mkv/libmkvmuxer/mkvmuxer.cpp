@@ -330,6 +330,57 @@ MkvMuxer::~MkvMuxer()
 	}
 }
 
+filepos_t MkvMuxer::RenderCluster()
+{
+	// render the cluster into memory at its final file position,
+	// then write it out with a few large sequential writes
+	HOT_TRACE_SCOPE("mkv.render_cluster");
+	clusterBuffer.Reset(pMKVFile->getFilePointer());
+	filepos_t clusterSize = pCluster->Render(clusterBuffer, *pAllCues, bWriteDefaultValues);
+	HOT_TRACE_ARG(clusterSize);
+	fileClusterCount++;
+
+	// the chunks stay in clusterBuffer for the next cluster
+	clusterBuffer.WriteTo(*pMKVFile);
+
+	return clusterSize;
+}
+
+bool MkvMuxer::Checkpoint()
+{
+	// keep the clusters written so far playable if the file is never stopped:
+	// the duration, the cues and then the size of the segment up to the last
+	// cluster are updated in place, while the meta seek stays void until
+	// StopMuxing() to tell an unfinished file
+	KaxDuration &segDuration = GetChild<KaxDuration>(GetChild<KaxInfo>(*pSegment));
+	*static_cast<EbmlFloat *>(&segDuration) = (lastFrameTimecode - firstFrameTimecode) / fileConfig.timecodeScale;
+
+	uint64 currentPosition = pMKVFile->getFilePointer();
+	pMKVFile->setFilePointer(segDuration.GetElementPosition());
+	segDuration.Render(*pMKVFile, false, true, true);
+	pMKVFile->setFilePointer(currentPosition);
+
+	bool result = true;
+	if (pAllCuesDummy->ReplaceWith(*pAllCues, *pMKVFile, true, bWriteDefaultValues) == INVALID_FILEPOS_T)
+	{
+		// warning: no room for the cues, the reader walks the clusters instead
+		result = false;
+	}
+
+	pSegment->SetSizeInfinite(true);
+	if (pSegment->ForceSize(segmentSize - pSegment->HeadSize()))
+	{
+		pSegment->OverwriteHead(*pMKVFile, true);
+	}
+	else
+	{
+		result = false;
+	}
+
+	lastCheckpointTimecode = lastFrameTimecode;
+	return result;
+}
+
 bool MkvMuxer::SetFileConfig(const FileConfig &config)
 {
 	if (state != STOPPED)
@@ -397,7 +448,9 @@ bool MkvMuxer::StartMuxing(const Streams &streams, const Frame &myFrame, const c
 			pMKVFile = NULL;
 		}
 
-		pMKVFile = new StdIOCallback(pOutFileName, MODE_CREATE);
+		// a preallocated file is not truncated, the segment size ends the new contents
+		bool isPreallocated = fileConfig.isPreallocated && boost::filesystem::exists(pOutFileName);
+		pMKVFile = new StdIOCallback(pOutFileName, isPreallocated ? MODE_SAFE : MODE_CREATE);
 		//pMKVFile = new MemIOCallback(1024*1024);
 	}
 
@@ -596,6 +649,9 @@ bool MkvMuxer::StartMuxing(const Streams &streams, const Frame &myFrame, const c
 		clusterMinTimecode = 0ull;
 		firstFrameTimecode = 0ull;
 		lastFrameTimecode = 0ull;
+		lastCheckpointTimecode = 0ull;
+		fileFrameCount = 0ull;
+		fileClusterCount = 0ull;
 		pLastSubtitleBlockGroup = NULL;
 		lastSubtitlePosition = 0ull;
 		pSubtitleData = NULL;
@@ -626,7 +682,7 @@ bool MkvMuxer::StopMuxing()
 		}
 
 		// release the last cluster
-		segmentSize += pCluster->Render(*pMKVFile, *pAllCues, bWriteDefaultValues);
+		segmentSize += RenderCluster();
 		pCluster->ReleaseFrames();
 		if (pListener != NULL)
 		{
@@ -665,6 +721,7 @@ bool MkvMuxer::StopMuxing()
 
 		// let's assume we know the size of the Segment element
 		// the size of the pSegment is also computed because mandatory elements we don't write ourself exist
+		pSegment->SetSizeInfinite(true);  // a checkpoint may have set it already
 		if (pSegment->ForceSize(segmentSize - pSegment->HeadSize()))
 		{
 			pSegment->OverwriteHead(*pMKVFile);
@@ -676,7 +733,10 @@ bool MkvMuxer::StopMuxing()
 	{
 		// error: empty file
 		pMKVFile->close();
-		boost::filesystem::remove(pOutFileName);
+		if (!fileConfig.isPreallocated)
+		{
+			boost::filesystem::remove(pOutFileName);
+		}
 		pOutFileName = NULL;
 	}
 
@@ -719,6 +779,9 @@ static bool MyFreeBuffer(const DataBuffer &aBuffer)
 
 bool MkvMuxer::AppendFrame(const Frame &myFrame)
 {
+	HOT_TRACE_SCOPE("mkv.append_frame");
+	HOT_TRACE_ARG(myFrame.size);
+
 	if (state < STARTED)
 	{
 		// error: not ready to append frames
@@ -734,6 +797,7 @@ bool MkvMuxer::AppendFrame(const Frame &myFrame)
 	if (firstFrameTimecode == 0ull)
 	{
 		firstFrameTimecode = myFrame.timecode;
+		lastCheckpointTimecode = myFrame.timecode;
 	}
 
 	if (myFrame.timecode - firstFrameTimecode >= fileConfig.pImpl->GetMaxSegmentDuration())
@@ -767,7 +831,7 @@ bool MkvMuxer::AppendFrame(const Frame &myFrame)
 				pLastSubtitleBlockGroup = NULL;
 			}
 
-			segmentSize += pCluster->Render(*pMKVFile, *pAllCues, bWriteDefaultValues);
+			segmentSize += RenderCluster();
 
 			if (!isOneSubtitleForEachCluster && (pLastSubtitleBlockGroup != NULL))
 			{
@@ -782,6 +846,22 @@ bool MkvMuxer::AppendFrame(const Frame &myFrame)
 				pMetaSeek->IndexThis(*pCluster, *pSegment);
 			}
 
+			if ((fileConfig.pImpl->GetCheckpointPeriod() > 0ull)
+			    && (lastFrameTimecode - lastCheckpointTimecode >= fileConfig.pImpl->GetCheckpointPeriod()))
+			{
+				Checkpoint();
+			}
+
+			if (pListener != NULL)
+			{
+				// seeking flushes the cluster out of the stdio buffer for the live readers
+				uint64 endPosition = pMKVFile->getFilePointer();
+				pMKVFile->setFilePointer(endPosition);
+				ClusterWrittenEvent event(pOutFileName, firstFrameTimecode, lastFrameTimecode, endPosition,
+				                          pCluster->GetElementPosition(), clusterMinTimecode);
+				pListener->ClusterWritten(event);
+			}
+
 			pCluster->ReleaseFrames();
 			if (pListener != NULL)
 			{
@@ -798,7 +878,7 @@ bool MkvMuxer::AppendFrame(const Frame &myFrame)
 		}
 		pCluster->SetParent(*pSegment); // mandatory to store references in this Cluster
 		pCluster->InitTimecode(myFrame.timecode / fileConfig.timecodeScale, fileConfig.timecodeScale);
-		//pCluster->EnableChecksum();
+		pCluster->EnableChecksum(fileConfig.isChecksumEnabled);
 
 		pLastVideoBlockBlob = NULL;
 		clusterMinTimecode = myFrame.timecode;
@@ -890,7 +970,23 @@ bool MkvMuxer::AppendFrame(const Frame &myFrame)
 	}
 
 	lastFrameTimecode = myFrame.timecode;
+	fileFrameCount++;
+
+	return true;
+}
+
+bool MkvMuxer::GetFileStats(FileStats &stats) const
+{
+	if ((state < STARTED) || (pMKVFile == NULL))
+	{
+		// no file is being written
+		return false;
+	}
 
+	stats.fileSize = pMKVFile->getFilePointer();
+	stats.duration = lastFrameTimecode - firstFrameTimecode;
+	stats.frameCount = fileFrameCount;
+	stats.clusterCount = fileClusterCount;
 	return true;
 }
 
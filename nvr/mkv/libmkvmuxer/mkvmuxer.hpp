@@ -5,6 +5,8 @@
 #include <iostream>
 
 #include "ebml/StdIOCallback.h"
+#include "ebml/ChunkedMemIOCallback.h"
+#include "ebml/HotTrace.h"
 
 #include "ebml/EbmlHead.h"
 #include "ebml/EbmlSubHead.h"
@@ -48,6 +50,7 @@ public:
 	virtual bool StartMuxing(const Streams &, const Frame &, const char * = NULL);
 	virtual bool StopMuxing();
 	virtual bool AppendFrame(const Frame &);
+	virtual bool GetFileStats(FileStats &) const;
 
 public:
 	// other public inner classes
@@ -127,6 +130,10 @@ protected:
 		SUGGEST_SPLITTING
 	};
 
+	// protected methods
+	filepos_t RenderCluster();
+	bool      Checkpoint();
+
 	// protected members
 	State                state;
 	const char          *pOutFileName;
@@ -153,11 +160,15 @@ protected:
 	bool           isSuggest;
 	bool           isFirstCluster;
 	KaxCluster    *pCluster;
+	ChunkedMemIOCallback clusterBuffer;
 	KaxBlockBlob  *pBlockBlob;
 	KaxBlockBlob  *pLastVideoBlockBlob;
 	uint64         clusterMinTimecode;
 	uint64         firstFrameTimecode;
 	uint64         lastFrameTimecode;
+	uint64         lastCheckpointTimecode;
+	uint64         fileFrameCount;
+	uint64         fileClusterCount;
 
 	KaxBlockGroup *pLastSubtitleBlockGroup;
 	uint64         lastSubtitleTimecode;
@@ -39,12 +39,17 @@ public:
 	{
 	public:
 		FileConfig();
+		FileConfig(const FileConfig &);
 		virtual ~FileConfig();
+		FileConfig & operator=(const FileConfig &);
 
 		double         videoCueThreshold;  // sec
 		double         maxDuration;  // sec
 		uint64_t       timecodeScale;  // nanosec
 		const wchar_t *applicationName;
+		bool           isChecksumEnabled;  // add a CRC-32 to every cluster
+		bool           isPreallocated;  // write an existing file in place, keeping its blocks
+		double         checkpointPeriod;  // sec of media between checkpoints of an unfinished file, 0 for none
 
 		MuxerImpl::FileConfig *pImpl;
 
@@ -52,7 +57,8 @@ public:
 		enum
 		{
 			DEFAULT_VIDEO_CUE_THRESHOLD = 5,
-			DEFAULT_MAX_DURATION = 600
+			DEFAULT_MAX_DURATION = 600,
+			DEFAULT_CHECKPOINT_PERIOD = 10
 		};
 	};
 
@@ -74,10 +80,26 @@ public:
 		time_t      endTime;
 	};
 
+	struct ClusterWrittenEvent
+	{
+		ClusterWrittenEvent(const char *_fileName, uint64_t _startTimecode, uint64_t _endTimecode, uint64_t _endPosition,
+		                    uint64_t _clusterPosition, uint64_t _clusterTimecode)
+			: fileName(_fileName), startTimecode(_startTimecode), endTimecode(_endTimecode), endPosition(_endPosition),
+			  clusterPosition(_clusterPosition), clusterTimecode(_clusterTimecode)
+		{}
+		const char *fileName;
+		uint64_t    startTimecode;    // nanosec, the first frame of the file
+		uint64_t    endTimecode;      // nanosec, the last frame of the cluster
+		uint64_t    endPosition;      // bytes of the file readable up to the cluster
+		uint64_t    clusterPosition;  // bytes, where the cluster starts
+		uint64_t    clusterTimecode;  // nanosec, of the cluster
+	};
+
 	class EventListener
 	{
 	public:
 		virtual void FileClosed(const FileClosedEvent &) const {}
+		virtual void ClusterWritten(const ClusterWrittenEvent &) const {}  // for the live readers of an unfinished file
 		virtual void SuggestSplitting() const {}
 		virtual void SuggestFreeBuffers() const {}
 	};
@@ -134,6 +156,20 @@ public:
 	virtual bool StopMuxing() = 0;
 	virtual bool AppendFrame(const Frame &) = 0;
 
+	// the file being written, for the thread appending the frames
+	struct FileStats
+	{
+		FileStats()
+			: fileSize(0ull), duration(0ull), frameCount(0ull), clusterCount(0ull)
+		{}
+		uint64_t fileSize;  // bytes written so far
+		uint64_t duration;  // nanosec from the first frame to the last one
+		uint64_t frameCount;
+		uint64_t clusterCount;  // clusters written so far
+	};
+
+	virtual bool GetFileStats(FileStats &) const = 0;  // false if no file is open
+
 public:
 	// other public inner classes
 	class Stream
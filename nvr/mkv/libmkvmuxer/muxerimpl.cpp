@@ -34,11 +34,18 @@ Muxer * Muxer::GetInstance(Muxer::ContainerFormat key)
 
 Muxer::FileConfig::FileConfig()
 	: videoCueThreshold(DEFAULT_VIDEO_CUE_THRESHOLD), maxDuration(DEFAULT_MAX_DURATION),
-	  timecodeScale(1000000ull), applicationName(L"muxer")
+	  timecodeScale(1000000ull), applicationName(L"muxer"), isChecksumEnabled(false),
+	  isPreallocated(false), checkpointPeriod(DEFAULT_CHECKPOINT_PERIOD)
 {
 	pImpl = new MuxerImpl::FileConfig(this);
 }
 
+Muxer::FileConfig::FileConfig(const FileConfig &config)
+{
+	pImpl = new MuxerImpl::FileConfig(this);
+	*this = config;
+}
+
 Muxer::FileConfig::~FileConfig()
 {
 	if (pImpl != NULL)
@@ -47,6 +54,19 @@ Muxer::FileConfig::~FileConfig()
 	}
 }
 
+Muxer::FileConfig & Muxer::FileConfig::operator=(const FileConfig &config)
+{
+	// copy the settings only, pImpl always refers to its own owner
+	videoCueThreshold = config.videoCueThreshold;
+	maxDuration       = config.maxDuration;
+	timecodeScale     = config.timecodeScale;
+	applicationName   = config.applicationName;
+	isChecksumEnabled = config.isChecksumEnabled;
+	isPreallocated    = config.isPreallocated;
+	checkpointPeriod  = config.checkpointPeriod;
+	return *this;
+}
+
 void Muxer::Streams::ClearAllStreams()
 {
 	// reset all streams
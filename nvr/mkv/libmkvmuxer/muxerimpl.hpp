@@ -27,6 +27,7 @@ public:
 	int      GetCueingDataElementSize() const { return ((int)(GetMaxSegmentDuration() / GetVideoCueTimecodeThreshold()) + 1) * 20 + 200; }
 	uint64_t GetMaxSegmentDuration() const { return (uint64_t)(pPublic->maxDuration * 1000000000.0); }
 	uint64_t GetMaxClusterDuration() const { return 0x7FFF * pPublic->timecodeScale; }
+	uint64_t GetCheckpointPeriod() const { return (uint64_t)(pPublic->checkpointPeriod * 1000000000.0); }
 
 	Muxer::FileConfig *pPublic;
 };
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/filesystem.hpp>
+#include <ebml/HotTrace.h>
+#include "streaming_media_recorder.hpp"
+#include "bench_frames.hpp"
+
+// Drives the recorder, the muxer and the index together with synthetic channels,
+// as fast as they go or paced at the frame rate with -realtime. POSIX only.
+// -trace writes the hot path events of the run as Chrome trace JSON, -stats prints
+// the channel statistics of the recorder every second.
+//
+// usage: bench_ingest [-dir path] [-channels n] [-duration sec] [-fps n] [-gop n]
+//                     [-kbps n] [-audio 0|1] [-osd 0|1] [-realtime] [-stats] [-trace file]
+
+class BenchConfig
+{
+public:
+	BenchConfig()
+		: dir("."), channelCount(4), duration(600), fps(30), gop(30), kbps(2048),
+		  hasAudio(true), hasOsd(true), isRealtime(false), isStatsShown(false), tracePath(NULL)
+	{}
+
+	const char *dir;
+	int         channelCount;
+	int         duration;  // sec of media per channel
+	int         fps;
+	int         gop;  // frames from a key frame to the next
+	int         kbps;  // video only
+	bool        hasAudio;  // G.711 at 8 kHz in 20 ms frames
+	bool        hasOsd;  // a short text every sec
+	bool        isRealtime;
+	bool        isStatsShown;
+	const char *tracePath;
+};
+
+class ChannelResult
+{
+public:
+	ChannelResult()
+		: frameCount(0ull), failedCount(0ull), payloadBytes(0ull), cpuTime(.0)
+	{}
+
+	std::vector<unsigned int> latencies;  // nanosec of every AppendFrame()
+	uint64_t frameCount;
+	uint64_t failedCount;
+	uint64_t payloadBytes;
+	double   cpuTime;  // sec spent by the feeding thread, the recorder included
+};
+
+static const uint64_t NANOSEC = 1000000000ull;
+static const size_t   AUDIO_FRAME_SIZE = 160;
+static const uint64_t AUDIO_FRAME_DURATION = NANOSEC / 50;
+static const int      MAX_CHANNEL_COUNT = 8;  // as many as the recorder has
+
+static BenchConfig config;
+static uint64_t    startTimecode;
+
+static double GetClock(clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint64_t GetMonotonicTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NANOSEC + (uint64_t)ts.tv_nsec;
+}
+
+static bool AppendFrame(StreamingMediaRecorder &recorder, int chId, StreamingMediaRecorder::Frame &frame, ChannelResult &result)
+{
+	frame.pFreeBuffer = BenchFreeBuffer;
+	size_t size = frame.size;
+
+	uint64_t begin = GetMonotonicTime();
+	bool isDone = recorder.AppendFrame(chId, frame);
+	uint64_t elapsed = GetMonotonicTime() - begin;
+
+	result.latencies.push_back(elapsed > 0xffffffffull ? 0xffffffffu : (unsigned int)elapsed);
+	result.frameCount++;
+	result.payloadBytes += size;
+	if (!isDone)
+	{
+		result.failedCount++;
+	}
+	return isDone;
+}
+
+static void FeedChannel(StreamingMediaRecorder *pRecorder, int chId, boost::barrier *pBarrier, ChannelResult *pResult)
+{
+	StreamingMediaRecorder &recorder = *pRecorder;
+	ChannelResult &result = *pResult;
+	unsigned int seed = (unsigned int)chId;
+
+	char threadName[16];
+	snprintf(threadName, sizeof(threadName), "ch%02d", chId);
+	libebml::HotTrace::SetThreadName(threadName);
+
+	// a key frame is about 8 times as big as the others
+	const uint64_t frameDuration = NANOSEC / config.fps;
+	const uint64_t frameCount = (uint64_t)config.duration * config.fps;
+	const size_t gopBytes = (size_t)((uint64_t)config.kbps * 1000 / 8 * config.gop / config.fps);
+	const size_t frameSize = std::max<size_t>(gopBytes / (config.gop - 1 + 8), 64);
+
+	result.latencies.reserve(frameCount + (config.hasAudio ? config.duration * 50 : 0) + config.duration + 16);
+
+	pBarrier->wait();
+	double cpuStart = GetClock(CLOCK_THREAD_CPUTIME_ID);
+	uint64_t wallStart = GetMonotonicTime();
+	uint64_t audioTimecode = 0ull;
+	uint64_t osdTimecode = 0ull;
+
+	for (uint64_t i = 0; i < frameCount; i++)
+	{
+		uint64_t timecode = i * frameDuration;
+
+		if (config.isRealtime)
+		{
+			uint64_t now = GetMonotonicTime() - wallStart;
+			if (now < timecode)
+			{
+				usleep((useconds_t)((timecode - now) / 1000));
+			}
+		}
+
+		// +/- 1/8 around the average size
+		bool isKey = (i % config.gop) == 0;
+		seed = seed * 1103515245u + 12345u;
+		size_t size = (isKey ? frameSize * 8 : frameSize) * (28 + ((seed >> 16) % 9)) / 32;
+
+		StreamingMediaRecorder::Frame video(StreamingMediaRecorder::FRAME_TYPE_VIDEO, startTimecode + timecode, size, MakeVideoFrame(size, isKey, seed));
+		video.isKey = isKey;
+		AppendFrame(recorder, chId, video, result);
+
+		// then the audio and the osd up to the next video frame
+		if (config.hasOsd && (osdTimecode < timecode + frameDuration))
+		{
+			char text[64];
+			int length = sprintf(text, "CH%02d %llu", chId, (unsigned long long)(osdTimecode / NANOSEC));
+			unsigned char *pBuffer = new unsigned char[length];
+			memcpy(pBuffer, text, length);
+
+			StreamingMediaRecorder::Frame osd(StreamingMediaRecorder::FRAME_TYPE_OSD, startTimecode + osdTimecode, length, pBuffer);
+			AppendFrame(recorder, chId, osd, result);
+			osdTimecode += NANOSEC;
+		}
+
+		for (; config.hasAudio && (audioTimecode < timecode + frameDuration); audioTimecode += AUDIO_FRAME_DURATION)
+		{
+			unsigned char *pBuffer = new unsigned char[AUDIO_FRAME_SIZE];
+			memset(pBuffer, 0xff, AUDIO_FRAME_SIZE);
+
+			StreamingMediaRecorder::Frame audio(StreamingMediaRecorder::FRAME_TYPE_AUDIO, startTimecode + audioTimecode, AUDIO_FRAME_SIZE, pBuffer);
+			AppendFrame(recorder, chId, audio, result);
+		}
+	}
+
+	recorder.StopRecording(chId);
+	result.cpuTime = GetClock(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+}
+
+static unsigned int GetPercentile(const std::vector<unsigned int> &sorted, double percentile)
+{
+	if (sorted.empty())
+	{
+		return 0;
+	}
+	size_t index = (size_t)(percentile / 100.0 * (double)(sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// reads the statistics while the channels are fed, it must never hold them up
+static void ShowStats(StreamingMediaRecorder *pRecorder, volatile bool *pIsDone)
+{
+	std::vector<StreamingMediaRecorder::ChannelStats> allStats;
+	while (!*pIsDone)
+	{
+		boost::this_thread::sleep(boost::posix_time::seconds(1));
+
+		uint64_t begin = GetMonotonicTime();
+		pRecorder->GetAllStats(allStats);
+		uint64_t elapsed = GetMonotonicTime() - begin;
+
+		for (size_t i = 0; i < allStats.size(); i++)
+		{
+			const StreamingMediaRecorder::ChannelStats &stats = allStats[i];
+			if (!stats.isRecording)
+			{
+				continue;
+			}
+			printf("stats ch%02d: %.1f fps, %.0f kbps, key every %.2f sec, frames %llu, dropped %llu, clip %.1f MB %.1f sec, write avg %.3f max %.3f ms, idle %.1f sec\n",
+			       stats.chId, stats.fps, stats.bitrate, stats.keyFrameInterval, stats.frameCount, stats.droppedFrameCount,
+			       stats.clipSize / 1048576.0, stats.clipDuration, stats.writeLatency, stats.maxWriteLatency, stats.idleTime);
+		}
+		printf("stats read in %.1f us\n", elapsed / 1000.0);
+	}
+}
+
+static void CountFiles(const boost::filesystem::path &dir, uint64_t &fileBytes, uint64_t &indexBytes, uint64_t &clipCount)
+{
+	boost::filesystem::recursive_directory_iterator end;
+	for (boost::filesystem::recursive_directory_iterator it(dir); it != end; ++it)
+	{
+		if (!boost::filesystem::is_regular_file(it->status()))
+		{
+			continue;
+		}
+
+		std::string name = it->path().filename().string();
+		uint64_t size = boost::filesystem::file_size(it->path());
+		fileBytes += size;
+		if (name.compare(0, 6, ".index") == 0)
+		{
+			indexBytes += size;
+		}
+		else if ((name.size() > 4) && (name.compare(name.size() - 4, 4, ".mkv") == 0))
+		{
+			clipCount++;
+		}
+	}
+}
+
+static bool ParseArguments(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *pValue = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (strcmp(argv[i], "-realtime") == 0)
+		{
+			config.isRealtime = true;
+			continue;
+		}
+		else if (strcmp(argv[i], "-stats") == 0)
+		{
+			config.isStatsShown = true;
+			continue;
+		}
+		else if (pValue == NULL)
+		{
+			return false;
+		}
+		else if (strcmp(argv[i], "-dir") == 0)      config.dir = pValue;
+		else if (strcmp(argv[i], "-channels") == 0) config.channelCount = atoi(pValue);
+		else if (strcmp(argv[i], "-duration") == 0) config.duration = atoi(pValue);
+		else if (strcmp(argv[i], "-fps") == 0)      config.fps = atoi(pValue);
+		else if (strcmp(argv[i], "-gop") == 0)      config.gop = atoi(pValue);
+		else if (strcmp(argv[i], "-kbps") == 0)     config.kbps = atoi(pValue);
+		else if (strcmp(argv[i], "-audio") == 0)    config.hasAudio = atoi(pValue) != 0;
+		else if (strcmp(argv[i], "-osd") == 0)      config.hasOsd = atoi(pValue) != 0;
+		else if (strcmp(argv[i], "-trace") == 0)    config.tracePath = pValue;
+		else
+		{
+			return false;
+		}
+		i++;
+	}
+
+	return (config.channelCount >= 1) && (config.channelCount <= MAX_CHANNEL_COUNT)
+	       && (config.duration > 0) && (config.fps > 0) && (config.gop > 0) && (config.kbps > 0);
+}
+
+int main(int argc, char **argv)
+{
+	if (!ParseArguments(argc, argv))
+	{
+		printf("usage: %s [-dir path] [-channels 1-%d] [-duration sec] [-fps n] [-gop n] [-kbps n] [-audio 0|1] [-osd 0|1] [-realtime] [-stats] [-trace file]\n",
+		       argv[0], MAX_CHANNEL_COUNT);
+		return -1;
+	}
+
+	// the trace file is relative to where we started
+	std::string tracePath;
+	if (config.tracePath != NULL)
+	{
+		char cwd[1024];
+		tracePath = ((config.tracePath[0] != '/') && (getcwd(cwd, sizeof(cwd)) != NULL)) ? std::string(cwd) + "/" + config.tracePath : config.tracePath;
+		libebml::HotTrace::Enable();
+	}
+
+	// the library keeps the index and the clips in the current directory
+	if (chdir(config.dir) != 0)
+	{
+		printf("fail to enter directory: %s\n", config.dir);
+		return -1;
+	}
+
+	uint64_t fileBytesBefore = 0ull, indexBytesBefore = 0ull, clipCountBefore = 0ull;
+	CountFiles(".", fileBytesBefore, indexBytesBefore, clipCountBefore);
+
+	StreamingMediaRecorder *pRecorder = StreamingMediaRecorder::GetStreamingMediaRecorder();
+	startTimecode = (uint64_t)time(NULL) * NANOSEC;
+
+	StreamingMediaRecorder::RecordingConfig recordingConfig(StreamingMediaRecorder::VIDEO_CODEC_ID_H264,
+	                                                        config.hasAudio ? StreamingMediaRecorder::AUDIO_CODEC_ID_G711_ULAW : StreamingMediaRecorder::AUDIO_CODEC_ID_NONE);
+	for (int chId = 1; chId <= config.channelCount; chId++)
+	{
+		if (!pRecorder->StartRecording(chId, recordingConfig))
+		{
+			printf("fail to start recording: channel %d\n", chId);
+			return -1;
+		}
+	}
+
+	std::vector<ChannelResult> results(config.channelCount);
+	boost::barrier barrier(config.channelCount + 1);
+	boost::thread_group threads;
+	for (int chId = 1; chId <= config.channelCount; chId++)
+	{
+		threads.create_thread(boost::bind(FeedChannel, pRecorder, chId, &barrier, &results[chId - 1]));
+	}
+
+	struct rusage usageStart, usageEnd;
+	getrusage(RUSAGE_SELF, &usageStart);
+	barrier.wait();
+	double wallStart = GetClock(CLOCK_MONOTONIC);
+	volatile bool isDone = false;
+	boost::thread *pStatsThread = config.isStatsShown ? new boost::thread(boost::bind(ShowStats, pRecorder, &isDone)) : NULL;
+	threads.join_all();
+	double wallTime = GetClock(CLOCK_MONOTONIC) - wallStart;
+	if (pStatsThread != NULL)
+	{
+		isDone = true;
+		pStatsThread->join();
+		delete pStatsThread;
+	}
+	getrusage(RUSAGE_SELF, &usageEnd);
+	delete pRecorder;
+
+	if (config.tracePath != NULL)
+	{
+		libebml::HotTrace::Disable();
+		if (!libebml::HotTrace::Dump(tracePath.c_str()))
+		{
+			printf("fail to write trace: %s\n", tracePath.c_str());
+		}
+	}
+
+	uint64_t fileBytes = 0ull, indexBytes = 0ull, clipCount = 0ull;
+	CountFiles(".", fileBytes, indexBytes, clipCount);
+	fileBytes -= std::min(fileBytes, fileBytesBefore);
+	indexBytes -= std::min(indexBytes, indexBytesBefore);
+	clipCount -= std::min(clipCount, clipCountBefore);
+
+	// report
+	std::vector<unsigned int> allLatencies;
+	uint64_t frameCount = 0ull, failedCount = 0ull, payloadBytes = 0ull;
+	double cpuTime = .0;
+
+	printf("channels: %d, duration: %d sec, %d fps, gop %d, %d kbps, audio %s, osd %s, %s\n",
+	       config.channelCount, config.duration, config.fps, config.gop, config.kbps,
+	       config.hasAudio ? "on" : "off", config.hasOsd ? "on" : "off", config.isRealtime ? "realtime" : "unpaced");
+	for (int i = 0; i < config.channelCount; i++)
+	{
+		ChannelResult &result = results[i];
+		std::sort(result.latencies.begin(), result.latencies.end());
+		printf("ch%02d: frames %llu, failed %llu, payload %.1f MB, cpu %.3f sec (%.1f%%), p99 %.1f us\n",
+		       i + 1, result.frameCount, result.failedCount, result.payloadBytes / 1048576.0,
+		       result.cpuTime, result.cpuTime * 100.0 / wallTime, GetPercentile(result.latencies, 99.0) / 1000.0);
+
+		allLatencies.insert(allLatencies.end(), result.latencies.begin(), result.latencies.end());
+		frameCount += result.frameCount;
+		failedCount += result.failedCount;
+		payloadBytes += result.payloadBytes;
+		cpuTime += result.cpuTime;
+	}
+	std::sort(allLatencies.begin(), allLatencies.end());
+
+	double processCpuTime = (usageEnd.ru_utime.tv_sec - usageStart.ru_utime.tv_sec) + (usageEnd.ru_utime.tv_usec - usageStart.ru_utime.tv_usec) / 1e6
+	                        + (usageEnd.ru_stime.tv_sec - usageStart.ru_stime.tv_sec) + (usageEnd.ru_stime.tv_usec - usageStart.ru_stime.tv_usec) / 1e6;
+
+	printf("total: %llu frames in %.3f sec, %.0f frames/s, %.1f MB/s of payload, failed %llu\n",
+	       frameCount, wallTime, frameCount / wallTime, payloadBytes / 1048576.0 / wallTime, failedCount);
+	printf("latency: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+	       GetPercentile(allLatencies, 50.0) / 1000.0, GetPercentile(allLatencies, 99.0) / 1000.0,
+	       GetPercentile(allLatencies, 99.9) / 1000.0, GetPercentile(allLatencies, 100.0) / 1000.0);
+	printf("written: %.1f MB, write amplification %.3f, index %.1f KB\n",
+	       fileBytes / 1048576.0, payloadBytes != 0ull ? (double)fileBytes / payloadBytes : .0, indexBytes / 1024.0);
+	printf("index updates: %llu clips\n", clipCount);
+	printf("cpu: %.3f sec feeding (%.3f per channel), %.3f sec in the process\n",
+	       cpuTime, cpuTime / config.channelCount, processCpuTime);
+
+	return failedCount != 0ull ? 1 : 0;
+}
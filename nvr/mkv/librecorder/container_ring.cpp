@@ -0,0 +1,308 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <boost/filesystem.hpp>
+#include <demuxer.hpp>
+#include "streaming_media_storage.hpp"
+
+ContainerRing::ContainerRing(const std::string &_dirName)
+	: dirName(_dirName), pFile(NULL), isWritable(false), openTime(0),
+	  generation(0), containerSize(0), allocatedSize(0), next(0)
+{
+}
+
+ContainerRing::~ContainerRing()
+{
+	if (pFile != NULL)
+	{
+		fclose(pFile);
+	}
+}
+
+// for the writer, the ring never shrinks since its containers hold indexed clips
+bool ContainerRing::Resize(IndexWord _containerSize, int containerCount)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	if (!isWritable)
+	{
+		try
+		{
+			boost::filesystem::create_directories(dirName);
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// error: the disk fails
+			return false;
+		}
+
+		if (pFile != NULL)
+		{
+			fclose(pFile);
+		}
+		std::string fileName = dirName + ".ring";
+		if ((pFile = fopen(fileName.c_str(), "r+b")) != NULL)
+		{
+			isWritable = true;
+			generation = -1;
+			Reload();
+		}
+		else if ((pFile = fopen(fileName.c_str(), "w+b")) != NULL)
+		{
+			isWritable = true;
+		}
+		else
+		{
+			// error:
+			return false;
+		}
+
+		// the containers are preallocated when they are used first
+		allocatedSize = 0;
+		for (size_t i = 0; i < clips.size(); i++)
+		{
+			try
+			{
+				allocatedSize += boost::filesystem::file_size(GetFileName((int)i));
+			}
+			catch (boost::filesystem::filesystem_error &)
+			{
+				// not yet
+			}
+		}
+	}
+
+	containerSize = _containerSize;
+	if ((size_t)containerCount > clips.size())
+	{
+		size_t oldCount = clips.size();
+		clips.resize(containerCount);
+		for (size_t i = oldCount; i < clips.size(); i++)
+		{
+			if (!WriteClip((int)i))
+			{
+				// error:
+				return false;
+			}
+		}
+	}
+
+	return WriteHeader();
+}
+
+IndexWord ContainerRing::GetAllocatedSize()
+{
+	boost::mutex::scoped_lock lock(mutex);
+	return allocatedSize;
+}
+
+// for recording, the containers read by playback sessions are skipped until
+// the next round, their clips stay whole for the sessions
+int ContainerRing::Allocate(Clip &evictedClip)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	if (!isWritable || clips.empty())
+	{
+		return -1;
+	}
+
+	for (size_t i = 0; i < clips.size(); i++)
+	{
+		int containerId = (next + (int)i) % (int)clips.size();
+		std::string fileName = GetFileName(containerId);
+		int reuseLock;
+		if (!DemuxerUtilities::LockForReuse(fileName.c_str(), reuseLock))
+		{
+			// being read
+			continue;
+		}
+
+		IndexWord size = 0;
+		try
+		{
+			size = boost::filesystem::file_size(fileName);
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// not yet
+		}
+		if (size < containerSize)
+		{
+			if (!PreallocateFile(fileName.c_str(), containerSize))
+			{
+				// error: the disk is full or fails
+				DemuxerUtilities::Unlock(reuseLock);
+				return -1;
+			}
+			allocatedSize += containerSize - size;
+		}
+
+		// the clip in the container is recycled, no reader opens it from now on
+		evictedClip = clips[containerId];
+		containerIds.erase(std::make_pair(evictedClip.chId, evictedClip.startTime));
+		clips[containerId] = Clip();
+
+		next = (containerId + 1) % (int)clips.size();
+		bool result = WriteClip(containerId) && WriteHeader();
+		DemuxerUtilities::Unlock(reuseLock);
+		if (!result)
+		{
+			// error:
+			return -1;
+		}
+		return containerId;
+	}
+
+	// error: every container is read, a file of its own then
+	return -1;
+}
+
+bool ContainerRing::SetClip(int containerId, const Clip &clip)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	if (!isWritable || (containerId < 0) || ((size_t)containerId >= clips.size()))
+	{
+		// error:
+		return false;
+	}
+
+	clips[containerId] = clip;
+	containerIds[std::make_pair(clip.chId, clip.startTime)] = containerId;
+	return WriteClip(containerId) && WriteHeader();
+}
+
+// for indexing
+int ContainerRing::FindClip(int chId, time_t startTime)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	std::pair<IndexWord, IndexWord> key((IndexWord)chId, (IndexWord)startTime);
+
+	std::map<std::pair<IndexWord, IndexWord>, int>::iterator it = containerIds.find(key);
+	if ((it == containerIds.end()) && !isWritable && Reload())
+	{
+		// the writer has added it since
+		it = containerIds.find(key);
+	}
+
+	return it != containerIds.end() ? it->second : -1;
+}
+
+std::string ContainerRing::GetFileName(int containerId)
+{
+	char name[16];
+	sprintf(name, "%06d.mkv", containerId);
+	return dirName + name;
+}
+
+bool ContainerRing::IsContainer(const std::string &fileName)
+{
+	return fileName.compare(0, dirName.size(), dirName) == 0;
+}
+
+// a clip no longer indexed leaves the ring, so that only the indexed clips and
+// those which a crash left out are found there
+bool ContainerRing::RemoveClip(int chId, time_t startTime)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	std::map<std::pair<IndexWord, IndexWord>, int>::iterator it = containerIds.find(std::make_pair((IndexWord)chId, (IndexWord)startTime));
+	if (!isWritable || (it == containerIds.end()))
+	{
+		// error: kept until its container is reused
+		return false;
+	}
+
+	int containerId = it->second;
+	containerIds.erase(it);
+	clips[containerId] = Clip();
+	return WriteClip(containerId) && WriteHeader();
+}
+
+void ContainerRing::GetClips(std::vector<Clip> &ringClips)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	if (!isWritable)
+	{
+		Reload();
+	}
+	ringClips = clips;
+}
+
+// for the readers, reload the ring only if the writer changed it
+bool ContainerRing::Reload()
+{
+	if (pFile == NULL)
+	{
+		time_t now = time(NULL);
+		if (now - openTime < REOPEN_PERIOD)
+		{
+			return false;
+		}
+		openTime = now;
+
+		std::string fileName = dirName + ".ring";
+		if ((pFile = fopen(fileName.c_str(), "rb")) == NULL)
+		{
+			// no container yet
+			return false;
+		}
+	}
+
+	IndexWord header[HEADER_WORDS];
+	if ((IndexFileSeek(pFile, 0) != 0) || (fread(header, sizeof(IndexWord), HEADER_WORDS, pFile) != HEADER_WORDS))
+	{
+		// error:
+		return false;
+	}
+	if (header[0] == generation)
+	{
+		return false;
+	}
+
+	std::vector<Clip> newClips((size_t)header[2]);
+	for (size_t i = 0; i < newClips.size(); i++)
+	{
+		if ((fread(&newClips[i].chId, sizeof(IndexWord), 1, pFile) != 1)
+		    || (fread(&newClips[i].startTime, sizeof(IndexWord), 1, pFile) != 1)
+		    || (fread(&newClips[i].endTime, sizeof(IndexWord), 1, pFile) != 1))
+		{
+			// error: being written
+			return false;
+		}
+	}
+
+	generation    = header[0];
+	containerSize = header[1];
+	next          = (int)header[3];
+	clips.swap(newClips);
+	containerIds.clear();
+	for (size_t i = 0; i < clips.size(); i++)
+	{
+		if (clips[i].chId > 0)
+		{
+			containerIds[std::make_pair(clips[i].chId, clips[i].startTime)] = (int)i;
+		}
+	}
+	return true;
+}
+
+bool ContainerRing::WriteClip(int containerId)
+{
+	const Clip &clip = clips[containerId];
+	return (IndexFileSeek(pFile, (HEADER_WORDS + containerId * 3) * sizeof(IndexWord)) == 0)
+	       && (fwrite(&clip.chId, sizeof(IndexWord), 1, pFile) == 1)
+	       && (fwrite(&clip.startTime, sizeof(IndexWord), 1, pFile) == 1)
+	       && (fwrite(&clip.endTime, sizeof(IndexWord), 1, pFile) == 1);
+}
+
+// the generation is written last, and the readers reload the clips once it changes
+bool ContainerRing::WriteHeader()
+{
+	IndexWord header[HEADER_WORDS];
+	header[0] = ++generation;
+	header[1] = containerSize;
+	header[2] = (IndexWord)clips.size();
+	header[3] = next;
+	return (IndexFileSeek(pFile, 0) == 0)
+	       && (fwrite(header, sizeof(IndexWord), HEADER_WORDS, pFile) == HEADER_WORDS)
+	       && (fflush(pFile) == 0);
+}
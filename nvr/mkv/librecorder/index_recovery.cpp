@@ -0,0 +1,317 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <demuxer.hpp>
+#include "streaming_media_storage.hpp"
+
+IndexRecovery::IndexRecovery(RootIndexNode *_pIndexRoot)
+	: pIndexRoot(_pIndexRoot), nextJob(0)
+{
+}
+
+IndexRecovery::~IndexRecovery()
+{
+}
+
+size_t IndexRecovery::Run()
+{
+	// a job per channel directory of every disk
+	std::vector<StoragePool::ChannelDirectory> directories;
+	storagePool.GetChannelDirectories(directories);
+
+	// nothing is scanned unless a channel on the disks lost its index, or has none yet
+	bool isIntact = true;
+	for (size_t i = 0; (i < directories.size()) && isIntact; i++)
+	{
+		isIntact = pIndexRoot->IsIntact(directories[i].chId);
+	}
+	if (isIntact)
+	{
+		return 0;
+	}
+
+	std::map<int, std::pair<int, int> > lastDates;
+	for (size_t i = 0; i < directories.size(); i++)
+	{
+		int chId = directories[i].chId;
+		if (lastDates.find(chId) == lastDates.end())
+		{
+			std::pair<int, int> &lastDate = lastDates[chId];
+			GetLastDate(chId, lastDate.first, lastDate.second);
+		}
+
+		Job job;
+		job.diskId   = directories[i].diskId;
+		job.chId     = chId;
+		job.dirName  = directories[i].dirName;
+		job.lastYear = lastDates[chId].first;
+		job.lastDate = lastDates[chId].second;
+		jobs.push_back(job);
+	}
+
+	std::vector<boost::thread *> threads;
+	for (size_t i = 0; (i < jobs.size()) && (i < MAX_THREAD_COUNT); i++)
+	{
+		threads.push_back(new boost::thread(&IndexRecovery::ScanJobs, this));
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	size_t diskCount = storagePool.GetDirectories().size();
+	for (size_t i = 0; i < diskCount; i++)
+	{
+		ScanContainers((int)i);
+	}
+
+	size_t count = 0;
+	for (std::map<int, std::vector<Clip> >::iterator it = channels.begin(); it != channels.end(); ++it)
+	{
+		count += IndexChannel(it->first, it->second);
+	}
+	return count;
+}
+
+// the clips left out by a crash are newer than the last one indexed, unless
+// the index is new or broken, then everything is scanned
+void IndexRecovery::GetLastDate(int chId, int &year, int &date)
+{
+	year = 0;
+	date = 0;
+	if (!pIndexRoot->IsIntact(chId))
+	{
+		return;
+	}
+
+	time_t time = ::time(NULL) + 366 * SECONDS_PER_DAY;
+	FileNode *pLastNode = pIndexRoot->SearchBackwardlyAndLoad(chId, time);
+	struct tm localTime;
+	if ((pLastNode != NULL) && (LocalTime(&pLastNode->startTime, &localTime) != NULL))
+	{
+		year = localTime.tm_year + 1900;
+		date = (localTime.tm_mon + 1) * 100 + localTime.tm_mday;
+	}
+}
+
+void IndexRecovery::ScanJobs()
+{
+	for (;;)
+	{
+		Job job;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			if (nextJob >= jobs.size())
+			{
+				return;
+			}
+			job = jobs[nextJob++];
+		}
+
+		std::vector<Clip> clips;
+		ScanChannel(job, clips);
+
+		boost::mutex::scoped_lock lock(mutex);
+		std::vector<Clip> &channel = channels[job.chId];
+		channel.insert(channel.end(), clips.begin(), clips.end());
+	}
+}
+
+// the ring of the disk keeps the clip of every container once it is finished,
+// before the clip is indexed
+void IndexRecovery::ScanContainers(int diskId)
+{
+	std::vector<ContainerRing::Clip> ringClips;
+	storagePool.GetContainerClips(diskId, ringClips);
+	for (size_t i = 0; i < ringClips.size(); i++)
+	{
+		const ContainerRing::Clip &ringClip = ringClips[i];
+		if (!StreamingMediaLibrary::IsChannelId((int)ringClip.chId) || (ringClip.endTime <= ringClip.startTime))
+		{
+			// empty, or being recorded
+			continue;
+		}
+
+		Clip clip;
+		clip.startTime   = (time_t)ringClip.startTime;
+		clip.endTime     = (time_t)ringClip.endTime;
+		clip.diskId      = diskId;
+		clip.containerId = (int)i;
+		channels[(int)ringClip.chId].push_back(clip);
+	}
+}
+
+// chxx/yyyy/MMdd/hhmmss_hhmmss.mkv and chxx/nnn.mkv
+void IndexRecovery::ScanChannel(const Job &job, std::vector<Clip> &clips)
+{
+	try
+	{
+		boost::filesystem::directory_iterator end;
+		for (boost::filesystem::directory_iterator year(job.dirName); year != end; ++year)
+		{
+			std::string yearName = year->path().string();
+			Clip clip;
+			clip.diskId = job.diskId;
+
+			if (boost::filesystem::is_regular_file(year->status()))
+			{
+				if (ParseTemporaryFile(yearName, clip))
+				{
+					clips.push_back(clip);
+				}
+				continue;
+			}
+			// chxx/sub is the job of the substream
+			int yearNumber = atoi(year->path().filename().string().c_str());
+			if (!boost::filesystem::is_directory(year->status()) || (yearNumber <= 0) || (yearNumber < job.lastYear))
+			{
+				continue;
+			}
+
+			for (boost::filesystem::directory_iterator date(year->path()); date != end; ++date)
+			{
+				if (!boost::filesystem::is_directory(date->status())
+				    || ((yearNumber == job.lastYear) && (atoi(date->path().filename().string().c_str()) < job.lastDate)))
+				{
+					continue;
+				}
+
+				for (boost::filesystem::directory_iterator file(date->path()); file != end; ++file)
+				{
+					if (boost::filesystem::is_regular_file(file->status())
+					    && ParseFileName(file->path().string(), clip))
+					{
+						clips.push_back(clip);
+					}
+				}
+			}
+		}
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: the disk fails, keep what was found
+	}
+}
+
+// the local times in the name, as FileNode::RebuildFileName() gives them
+bool IndexRecovery::ParseFileName(const std::string &fileName, Clip &clip)
+{
+	struct tm start;
+	struct tm end;
+	char extension[8];
+	size_t pos = fileName.size() > 28 ? fileName.size() - 28 : 0;  // /yyyy/MMdd/hhmmss_hhmmss.mkv
+	if ((sscanf(fileName.c_str() + pos, "/%4d/%2d%2d/%2d%2d%2d_%2d%2d%2d.%3s",
+	            &start.tm_year, &start.tm_mon, &start.tm_mday, &start.tm_hour, &start.tm_min, &start.tm_sec,
+	            &end.tm_hour, &end.tm_min, &end.tm_sec, extension) != 10)
+	    || (strcmp(extension, "mkv") != 0))
+	{
+		// not a clip
+		return false;
+	}
+
+	start.tm_year -= 1900;
+	start.tm_mon  -= 1;
+	start.tm_isdst = -1;
+	end.tm_year    = start.tm_year;
+	end.tm_mon     = start.tm_mon;
+	end.tm_mday    = start.tm_mday;
+	end.tm_isdst   = -1;
+
+	clip.startTime = mktime(&start);
+	clip.endTime   = mktime(&end);
+	if (clip.endTime < clip.startTime)
+	{
+		// across midnight
+		clip.endTime += SECONDS_PER_DAY;
+	}
+	clip.temporaryFileName.clear();
+	return clip.startTime > 0;
+}
+
+// the times of a clip never finished, from its clusters
+bool IndexRecovery::ParseTemporaryFile(const std::string &fileName, Clip &clip)
+{
+	int index;
+	char extension[8];
+	size_t pos = fileName.size() > 8 ? fileName.size() - 8 : 0;  // /nnn.mkv
+	if ((sscanf(fileName.c_str() + pos, "/%3d.%3s", &index, extension) != 2) || (strcmp(extension, "mkv") != 0))
+	{
+		return false;
+	}
+
+	uint64_t startTime;
+	uint64_t endTime;
+	if (!DemuxerUtilities::GetMkvTimeRange(fileName.c_str(), startTime, endTime))
+	{
+		// error: nothing recorded, or a clip from another container format
+		return false;
+	}
+
+	clip.startTime = (time_t)(startTime / 1000000000ull);
+	clip.endTime   = (time_t)((endTime + 999999999ull) / 1000000000ull);
+	if (clip.endTime <= clip.startTime)
+	{
+		clip.endTime = clip.startTime + 1;
+	}
+	clip.temporaryFileName = fileName;
+	return true;
+}
+
+// insert the clips newer than the last one indexed, as a batch
+size_t IndexRecovery::IndexChannel(int chId, std::vector<Clip> &clips)
+{
+	if (clips.empty())
+	{
+		return 0;
+	}
+	std::sort(clips.begin(), clips.end());
+
+	time_t lastEndTime = 0;
+	FileNode *pLastNode = pIndexRoot->SearchBackwardlyAndLoad(chId, clips.back().startTime + 1);
+	if (pLastNode != NULL)
+	{
+		lastEndTime = pLastNode->endTime;
+	}
+
+	std::vector<FileNode *> nodes;
+	for (size_t i = 0; i < clips.size(); i++)
+	{
+		const Clip &clip = clips[i];
+		if (clip.startTime < lastEndTime)
+		{
+			// indexed, or the same time on another disk
+			continue;
+		}
+
+		FileNode *pFileNode = new FileNode(FileNode::FILE_TYPE_NORMAL);
+		pFileNode->chId      = chId;
+		pFileNode->startTime = clip.startTime;
+		pFileNode->endTime   = clip.endTime;
+		pFileNode->diskId    = clip.diskId;
+		pFileNode->containerId    = clip.containerId;
+		pFileNode->isPreallocated = clip.containerId != FileNode::CONTAINER_ID_UNKNOWN;
+		if (clip.temporaryFileName.empty() ? !pFileNode->RebuildFileName() : !pFileNode->RenameFrom(clip.temporaryFileName.c_str()))
+		{
+			// error: the disk fails
+			delete pFileNode;
+			continue;
+		}
+
+		try
+		{
+			pFileNode->fileSize = boost::filesystem::file_size(pFileNode->GetFileName());
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// error: not counted
+		}
+
+		nodes.push_back(pFileNode);
+		lastEndTime = clip.endTime;
+	}
+
+	return pIndexRoot->InsertIndexes(nodes);
+}
@@ -0,0 +1,217 @@
+
+#include <stdio.h>
+#include <boost/filesystem.hpp>
+#include <exporter.hpp>
+#include <ebml/HotTrace.h>
+#include "streaming_media_storage.hpp"
+
+StorageCompactor::StorageCompactor(RootIndexNode *_pIndexRoot, const CompactionConfig &_config, StorageRecycler *&_pRecycler, boost::mutex &_recyclerMutex)
+	: pIndexRoot(_pIndexRoot), pRecycler(_pRecycler), recyclerMutex(_recyclerMutex), isStopping(false), config(_config)
+{
+	pThread = new boost::thread(&StorageCompactor::Run, this);
+}
+
+StorageCompactor::~StorageCompactor()
+{
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		isStopping = true;
+	}
+	pThread->join();
+	delete pThread;
+}
+
+void StorageCompactor::SetConfig(const CompactionConfig &_config)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	config = _config;
+}
+
+void StorageCompactor::SetChannelDays(int chId, int days)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	channels[chId].days = days;
+	channels[chId].hasDays = true;
+}
+
+void StorageCompactor::Run()
+{
+	time_t scanTime = 0;
+	time_t idleTime = 0;
+
+	while (!IsStopping())
+	{
+		time_t now = time(NULL);
+		if ((now >= idleTime) && (now - idleTime < IDLE_PERIOD))
+		{
+			// nothing was left to thin a moment ago
+			SleepMilliseconds(CHECK_PERIOD);
+			continue;
+		}
+
+		if ((now - scanTime >= RESCAN_PERIOD) || (now < scanTime))
+		{
+			FindChannels();
+			scanTime = now;
+		}
+
+		CompactionConfig currentConfig;
+		std::map<int, ChannelState> currentChannels;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			currentConfig = config;
+			currentChannels = channels;
+		}
+
+		// a clip of every channel in turn
+		bool isCompacting = false;
+		for (std::map<int, ChannelState>::iterator it = currentChannels.begin(); (it != currentChannels.end()) && !IsStopping(); ++it)
+		{
+			int days = it->second.hasDays ? it->second.days : currentConfig.compactionDays;
+			if ((days > 0) && CompactNextFile(it->first, now - days * SECONDS_PER_DAY, currentConfig))
+			{
+				isCompacting = true;
+			}
+		}
+
+		if (!isCompacting)
+		{
+			idleTime = now;
+		}
+	}
+}
+
+bool StorageCompactor::IsStopping()
+{
+	boost::mutex::scoped_lock lock(mutex);
+	return isStopping;
+}
+
+// the channels with a directory on any disk, chxx
+void StorageCompactor::FindChannels()
+{
+	std::vector<StoragePool::ChannelDirectory> directories;
+	storagePool.GetChannelDirectories(directories);
+
+	boost::mutex::scoped_lock lock(mutex);
+	for (size_t i = 0; i < directories.size(); i++)
+	{
+		channels[directories[i].chId];
+	}
+}
+
+// the oldest clip of the channel not looked at yet, false if there is none
+// ending before the time
+bool StorageCompactor::CompactNextFile(int chId, time_t before, const CompactionConfig &currentConfig)
+{
+	time_t compactedTime;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		compactedTime = channels[chId].compactedTime;
+	}
+
+	RootIndexNode::Clip clip;
+	if (!pIndexRoot->GetNextClip(chId, compactedTime, clip) || (clip.endTime > before))
+	{
+		return false;
+	}
+
+	time_t startTime = clip.startTime;
+	time_t endTime   = clip.endTime;
+	const std::string &fileName = clip.fileName;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		channels[chId].compactedTime = endTime > startTime ? endTime : startTime + 1;
+	}
+
+	if (!storagePool.IsContainer(fileName))
+	{
+		// a container is reused by its ring anyway
+		CompactFile(chId, startTime, endTime, fileName, currentConfig);
+	}
+	return true;
+}
+
+// into a temporary file next to the clip, which the index then swaps in
+bool StorageCompactor::CompactFile(int chId, time_t startTime, time_t endTime, const std::string &fileName, const CompactionConfig &currentConfig)
+{
+	HOT_TRACE_SCOPE("compact.file");
+
+	Exporter *pExporter = ExporterUtilities::CreateMkvExporter();
+	if (pExporter->IsThinned(fileName.c_str()))
+	{
+		// done before the restart
+		delete pExporter;
+		return false;
+	}
+
+	Exporter::Config exporterConfig;
+	exporterConfig.keptGopInterval = currentConfig.keptGopInterval;
+	exporterConfig.hasAudio        = currentConfig.hasAudio;
+	exporterConfig.isTimeKept      = true;
+
+	std::string newFileName = fileName + ".tmp";
+	bool result = pExporter->SetConfig(exporterConfig)
+	              && pExporter->StartExporting(newFileName.c_str(), startTime * 1000000000ull, (endTime + 1) * 1000000000ull);
+	if (result)
+	{
+		pExporter->AppendFile(fileName.c_str());
+		result = pExporter->StopExporting();
+	}
+	delete pExporter;
+
+	uint64_t oldSize = 0, newSize = 0;
+	try
+	{
+		oldSize = result ? boost::filesystem::file_size(fileName) : 0;
+		newSize = result ? boost::filesystem::file_size(newFileName) : 0;
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: the clip is recycled meanwhile
+		result = false;
+	}
+
+	uint64_t savedBytes = oldSize > newSize ? oldSize - newSize : 0;
+	if (result && (newSize * 100 <= oldSize * MAX_KEPT_PERCENT))
+	{
+		result = pIndexRoot->ReplaceFile(chId, startTime, newFileName.c_str(), savedBytes);
+	}
+	else
+	{
+		// error: unreadable, or not worth it
+		result = false;
+	}
+
+	if (!result)
+	{
+		try
+		{
+			boost::filesystem::remove(newFileName);
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// error: overwritten next time
+		}
+	}
+	else
+	{
+		boost::mutex::scoped_lock lock(recyclerMutex);
+		if (pRecycler != NULL)
+		{
+			pRecycler->ReduceUsage(chId, savedBytes);
+		}
+	}
+
+	// as long as the bytes read and written take at the rate
+	if (currentConfig.maxByteRate > 0)
+	{
+		uint64_t msec = (oldSize + newSize) * 1000 / (currentConfig.maxByteRate * 1024ull);
+		for ( ; (msec > 0) && !IsStopping(); msec -= msec < (uint64_t)CHECK_PERIOD ? msec : (uint64_t)CHECK_PERIOD)
+		{
+			SleepMilliseconds(msec < (uint64_t)CHECK_PERIOD ? (int)msec : (int)CHECK_PERIOD);
+		}
+	}
+
+	return result;
+}
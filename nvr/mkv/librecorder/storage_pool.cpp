@@ -0,0 +1,573 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include "streaming_media_storage.hpp"
+
+StoragePool storagePool;
+
+StoragePool::Disk::Disk(const std::string &_mountPoint)
+	: mountPoint(_mountPoint), isPooled(false), isFailed(false), failureTime(0),
+	  writingCount(0), writtenBytes(0ull), writeRate(0ull), rateTime(time(NULL))
+{
+	if (!mountPoint.empty())
+	{
+		prefix = mountPoint[mountPoint.size() - 1] == '/' ? mountPoint : mountPoint + "/";
+	}
+
+	pRing = new ContainerRing(prefix + "containers/");
+}
+
+StoragePool::Disk::~Disk()
+{
+	delete pRing;
+}
+
+StoragePool::StoragePool()
+	: hasPooledDisk(false), containerSize(0), containerCount(0)
+{
+	// the current directory
+	disks.push_back(new Disk(""));
+}
+
+StoragePool::~StoragePool()
+{
+	for (size_t i = 0; i < disks.size(); i++)
+	{
+		delete disks[i];
+	}
+}
+
+// number the mount points added before, one per line of .storage
+bool StoragePool::Load()
+{
+	FILE *pFile = fopen(".storage", "r");
+	if (pFile == NULL)
+	{
+		// no disk was ever added
+		return true;
+	}
+
+	boost::mutex::scoped_lock lock(mutex);
+	char line[MAX_MOUNT_POINT_LENGTH + 2];
+	while ((disks.size() <= MAX_DISK_COUNT) && (fgets(line, sizeof(line), pFile) != NULL))
+	{
+		size_t length = strlen(line);
+		if ((length > 0) && (line[length - 1] == '\n'))
+		{
+			line[length - 1] = '\0';
+		}
+		disks.push_back(new Disk(line));
+	}
+
+	fclose(pFile);
+	return true;
+}
+
+int StoragePool::AddDisk(const char *mountPoint)
+{
+	if ((mountPoint == NULL) || (*mountPoint == '\0')
+	    || (strlen(mountPoint) > MAX_MOUNT_POINT_LENGTH) || (strchr(mountPoint, '\n') != NULL))
+	{
+		// error: wrong mount point
+		return -1;
+	}
+
+	try
+	{
+		if (!boost::filesystem::is_directory(mountPoint))
+		{
+			// error: not mounted
+			return -1;
+		}
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error:
+		return -1;
+	}
+
+	boost::mutex::scoped_lock lock(mutex);
+	int diskId;
+	for (diskId = 1; diskId < (int)disks.size(); diskId++)
+	{
+		if (disks[diskId]->mountPoint == mountPoint)
+		{
+			break;
+		}
+	}
+
+	if (diskId == (int)disks.size())
+	{
+		if (diskId > MAX_DISK_COUNT)
+		{
+			// error: too many disks
+			return -1;
+		}
+
+		FILE *pFile = fopen(".storage", "a");
+		if (pFile == NULL)
+		{
+			// error:
+			return -1;
+		}
+		bool isWritten = fprintf(pFile, "%s\n", mountPoint) > 0;
+		if ((fclose(pFile) != 0) || !isWritten)
+		{
+			// error:
+			return -1;
+		}
+		disks.push_back(new Disk(mountPoint));
+	}
+
+	if ((containerCount > 0) && !disks[diskId]->pRing->Resize(containerSize, containerCount))
+	{
+		// error: no container, a file per clip
+	}
+
+	disks[diskId]->isPooled = true;
+	hasPooledDisk = true;
+	return diskId;
+}
+
+// for recording
+int StoragePool::AllocateDisk(int chId)
+{
+	time_t now = time(NULL);
+	boost::mutex::scoped_lock lock(mutex);
+
+	Channel &channel = channels[chId];
+	if (channel.isWriting)
+	{
+		// the last clip was never added
+		disks[channel.diskId]->writingCount--;
+		channel.isWriting = false;
+	}
+
+	uint64_t freeSpace;
+	int diskId = -1;
+	if ((channel.diskId >= 0) && (now >= channel.allocationTime) && (now - channel.allocationTime < STICKY_PERIOD)
+	    && IsPooled(channel.diskId) && IsAvailable(channel.diskId, now, freeSpace))
+	{
+		// stay on the disk for a while
+		diskId = channel.diskId;
+	}
+	else
+	{
+		// the least load for the free space, of the clips being written and of the write rate
+		double minCost = 0.0;
+		for (int i = 0; i < (int)disks.size(); i++)
+		{
+			if (!IsPooled(i) || !IsAvailable(i, now, freeSpace))
+			{
+				continue;
+			}
+
+			double cost = (disks[i]->writingCount + 1.0) * ((double)disks[i]->writeRate + BASE_WRITE_RATE) / (double)freeSpace;
+			if ((diskId < 0) || (cost < minCost))
+			{
+				diskId = i;
+				minCost = cost;
+			}
+		}
+
+		if (diskId < 0)
+		{
+			// error: every disk fails or is full, keep writing until the recycler makes room
+			for (diskId = (int)disks.size() - 1; (diskId > 0) && !IsPooled(diskId); diskId--)
+			{
+			}
+			if ((channel.diskId >= 0) && IsPooled(channel.diskId))
+			{
+				diskId = channel.diskId;
+			}
+		}
+		channel.allocationTime = now;
+	}
+
+	channel.diskId = diskId;
+	channel.isWriting = true;
+	disks[diskId]->writingCount++;
+	return diskId;
+}
+
+// the clip is added to the index, or its disk fails
+uint64_t StoragePool::FinishWriting(int chId, const char *fileName, bool isSucceeded)
+{
+	uint64_t size = 0;
+	if (isSucceeded)
+	{
+		try
+		{
+			size = boost::filesystem::file_size(fileName);
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// error: not counted
+		}
+	}
+
+	time_t now = time(NULL);
+	boost::mutex::scoped_lock lock(mutex);
+
+	Channel &channel = channels[chId];
+	if (!channel.isWriting)
+	{
+		// the disk is not known
+		return size;
+	}
+	channel.isWriting = false;
+
+	Disk &disk = *disks[channel.diskId];
+	disk.writingCount--;
+	if (!isSucceeded)
+	{
+		// drain the disk, and move the channel at once
+		disk.isFailed = true;
+		disk.failureTime = now;
+		channel.allocationTime = 0;
+		return 0;
+	}
+
+	disk.writtenBytes += size;
+	UpdateWriteRate(disk, now);
+	return size;
+}
+
+// chxx/nnn.mkv, in the directory of the channel so that a crash leaves it to the channel
+void StoragePool::GetTemporaryFileName(int diskId, int chId, size_t index, char *buffer)
+{
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		Disk &disk = *disks[(diskId > 0) && (diskId < (int)disks.size()) ? diskId : 0];
+		int length = sprintf(buffer, "%s", disk.prefix.c_str());
+		length += GetChannelDirectoryName(chId, buffer + length);
+		strcpy(buffer + length, "/");
+	}
+
+	try
+	{
+		if (!boost::filesystem::is_directory(buffer))
+		{
+			boost::filesystem::create_directories(buffer);
+		}
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: the disk fails, and so does the clip
+	}
+
+	sprintf(buffer + strlen(buffer), "%03d.mkv", (int)(index % TEMPORARY_FILE_NAME_COUNT));
+}
+
+// for indexing
+void StoragePool::GetFileName(int diskId, const char *relativeName, char *buffer)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	Disk &disk = *disks[(diskId > 0) && (diskId < (int)disks.size()) ? diskId : 0];
+	sprintf(buffer, "%s%s", disk.prefix.c_str(), relativeName);
+}
+
+// look for the clip on the added disks, or it is on the first one
+int StoragePool::FindDisk(const char *relativeName)
+{
+	std::vector<std::string> prefixes;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		for (size_t i = 1; i < disks.size(); i++)
+		{
+			prefixes.push_back(disks[i]->prefix);
+		}
+	}
+
+	for (size_t i = 0; i < prefixes.size(); i++)
+	{
+		try
+		{
+			if (boost::filesystem::exists(prefixes[i] + relativeName))
+			{
+				return (int)i + 1;
+			}
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// error: the disk fails
+		}
+	}
+
+	return 0;
+}
+
+// for containers, on every disk taking new clips
+bool StoragePool::SetContainers(IndexWord _containerSize, int _containerCount)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	containerSize = _containerSize;
+	containerCount = _containerCount;
+
+	bool result = true;
+	for (int i = 0; (containerCount > 0) && (i < (int)disks.size()); i++)
+	{
+		if (IsPooled(i) && !disks[i]->pRing->Resize(containerSize, containerCount))
+		{
+			// error: no container on the disk
+			result = false;
+		}
+	}
+	return result;
+}
+
+// the next container of the disk, or -1 for a file of its own
+int StoragePool::AllocateContainer(int diskId, ContainerRing::Clip &evictedClip)
+{
+	ContainerRing *pRing;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if ((containerCount <= 0) || (diskId < 0) || (diskId >= (int)disks.size()))
+		{
+			return -1;
+		}
+		pRing = disks[diskId]->pRing;
+	}
+
+	return pRing->Allocate(evictedClip);
+}
+
+bool StoragePool::SetContainerClip(int diskId, int containerId, const ContainerRing::Clip &clip)
+{
+	ContainerRing *pRing;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if ((diskId < 0) || (diskId >= (int)disks.size()))
+		{
+			return false;
+		}
+		pRing = disks[diskId]->pRing;
+	}
+
+	return pRing->SetClip(containerId, clip);
+}
+
+bool StoragePool::FindContainer(int chId, time_t startTime, int &diskId, int &containerId)
+{
+	std::vector<ContainerRing *> rings;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		for (size_t i = 0; i < disks.size(); i++)
+		{
+			rings.push_back(disks[i]->pRing);
+		}
+	}
+
+	for (size_t i = 0; i < rings.size(); i++)
+	{
+		int id = rings[i]->FindClip(chId, startTime);
+		if (id >= 0)
+		{
+			diskId = (int)i;
+			containerId = id;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void StoragePool::GetContainerFileName(int diskId, int containerId, char *buffer)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	Disk &disk = *disks[(diskId > 0) && (diskId < (int)disks.size()) ? diskId : 0];
+	strcpy(buffer, disk.pRing->GetFileName(containerId).c_str());
+}
+
+bool StoragePool::RemoveContainerClip(int chId, time_t startTime)
+{
+	std::vector<ContainerRing *> rings;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		for (size_t i = 0; i < disks.size(); i++)
+		{
+			rings.push_back(disks[i]->pRing);
+		}
+	}
+
+	for (size_t i = 0; i < rings.size(); i++)
+	{
+		if (rings[i]->RemoveClip(chId, startTime))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// the clips of the ring by container, those with no channel are empty
+void StoragePool::GetContainerClips(int diskId, std::vector<ContainerRing::Clip> &clips)
+{
+	ContainerRing *pRing;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if ((diskId < 0) || (diskId >= (int)disks.size()))
+		{
+			clips.clear();
+			return;
+		}
+		pRing = disks[diskId]->pRing;
+	}
+
+	pRing->GetClips(clips);
+}
+
+bool StoragePool::IsContainer(const std::string &fileName)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	for (size_t i = 0; i < disks.size(); i++)
+	{
+		if (disks[i]->pRing->IsContainer(fileName))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// for recycling
+std::vector<std::string> StoragePool::GetDirectories()
+{
+	std::vector<std::string> prefixes;
+	boost::mutex::scoped_lock lock(mutex);
+	for (size_t i = 0; i < disks.size(); i++)
+	{
+		prefixes.push_back(disks[i]->prefix);
+	}
+	return prefixes;
+}
+
+// the chxx and chxx/sub found on every disk, disk by disk, looked for out of the lock
+void StoragePool::GetChannelDirectories(std::vector<ChannelDirectory> &directories)
+{
+	std::vector<std::string> prefixes = GetDirectories();
+	for (size_t i = 0; i < prefixes.size(); i++)
+	{
+		for (int chId = 1; chId <= MAX_CHANNEL_COUNT; chId++)
+		{
+			ChannelDirectory directory;
+			char dirName[16];
+			GetChannelDirectoryName(chId, dirName);
+			directory.diskId  = (int)i;
+			directory.chId    = chId;
+			directory.dirName = prefixes[i] + dirName;
+			try
+			{
+				if (!boost::filesystem::is_directory(directory.dirName))
+				{
+					continue;
+				}
+				directories.push_back(directory);
+
+				// the substream of the channel, if it has one
+				directory.chId = StreamingMediaLibrary::GetSubstreamChannelId(chId);
+				GetChannelDirectoryName(directory.chId, dirName);
+				directory.dirName = prefixes[i] + dirName;
+				if (boost::filesystem::is_directory(directory.dirName))
+				{
+					directories.push_back(directory);
+				}
+			}
+			catch (boost::filesystem::filesystem_error &)
+			{
+				// error: the disk fails
+			}
+		}
+	}
+}
+
+// % in use of all the disks taking new clips, where the containers count as
+// free since their ring recycles them
+int StoragePool::GetDiskUsage()
+{
+	std::vector<std::string> mountPoints;
+	std::vector<ContainerRing *> rings;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		for (int i = 0; i < (int)disks.size(); i++)
+		{
+			if (IsPooled(i))
+			{
+				mountPoints.push_back(disks[i]->mountPoint);
+				rings.push_back(disks[i]->pRing);
+			}
+		}
+	}
+
+	uint64_t totalCapacity = 0;
+	uint64_t totalFreeSpace = 0;
+	for (size_t i = 0; i < mountPoints.size(); i++)
+	{
+		uint64_t capacity = 0;
+		totalFreeSpace += GetFreeSpace(mountPoints[i], &capacity) + rings[i]->GetAllocatedSize();
+		totalCapacity += capacity;
+	}
+	totalFreeSpace = totalFreeSpace < totalCapacity ? totalFreeSpace : totalCapacity;
+
+	return totalCapacity > 0 ? (int)((totalCapacity - totalFreeSpace) * 100 / totalCapacity) : 0;
+}
+
+bool StoragePool::IsPooled(int diskId)
+{
+	// the current directory until a disk is added
+	return hasPooledDisk ? disks[diskId]->isPooled : diskId == 0;
+}
+
+bool StoragePool::IsAvailable(int diskId, time_t now, uint64_t &freeSpace)
+{
+	Disk &disk = *disks[diskId];
+	if (disk.isFailed)
+	{
+		if ((now >= disk.failureTime) && (now - disk.failureTime < RETRY_PERIOD))
+		{
+			return false;
+		}
+		// try it again
+		disk.isFailed = false;
+	}
+
+	UpdateWriteRate(disk, now);
+	freeSpace = GetFreeSpace(disk.mountPoint);
+	return freeSpace >= MIN_FREE_SPACE * 1024ull * 1024ull;
+}
+
+void StoragePool::UpdateWriteRate(Disk &disk, time_t now)
+{
+	if (now < disk.rateTime)
+	{
+		// the clock is set back
+		disk.rateTime = now;
+		disk.writtenBytes = 0;
+	}
+	else if (now - disk.rateTime >= RATE_PERIOD)
+	{
+		disk.writeRate = disk.writtenBytes / (now - disk.rateTime);
+		disk.writtenBytes = 0;
+		disk.rateTime = now;
+	}
+}
+
+uint64_t StoragePool::GetFreeSpace(const std::string &mountPoint, uint64_t *pCapacity)
+{
+	try
+	{
+		boost::filesystem::space_info space = boost::filesystem::space(mountPoint.empty() ? "." : mountPoint);
+		if (pCapacity != NULL)
+		{
+			*pCapacity = space.capacity;
+		}
+		return space.available;
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: the disk fails
+		return 0;
+	}
+}
@@ -0,0 +1,351 @@
+
+#include <stdio.h>
+#include <boost/filesystem.hpp>
+#include "streaming_media_storage.hpp"
+
+StorageRecycler::StorageRecycler(RootIndexNode *_pIndexRoot, const RetentionConfig &_config)
+	: pIndexRoot(_pIndexRoot), isStopping(false), config(_config), totalUsage(0ull), isRecycling(false)
+{
+	pThread = new boost::thread(&StorageRecycler::Run, this);
+}
+
+StorageRecycler::~StorageRecycler()
+{
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		isStopping = true;
+	}
+	pThread->join();
+	delete pThread;
+}
+
+void StorageRecycler::SetConfig(const RetentionConfig &_config)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	config = _config;
+}
+
+void StorageRecycler::SetChannelQuota(int chId, uint64_t quota)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	channels[chId].quota = quota;
+	channels[chId].hasQuota = true;
+}
+
+// for recording
+void StorageRecycler::AddFile(int chId, const char *fileName)
+{
+	uint64_t size = 0;
+	try
+	{
+		size = boost::filesystem::file_size(fileName);
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: counted at the next time
+	}
+
+	boost::mutex::scoped_lock lock(mutex);
+	channels[chId].usage += size;
+	totalUsage += size;
+}
+
+// for compacting
+void StorageRecycler::ReduceUsage(int chId, uint64_t byteCount)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	ChannelUsage &channel = channels[chId];
+	channel.usage -= byteCount < channel.usage ? byteCount : channel.usage;
+	totalUsage -= byteCount < totalUsage ? byteCount : totalUsage;
+}
+
+void StorageRecycler::Run()
+{
+	time_t countTime = 0;
+
+	// the channels where nothing could be removed, e.g. a channel which
+	// stopped recording keeps its last clips, until the next sleep
+	std::set<int> skippedChannels;
+	while (!IsStopping())
+	{
+		time_t now = time(NULL);
+		if ((now - countTime >= RECOUNT_PERIOD) || (now < countTime))
+		{
+			CountUsage();
+			countTime = now;
+		}
+
+		time_t before;
+		int chId = SelectChannel(now, skippedChannels, before);
+		if (chId <= 0)
+		{
+			skippedChannels.clear();
+			SleepMilliseconds(CHECK_PERIOD);
+		}
+		else if (Recycle(chId, before) == 0)
+		{
+			// the next oldest channel at once
+			skippedChannels.insert(chId);
+		}
+	}
+}
+
+bool StorageRecycler::IsStopping()
+{
+	boost::mutex::scoped_lock lock(mutex);
+	return isStopping;
+}
+
+// count the clips of every channel on all the disks, chxx/yyyy/MMdd/hhmmss_hhmmss.mkv
+// and chxx/sub/yyyy/MMdd/hhmmss_hhmmss.mkv
+bool StorageRecycler::CountUsage()
+{
+	std::map<int, uint64_t> usages;
+	uint64_t total = 0;
+	std::vector<StoragePool::ChannelDirectory> directories;
+	storagePool.GetChannelDirectories(directories);
+
+	try
+	{
+		for (size_t i = 0; i < directories.size(); i++)
+		{
+			const std::string &dirName = directories[i].dirName;
+			uint64_t &usage = usages[directories[i].chId];
+			boost::filesystem::recursive_directory_iterator end;
+			for (boost::filesystem::recursive_directory_iterator it(dirName); it != end; ++it)
+			{
+				// chxx/sub is counted for the substream
+				std::string name = it->path().string();
+				if (boost::filesystem::is_regular_file(it->status())
+				    && (name.compare(dirName.size(), 5, "/sub/") != 0)
+				    && (name.size() > 4) && (name.compare(name.size() - 4, 4, ".mkv") == 0))
+				{
+					uint64_t size = boost::filesystem::file_size(it->path());
+					usage += size;
+					total += size;
+				}
+			}
+		}
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: keep the last usage
+		return false;
+	}
+
+	boost::mutex::scoped_lock lock(mutex);
+	for (std::map<int, ChannelUsage>::iterator it = channels.begin(); it != channels.end(); ++it)
+	{
+		it->second.usage = 0;
+	}
+	for (std::map<int, uint64_t>::iterator it = usages.begin(); it != usages.end(); ++it)
+	{
+		channels[it->first].usage = it->second;
+	}
+	totalUsage = total;
+	return true;
+}
+
+// % of the disks in use
+int StorageRecycler::GetDiskUsage()
+{
+	return storagePool.GetDiskUsage();
+}
+
+// choose the channel to recycle and the time its clips must end before
+int StorageRecycler::SelectChannel(time_t now, const std::set<int> &skippedChannels, time_t &before)
+{
+	RetentionConfig currentConfig;
+	std::map<int, ChannelUsage> currentChannels;
+	uint64_t currentTotalUsage;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		currentConfig = config;
+		currentChannels = channels;
+		currentTotalUsage = totalUsage;
+	}
+
+	// start at the high watermark and stop at the low one
+	int diskUsage = GetDiskUsage();
+	if ((currentConfig.highWatermark > 0) && (diskUsage >= currentConfig.highWatermark))
+	{
+		isRecycling = true;
+	}
+	else if ((currentConfig.highWatermark <= 0) || (diskUsage < currentConfig.lowWatermark))
+	{
+		isRecycling = false;
+	}
+
+	time_t maxRetentionTime = currentConfig.maxRetentionDays > 0 ? now - currentConfig.maxRetentionDays * SECONDS_PER_DAY : 0;
+	time_t minRetentionTime = currentConfig.minRetentionDays > 0 ? now - currentConfig.minRetentionDays * SECONDS_PER_DAY : now;
+
+	// the oldest clips go first, of all the channels or of those over their quotas
+	int    oldestChId = 0;
+	time_t oldestTime = 0;
+	int    overQuotaChId = 0;
+	time_t overQuotaTime = 0;
+	for (std::map<int, ChannelUsage>::iterator it = currentChannels.begin(); it != currentChannels.end(); ++it)
+	{
+		time_t time = skippedChannels.count(it->first) == 0 ? pIndexRoot->GetOldestTime(it->first) : 0;
+		if (time == 0)
+		{
+			continue;
+		}
+
+		if ((oldestChId == 0) || (time < oldestTime))
+		{
+			oldestChId = it->first;
+			oldestTime = time;
+		}
+
+		uint64_t quota = it->second.hasQuota ? it->second.quota : currentConfig.channelQuota;
+		if ((quota > 0) && (it->second.usage > quota) && ((overQuotaChId == 0) || (time < overQuotaTime)))
+		{
+			overQuotaChId = it->first;
+			overQuotaTime = time;
+		}
+	}
+
+	if (oldestChId == 0)
+	{
+		return 0;
+	}
+
+	if (oldestTime < maxRetentionTime)
+	{
+		// expired
+		before = maxRetentionTime;
+		return oldestChId;
+	}
+
+	if (isRecycling)
+	{
+		// the disk is almost full, the retention days can not be kept
+		before = now;
+		return oldestChId;
+	}
+
+	if ((overQuotaChId != 0) && (overQuotaTime < minRetentionTime))
+	{
+		// over the quota of the channel
+		before = minRetentionTime;
+		return overQuotaChId;
+	}
+
+	if ((currentConfig.globalQuota > 0) && (currentTotalUsage > currentConfig.globalQuota) && (oldestTime < minRetentionTime))
+	{
+		// over the quota of all the channels
+		before = minRetentionTime;
+		return oldestChId;
+	}
+
+	return 0;
+}
+
+// remove a batch of clips from the index, and then delete their files slowly
+size_t StorageRecycler::Recycle(int chId, time_t before)
+{
+	size_t batchSize;
+	int deletionRate;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		batchSize = config.batchSize > 0 ? config.batchSize : 1;
+		deletionRate = config.maxDeletionRate;
+	}
+
+	std::vector<RootIndexNode::Clip> clips;
+	size_t count = pIndexRoot->RemoveOldestFiles(chId, before, batchSize, clips);
+
+	std::string lastDirName;
+	for (size_t i = 0; i < clips.size(); i++)
+	{
+		const std::string &fileName = clips[i].fileName;
+		try
+		{
+			clips[i].fileSize = boost::filesystem::file_size(fileName);
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// error: the file is lost, nothing to count
+		}
+
+		if (storagePool.IsContainer(fileName))
+		{
+			// reused by its ring
+			storagePool.RemoveContainerClip(chId, clips[i].startTime);
+			continue;
+		}
+
+		try
+		{
+			boost::filesystem::remove(fileName);
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// error: the file is busy, it is no longer indexed anyway
+		}
+
+		try
+		{
+			// the key frames taken for the timelines, if any
+			boost::filesystem::remove(ThumbnailCache::GetCacheFileName(fileName));
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// error: left in the directory
+		}
+
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			uint64_t size = clips[i].fileSize;
+			ChannelUsage &channel = channels[chId];
+			channel.usage -= size < channel.usage ? size : channel.usage;
+			totalUsage -= size < totalUsage ? size : totalUsage;
+		}
+
+		// the clips are in time order, so a date is done once the next clip is in another one
+		std::string dirName = fileName.substr(0, fileName.rfind('/'));
+		if (!lastDirName.empty() && (dirName != lastDirName))
+		{
+			RemoveEmptyDirectory(lastDirName);
+		}
+		lastDirName = dirName;
+
+		if ((deletionRate > 0) && !IsStopping())
+		{
+			SleepMilliseconds(1000 / deletionRate);
+		}
+	}
+
+	// the dates left count the bytes they lost, in a short call of their own
+	pIndexRoot->RemoveUsage(chId, clips);
+
+	if (!lastDirName.empty())
+	{
+		RemoveEmptyDirectory(lastDirName);
+	}
+
+	return count;
+}
+
+// remove chxx/yyyy/MMdd if empty, and then chxx/yyyy
+void StorageRecycler::RemoveEmptyDirectory(const std::string &dirName)
+{
+	try
+	{
+		if (boost::filesystem::is_directory(dirName) && boost::filesystem::is_empty(dirName))
+		{
+			boost::filesystem::remove(dirName);
+
+			std::string yearDirName = dirName.substr(0, dirName.rfind('/'));
+			if (boost::filesystem::is_directory(yearDirName) && boost::filesystem::is_empty(yearDirName))
+			{
+				boost::filesystem::remove(yearDirName);
+			}
+		}
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: removed next time
+	}
+}
@@ -2,90 +2,270 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#if defined(WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
 #include <boost/thread/thread.hpp>
-#include <boost/thread/xtime.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <exporter.hpp>
+#include <ebml/HotTrace.h>
 #include "streaming_media_library.hpp"
+#include "streaming_media_storage.hpp"
 
 class RootNode;
 class ChannelNode;
 class YearNode;
-class DateNode;
-class FileNode;
 
-typedef FileNode StreamingMediaFileImpl;
-
-class RootIndexNode
+// The index file starts with a header since version 2. Version 1 files have
+// no header and store 4-byte words: times end in 2038 and seek bases at 2 GB.
+// Version 2 stores 8-byte words and aligns every node to a cache line; the
+// date node header takes a full line so that its entries never straddle one.
+struct IndexFileHeader
 {
-public:
-	virtual ~RootIndexNode() {}
-	virtual int GetCurrentDuration(int chId) = 0;
-	virtual bool SetDefaultDuration(int chId, int duration) = 0;
-	virtual bool InsertIndex(StreamingMediaFileImpl *pCurrentNode) = 0;
-	virtual StreamingMediaFileImpl * SearchForwardlyAndLoad(int chId, time_t time) = 0;
-	virtual StreamingMediaFileImpl * SearchBackwardlyAndLoad(int chId, time_t time) = 0;
-
-	static RootIndexNode * GetRootIndexNode(size_t channelCount);
+	enum
+	{
+		VERSION_1 = 1,
+		VERSION_2 = 2,
+		CURRENT_VERSION = VERSION_2,
+
+		FEATURE_CHANGE_LOG = 0x0001,
+		CURRENT_FEATURES   = FEATURE_CHANGE_LOG,
+
+		HEADER_SIZE = 64,
+		ALIGNMENT   = 64
+	};
+
+	char magic[8];   // "NVRINDEX"
+	int  version;
+	int  features;
+	int  wordSize;
+	int  alignment;
+	char reserved[HEADER_SIZE - 24];
+
+	void Initialize(int _version)
+	{
+		memset(this, 0, sizeof(*this));
+		memcpy(magic, MAGIC, sizeof(magic));
+		version   = _version;
+		features  = CURRENT_FEATURES;
+		wordSize  = sizeof(IndexWord);
+		alignment = ALIGNMENT;
+	}
+
+	static const char MAGIC[8];
 };
 
-static FILE *pIndexFile;
+const char IndexFileHeader::MAGIC[8] = { 'N', 'V', 'R', 'I', 'N', 'D', 'E', 'X' };
+
 static int TIMEZONE;
 
-static inline bool IndexFileRead(void *ptr, size_t size)
+// orders the accesses to the live clips shared with the other processes
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define LIVE_MEMORY_BARRIER() _ReadWriteBarrier()
+#else
+#define LIVE_MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+// The change log follows the channel table of the root node. Every node
+// written by the recorder is recorded there under a new generation, so that
+// a reader only reloads the nodes which changed since it has read them. The
+// log is mapped in memory and checking it costs no system call.
+class IndexChangeLog
 {
-	int value = 0;
-	do
+public:
+	enum
 	{
-		value = fread(ptr, 1, size, pIndexFile);
-		size -= value;
-	} while ((value > 0) && (size > 0));
+		MAGIC        = 0x474f4c43,  // "CLOG"
+		MOVED_MAGIC  = 0x44564f4d,  // "MOVD", the index file has been replaced
+		CAPACITY     = 64,
+		HEADER_WORDS = 4,  // magic, generation, capacity, reserved
+		ENTRY_WORDS  = 4,  // generation, seek base, size, reserved
+		MAX_LOG_SIZE = (HEADER_WORDS + CAPACITY * ENTRY_WORDS) * sizeof(IndexWord)
+	};
 
-	if (value <= 0)
+	IndexChangeLog(IndexFile *_pIndex);
+	virtual ~IndexChangeLog();
+
+	bool Create(IndexWord seek);
+	bool Load(IndexWord seek);
+	void Unload();
+	bool IsAvailable() { return seekBase > 0; }
+	size_t GetLogSize();
+
+	// for recording
+	int RecordChange(IndexWord nodeSeekBase, size_t nodeSize);
+	bool UpdateIndexFile();
+	bool MarkMoved(bool isMoved);
+
+	// for indexing
+	int GetGeneration();
+	bool IsChangedSince(IndexWord nodeSeekBase, size_t nodeSize, int generation);
+	bool IsMoved();
+
+protected:
+	bool MapIndexFile();
+	void UnmapIndexFile();
+	const char * GetLog();
+
+	IndexFile *pIndex;
+	IndexWord seekBase;
+	char *pBuffer;
+	bool isDirty;
+
+	boost::interprocess::file_mapping  *pMapping;
+	boost::interprocess::mapped_region *pRegion;
+	const char                         *pMappedLog;
+};
+
+// An index file opened by a root node, with its format and its change log.
+// The nodes loaded from the file keep a pointer to it, so that the nodes of
+// different files share nothing.
+class IndexFile
+{
+public:
+	IndexFile(const char *_fileName);
+	virtual ~IndexFile();
+
+	bool Open(const char *mode);
+	void SetFormat(int _version);
+
+	IndexWord GetWord(const char *ptr, size_t index) const
 	{
-		// error: bad file
-		fclose(pIndexFile);
-		pIndexFile = NULL;
-		return false;
+		return wordSize == sizeof(IndexWord) ? *((const IndexWord *)ptr + index) : *((const int *)ptr + index);
 	}
 
-	return true;
-}
+	void SetWord(char *ptr, size_t index, IndexWord value) const
+	{
+		if (wordSize == sizeof(IndexWord))
+		{
+			*((IndexWord *)ptr + index) = value;
+		}
+		else
+		{
+			*((int *)ptr + index) = (int)value;
+		}
+	}
+
+	IndexWord Align(IndexWord offset) const
+	{
+		return (offset + alignment - 1) / alignment * alignment;
+	}
+
+	int       Seek(IndexWord offset, int origin = SEEK_SET);
+	IndexWord Tell();
+	int       SeekToEnd();
+	bool      Read(void *ptr, size_t size);
+	bool      Write(void *ptr, size_t size);
+	bool      ReadWord(IndexWord &word);
+
+	std::string fileName;
+	FILE       *pFile;
 
-static inline bool IndexFileWrite(void *ptr, size_t size)
+	// format of the opened file
+	int    version;
+	size_t wordSize;
+	size_t alignment;
+
+	unsigned int   writeCount;  // checked by the migrator
+	IndexChangeLog changeLog;
+};
+
+// Converts a version 1 index file into the current format in a background
+// thread while the recorder and the readers keep using the old file. The
+// result is taken by RootNode::CheckMigration() only if the old file was not
+// written in the meantime.
+class IndexMigrator
 {
-	int value = 0;
-	do
+public:
+	IndexMigrator(const std::string &_oldFileName, unsigned int _writeCount);
+	virtual ~IndexMigrator();
+
+	bool IsFinished();
+	bool IsSucceeded();
+	unsigned int GetWriteCount() { return writeCount; }
+
+	static std::string GetNewFileName(const std::string &oldFileName) { return oldFileName + ".new"; }
+
+protected:
+	enum NodeType
 	{
-		value = fwrite(ptr, 1, size, pIndexFile);
-		size -= value;
-	} while ((value > 0) && (size > 0));
+		NODE_TYPE_ROOT,
+		NODE_TYPE_CHANNEL,
+		NODE_TYPE_YEAR,
+		NODE_TYPE_DATE
+	};
 
-	if (value <= 0)
+	struct NodeMapping
 	{
-		// error: bad file
-		fclose(pIndexFile);
-		pIndexFile = NULL;
-		return false;
-	}
+		NodeType  type;
+		IndexWord oldSeekBase;
+		IndexWord oldSize;
+		IndexWord newSeekBase;
+		IndexWord newSize;
+	};
 
-	return true;
-}
+	void Run();
+	bool ReadOldNode(IndexWord seek, size_t headerWords, size_t tableCapacity, size_t entryWords, std::vector<int> &words);
+	bool AddNode(NodeType type, IndexWord oldSeekBase, const std::vector<int> &words);
+	bool Plan();
+	bool WriteNewFile();
+	IndexWord Translate(IndexWord oldSeekBase);
+
+	boost::thread *pThread;
+	boost::mutex   mutex;
+	bool           isFinished;
+	bool           isSucceeded;
+	unsigned int   writeCount;
+
+	std::string oldFileName;
+	std::string newFileName;
+	FILE       *pOldFile;
+	FILE       *pNewFile;
+	IndexWord newFileSize;
+	std::map<IndexWord, NodeMapping> nodes;
+};
 
 class RootNode : public RootIndexNode
 {
 public:
-	RootNode(size_t channelCount);
+	RootNode(size_t channelCount, const char *fileName = ".index");
 	virtual ~RootNode();
 
+	bool Load(size_t channelCount);
+	bool Reload();
+	bool IsReplaced();
+	void CheckMigration();
+	void StartMigration();
 	bool UpdateIndexFile();
-	bool SetBufferContent(int chId, int value);
+	bool SetBufferContent(int chId, IndexWord value);
 	ChannelNode * GetChannelNode(int chId, bool isCreate = true);
 
 	virtual int GetCurrentDuration(int chId);
 	virtual bool SetDefaultDuration(int chId, int duration);
 	virtual bool InsertIndex(FileNode *pCurrentNode);
+	virtual size_t InsertIndexes(std::vector<FileNode *> &nodes);
 	virtual FileNode * SearchForwardlyAndLoad(int chId, time_t time);
 	virtual FileNode * SearchBackwardlyAndLoad(int chId, time_t time);
+	virtual time_t GetOldestTime(int chId);
+	virtual bool GetNextClip(int chId, time_t time, Clip &clip, bool isAcross = false);
+	virtual size_t RemoveOldestFiles(int chId, time_t before, size_t maxCount, std::vector<Clip> &clips);
+	virtual void RemoveUsage(int chId, const std::vector<Clip> &clips);
+	virtual bool ReplaceFile(int chId, time_t startTime, const char *newFileName, uint64_t savedBytes);
+	virtual bool GetDayUsage(int chId, time_t time, StreamingMediaLibrary::DayUsage &usage);
+	virtual bool GetYearUsage(int chId, int year, StreamingMediaLibrary::YearUsage &usage);
+	virtual uint64_t GetChannelUsage(int chId);
+	virtual bool IsIntact(int chId) { return isIntact; }
 
 protected:
 	enum
@@ -93,28 +273,79 @@ protected:
 		DEFAULT_CHANNEL_TABLE_CAPACITY = 255
 	};
 
+	bool LinkFileNode(FileNode *pCurrentNode, bool isFlushing);
+
 	size_t channelTableCapacity;
 	ChannelNode **pChannelTable;
 
-	int seekBase;
+	IndexFile *pIndex;
+	IndexWord seekBase;
 	size_t headerSize;
 	size_t bufferSize;
 	char *pBuffer;
 	bool isDirty;
+	bool isIntact;
+
+	IndexMigrator *pMigrator;
+	bool isMigrationFailed;
+
+	boost::mutex mutex;  // for the recorder, the readers and the recycler
+};
+
+// A directory over per-channel index files chNN/.index, and chNN/sub/.index
+// for the substreams. Every shard is the root node of its own file, so that
+// the channels share no file, no node and no change log, and a broken shard
+// loses only its own channel. A library with a single index file keeps the
+// main channels there.
+class ShardedRootNode : public RootIndexNode
+{
+public:
+	ShardedRootNode(size_t channelCount, RootNode *pMainRoot = NULL);
+	virtual ~ShardedRootNode();
+
+	virtual int GetCurrentDuration(int chId);
+	virtual bool SetDefaultDuration(int chId, int duration);
+	virtual bool InsertIndex(FileNode *pCurrentNode);
+	virtual size_t InsertIndexes(std::vector<FileNode *> &nodes);
+	virtual FileNode * SearchForwardlyAndLoad(int chId, time_t time);
+	virtual FileNode * SearchBackwardlyAndLoad(int chId, time_t time);
+	virtual time_t GetOldestTime(int chId);
+	virtual bool GetNextClip(int chId, time_t time, Clip &clip, bool isAcross = false);
+	virtual size_t RemoveOldestFiles(int chId, time_t before, size_t maxCount, std::vector<Clip> &clips);
+	virtual void RemoveUsage(int chId, const std::vector<Clip> &clips);
+	virtual bool ReplaceFile(int chId, time_t startTime, const char *newFileName, uint64_t savedBytes);
+	virtual bool GetDayUsage(int chId, time_t time, StreamingMediaLibrary::DayUsage &usage);
+	virtual bool GetYearUsage(int chId, int year, StreamingMediaLibrary::YearUsage &usage);
+	virtual uint64_t GetChannelUsage(int chId);
+	virtual bool IsIntact(int chId);
+
+protected:
+	enum
+	{
+		DEFAULT_SHARD_TABLE_CAPACITY = StreamingMediaLibrary::SUBSTREAM_CHANNEL_BASE + StreamingMediaLibrary::MAX_CHANNEL_ID
+	};
+
+	RootNode * GetShard(int chId);
+
+	size_t        shardTableCapacity;
+	RootNode    **pShardTable;
+	RootNode     *pMainRoot;  // the single index file, if any
+	boost::mutex  mutex;  // for opening the shards only
 };
 
 class ChannelNode
 {
 public:
-	ChannelNode(int _chId, int seek = -1);
+	ChannelNode(IndexFile *_pIndex, int _chId, IndexWord seek = -1);
 	virtual ~ChannelNode();
 
 	int chId;
 	int GetCurrentDuration();
 	void SetDefaultDuration(int duration) { defaultDuration = duration; }
 	bool UpdateIndexFile();
-	bool SetBufferContent(int year, int value);
+	bool SetBufferContent(int year, IndexWord value);
 	bool ForceReloadBuffer();
+	bool Revalidate();
 
 	YearNode * GetYearNode(time_t time, bool isCreate = false);
 	YearNode * GetYearNodeForwardly(time_t time);
@@ -125,6 +356,11 @@ public:
 	FileNode * GetFirstFileNode() { return pFirstFileNode; }
 	FileNode * GetLastFileNode()  { return pLastFileNode;  }
 
+	bool IsEmpty() { return pIndex->GetWord(pBuffer, 2) < 0; }
+	void UnloadYearNode(YearNode *pYearNode);
+	bool RemoveYearNode(YearNode *pYearNode);
+	uint64_t GetByteCount();
+
 //protected:
 	enum
 	{
@@ -142,26 +378,29 @@ public:
 	FileNode  *pFirstFileNode;
 	FileNode  *pLastFileNode;
 
-	int seekBase;
+	IndexFile *pIndex;
+	IndexWord seekBase;
 	size_t headerSize;
 	size_t bufferSize;
 	char *pBuffer;
 	bool isDirty;
+	int generation;
 	int defaultDuration;
 };
 
 class YearNode
 {
 public:
-	YearNode(int year, int seek = -1);
+	YearNode(IndexFile *_pIndex, int year, IndexWord seek = -1);
 	virtual ~YearNode();
 
 	time_t startTime;
 	time_t endTime;
 
 	bool UpdateIndexFile();
-	bool SetBufferContent(time_t time, int value);
+	bool SetBufferContent(time_t time, IndexWord value);
 	bool ForceReloadBuffer();
+	bool Revalidate();
 
 	DateNode * GetDateNode(time_t time, bool isCreate = false);
 	DateNode * GetDateNodeForwardly(time_t time);
@@ -170,6 +409,14 @@ public:
 	DateNode * GetLastDateNode()  { return pLastDateNode;  }
 	ChannelNode * GetParentNode() { return pParent;        }
 
+	bool IsEmpty() { return pIndex->GetWord(pBuffer, 1) < 0; }
+	void UnloadDateNode(DateNode *pDateNode);
+	bool RemoveDateNode(DateNode *pDateNode);
+
+	int       GetDateIndex(time_t time);
+	IndexWord GetDateSeekBase(int index) { return ((index >= 0) && ((size_t)index < dateTableCapacity)) ? pIndex->GetWord(pBuffer + headerSize, index) : 0; }
+	uint64_t  GetByteCount();
+
 //protected:
 	size_t dateTableCapacity;
 
@@ -180,17 +427,24 @@ public:
 
 	ChannelNode *pParent;
 
-	int seekBase;
+	IndexFile *pIndex;
+	IndexWord seekBase;
 	size_t headerSize;
 	size_t bufferSize;
 	char *pBuffer;
 	bool isDirty;
+	int generation;
+
+	// The bytes of the dates, cached with their seek bases as of the
+	// generation, so that only the dates changed since are read again.
+	IndexWord *pUsageTable;
+	int usageGeneration;
 };
 
 class DateNode
 {
 public:
-	DateNode(time_t time, int duration, int seek = -1);
+	DateNode(IndexFile *_pIndex, time_t time, int duration, IndexWord seek = -1);
 	virtual ~DateNode();
 
 	time_t startTime;
@@ -199,15 +453,39 @@ public:
 	bool UpdateIndexFile();
 	bool SetBufferContent(time_t time, FileNode *currentNode);
 	bool ForceReloadBuffer();
+	bool Revalidate();
 
 	int        GetFileDuration()  { return fileDuration;   }  // sec
 	FileNode * GetFileNodeForwardly(time_t time);
 	FileNode * GetFileNodeBackwardly(time_t time);
+	FileNode * LoadFileNode(IndexWord fileSeekBase);
+	bool       IsInBuffer(IndexWord fileSeekBase) { return (fileSeekBase - seekBase >= (IndexWord)headerSize) && (fileSeekBase - seekBase + 4 * pIndex->wordSize <= bufferSize); }
 	FileNode * GetFirstFileNode() { return pFirstFileNode; }
 	FileNode * GetLastFileNode()  { return pLastFileNode;  }
 
 	YearNode * GetParentNode()    { return pParent;        }
 
+	bool   IsEmpty() { return pIndex->GetWord(pBuffer, 2) == 0; }
+	time_t GetFirstStartTime();
+	size_t RemoveOldestFiles(int chId, time_t before, size_t maxCount, IndexWord keptSeekBase, std::vector<RootIndexNode::Clip> &clips);
+	void   UnlinkFirstFile();
+
+	int  GetDiskId(size_t index);
+	void SetDiskId(size_t index, int diskId);
+	bool LoadDiskTable();
+	bool UpdateDiskTable();
+
+	uint64_t GetByteCount() { return HasUsage() && (pIndex->GetWord(pBuffer, 5) > 0) ? pIndex->GetWord(pBuffer, 5) : 0; }
+	const unsigned char * GetMinuteTable() { return minuteTable; }
+	void AddUsage(FileNode *pFileNode);
+	void RemoveUsage(uint64_t byteCount);
+	void SetMinutes(time_t start, time_t end);
+	void RebuildMinuteTable();
+	bool LoadMinuteTable();
+	bool UpdateMinuteTable();
+	bool HasUsage() { return headerSize >= 7 * pIndex->wordSize; }
+	static bool ReadUsage(IndexFile *pIndex, IndexWord dateSeekBase, uint64_t &byteCount, unsigned char *pMinutes);
+
 //protected:
 	int        fileDuration;  // sec
 	size_t     fileTableCapacity;
@@ -220,192 +498,642 @@ public:
 
 	YearNode *pParent;
 
-	int seekBase;
+	IndexFile *pIndex;
+	IndexWord seekBase;
 	size_t headerSize;
 	size_t bufferSize;
 	char *pBuffer;
 	bool isDirty;
+	int generation;
+
+	// The disks of the clips, a byte per entry, are kept in another node
+	// linked from the fifth word of the header. A date without it has all its
+	// clips on the first disk, as every date of a version 1 file.
+	unsigned char *pDiskTable;
+	size_t diskTableSize;
+	bool isDiskTableDirty;
+
+	// The bytes of the clips are counted in the sixth word of the header, and
+	// the minutes they cover are kept in a bitmap linked from the seventh one.
+	// A date without the bitmap, indexed before or in a version 1 file, has
+	// it found from its entries when loaded; version 1 counts no bytes.
+	enum
+	{
+		MINUTE_TABLE_SIZE = StreamingMediaLibrary::DayUsage::MINUTE_COUNT / 8
+	};
+
+	unsigned char minuteTable[MINUTE_TABLE_SIZE];
+	bool isMinuteTableDirty;
 };
 
-class FileNode : public StreamingMediaFile
+// The clip being recorded on a channel, published in chNN/.live for the live
+// readers of every process: its file, the end of its last cluster written and
+// the position and the timecode of its clusters, so that they demux it up to
+// there without walking the file. The recorder keeps the file mapped and sets
+// the generation odd while it changes the clip and even again after; a reader
+// copies the clip between two reads of the same even generation.
+class LiveClipFile
 {
 public:
-	enum FileType
-	{
-		FILE_TYPE_NULL,
-		FILE_TYPE_UNLOADED,
-		FILE_TYPE_TEMPORARY,
-		FILE_TYPE_NORMAL,
-	};
-
-	// config
 	enum
 	{
-		DEFAULT_CHANNEL_COUNT = 16,
-		DEFAULT_MEDIA_DURATION = 10,//600,  // sec
+		MAGIC         = 0x4556494c,  // "LIVE"
+		HEADER_WORDS  = 8,  // magic, generation, start time, end time, end position, cluster count, reserved
+		CAPACITY      = 8192,  // clusters, the later ones are demuxed but not sought
+		FILE_SIZE     = HEADER_WORDS * sizeof(IndexWord) + FileNode::BUFFER_SIZE + CAPACITY * 2 * sizeof(IndexWord),
+		RETRY_COUNT   = 1000,
+		REOPEN_PERIOD = 1,  // sec
 	};
 
+	LiveClipFile(int chId);
+	virtual ~LiveClipFile();
+
+	// for recording
+	bool Publish(const char *clipFileName, uint64_t startTime, uint64_t endTime, uint64_t endPosition, uint64_t clusterPosition, uint64_t clusterTime);
+	bool Withdraw();
+
+	// for live reading
+	bool Read(std::string &clipFileName, uint64_t &startTime, uint64_t &endTime, StreamingMediaLiveClusters *pClusters);
+
+protected:
 	enum
 	{
-		BUFFER_SIZE = 128,
+		WORD_MAGIC = 0,
+		WORD_GENERATION,
+		WORD_START_TIME,
+		WORD_END_TIME,
+		WORD_END_POSITION,
+		WORD_CLUSTER_COUNT
 	};
 
-	FileNode(FileType _type = FILE_TYPE_NULL, int seek = -1);
-	virtual ~FileNode();
+	bool Map(bool isWriter);
+	void Unmap();
+	void BeginChange();
+	void EndChange();
+
+	boost::mutex mutex;
+	std::string fileName;
+	bool isWritable;  // by the only recorder of the channel
+	time_t openTime;
+
+	boost::interprocess::file_mapping  *pMapping;
+	boost::interprocess::mapped_region *pRegion;
+	IndexWord *pWords;
+	char      *pClipFileName;
+	IndexWord *pClusters;  // position and timecode of every cluster
+};
 
-	const char * GetFileName() const;
-	bool RebuildFileName();
-	bool RenameFrom(const char *old);
-	FileNode * GetNext() { return pNext; }
-	FileNode * GetPrev() { return pPrev; }
-	FileNode * LoadNext() { return LoadNextFromFileDirectly(); }
-	FileNode * LoadPrev() { return LoadPreviousFromFileDirectly(); }
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+IndexFile::IndexFile(const char *_fileName)
+	: fileName(_fileName), pFile(NULL), writeCount(0), changeLog(this)
+{
+	SetFormat(IndexFileHeader::CURRENT_VERSION);
+}
 
-	FileNode * LoadNextFromFileDirectly();
-	FileNode * LoadPreviousFromFileDirectly();
+IndexFile::~IndexFile()
+{
+	changeLog.Unload();
+	if (pFile != NULL)
+	{
+		fclose(pFile);
+	}
+}
 
-	// private members
-	int serial;
-	int diskId;
-	char *fullPath;
-	const char *fileName;
+bool IndexFile::Open(const char *mode)
+{
+	pFile = fopen(fileName.c_str(), mode);
+	return pFile != NULL;
+}
 
-	// file node members
-	char fileNameBuffer[BUFFER_SIZE];
+void IndexFile::SetFormat(int _version)
+{
+	version   = _version;
+	wordSize  = version >= IndexFileHeader::VERSION_2 ? sizeof(IndexWord) : 4;
+	alignment = version >= IndexFileHeader::VERSION_2 ? IndexFileHeader::ALIGNMENT : 1;
+}
 
-	FileType type;
+int IndexFile::Seek(IndexWord offset, int origin)
+{
+	return IndexFileSeek(pFile, offset, origin);
+}
 
-	// index tree
-	DateNode *pParent;
-	FileNode *pPrev;
-	FileNode *pNext;
+IndexWord IndexFile::Tell()
+{
+	return IndexFileTell(pFile);
+}
 
-	int seekBase;
-	bool isDirty;
+// seek to the end of the file, aligned for a new node
+int IndexFile::SeekToEnd()
+{
+	if (Seek(0, SEEK_END) != 0)
+	{
+		return -1;
+	}
 
-	// static const
-	static FileNode * const pUnloadedNode;
-	static FileNode * const pUnkonwnNode;
-};
+	return Seek(Align(Tell()));
+}
 
-//---------------------------------------------------------------------------
-//---------------------------------------------------------------------------
-RootIndexNode * RootIndexNode::GetRootIndexNode(size_t channelCount)
+bool IndexFile::Read(void *ptr, size_t size)
 {
-	return new RootNode(channelCount);
+	int value = 0;
+	do
+	{
+		value = fread(ptr, 1, size, pFile);
+		size -= value;
+	} while ((value > 0) && (size > 0));
+
+	if (value <= 0)
+	{
+		// error: bad file
+		fclose(pFile);
+		pFile = NULL;
+		return false;
+	}
+
+	return true;
 }
 
-// for recording
-inline int RootNode::GetCurrentDuration(int chId)
+bool IndexFile::Write(void *ptr, size_t size)
 {
-	int result = 0;
+	writeCount++;
 
-	ChannelNode *channelNode = GetChannelNode(chId);
-	if (channelNode != NULL)
+	int value = 0;
+	do
 	{
-		result = channelNode->GetCurrentDuration();
+		value = fwrite(ptr, 1, size, pFile);
+		size -= value;
+	} while ((value > 0) && (size > 0));
+
+	if (value <= 0)
+	{
+		// error: bad file
+		fclose(pFile);
+		pFile = NULL;
+		return false;
 	}
 
-	if (result == 0)
+	return true;
+}
+
+bool IndexFile::ReadWord(IndexWord &word)
+{
+	char buffer[sizeof(IndexWord)];
+	if (fread(buffer, 1, wordSize, pFile) != wordSize)
 	{
-		result = FileNode::DEFAULT_MEDIA_DURATION;
+		return false;
 	}
 
-	return result;
+	word = GetWord(buffer, 0);
+	return true;
+}
+
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+IndexChangeLog::IndexChangeLog(IndexFile *_pIndex)
+	: pIndex(_pIndex), seekBase(-1), isDirty(false), pMapping(NULL), pRegion(NULL), pMappedLog(NULL)
+{
+	pBuffer = new char[MAX_LOG_SIZE];
+	memset(pBuffer, 0, MAX_LOG_SIZE);
+}
+
+IndexChangeLog::~IndexChangeLog()
+{
+	UnmapIndexFile();
+	delete[] pBuffer;
+}
+
+size_t IndexChangeLog::GetLogSize()
+{
+	return (HEADER_WORDS + CAPACITY * ENTRY_WORDS) * pIndex->wordSize;
 }
 
 // for recording
-inline bool RootNode::SetDefaultDuration(int chId, int duration)
+bool IndexChangeLog::Create(IndexWord seek)
 {
-	ChannelNode *channelNode = GetChannelNode(chId);
-	if (channelNode == NULL)
+	memset(pBuffer, 0, MAX_LOG_SIZE);
+	pIndex->SetWord(pBuffer, 0, MAGIC);
+	pIndex->SetWord(pBuffer, 2, CAPACITY);
+
+	seekBase = seek;
+	isDirty = true;
+	if (!UpdateIndexFile())
 	{
+		// error:
+		seekBase = -1;
 		return false;
 	}
 
-	channelNode->SetDefaultDuration(duration);
+	MapIndexFile();
 	return true;
 }
 
-// for indexing
-FileNode * RootNode::SearchForwardlyAndLoad(int chId, time_t time)
+bool IndexChangeLog::Load(IndexWord seek)
 {
-	// force to reload file
-	if (pIndexFile != NULL)
+	Unload();
+
+	if ((pIndex->pFile == NULL) || (seek <= 0)
+	    || (pIndex->Seek(seek) != 0)
+	    || (fread(pBuffer, 1, GetLogSize(), pIndex->pFile) != GetLogSize())
+	    || ((pIndex->GetWord(pBuffer, 0) != MAGIC) && (pIndex->GetWord(pBuffer, 0) != MOVED_MAGIC))
+	    || (pIndex->GetWord(pBuffer, 2) != CAPACITY))
 	{
-		fclose(pIndexFile);
+		// an index file written before the change log, every lookup reloads its nodes
+		memset(pBuffer, 0, MAX_LOG_SIZE);
+		return false;
 	}
-	pIndexFile = fopen(".index", "rb+");
 
-	ChannelNode *pChannelNode = GetChannelNode(chId);
-	YearNode *pYearNode;
-	DateNode *pDateNode;
-	FileNode *pFileNode;
+	seekBase = seek;
+	MapIndexFile();
+	return true;
+}
 
-	if (((pYearNode = pChannelNode->GetYearNodeForwardly(time)) != NULL)
-	    && ((pDateNode = pYearNode->GetDateNodeForwardly(time)) != NULL)
-	    && ((pFileNode = pDateNode->GetFileNodeForwardly(time)) != NULL))
+void IndexChangeLog::Unload()
+{
+	UnmapIndexFile();
+	memset(pBuffer, 0, MAX_LOG_SIZE);
+	seekBase = -1;
+	isDirty = false;
+}
+
+bool IndexChangeLog::MapIndexFile()
+{
+	UnmapIndexFile();
+
+	try
 	{
-		return pFileNode;
+		pMapping = new boost::interprocess::file_mapping(pIndex->fileName.c_str(), boost::interprocess::read_only);
+		pRegion = new boost::interprocess::mapped_region(*pMapping, boost::interprocess::read_only, 0, seekBase + GetLogSize());
+		pMappedLog = (const char *)pRegion->get_address() + seekBase;
+	}
+	catch (boost::interprocess::interprocess_exception &)
+	{
+		// error: read the log from the file instead
+		UnmapIndexFile();
+		return false;
 	}
 
-	return NULL;
+	return true;
 }
 
-// for indexing
-FileNode * RootNode::SearchBackwardlyAndLoad(int chId, time_t time)
+void IndexChangeLog::UnmapIndexFile()
+{
+	pMappedLog = NULL;
+	if (pRegion != NULL)
+	{
+		delete pRegion;
+		pRegion = NULL;
+	}
+	if (pMapping != NULL)
+	{
+		delete pMapping;
+		pMapping = NULL;
+	}
+}
+
+const char * IndexChangeLog::GetLog()
 {
-	// force to reload file
-	if (pIndexFile != NULL)
+	if (isDirty || (seekBase <= 0))
 	{
-		fclose(pIndexFile);
+		// changes recorded by this process are not written yet
+		return pBuffer;
 	}
-	pIndexFile = fopen(".index", "rb+");
 
-	ChannelNode *pChannelNode = GetChannelNode(chId);
-	YearNode *pYearNode;
-	DateNode *pDateNode;
-	FileNode *pFileNode;
+	if (pMappedLog != NULL)
+	{
+		return pMappedLog;
+	}
 
-	if (((pYearNode = pChannelNode->GetYearNodeBackwardly(time)) != NULL)
-	    && ((pDateNode = pYearNode->GetDateNodeBackwardly(time)) != NULL)
-	    && ((pFileNode = pDateNode->GetFileNodeBackwardly(time)) != NULL))
+	if ((pIndex->pFile == NULL)
+	    || (pIndex->Seek(seekBase) != 0)
+	    || (pIndex->Read(pBuffer, GetLogSize()) == false))
 	{
-		return pFileNode;
+		// error: assume nothing changed
 	}
 
-	return NULL;
+	return pBuffer;
 }
 
 // for recording
-bool RootNode::InsertIndex(FileNode *pCurrentNode)
+int IndexChangeLog::RecordChange(IndexWord nodeSeekBase, size_t nodeSize)
 {
-	ChannelNode *pChannelNode = GetChannelNode(pCurrentNode->chId);
-	if (pChannelNode == NULL)
+	if (seekBase <= 0)
 	{
-		return false;
+		return 0;
 	}
 
-	FileNode *pLastNode = pChannelNode->pLastFileNode;
-	if (pLastNode == NULL)
-	{
-		// This is the first node of the current channel
-		pCurrentNode->pPrev = NULL;
-		pCurrentNode->pNext = NULL;
-		pChannelNode->pLastFileNode = pCurrentNode;
+	int generation = (int)pIndex->GetWord(pBuffer, 1) + 1;
 
-		YearNode *pYearNode = pChannelNode->GetYearNode(pCurrentNode->startTime, true);
-		if (pYearNode != NULL)
-		{
-			pYearNode->pParent = pChannelNode;
+	char *pEntry = pBuffer + (HEADER_WORDS + ((unsigned int)generation % CAPACITY) * ENTRY_WORDS) * pIndex->wordSize;
+	pIndex->SetWord(pEntry, 0, generation);
+	pIndex->SetWord(pEntry, 1, nodeSeekBase);
+	pIndex->SetWord(pEntry, 2, nodeSize);
 
-			DateNode *pDateNode = pYearNode->GetDateNode(pCurrentNode->startTime, true);
-			if (pDateNode != NULL)
+	pIndex->SetWord(pBuffer, 1, generation);
+	isDirty = true;
+	return generation;
+}
+
+// for recording
+bool IndexChangeLog::UpdateIndexFile()
+{
+	if (!isDirty || (seekBase <= 0) || (pIndex->pFile == NULL))
+	{
+		// there is nothing to do
+		return true;
+	}
+	isDirty = false;
+
+	// write the entries before the generation which publishes them
+	size_t headerSize = HEADER_WORDS * pIndex->wordSize;
+	if ((pIndex->Seek(seekBase + headerSize) != 0)
+	    || (pIndex->Write(pBuffer + headerSize, GetLogSize() - headerSize) == false)
+	    || (pIndex->Seek(seekBase) != 0)
+	    || (pIndex->Write(pBuffer, headerSize) == false))
+	{
+		// error:
+		if (pIndex->pFile != NULL)
+		{
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+		}
+		return false;
+	}
+
+	fflush(pIndex->pFile);
+	return true;
+}
+
+// for recording
+bool IndexChangeLog::MarkMoved(bool isMoved)
+{
+	if (seekBase <= 0)
+	{
+		return true;
+	}
+
+	pIndex->SetWord(pBuffer, 0, isMoved ? MOVED_MAGIC : MAGIC);
+	isDirty = true;
+	return UpdateIndexFile();
+}
+
+// for indexing
+int IndexChangeLog::GetGeneration()
+{
+	return (int)pIndex->GetWord(GetLog(), 1);
+}
+
+// for indexing
+bool IndexChangeLog::IsChangedSince(IndexWord nodeSeekBase, size_t nodeSize, int generation)
+{
+	if (seekBase <= 0)
+	{
+		// no change log, always reload
+		return true;
+	}
+
+	const char *pLog = GetLog();
+	unsigned int currentGeneration = (unsigned int)pIndex->GetWord(pLog, 1);
+	unsigned int changeCount = currentGeneration - (unsigned int)generation;
+
+	if (changeCount == 0)
+	{
+		return false;
+	}
+	if (changeCount >= CAPACITY)
+	{
+		// the changes are not in the log any more
+		return true;
+	}
+
+	for (unsigned int g = generation + 1; g != currentGeneration + 1; g++)
+	{
+		const char *pEntry = pLog + (HEADER_WORDS + (g % CAPACITY) * ENTRY_WORDS) * pIndex->wordSize;
+		if ((unsigned int)pIndex->GetWord(pEntry, 0) != g)
+		{
+			// the entry is being overwritten
+			return true;
+		}
+		if ((pIndex->GetWord(pEntry, 1) < nodeSeekBase + (IndexWord)nodeSize)
+		    && (nodeSeekBase < pIndex->GetWord(pEntry, 1) + pIndex->GetWord(pEntry, 2)))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// for indexing
+bool IndexChangeLog::IsMoved()
+{
+	return (seekBase > 0) && (pIndex->GetWord(GetLog(), 0) == MOVED_MAGIC);
+}
+
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+RootIndexNode * RootIndexNode::GetRootIndexNode(size_t channelCount)
+{
+	// a library with a single index file keeps it for the main channels, a
+	// new one is sharded; the substreams are sharded anyway
+	FILE *pFile = fopen(".index", "rb");
+	if (pFile != NULL)
+	{
+		fclose(pFile);
+		return new ShardedRootNode(channelCount, new RootNode(channelCount));
+	}
+
+	return new ShardedRootNode(channelCount);
+}
+
+// for recording
+inline int RootNode::GetCurrentDuration(int chId)
+{
+	int result = 0;
+
+	ChannelNode *channelNode = GetChannelNode(chId);
+	if (channelNode != NULL)
+	{
+		result = channelNode->GetCurrentDuration();
+	}
+
+	if (result == 0)
+	{
+		result = FileNode::DEFAULT_MEDIA_DURATION;
+	}
+
+	return result;
+}
+
+// for recording
+inline bool RootNode::SetDefaultDuration(int chId, int duration)
+{
+	ChannelNode *channelNode = GetChannelNode(chId);
+	if (channelNode == NULL)
+	{
+		return false;
+	}
+
+	channelNode->SetDefaultDuration(duration);
+	return true;
+}
+
+// for indexing
+FileNode * RootNode::SearchForwardlyAndLoad(int chId, time_t time)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	// the nodes reload what changed by themselves, reopen only a failed or replaced file
+	if (IsReplaced())
+	{
+		Reload();
+	}
+	else if (pIndex->pFile == NULL)
+	{
+		pIndex->Open("rb+");
+	}
+
+	ChannelNode *pChannelNode = GetChannelNode(chId);
+	YearNode *pYearNode;
+	DateNode *pDateNode;
+	FileNode *pFileNode;
+
+	if (((pYearNode = pChannelNode->GetYearNodeForwardly(time)) != NULL)
+	    && ((pDateNode = pYearNode->GetDateNodeForwardly(time)) != NULL)
+	    && ((pFileNode = pDateNode->GetFileNodeForwardly(time)) != NULL))
+	{
+		return pFileNode;
+	}
+
+	return NULL;
+}
+
+// for indexing
+FileNode * RootNode::SearchBackwardlyAndLoad(int chId, time_t time)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	// the nodes reload what changed by themselves, reopen only a failed or replaced file
+	if (IsReplaced())
+	{
+		Reload();
+	}
+	else if (pIndex->pFile == NULL)
+	{
+		pIndex->Open("rb+");
+	}
+
+	ChannelNode *pChannelNode = GetChannelNode(chId);
+	YearNode *pYearNode;
+	DateNode *pDateNode;
+	FileNode *pFileNode;
+
+	if (((pYearNode = pChannelNode->GetYearNodeBackwardly(time)) != NULL)
+	    && ((pDateNode = pYearNode->GetDateNodeBackwardly(time)) != NULL)
+	    && ((pFileNode = pDateNode->GetFileNodeBackwardly(time)) != NULL))
+	{
+		return pFileNode;
+	}
+
+	return NULL;
+}
+
+// for recording
+bool RootNode::InsertIndex(FileNode *pCurrentNode)
+{
+	HOT_TRACE_SCOPE("idx.insert_index");  // with the wait for the lock
+	boost::mutex::scoped_lock lock(mutex);
+
+	CheckMigration();
+
+	if (!LinkFileNode(pCurrentNode, true))
+	{
+		return false;
+	}
+
+	pIndex->changeLog.UpdateIndexFile();
+	StartMigration();
+	return true;
+}
+
+// for recovering, the nodes of a channel in time order, all newer than its last one
+size_t RootNode::InsertIndexes(std::vector<FileNode *> &nodes)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	CheckMigration();
+
+	size_t count = 0;
+	int chId = nodes.empty() ? 0 : nodes[0]->chId;
+	while ((count < nodes.size()) && LinkFileNode(nodes[count], false))
+	{
+		count++;
+	}
+
+	for (size_t i = count; i < nodes.size(); i++)
+	{
+		// error: not taken by the index
+		delete nodes[i];
+	}
+	nodes.clear();
+
+	// write what the batch left behind, the dates before were written once done
+	ChannelNode *pChannelNode = count > 0 ? GetChannelNode(chId, false) : NULL;
+	if (pChannelNode != NULL)
+	{
+		FileNode *pLastNode = pChannelNode->pLastFileNode;
+		if ((pLastNode != NULL) && (pLastNode->pParent != NULL))
+		{
+			pLastNode->pParent->UpdateIndexFile();
+			if (pLastNode->pParent->pParent != NULL)
+			{
+				pLastNode->pParent->pParent->UpdateIndexFile();
+			}
+		}
+
+		pChannelNode->UpdateIndexFile();
+		UpdateIndexFile();
+	}
+
+	pIndex->changeLog.UpdateIndexFile();
+	StartMigration();
+	return count;
+}
+
+// link the node after the last one of its channel, and write the nodes which
+// changed, or only the new ones and the dates left behind unless flushing
+bool RootNode::LinkFileNode(FileNode *pCurrentNode, bool isFlushing)
+{
+	// the node belongs to this index file from now on
+	pCurrentNode->pIndex = pIndex;
+
+	ChannelNode *pChannelNode = GetChannelNode(pCurrentNode->chId);
+	if (pChannelNode == NULL)
+	{
+		return false;
+	}
+
+	FileNode *pLastNode = pChannelNode->pLastFileNode;
+	if (pLastNode == NULL)
+	{
+		// This is the first node of the current channel
+		pCurrentNode->pPrev = NULL;
+		pCurrentNode->pNext = NULL;
+		pChannelNode->pLastFileNode = pCurrentNode;
+
+		YearNode *pYearNode = pChannelNode->GetYearNode(pCurrentNode->startTime, true);
+		if (pYearNode != NULL)
+		{
+			pYearNode->pParent = pChannelNode;
+
+			DateNode *pDateNode = pYearNode->GetDateNode(pCurrentNode->startTime, true);
+			if (pDateNode != NULL)
 			{
 				pDateNode->pParent = pYearNode;
 				pCurrentNode->pParent = pDateNode;
 
 				pDateNode->SetBufferContent(pCurrentNode->startTime, pCurrentNode);
+				pDateNode->AddUsage(pCurrentNode);
 				pDateNode->UpdateIndexFile();
 			}
 			else
@@ -443,6 +1171,7 @@ bool RootNode::InsertIndex(FileNode *pCurrentNode)
 		if (pCurrentNode->pParent != NULL)
 		{
 			pCurrentNode->pParent->SetBufferContent(pCurrentNode->startTime, pCurrentNode);
+			pCurrentNode->pParent->AddUsage(pCurrentNode);
 		}
 
 		if (pLastNode->pParent != NULL)
@@ -458,7 +1187,8 @@ bool RootNode::InsertIndex(FileNode *pCurrentNode)
 			}
 		}
 
-		if (pCurrentNode->pParent != NULL)
+		// a new date is written at once for its seek base, which the next nodes link to
+		if ((pCurrentNode->pParent != NULL) && (isFlushing || (pCurrentNode->pParent->seekBase <= 0)))
 		{
 			pCurrentNode->pParent->UpdateIndexFile();
 			if (pCurrentNode->pParent->pParent != NULL)
@@ -467,19 +1197,39 @@ bool RootNode::InsertIndex(FileNode *pCurrentNode)
 			}
 		}
 
-		pChannelNode->UpdateIndexFile();
-		UpdateIndexFile();
+		if (isFlushing)
+		{
+			pChannelNode->UpdateIndexFile();
+			UpdateIndexFile();
+		}
 
 		if (pLastNode->pPrev != NULL)
 		{
-			if ((pLastNode->pPrev->pParent != NULL) && (pLastNode->pPrev->pParent != pLastNode->pParent))
+			// unload the date and the year left behind from their tables, they are loaded again when searched
+			DateNode *pPrevDateNode = pLastNode->pPrev->pParent;
+			if ((pPrevDateNode != NULL) && (pPrevDateNode != pLastNode->pParent))
 			{
-				if ((pLastNode->pPrev->pParent->pParent != NULL) && (pLastNode->pParent) && (pLastNode->pPrev->pParent->pParent != pLastNode->pParent->pParent))
+				YearNode *pPrevYearNode = pPrevDateNode->pParent;
+				if (pPrevYearNode != NULL)
+				{
+					pPrevYearNode->UnloadDateNode(pPrevDateNode);
+				}
+				else
+				{
+					delete pPrevDateNode;
+				}
+
+				if ((pPrevYearNode != NULL) && (pLastNode->pParent != NULL) && (pPrevYearNode != pLastNode->pParent->pParent))
 				{
-					delete pLastNode->pPrev->pParent->pParent;
-					pLastNode->pPrev->pParent->pParent = NULL;
+					if (pPrevYearNode->pParent != NULL)
+					{
+						pPrevYearNode->pParent->UnloadYearNode(pPrevYearNode);
+					}
+					else
+					{
+						delete pPrevYearNode;
+					}
 				}
-				delete pLastNode->pPrev->pParent;
 				pLastNode->pPrev->pParent = NULL;
 			}
 			delete pLastNode->pPrev;
@@ -490,48 +1240,462 @@ bool RootNode::InsertIndex(FileNode *pCurrentNode)
 	return true;
 }
 
-RootNode::RootNode(size_t channelCount)
-	: seekBase(0), headerSize(4), isDirty(false)
+// for recycling
+time_t RootNode::GetOldestTime(int chId)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	ChannelNode *pChannelNode = GetChannelNode(chId, false);
+	YearNode *pYearNode;
+	DateNode *pDateNode;
+
+	if ((pChannelNode != NULL)
+	    && ((pYearNode = pChannelNode->GetYearNodeForwardly(0)) != NULL)
+	    && ((pDateNode = pYearNode->GetDateNodeForwardly(0)) != NULL))
+	{
+		return pDateNode->GetFirstStartTime();
+	}
+
+	return 0;
+}
+
+// for recycling
+// remove the oldest clips which end before the time, date by date, and return
+// them, their files are left to the caller
+size_t RootNode::RemoveOldestFiles(int chId, time_t before, size_t maxCount, std::vector<Clip> &clips)
 {
-	pIndexFile = fopen(".index", "rb+");
-	if ((pIndexFile != NULL)
-	    && (fread(&channelTableCapacity, 1, 4, pIndexFile) == 4))
+	boost::mutex::scoped_lock lock(mutex);
+
+	ChannelNode *pChannelNode = GetChannelNode(chId, false);
+	if ((pChannelNode == NULL) || (pIndex->pFile == NULL))
 	{
-		if (channelCount > channelTableCapacity)
+		return 0;
+	}
+
+	// the last two clips are still linked by the recorder, keep them and their nodes
+	FileNode *pLastNode = pChannelNode->pLastFileNode;
+	FileNode *pPrevNode = pLastNode != NULL ? pLastNode->pPrev : NULL;
+	DateNode *pLastDateNode = pLastNode != NULL ? pLastNode->pParent : NULL;
+	DateNode *pPrevDateNode = pPrevNode != NULL ? pPrevNode->pParent : NULL;
+	YearNode *pLastYearNode = pLastDateNode != NULL ? pLastDateNode->pParent : NULL;
+	YearNode *pPrevYearNode = pPrevDateNode != NULL ? pPrevDateNode->pParent : NULL;
+	IndexWord keptSeekBase = ((pPrevNode != NULL) && (pPrevNode->seekBase > 0)) ? pPrevNode->seekBase
+	                         : pLastNode != NULL ? pLastNode->seekBase : 0;
+
+	size_t count = 0;
+	YearNode *pYearNode;
+	while ((count < maxCount) && ((pYearNode = pChannelNode->GetYearNodeForwardly(0)) != NULL))
+	{
+		DateNode *pDateNode = pYearNode->GetDateNodeForwardly(0);
+		if (pDateNode != NULL)
 		{
-			// FIXME: MUST extend root node in the index file
+			count += pDateNode->RemoveOldestFiles(chId, before, maxCount - count, keptSeekBase, clips);
+			pDateNode->UpdateIndexFile();
+
+			if (!pDateNode->IsEmpty() || (pDateNode == pLastDateNode) || (pDateNode == pPrevDateNode)
+			    || !pYearNode->RemoveDateNode(pDateNode))
+			{
+				// stopped by the time, the count or the recorder
+				break;
+			}
+			pYearNode->UpdateIndexFile();
+		}
+		else if (!pYearNode->IsEmpty())
+		{
+			// error: the first date can not be loaded
+			break;
 		}
-		bufferSize = headerSize + channelTableCapacity * 4;
-		pBuffer = new char[bufferSize];
 
-		*(int *)pBuffer = channelTableCapacity;
-		if (IndexFileRead(pBuffer + 4, bufferSize - 4) == false)
+		if (pYearNode->IsEmpty())
 		{
-			// error:
-			memset(pBuffer + 4, 0, bufferSize - 4);
-			isDirty = true;
+			if ((pYearNode == pLastYearNode) || (pYearNode == pPrevYearNode) || !pChannelNode->RemoveYearNode(pYearNode))
+			{
+				break;
+			}
+			pChannelNode->UpdateIndexFile();
 		}
 	}
-	else
+
+	if (count > 0)
 	{
-		// error:
-		if (pIndexFile != NULL)
+		// the oldest clip left has no previous one
+		DateNode *pDateNode;
+		if (((pYearNode = pChannelNode->GetYearNodeForwardly(0)) != NULL)
+		    && ((pDateNode = pYearNode->GetDateNodeForwardly(0)) != NULL))
 		{
-			fclose(pIndexFile);
-			pIndexFile = NULL;
+			pDateNode->UnlinkFirstFile();
+			pDateNode->UpdateIndexFile();
 		}
+	}
 
-		// create new file
-		pIndexFile = fopen(".index", "wb+");
+	pIndex->changeLog.UpdateIndexFile();
+	return count;
+}
+
+// for recycling
+// the dates still indexed stop counting the bytes of their removed clips, the
+// sizes are taken by the caller without the lock
+void RootNode::RemoveUsage(int chId, const std::vector<Clip> &clips)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	ChannelNode *pChannelNode = GetChannelNode(chId, false);
+	if ((pChannelNode == NULL) || (pIndex->pFile == NULL))
+	{
+		return;
+	}
+
+	DateNode *pLastDateNode = NULL;
+	for (size_t i = 0; i < clips.size(); i++)
+	{
+		YearNode *pYearNode;
+		DateNode *pDateNode;
+		if ((clips[i].fileSize == 0ull)
+		    || ((pYearNode = pChannelNode->GetYearNode(clips[i].startTime, false)) == NULL)
+		    || ((pDateNode = pYearNode->GetDateNode(clips[i].startTime, false)) == NULL))
+		{
+			// the date went with its last clip
+			continue;
+		}
+
+		if ((pLastDateNode != NULL) && (pDateNode != pLastDateNode))
+		{
+			pLastDateNode->UpdateIndexFile();
+		}
+		pDateNode->RemoveUsage(clips[i].fileSize);
+		pLastDateNode = pDateNode;
+	}
+
+	if (pLastDateNode != NULL)
+	{
+		pLastDateNode->UpdateIndexFile();
+		pIndex->changeLog.UpdateIndexFile();
+	}
+}
+
+// for compacting, exporting and thumbnails
+// the first clip which starts at or after the time, or the one across the
+// time if asked, copied out under the lock so that no node is kept while the
+// recycler may unload it
+bool RootNode::GetNextClip(int chId, time_t time, Clip &clip, bool isAcross)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	// the nodes reload what changed by themselves, reopen only a failed or replaced file
+	if (IsReplaced())
+	{
+		Reload();
+	}
+	else if (pIndex->pFile == NULL)
+	{
+		pIndex->Open("rb+");
+	}
+
+	ChannelNode *pChannelNode = GetChannelNode(chId, false);
+	YearNode *pYearNode;
+	DateNode *pDateNode;
+	FileNode *pFileNode;
+	if ((pChannelNode == NULL) || (pIndex->pFile == NULL)
+	    || ((pYearNode = pChannelNode->GetYearNodeForwardly(time)) == NULL)
+	    || ((pDateNode = pYearNode->GetDateNodeForwardly(time)) == NULL)
+	    || ((pFileNode = pDateNode->GetFileNodeForwardly(time)) == NULL))
+	{
+		return false;
+	}
+
+	if ((pFileNode->startTime < time) && (!isAcross || (pFileNode->endTime <= time)))
+	{
+		// the clip before or across the time
+		pFileNode = pFileNode->GetNext() != NULL ? pFileNode->GetNext() : pFileNode->LoadNext();
+	}
+	if ((pFileNode == NULL) || (pFileNode->startTime == 0))
+	{
+		return false;
+	}
+
+	pFileNode->chId = chId;
+	pFileNode->RebuildFileName();
+	clip.startTime = pFileNode->startTime;
+	clip.endTime   = pFileNode->endTime;
+	clip.fileName  = pFileNode->GetFileName();
+	clip.fileSize  = 0ull;
+	return true;
+}
+
+// for compacting
+// the file of the clip is replaced by the new one, unless the clip was
+// recycled meanwhile, and its date counts the bytes saved, measured by the
+// caller; the name and the entry of the clip stay as they are
+bool RootNode::ReplaceFile(int chId, time_t startTime, const char *newFileName, uint64_t savedBytes)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	// the nodes reload what changed by themselves, reopen only a failed or replaced file
+	if (IsReplaced())
+	{
+		Reload();
+	}
+	else if (pIndex->pFile == NULL)
+	{
+		pIndex->Open("rb+");
+	}
+
+	ChannelNode *pChannelNode = GetChannelNode(chId, false);
+	YearNode *pYearNode;
+	DateNode *pDateNode;
+	FileNode *pFileNode;
+	if ((pChannelNode == NULL) || (pIndex->pFile == NULL)
+	    || ((pYearNode = pChannelNode->GetYearNodeForwardly(startTime)) == NULL)
+	    || ((pDateNode = pYearNode->GetDateNodeForwardly(startTime)) == NULL)
+	    || ((pFileNode = pDateNode->GetFileNodeForwardly(startTime)) == NULL)
+	    || (pFileNode->startTime != startTime))
+	{
+		// the clip is no longer indexed
+		return false;
+	}
+
+	pFileNode->chId = chId;
+	pFileNode->RebuildFileName();
+
+	try
+	{
+		boost::filesystem::rename(newFileName, pFileNode->GetFileName());
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: the clip is lost or busy, keep it as it is
+		return false;
+	}
+
+	pFileNode->pParent->RemoveUsage(savedBytes);
+	pFileNode->pParent->UpdateIndexFile();
+	pIndex->changeLog.UpdateIndexFile();
+	return true;
+}
+
+// for indexing
+// the usage of a date is read from its header and its bitmap, only a date
+// indexed before is loaded to find its minutes from the entries
+bool RootNode::GetDayUsage(int chId, time_t time, StreamingMediaLibrary::DayUsage &usage)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	// the nodes reload what changed by themselves, reopen only a failed or replaced file
+	if (IsReplaced())
+	{
+		Reload();
+	}
+	else if (pIndex->pFile == NULL)
+	{
+		pIndex->Open("rb+");
+	}
+
+	usage = StreamingMediaLibrary::DayUsage();
+
+	ChannelNode *pChannelNode = GetChannelNode(chId, false);
+	if (pChannelNode == NULL)
+	{
+		// error: wrong id or no clip of the channel
+		return false;
+	}
+	pChannelNode->Revalidate();
+
+	YearNode *pYearNode = pChannelNode->GetYearNode(time, false);
+	if (pYearNode == NULL)
+	{
+		// no clip in the year
+		return true;
+	}
+	pYearNode->Revalidate();
+
+	IndexWord dateSeekBase = pYearNode->GetDateSeekBase(pYearNode->GetDateIndex(time));
+	if ((dateSeekBase <= 0)
+	    || DateNode::ReadUsage(pIndex, dateSeekBase, usage.byteCount, usage.minuteBitmap))
+	{
+		return true;
+	}
+
+	DateNode *pDateNode = pYearNode->GetDateNode(time, false);
+	if (pDateNode == NULL)
+	{
+		// error: the date can not be loaded
+		return false;
+	}
+	pDateNode->Revalidate();
+
+	usage.byteCount = pDateNode->GetByteCount();
+	memcpy(usage.minuteBitmap, pDateNode->GetMinuteTable(), sizeof(usage.minuteBitmap));
+	return true;
+}
+
+// for indexing
+bool RootNode::GetYearUsage(int chId, int year, StreamingMediaLibrary::YearUsage &usage)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	if (IsReplaced())
+	{
+		Reload();
+	}
+	else if (pIndex->pFile == NULL)
+	{
+		pIndex->Open("rb+");
+	}
+
+	usage = StreamingMediaLibrary::YearUsage();
+
+	ChannelNode *pChannelNode = GetChannelNode(chId, false);
+	if ((pChannelNode == NULL) || (year < 1970))
+	{
+		// error: wrong id, no clip of the channel or wrong year
+		return false;
+	}
+	pChannelNode->Revalidate();
+
+	struct tm t;  // local time, noon is never skipped by a daylight saving change
+	memset(&t, 0, sizeof(t));
+	t.tm_year = year - 1900;
+	t.tm_mon  = 0;
+	t.tm_mday = 1;
+	t.tm_hour = 12;
+	t.tm_isdst = -1;
+	YearNode *pYearNode = pChannelNode->GetYearNode(mktime(&t), false);
+	if (pYearNode == NULL)
+	{
+		// no clip in the year
+		return true;
+	}
+
+	usage.byteCount = pYearNode->GetByteCount();
+	for (int index = 0; (size_t)index < pYearNode->dateTableCapacity; index++)
+	{
+		if (pYearNode->GetDateSeekBase(index) > 0)
+		{
+			usage.dayBitmap[index / 8] |= (unsigned char)(1 << (index % 8));
+		}
+	}
+	return true;
+}
+
+// for indexing
+uint64_t RootNode::GetChannelUsage(int chId)
+{
+	boost::mutex::scoped_lock lock(mutex);
+
+	if (IsReplaced())
+	{
+		Reload();
+	}
+	else if (pIndex->pFile == NULL)
+	{
+		pIndex->Open("rb+");
+	}
+
+	ChannelNode *pChannelNode = GetChannelNode(chId, false);
+	return pChannelNode != NULL ? pChannelNode->GetByteCount() : 0;
+}
+
+RootNode::RootNode(size_t channelCount, const char *fileName)
+	: channelTableCapacity(0), pChannelTable(NULL), pIndex(new IndexFile(fileName)), pBuffer(NULL),
+	  pMigrator(NULL), isMigrationFailed(false)
+{
+	Load(channelCount);
+}
+
+bool RootNode::Load(size_t channelCount)
+{
+	IndexFileHeader header;
+	bool result = true;
+
+	isDirty  = false;
+	isIntact = false;
+	pIndex->Open("rb+");
+	if ((pIndex->pFile != NULL)
+	    && (fread(&header, 1, 4, pIndex->pFile) == 4)
+	    && ((memcmp(header.magic, IndexFileHeader::MAGIC, 4) != 0)
+	        || (fread(header.magic + 4, 1, sizeof(header) - 4, pIndex->pFile) == sizeof(header) - 4)))
+	{
+		if (memcmp(header.magic, IndexFileHeader::MAGIC, sizeof(header.magic)) != 0)
+		{
+			// version 1, the file starts with the root node
+			pIndex->SetFormat(IndexFileHeader::VERSION_1);
+			seekBase = 0;
+			channelTableCapacity = *(int *)header.magic;
+		}
+		else if ((header.version >= IndexFileHeader::VERSION_2) && (header.version <= IndexFileHeader::CURRENT_VERSION)
+		         && (header.wordSize == sizeof(IndexWord)) && (header.alignment == IndexFileHeader::ALIGNMENT))
+		{
+			IndexWord capacity = 0;
+			pIndex->SetFormat(header.version);
+			seekBase = IndexFileHeader::HEADER_SIZE;
+			if (pIndex->ReadWord(capacity))
+			{
+				channelTableCapacity = (size_t)capacity;
+			}
+		}
+		else
+		{
+			// error: written by a newer version, never overwrite it
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+			result = false;
+		}
+
+		if (channelCount > channelTableCapacity)
+		{
+			// FIXME: MUST extend root node in the index file
+		}
+		if (channelTableCapacity == 0)
+		{
+			channelTableCapacity = channelCount < DEFAULT_CHANNEL_TABLE_CAPACITY ? DEFAULT_CHANNEL_TABLE_CAPACITY : channelCount;
+		}
+		headerSize = pIndex->wordSize;
+		bufferSize = headerSize + channelTableCapacity * pIndex->wordSize;
+		pBuffer = new char[bufferSize];
+
+		memset(pBuffer, 0, bufferSize);
+		pIndex->SetWord(pBuffer, 0, channelTableCapacity);
+		if (pIndex->pFile == NULL)
+		{
+			// keep an empty index in memory
+		}
+		else if (pIndex->Read(pBuffer + headerSize, bufferSize - headerSize) == false)
+		{
+			// error:
+			memset(pBuffer + headerSize, 0, bufferSize - headerSize);
+			isDirty = true;
+			result = false;
+		}
+		else
+		{
+			pIndex->changeLog.Load(pIndex->Align(seekBase + bufferSize));
+			isIntact = true;
+		}
+	}
+	else
+	{
+		// error:
+		if (pIndex->pFile != NULL)
+		{
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+		}
+
+		// create new file in the current format
+		pIndex->SetFormat(IndexFileHeader::CURRENT_VERSION);
+		pIndex->Open("wb+");
 		channelTableCapacity = channelCount < DEFAULT_CHANNEL_TABLE_CAPACITY ? DEFAULT_CHANNEL_TABLE_CAPACITY : channelCount;
 
-		bufferSize = headerSize + channelTableCapacity * 4;
+		seekBase = IndexFileHeader::HEADER_SIZE;
+		headerSize = pIndex->wordSize;
+		bufferSize = headerSize + channelTableCapacity * pIndex->wordSize;
 		pBuffer = new char[bufferSize];
 		memset(pBuffer, 0, bufferSize);
-		*(int *)pBuffer = channelTableCapacity;
+		pIndex->SetWord(pBuffer, 0, channelTableCapacity);
 		isDirty = true;
 
 		UpdateIndexFile();
+		pIndex->changeLog.Create(pIndex->Align(seekBase + bufferSize));
 	}
 
 	pChannelTable = new ChannelNode *[channelTableCapacity];
@@ -539,10 +1703,127 @@ RootNode::RootNode(size_t channelCount)
 	{
 		pChannelTable[i] = NULL;
 	}
+
+	return result;
+}
+
+// load the index again after it has been replaced by a migration
+bool RootNode::Reload()
+{
+	pIndex->changeLog.Unload();
+	if (pIndex->pFile != NULL)
+	{
+		fclose(pIndex->pFile);
+		pIndex->pFile = NULL;
+	}
+
+	// the old nodes are left to the files located from them
+	delete[] pChannelTable;
+	pChannelTable = NULL;
+	delete[] pBuffer;
+	pBuffer = NULL;
+
+	return Load(channelTableCapacity);
+}
+
+// for indexing
+bool RootNode::IsReplaced()
+{
+	if (pIndex->changeLog.IsAvailable())
+	{
+		return pIndex->changeLog.IsMoved();
+	}
+
+	if (pIndex->version >= IndexFileHeader::CURRENT_VERSION)
+	{
+		return false;
+	}
+
+	// no change log to tell it, look at the file itself
+	bool result = false;
+	char magic[sizeof(IndexFileHeader::MAGIC)];
+	FILE *pFile = fopen(pIndex->fileName.c_str(), "rb");
+	if (pFile != NULL)
+	{
+		result = (fread(magic, 1, sizeof(magic), pFile) == sizeof(magic))
+		         && (memcmp(magic, IndexFileHeader::MAGIC, sizeof(magic)) == 0);
+		fclose(pFile);
+	}
+
+	return result;
+}
+
+// for recording
+void RootNode::CheckMigration()
+{
+	if ((pIndex->version >= IndexFileHeader::CURRENT_VERSION) || (pIndex->pFile == NULL) || isMigrationFailed)
+	{
+		return;
+	}
+
+	if ((pMigrator == NULL) || !pMigrator->IsFinished())
+	{
+		return;
+	}
+
+	bool isSucceeded = pMigrator->IsSucceeded();
+	bool isChanged = pMigrator->GetWriteCount() != pIndex->writeCount;
+	delete pMigrator;
+	pMigrator = NULL;
+
+	if (!isSucceeded || isChanged)
+	{
+		// error or written meanwhile: give up or migrate again at the next insertion
+		remove(IndexMigrator::GetNewFileName(pIndex->fileName).c_str());
+		isMigrationFailed = !isSucceeded;
+		return;
+	}
+
+	// tell the readers to reload before the file is replaced
+	pIndex->changeLog.MarkMoved(true);
+	pIndex->changeLog.Unload();
+	fclose(pIndex->pFile);
+	pIndex->pFile = NULL;
+
+	try
+	{
+		boost::filesystem::rename(IndexMigrator::GetNewFileName(pIndex->fileName), pIndex->fileName);
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: keep the old file
+		remove(IndexMigrator::GetNewFileName(pIndex->fileName).c_str());
+		isMigrationFailed = true;
+		Reload();
+		pIndex->changeLog.MarkMoved(false);
+		return;
+	}
+
+	Reload();
+}
+
+// the migration of an old file runs between two insertions
+void RootNode::StartMigration()
+{
+	if ((pIndex->version >= IndexFileHeader::CURRENT_VERSION) || (pIndex->pFile == NULL) || isMigrationFailed || (pMigrator != NULL))
+	{
+		return;
+	}
+
+	// the migrator reads the old file by itself
+	fflush(pIndex->pFile);
+	pMigrator = new IndexMigrator(pIndex->fileName, pIndex->writeCount);
 }
 
 RootNode::~RootNode()
 {
+	if (pMigrator != NULL)
+	{
+		// an unfinished migration is started again next time
+		delete pMigrator;
+		remove(IndexMigrator::GetNewFileName(pIndex->fileName).c_str());
+	}
+
 	if (pChannelTable != NULL)
 	{
 		for (size_t i = 0; i < channelTableCapacity; i++)
@@ -554,6 +1835,8 @@ RootNode::~RootNode()
 		}
 		delete[] pChannelTable;
 	}
+
+	delete pIndex;
 }
 
 bool RootNode::UpdateIndexFile()
@@ -565,20 +1848,39 @@ bool RootNode::UpdateIndexFile()
 	}
 	isDirty = false;
 
-	if (pIndexFile == NULL)
+	if (pIndex->pFile == NULL)
 	{
-		pIndexFile = fopen(".index", "rb+");
-		if (pIndexFile != NULL)
+		pIndex->Open("rb+");
+		if (pIndex->pFile != NULL)
 		{
 			// error: file already exist
-			fclose(pIndexFile);
-			pIndexFile = NULL;
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
 			return false;
 		}
 
 		// create new file
-		pIndexFile = fopen(".index", "wb+");
-		if (pIndexFile == NULL)
+		pIndex->Open("wb+");
+		if (pIndex->pFile == NULL)
+		{
+			// error:
+			return false;
+		}
+	}
+
+	if (pIndex->version >= IndexFileHeader::VERSION_2)
+	{
+		// the file header precedes the root node
+		IndexFileHeader header;
+		header.Initialize(pIndex->version);
+		if (pIndex->Seek(0) != 0)
+		{
+			// error:
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+			return false;
+		}
+		if (pIndex->Write(&header, sizeof(header)) == false)
 		{
 			// error:
 			return false;
@@ -587,27 +1889,27 @@ bool RootNode::UpdateIndexFile()
 
 	if (seekBase >= 0)
 	{
-		if (fseek(pIndexFile, seekBase, SEEK_SET) != 0)
+		if (pIndex->Seek(seekBase) != 0)
 		{
 			// error:
-			fclose(pIndexFile);
-			pIndexFile = NULL;
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
 			return false;
 		}
 	}
 	else
 	{
-		if (fseek(pIndexFile, 0, SEEK_END) != 0)
+		if (pIndex->SeekToEnd() != 0)
 		{
 			// error:
-			fclose(pIndexFile);
-			pIndexFile = NULL;
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
 			return false;
 		}
-		seekBase = ftell(pIndexFile);
+		seekBase = pIndex->Tell();
 	}
 
-	if (IndexFileWrite(pBuffer, bufferSize) == false)
+	if (pIndex->Write(pBuffer, bufferSize) == false)
 	{
 		// error:
 		return false;
@@ -616,7 +1918,7 @@ bool RootNode::UpdateIndexFile()
 	return true;
 }
 
-bool RootNode::SetBufferContent(int chId, int value)
+bool RootNode::SetBufferContent(int chId, IndexWord value)
 {
 	if ((chId <= 0) || ((size_t)chId > channelTableCapacity) || (pBuffer == NULL))
 	{
@@ -624,7 +1926,7 @@ bool RootNode::SetBufferContent(int chId, int value)
 		return false;
 	}
 
-	*((int *)(pBuffer + headerSize) + chId - 1) = value;
+	pIndex->SetWord(pBuffer + headerSize, chId - 1, value);
 	isDirty = true;
 	return true;
 }
@@ -640,11 +1942,11 @@ ChannelNode * RootNode::GetChannelNode(int chId, bool isCreate)
 	if (pChannelTable[chId - 1] == NULL)
 	{
 		// try to load the specific channel node
-		if ((pIndexFile != NULL) && (pBuffer != NULL))
+		if ((pIndex->pFile != NULL) && (pBuffer != NULL))
 		{
-			if (*((int *)(pBuffer + headerSize) + chId - 1) != 0)
+			if (pIndex->GetWord(pBuffer + headerSize, chId - 1) != 0)
 			{
-				pChannelTable[chId - 1] = new ChannelNode(chId, *((int *)(pBuffer + headerSize) + chId - 1));
+				pChannelTable[chId - 1] = new ChannelNode(pIndex, chId, pIndex->GetWord(pBuffer + headerSize, chId - 1));
 				pChannelTable[chId - 1]->pParent = this;
 
 				if (!pChannelTable[chId - 1]->isDirty)
@@ -652,25 +1954,25 @@ ChannelNode * RootNode::GetChannelNode(int chId, bool isCreate)
 					// try to load the last node
 					ChannelNode *pChannalNode = pChannelTable[chId - 1];
 					int yearIndex;
-					int yearSeekBase;
+					IndexWord yearSeekBase;
 					if ((pChannalNode->yearTableBase != 0)
-					    && ((yearIndex = *((int *)pChannalNode->pBuffer + 3)) != -1)
+					    && ((yearIndex = pIndex->GetWord(pChannalNode->pBuffer, 3)) != -1)
 					    && (yearIndex >= 0) && ((size_t)yearIndex < pChannalNode->yearTableCapacity)
-					    && ((yearSeekBase = *((int *)(pChannalNode->pBuffer + pChannalNode->headerSize) + yearIndex)) != 0))
+					    && ((yearSeekBase = pIndex->GetWord(pChannalNode->pBuffer + pChannalNode->headerSize, yearIndex)) != 0))
 					{
 						int year = pChannalNode->yearTableBase + yearIndex;
-						pChannalNode->pYearTable[yearIndex] = new YearNode(year, yearSeekBase);
+						pChannalNode->pYearTable[yearIndex] = new YearNode(pIndex, year, yearSeekBase);
 						pChannalNode->pYearTable[yearIndex]->pParent = pChannalNode;
 
 						if (!pChannalNode->pYearTable[yearIndex]->isDirty)
 						{
 							YearNode *pYearNode = pChannalNode->pYearTable[yearIndex];
 							int dateIndex;
-							int dateSeekBase;
-							if (((dateIndex = *((int *)pYearNode->pBuffer + 2)) != -1)
+							IndexWord dateSeekBase;
+							if (((dateIndex = pIndex->GetWord(pYearNode->pBuffer, 2)) != -1)
 							    && (dateIndex >= 0) && ((size_t)dateIndex < pYearNode->dateTableCapacity)
 								&& (pYearNode->isLeapYear || ((size_t)dateIndex != pYearNode->dateTableCapacity - 1))
-								&& ((dateSeekBase = *((int *)(pYearNode->pBuffer + pYearNode->headerSize) + dateIndex)) != 0))
+								&& ((dateSeekBase = pIndex->GetWord(pYearNode->pBuffer + pYearNode->headerSize, dateIndex)) != 0))
 							{
 								struct tm t;  // local time
 								t.tm_year = year - 1900;
@@ -679,18 +1981,19 @@ ChannelNode * RootNode::GetChannelNode(int chId, bool isCreate)
 								t.tm_hour = 0;
 								t.tm_min  = 0;
 								t.tm_sec  = 0;
+								t.tm_isdst = -1;
 								time_t dateStartTime = mktime(&t);
 								dateStartTime += dateIndex * 24 * 60 * 60;
-								pYearNode->pDateTable[dateIndex] = new DateNode(dateStartTime, 0, dateSeekBase);
+								pYearNode->pDateTable[dateIndex] = new DateNode(pIndex, dateStartTime, 0, dateSeekBase);
 								pYearNode->pDateTable[dateIndex]->pParent = pYearNode;
 
 								if (!pYearNode->pDateTable[dateIndex]->isDirty)
 								{
 									DateNode *pDateNode = pYearNode->pDateTable[dateIndex];
-									int fileSeekBase = *((int *)pDateNode->pBuffer + 3);
+									IndexWord fileSeekBase = pIndex->GetWord(pDateNode->pBuffer, 3);
 									if (fileSeekBase != 0)
 									{
-										FileNode *pFileNode = new FileNode(FileNode::FILE_TYPE_NORMAL, fileSeekBase);
+										FileNode *pFileNode = new FileNode(FileNode::FILE_TYPE_NORMAL, pIndex, fileSeekBase);
 										if (!pFileNode->isDirty)
 										{
 											//pDateNode->pFileTable[index] = pFileNode;
@@ -745,10 +2048,11 @@ ChannelNode * RootNode::GetChannelNode(int chId, bool isCreate)
 		// if there exist no specific channel node, create a new one
 		if ((pChannelTable[chId - 1] == NULL) && isCreate)
 		{
-			pChannelTable[chId - 1] = new ChannelNode(chId);
+			pChannelTable[chId - 1] = new ChannelNode(pIndex, chId);
 			pChannelTable[chId - 1]->pParent = this;
 			pChannelTable[chId - 1]->UpdateIndexFile();
 			UpdateIndexFile();
+			pIndex->changeLog.UpdateIndexFile();
 
 			// initialize channel node
 		}
@@ -759,51 +2063,241 @@ ChannelNode * RootNode::GetChannelNode(int chId, bool isCreate)
 
 //---------------------------------------------------------------------------
 //---------------------------------------------------------------------------
-ChannelNode::ChannelNode(int _chId, int seek)
-	: chId(_chId),
-	  yearTableBase(0), yearTableCapacity(DEFAULT_YEAR_TABLE_CAPACITY),
-	  pFirstYearNode(NULL), pLastYearNode(NULL),
-	  pParent(NULL), pFirstFileNode(NULL), pLastFileNode(NULL),
-	  seekBase(seek), headerSize(16), isDirty(false), defaultDuration(0)
+ShardedRootNode::ShardedRootNode(size_t channelCount, RootNode *_pMainRoot)
+	: pMainRoot(_pMainRoot)
 {
-	if ((pIndexFile != NULL) && (seekBase > 0)
-	    && (fseek(pIndexFile, seekBase, SEEK_SET) == 0)
-	    && (fread(&yearTableCapacity, 1, 4, pIndexFile) == 4))
+	shardTableCapacity = channelCount < DEFAULT_SHARD_TABLE_CAPACITY ? DEFAULT_SHARD_TABLE_CAPACITY : channelCount;
+	pShardTable = new RootNode *[shardTableCapacity];
+	for (size_t i = 0; i < shardTableCapacity; i++)
 	{
-		bufferSize = headerSize + yearTableCapacity * 4;
-		pBuffer = new char[bufferSize];
+		pShardTable[i] = NULL;
+	}
+}
 
-		*(int *)pBuffer = yearTableCapacity;
-		if (fread(&yearTableBase, 1, 4, pIndexFile) != 4)
-		{
-			yearTableBase = 0;
-			isDirty = true;
-		}
-		*((int *)pBuffer + 1) = yearTableBase;
-		if (IndexFileRead(pBuffer + 8, bufferSize - 8) == false)
+ShardedRootNode::~ShardedRootNode()
+{
+	for (size_t i = 0; i < shardTableCapacity; i++)
+	{
+		if (pShardTable[i] != NULL)
 		{
-			memset(pBuffer + 8, 0, bufferSize - 8);  // FIXME: can not set all zero
-			*((int *)pBuffer + 2) = -1;
-			*((int *)pBuffer + 3) = -1;
-			isDirty = true;
+			delete pShardTable[i];
 		}
 	}
-	else
+	delete[] pShardTable;
+	if (pMainRoot != NULL)
 	{
-		// error
-		if (pIndexFile != NULL)
-		{
-			//fclose(pIndexFile);
-			//pIndexFile = NULL;
-		}
-		yearTableCapacity = DEFAULT_YEAR_TABLE_CAPACITY;
+		delete pMainRoot;
+	}
+}
 
-		bufferSize = headerSize + yearTableCapacity * 4;
+RootNode * ShardedRootNode::GetShard(int chId)
+{
+	if ((chId <= 0) || ((size_t)chId > shardTableCapacity))
+	{
+		// error: wrong id
+		return NULL;
+	}
+	if ((pMainRoot != NULL) && (chId <= StreamingMediaLibrary::MAX_CHANNEL_ID))
+	{
+		return pMainRoot;
+	}
+
+	// a shard is opened once and never replaced, only the opening is locked
+	if (pShardTable[chId - 1] == NULL)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if (pShardTable[chId - 1] == NULL)
+		{
+			char fileName[32];
+			int length = GetChannelDirectoryName(chId, fileName);
+			try
+			{
+				boost::filesystem::create_directories(fileName);
+			}
+			catch (boost::filesystem::filesystem_error &)
+			{
+				// error: the shard is kept in memory only
+			}
+
+			strcpy(fileName + length, "/.index");
+			pShardTable[chId - 1] = new RootNode(chId, fileName);
+		}
+	}
+
+	return pShardTable[chId - 1];
+}
+
+// for recording
+int ShardedRootNode::GetCurrentDuration(int chId)
+{
+	RootNode *pShard = GetShard(chId);
+	return pShard != NULL ? pShard->GetCurrentDuration(chId) : FileNode::DEFAULT_MEDIA_DURATION;
+}
+
+// for recording
+bool ShardedRootNode::SetDefaultDuration(int chId, int duration)
+{
+	RootNode *pShard = GetShard(chId);
+	return (pShard != NULL) && pShard->SetDefaultDuration(chId, duration);
+}
+
+// for recording
+bool ShardedRootNode::InsertIndex(FileNode *pCurrentNode)
+{
+	RootNode *pShard = GetShard(pCurrentNode->chId);
+	return (pShard != NULL) && pShard->InsertIndex(pCurrentNode);
+}
+
+// for recovering
+size_t ShardedRootNode::InsertIndexes(std::vector<FileNode *> &nodes)
+{
+	RootNode *pShard = nodes.empty() ? NULL : GetShard(nodes[0]->chId);
+	if (pShard == NULL)
+	{
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			delete nodes[i];
+		}
+		nodes.clear();
+		return 0;
+	}
+
+	return pShard->InsertIndexes(nodes);
+}
+
+// for indexing
+FileNode * ShardedRootNode::SearchForwardlyAndLoad(int chId, time_t time)
+{
+	RootNode *pShard = GetShard(chId);
+	return pShard != NULL ? pShard->SearchForwardlyAndLoad(chId, time) : NULL;
+}
+
+// for indexing
+FileNode * ShardedRootNode::SearchBackwardlyAndLoad(int chId, time_t time)
+{
+	RootNode *pShard = GetShard(chId);
+	return pShard != NULL ? pShard->SearchBackwardlyAndLoad(chId, time) : NULL;
+}
+
+// for recycling
+time_t ShardedRootNode::GetOldestTime(int chId)
+{
+	RootNode *pShard = GetShard(chId);
+	return pShard != NULL ? pShard->GetOldestTime(chId) : 0;
+}
+
+// for compacting, exporting and thumbnails
+bool ShardedRootNode::GetNextClip(int chId, time_t time, Clip &clip, bool isAcross)
+{
+	RootNode *pShard = GetShard(chId);
+	return (pShard != NULL) && pShard->GetNextClip(chId, time, clip, isAcross);
+}
+
+// for recycling
+size_t ShardedRootNode::RemoveOldestFiles(int chId, time_t before, size_t maxCount, std::vector<Clip> &clips)
+{
+	RootNode *pShard = GetShard(chId);
+	return pShard != NULL ? pShard->RemoveOldestFiles(chId, before, maxCount, clips) : 0;
+}
+
+// for recycling
+void ShardedRootNode::RemoveUsage(int chId, const std::vector<Clip> &clips)
+{
+	RootNode *pShard = GetShard(chId);
+	if (pShard != NULL)
+	{
+		pShard->RemoveUsage(chId, clips);
+	}
+}
+
+// for indexing
+bool ShardedRootNode::GetDayUsage(int chId, time_t time, StreamingMediaLibrary::DayUsage &usage)
+{
+	RootNode *pShard = GetShard(chId);
+	return (pShard != NULL) && pShard->GetDayUsage(chId, time, usage);
+}
+
+// for indexing
+bool ShardedRootNode::GetYearUsage(int chId, int year, StreamingMediaLibrary::YearUsage &usage)
+{
+	RootNode *pShard = GetShard(chId);
+	return (pShard != NULL) && pShard->GetYearUsage(chId, year, usage);
+}
+
+// for compacting
+bool ShardedRootNode::ReplaceFile(int chId, time_t startTime, const char *newFileName, uint64_t savedBytes)
+{
+	RootNode *pShard = GetShard(chId);
+	return (pShard != NULL) && pShard->ReplaceFile(chId, startTime, newFileName, savedBytes);
+}
+
+// for indexing
+uint64_t ShardedRootNode::GetChannelUsage(int chId)
+{
+	RootNode *pShard = GetShard(chId);
+	return pShard != NULL ? pShard->GetChannelUsage(chId) : 0;
+}
+
+// a shard opened for the first time is created
+bool ShardedRootNode::IsIntact(int chId)
+{
+	RootNode *pShard = GetShard(chId);
+	return (pShard != NULL) && pShard->IsIntact(chId);
+}
+
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+ChannelNode::ChannelNode(IndexFile *_pIndex, int _chId, IndexWord seek)
+	: chId(_chId),
+	  yearTableBase(0), yearTableCapacity(DEFAULT_YEAR_TABLE_CAPACITY),
+	  pFirstYearNode(NULL), pLastYearNode(NULL),
+	  pParent(NULL), pFirstFileNode(NULL), pLastFileNode(NULL),
+	  pIndex(_pIndex), seekBase(seek), headerSize(4 * pIndex->wordSize), isDirty(false), generation(pIndex->changeLog.GetGeneration()), defaultDuration(0)
+{
+	IndexWord value;
+	if ((pIndex->pFile != NULL) && (seekBase > 0)
+	    && (pIndex->Seek(seekBase) == 0)
+	    && pIndex->ReadWord(value))
+	{
+		yearTableCapacity = (size_t)value;
+		bufferSize = headerSize + yearTableCapacity * pIndex->wordSize;
+		pBuffer = new char[bufferSize];
+
+		pIndex->SetWord(pBuffer, 0, yearTableCapacity);
+		if (pIndex->ReadWord(value))
+		{
+			yearTableBase = (unsigned int)value;
+		}
+		else
+		{
+			yearTableBase = 0;
+			isDirty = true;
+		}
+		pIndex->SetWord(pBuffer, 1, yearTableBase);
+		if (pIndex->Read(pBuffer + 2 * pIndex->wordSize, bufferSize - 2 * pIndex->wordSize) == false)
+		{
+			memset(pBuffer + 2 * pIndex->wordSize, 0, bufferSize - 2 * pIndex->wordSize);  // FIXME: can not set all zero
+			pIndex->SetWord(pBuffer, 2, -1);
+			pIndex->SetWord(pBuffer, 3, -1);
+			isDirty = true;
+		}
+	}
+	else
+	{
+		// error
+		if (pIndex->pFile != NULL)
+		{
+			//fclose(pIndex->pFile);
+			//pIndex->pFile = NULL;
+		}
+		yearTableCapacity = DEFAULT_YEAR_TABLE_CAPACITY;
+
+		bufferSize = headerSize + yearTableCapacity * pIndex->wordSize;
 		pBuffer = new char[bufferSize];
 		memset(pBuffer, 0, bufferSize);
-		*(int *)pBuffer = yearTableCapacity;
-		*((int *)pBuffer + 2) = -1;
-		*((int *)pBuffer + 3) = -1;
+		pIndex->SetWord(pBuffer, 0, yearTableCapacity);
+		pIndex->SetWord(pBuffer, 2, -1);
+		pIndex->SetWord(pBuffer, 3, -1);
 		isDirty = true;
 	}
 
@@ -832,19 +2326,19 @@ ChannelNode::~ChannelNode()
 bool ChannelNode::ForceReloadBuffer()
 {
 	bool result = true;
-	size_t reloadedYearTableCapacity;
+	IndexWord reloadedYearTableCapacity;
 	size_t reloadedBufferSize;
 
-	if ((pIndexFile != NULL) && (seekBase > 0)
-	    && (fseek(pIndexFile, seekBase, SEEK_SET) == 0)
-	    && (fread(&reloadedYearTableCapacity, 1, 4, pIndexFile) == 4))
+	if ((pIndex->pFile != NULL) && (seekBase > 0)
+	    && (pIndex->Seek(seekBase) == 0)
+	    && pIndex->ReadWord(reloadedYearTableCapacity))
 	{
-		if (reloadedYearTableCapacity != yearTableCapacity)
+		if ((size_t)reloadedYearTableCapacity != yearTableCapacity)
 		{
 			result = false;
 
 			// recalculate bufferSize
-			reloadedBufferSize = headerSize + reloadedYearTableCapacity * 4;
+			reloadedBufferSize = headerSize + reloadedYearTableCapacity * pIndex->wordSize;
 			if (reloadedBufferSize > bufferSize)
 			{
 				reloadedBufferSize = bufferSize;
@@ -855,12 +2349,12 @@ bool ChannelNode::ForceReloadBuffer()
 			reloadedBufferSize = bufferSize;
 		}
 
-		if (IndexFileRead(pBuffer + 4, reloadedBufferSize - 4) == false)
+		if (pIndex->Read(pBuffer + pIndex->wordSize, reloadedBufferSize - pIndex->wordSize) == false)
 		{
 			result = false;
 		}
 
-		if ((size_t)*((int *)pBuffer + 1) != yearTableBase)
+		if ((unsigned int)pIndex->GetWord(pBuffer, 1) != yearTableBase)
 		{
 			result = false;
 		}
@@ -873,9 +2367,21 @@ bool ChannelNode::ForceReloadBuffer()
 	return result;
 }
 
+bool ChannelNode::Revalidate()
+{
+	if (!pIndex->changeLog.IsChangedSince(seekBase, bufferSize, generation))
+	{
+		// the buffer is up to date
+		return true;
+	}
+
+	generation = pIndex->changeLog.GetGeneration();
+	return ForceReloadBuffer();
+}
+
 bool ChannelNode::UpdateIndexFile()
 {
-	if (!isDirty || (pBuffer == NULL) || (bufferSize == 0) || (pIndexFile == NULL))
+	if (!isDirty || (pBuffer == NULL) || (bufferSize == 0) || (pIndex->pFile == NULL))
 	{
 		// there is nothing to do
 		return true;
@@ -884,37 +2390,38 @@ bool ChannelNode::UpdateIndexFile()
 
 	if (seekBase > 0)
 	{
-		if (fseek(pIndexFile, seekBase, SEEK_SET) != 0)
+		if (pIndex->Seek(seekBase) != 0)
 		{
 			// error:
-			fclose(pIndexFile);
-			pIndexFile = NULL;
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
 			return false;
 		}
 	}
 	else
 	{
-		if (fseek(pIndexFile, 0, SEEK_END) != 0)
+		if (pIndex->SeekToEnd() != 0)
 		{
 			// error:
-			fclose(pIndexFile);
-			pIndexFile = NULL;
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
 			return false;
 		}
-		seekBase = ftell(pIndexFile);
+		seekBase = pIndex->Tell();
 		pParent->SetBufferContent(chId, seekBase);
 	}
 
-	if (IndexFileWrite(pBuffer, bufferSize) == false)
+	if (pIndex->Write(pBuffer, bufferSize) == false)
 	{
 		// error:
 		return false;
 	}
+	generation = pIndex->changeLog.RecordChange(seekBase, bufferSize);
 
 	return true;
 }
 
-bool ChannelNode::SetBufferContent(int year, int value)
+bool ChannelNode::SetBufferContent(int year, IndexWord value)
 {
 	if (pBuffer == NULL)
 	{
@@ -924,7 +2431,7 @@ bool ChannelNode::SetBufferContent(int year, int value)
 
 	if (yearTableBase == 0)
 	{
-		*((int *)pBuffer + 1) = yearTableBase = year;
+		pIndex->SetWord(pBuffer, 1, yearTableBase = year);
 		isDirty = true;
 	}
 
@@ -936,17 +2443,17 @@ bool ChannelNode::SetBufferContent(int year, int value)
 		return false;
 	}
 
-	*((int *)(pBuffer + headerSize) + index) = value;
+	pIndex->SetWord(pBuffer + headerSize, index, value);
 
-	int firstIndex = *((int *)pBuffer + 2);
-	int lastIndex  = *((int *)pBuffer + 3);
+	int firstIndex = pIndex->GetWord(pBuffer, 2);
+	int lastIndex  = pIndex->GetWord(pBuffer, 3);
 	if ((firstIndex == -1) || (index < firstIndex))
 	{
-		*((int *)pBuffer + 2) = index;
+		pIndex->SetWord(pBuffer, 2, index);
 	}
 	if ((lastIndex == -1) || (index > lastIndex))
 	{
-		*((int *)pBuffer + 3) = index;
+		pIndex->SetWord(pBuffer, 3, index);
 	}
 
 	isDirty = true;
@@ -955,13 +2462,13 @@ bool ChannelNode::SetBufferContent(int year, int value)
 
 YearNode * ChannelNode::GetYearNode(time_t time, bool isCreate)
 {
-	struct tm *t;
-	t = localtime(&time);
+	struct tm tmBuffer;
+	struct tm *t = LocalTime(&time, &tmBuffer);
 	int year = 1900 + t->tm_year;
 
 	if ((yearTableBase == 0) && (seekBase > 0))
 	{
-		yearTableBase = *((int *)pBuffer + 1);
+		yearTableBase = pIndex->GetWord(pBuffer, 1);
 	}
 
 	if (yearTableBase == 0)
@@ -972,7 +2479,7 @@ YearNode * ChannelNode::GetYearNode(time_t time, bool isCreate)
 		}
 		else
 		{
-			*((int *)pBuffer + 1) = yearTableBase = year;
+			pIndex->SetWord(pBuffer, 1, yearTableBase = year);
 			isDirty = true;
 		}
 	}
@@ -988,11 +2495,11 @@ YearNode * ChannelNode::GetYearNode(time_t time, bool isCreate)
 	if (pYearTable[index] == NULL)
 	{
 		// try to load the specific year node
-		if ((pIndexFile != NULL) && (pBuffer != NULL))
+		if ((pIndex->pFile != NULL) && (pBuffer != NULL))
 		{
-			if (*((int *)(pBuffer + headerSize) + index) != 0)
+			if (pIndex->GetWord(pBuffer + headerSize, index) != 0)
 			{
-				pYearTable[index] = new YearNode(year, *((int *)(pBuffer + headerSize) + index));
+				pYearTable[index] = new YearNode(pIndex, year, pIndex->GetWord(pBuffer + headerSize, index));
 				pYearTable[index]->pParent = this;
 
 				if (pYearTable[index]->isDirty)
@@ -1010,7 +2517,7 @@ YearNode * ChannelNode::GetYearNode(time_t time, bool isCreate)
 		// if there exist no specific year node, create a new one
 		if ((pYearTable[index] == NULL) && isCreate)
 		{
-			pYearTable[index] = new YearNode(year);
+			pYearTable[index] = new YearNode(pIndex, year);
 			pYearTable[index]->pParent = this;
 		}
 	}
@@ -1020,15 +2527,15 @@ YearNode * ChannelNode::GetYearNode(time_t time, bool isCreate)
 
 YearNode * ChannelNode::GetYearNodeForwardly(time_t time)
 {
-	ForceReloadBuffer();
+	Revalidate();
 
-	struct tm *t;
-	t = localtime(&time);
+	struct tm tmBuffer;
+	struct tm *t = LocalTime(&time, &tmBuffer);
 	int year = 1900 + t->tm_year;
 
 	if ((yearTableBase == 0) && (seekBase > 0))
 	{
-		yearTableBase = *((int *)pBuffer + 1);
+		yearTableBase = pIndex->GetWord(pBuffer, 1);
 	}
 
 	if (yearTableBase == 0)
@@ -1037,7 +2544,7 @@ YearNode * ChannelNode::GetYearNodeForwardly(time_t time)
 	}
 
 	int index = (unsigned int)year <= yearTableBase ? 0 : year - yearTableBase;
-	int lastIndex = *((int *)pBuffer + 3);
+	int lastIndex = pIndex->GetWord(pBuffer, 3);
 
 	if ((index < 0) || ((size_t)index >= yearTableCapacity)
 	    || (lastIndex < 0)
@@ -1052,12 +2559,12 @@ YearNode * ChannelNode::GetYearNodeForwardly(time_t time)
 		if (pYearTable[index] == NULL)
 		{
 			// try to load the specific year node
-			if ((pIndexFile != NULL) && (pBuffer != NULL))
+			if ((pIndex->pFile != NULL) && (pBuffer != NULL))
 			{
-				int yearSeekBase;
-				if ((yearSeekBase = *((int *)(pBuffer + headerSize) + index)) != 0)
+				IndexWord yearSeekBase;
+				if ((yearSeekBase = pIndex->GetWord(pBuffer + headerSize, index)) != 0)
 				{
-					pYearTable[index] = new YearNode(year, yearSeekBase);
+					pYearTable[index] = new YearNode(pIndex, yearTableBase + index, yearSeekBase);
 					pYearTable[index]->pParent = this;
 
 					if (pYearTable[index]->isDirty)
@@ -1081,15 +2588,15 @@ YearNode * ChannelNode::GetYearNodeForwardly(time_t time)
 
 YearNode * ChannelNode::GetYearNodeBackwardly(time_t time)
 {
-	ForceReloadBuffer();
+	Revalidate();
 
-	struct tm *t;
-	t = localtime(&time);
+	struct tm tmBuffer;
+	struct tm *t = LocalTime(&time, &tmBuffer);
 	int year = 1900 + t->tm_year;
 
 	if ((yearTableBase == 0) && (seekBase > 0))
 	{
-		yearTableBase = *((int *)pBuffer + 1);
+		yearTableBase = pIndex->GetWord(pBuffer, 1);
 	}
 
 	if (yearTableBase == 0)
@@ -1098,7 +2605,7 @@ YearNode * ChannelNode::GetYearNodeBackwardly(time_t time)
 	}
 
 	int index = year - yearTableBase;
-	int firstIndex = *((int *)pBuffer + 2);
+	int firstIndex = pIndex->GetWord(pBuffer, 2);
 
 	if ((size_t)index >= yearTableCapacity)
 	{
@@ -1117,12 +2624,12 @@ YearNode * ChannelNode::GetYearNodeBackwardly(time_t time)
 		if (pYearTable[index] == NULL)
 		{
 			// try to load the specific year node
-			if ((pIndexFile != NULL) && (pBuffer != NULL))
+			if ((pIndex->pFile != NULL) && (pBuffer != NULL))
 			{
-				int yearSeekBase;
-				if ((yearSeekBase = *((int *)(pBuffer + headerSize) + index)) != 0)
+				IndexWord yearSeekBase;
+				if ((yearSeekBase = pIndex->GetWord(pBuffer + headerSize, index)) != 0)
 				{
-					pYearTable[index] = new YearNode(year, yearSeekBase);
+					pYearTable[index] = new YearNode(pIndex, yearTableBase + index, yearSeekBase);
 					pYearTable[index]->pParent = this;
 
 					if (pYearTable[index]->isDirty)
@@ -1161,11 +2668,98 @@ inline int ChannelNode::GetCurrentDuration()
 	return defaultDuration;
 }
 
+// unload a year node from the table, it is loaded again when searched
+void ChannelNode::UnloadYearNode(YearNode *pYearNode)
+{
+	for (size_t i = 0; i < yearTableCapacity; i++)
+	{
+		if (pYearTable[i] == pYearNode)
+		{
+			pYearTable[i] = NULL;
+		}
+	}
+	delete pYearNode;
+}
+
+// for recycling
+bool ChannelNode::RemoveYearNode(YearNode *pYearNode)
+{
+	int index;
+	for (index = 0; ((size_t)index < yearTableCapacity) && (pYearTable[index] != pYearNode); index++)
+	{
+	}
+
+	if ((size_t)index >= yearTableCapacity)
+	{
+		// error: not in this channel
+		return false;
+	}
+
+	pIndex->SetWord(pBuffer + headerSize, index, 0);
+
+	int firstIndex = pIndex->GetWord(pBuffer, 2);
+	int lastIndex  = pIndex->GetWord(pBuffer, 3);
+	for ( ; (firstIndex >= 0) && (firstIndex <= lastIndex) && (pIndex->GetWord(pBuffer + headerSize, firstIndex) == 0); firstIndex++)
+	{
+	}
+	for ( ; (lastIndex >= firstIndex) && (pIndex->GetWord(pBuffer + headerSize, lastIndex) == 0); lastIndex--)
+	{
+	}
+	if ((firstIndex < 0) || (firstIndex > lastIndex))
+	{
+		// no year left
+		firstIndex = lastIndex = -1;
+	}
+	pIndex->SetWord(pBuffer, 2, firstIndex);
+	pIndex->SetWord(pBuffer, 3, lastIndex);
+	isDirty = true;
+
+	UnloadYearNode(pYearNode);
+	return true;
+}
+
+// for capacity planning
+uint64_t ChannelNode::GetByteCount()
+{
+	Revalidate();
+
+	uint64_t byteCount = 0;
+	for (size_t index = 0; index < yearTableCapacity; index++)
+	{
+		if (pYearTable[index] == NULL)
+		{
+			// try to load the specific year node
+			IndexWord yearSeekBase;
+			if ((pIndex->pFile != NULL) && (yearTableBase != 0)
+			    && ((yearSeekBase = pIndex->GetWord(pBuffer + headerSize, index)) != 0))
+			{
+				pYearTable[index] = new YearNode(pIndex, yearTableBase + index, yearSeekBase);
+				pYearTable[index]->pParent = this;
+
+				if (pYearTable[index]->isDirty)
+				{
+					// error
+					delete pYearTable[index];
+					pYearTable[index] = NULL;
+				}
+			}
+		}
+
+		if (pYearTable[index] != NULL)
+		{
+			byteCount += pYearTable[index]->GetByteCount();
+		}
+	}
+
+	return byteCount;
+}
+
 //---------------------------------------------------------------------------
 //---------------------------------------------------------------------------
-YearNode::YearNode(int year, int seek)
+YearNode::YearNode(IndexFile *_pIndex, int year, IndexWord seek)
 	: pFirstDateNode(NULL), pLastDateNode(NULL), pParent(NULL),
-	  seekBase(seek), headerSize(12), isDirty(false)
+	  pIndex(_pIndex), seekBase(seek), headerSize(3 * pIndex->wordSize), isDirty(false), generation(pIndex->changeLog.GetGeneration()),
+	  pUsageTable(NULL), usageGeneration(0)
 {
 	if (year < 1970)
 	{
@@ -1180,6 +2774,7 @@ YearNode::YearNode(int year, int seek)
 		t.tm_hour = 0;
 		t.tm_min  = 0;
 		t.tm_sec  = 0;
+		t.tm_isdst = -1;
 		startTime = mktime(&t);
 
 		t.tm_year = year + 1 - 1900;
@@ -1188,6 +2783,7 @@ YearNode::YearNode(int year, int seek)
 		t.tm_hour = 0;
 		t.tm_min  = 0;
 		t.tm_sec  = 0;
+		t.tm_isdst = -1;
 		endTime   = mktime(&t);
 	}
 
@@ -1197,42 +2793,42 @@ YearNode::YearNode(int year, int seek)
 
 	dateTableCapacity = 366;
 
-	int valueIsLeapYear = 0;
-	if ((pIndexFile != NULL) && (seekBase > 0)
-	    && (fseek(pIndexFile, seekBase, SEEK_SET) == 0)
-	    && (fread(&valueIsLeapYear, 1, 4, pIndexFile) == 4))
+	IndexWord valueIsLeapYear = 0;
+	if ((pIndex->pFile != NULL) && (seekBase > 0)
+	    && (pIndex->Seek(seekBase) == 0)
+	    && pIndex->ReadWord(valueIsLeapYear))
 	{
 		if (isLeapYear == !valueIsLeapYear)
 		{
 			// FIXME: something wrong
 		}
-		bufferSize = headerSize + dateTableCapacity * 4;
+		bufferSize = headerSize + dateTableCapacity * pIndex->wordSize;
 		pBuffer = new char[bufferSize];
 
-		*(int *)pBuffer = isLeapYear ? -1 : 0;
-		if (IndexFileRead(pBuffer + 4, bufferSize - 4) == false)
+		pIndex->SetWord(pBuffer, 0, isLeapYear ? -1 : 0);
+		if (pIndex->Read(pBuffer + pIndex->wordSize, bufferSize - pIndex->wordSize) == false)
 		{
-			*((int *)pBuffer + 1) = -1;
-			*((int *)pBuffer + 2) = -1;
-			memset(pBuffer + 12, 0, bufferSize - 12);
+			pIndex->SetWord(pBuffer, 1, -1);
+			pIndex->SetWord(pBuffer, 2, -1);
+			memset(pBuffer + headerSize, 0, bufferSize - headerSize);
 			isDirty = true;
 		}
 	}
 	else
 	{
 		// error
-		if (pIndexFile != NULL)
+		if (pIndex->pFile != NULL)
 		{
-			//fclose(pIndexFile);
-			//pIndexFile = NULL;
+			//fclose(pIndex->pFile);
+			//pIndex->pFile = NULL;
 		}
 
-		bufferSize = headerSize + dateTableCapacity * 4;
+		bufferSize = headerSize + dateTableCapacity * pIndex->wordSize;
 		pBuffer = new char[bufferSize];
 		memset(pBuffer, 0, bufferSize);
-		*(int *)pBuffer = isLeapYear ? -1 : 0;
-		*((int *)pBuffer + 1) = -1;
-		*((int *)pBuffer + 2) = -1;
+		pIndex->SetWord(pBuffer, 0, isLeapYear ? -1 : 0);
+		pIndex->SetWord(pBuffer, 1, -1);
+		pIndex->SetWord(pBuffer, 2, -1);
 		isDirty = true;
 	}
 
@@ -1256,16 +2852,21 @@ YearNode::~YearNode()
 		}
 		delete[] pDateTable;
 	}
+
+	if (pUsageTable != NULL)
+	{
+		delete[] pUsageTable;
+	}
 }
 
 bool YearNode::ForceReloadBuffer()
 {
 	bool result = true;
 	size_t reloadedDateTableCapacity = 366;
-	size_t reloadedBufferSize = headerSize + reloadedDateTableCapacity * 4;
+	size_t reloadedBufferSize = headerSize + reloadedDateTableCapacity * pIndex->wordSize;
 
-	if ((pIndexFile != NULL) && (seekBase > 0)
-	    && (fseek(pIndexFile, seekBase, SEEK_SET) == 0))
+	if ((pIndex->pFile != NULL) && (seekBase > 0)
+	    && (pIndex->Seek(seekBase) == 0))
 	{
 		if (reloadedBufferSize != bufferSize)
 		{
@@ -1277,7 +2878,7 @@ bool YearNode::ForceReloadBuffer()
 			}
 		}
 
-		if (IndexFileRead(pBuffer, reloadedBufferSize) == false)
+		if (pIndex->Read(pBuffer, reloadedBufferSize) == false)
 		{
 			result = false;
 		}
@@ -1290,9 +2891,21 @@ bool YearNode::ForceReloadBuffer()
 	return result;
 }
 
+bool YearNode::Revalidate()
+{
+	if (!pIndex->changeLog.IsChangedSince(seekBase, bufferSize, generation))
+	{
+		// the buffer is up to date
+		return true;
+	}
+
+	generation = pIndex->changeLog.GetGeneration();
+	return ForceReloadBuffer();
+}
+
 bool YearNode::UpdateIndexFile()
 {
-	if (!isDirty || (pBuffer == NULL) || (bufferSize == 0) || (pIndexFile == NULL))
+	if (!isDirty || (pBuffer == NULL) || (bufferSize == 0) || (pIndex->pFile == NULL))
 	{
 		// there is nothing to do
 		return true;
@@ -1301,39 +2914,40 @@ bool YearNode::UpdateIndexFile()
 
 	if (seekBase > 0)
 	{
-		if (fseek(pIndexFile, seekBase, SEEK_SET) != 0)
+		if (pIndex->Seek(seekBase) != 0)
 		{
 			// error:
-			fclose(pIndexFile);
-			pIndexFile = NULL;
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
 			return false;
 		}
 	}
 	else
 	{
-		if (fseek(pIndexFile, 0, SEEK_END) != 0)
+		if (pIndex->SeekToEnd() != 0)
 		{
 			// error:
-			fclose(pIndexFile);
-			pIndexFile = NULL;
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
 			return false;
 		}
-		seekBase = ftell(pIndexFile);
-		struct tm *t;
-		t = localtime(&startTime);
+		seekBase = pIndex->Tell();
+		struct tm tmBuffer;
+		struct tm *t = LocalTime(&startTime, &tmBuffer);
 		pParent->SetBufferContent(1900 + t->tm_year, seekBase);
 	}
 
-	if (IndexFileWrite(pBuffer, bufferSize) == false)
+	if (pIndex->Write(pBuffer, bufferSize) == false)
 	{
 		// error:
 		return false;
 	}
+	generation = pIndex->changeLog.RecordChange(seekBase, bufferSize);
 
 	return true;
 }
 
-bool YearNode::SetBufferContent(time_t time, int value)
+bool YearNode::SetBufferContent(time_t time, IndexWord value)
 {
 	if ((time < startTime) || (time >= endTime) || (pBuffer == NULL))
 	{
@@ -1350,17 +2964,17 @@ bool YearNode::SetBufferContent(time_t time, int value)
 		return false;
 	}
 
-	*((int *)(pBuffer + headerSize) + index) = value;
+	pIndex->SetWord(pBuffer + headerSize, index, value);
 
-	int firstIndex = *((int *)pBuffer + 1);
-	int lastIndex  = *((int *)pBuffer + 2);
+	int firstIndex = pIndex->GetWord(pBuffer, 1);
+	int lastIndex  = pIndex->GetWord(pBuffer, 2);
 	if ((firstIndex == -1) || (index < firstIndex))
 	{
-		*((int *)pBuffer + 1) = index;
+		pIndex->SetWord(pBuffer, 1, index);
 	}
 	if ((lastIndex == -1) || (index > lastIndex))
 	{
-		*((int *)pBuffer + 2) = index;
+		pIndex->SetWord(pBuffer, 2, index);
 	}
 
 	isDirty = true;
@@ -1387,11 +3001,11 @@ DateNode * YearNode::GetDateNode(time_t time, bool isCreate)
 	if (pDateTable[index] == NULL)
 	{
 		// try to load the specific date node
-		if ((pIndexFile != NULL) && (pBuffer != NULL))
+		if ((pIndex->pFile != NULL) && (pBuffer != NULL))
 		{
-			if (*((int *)(pBuffer + headerSize) + index) != 0)
+			if (pIndex->GetWord(pBuffer + headerSize, index) != 0)
 			{
-				pDateTable[index] = new DateNode(time, 0, *((int *)(pBuffer + headerSize) + index));
+				pDateTable[index] = new DateNode(pIndex, time, 0, pIndex->GetWord(pBuffer + headerSize, index));
 				pDateTable[index]->pParent = this;
 
 				if (pDateTable[index]->isDirty)
@@ -1409,7 +3023,7 @@ DateNode * YearNode::GetDateNode(time_t time, bool isCreate)
 		// if there exist no specific date node, create a new one
 		if ((pDateTable[index] == NULL) && (isCreate))
 		{
-			pDateTable[index] = new DateNode(time, pParent->GetCurrentDuration());
+			pDateTable[index] = new DateNode(pIndex, time, pParent->GetCurrentDuration());
 			pDateTable[index]->pParent = this;
 			pDateTable[index]->UpdateIndexFile();
 		}
@@ -1420,7 +3034,7 @@ DateNode * YearNode::GetDateNode(time_t time, bool isCreate)
 
 DateNode * YearNode::GetDateNodeForwardly(time_t time)
 {
-	ForceReloadBuffer();
+	Revalidate();
 
 	if (time >= endTime)
 	{
@@ -1429,7 +3043,7 @@ DateNode * YearNode::GetDateNodeForwardly(time_t time)
 	}
 
 	int index = time <= startTime ? 0 : (time - startTime) / (24 * 60 * 60);
-	int lastIndex = *((int *)pBuffer + 2);
+	int lastIndex = pIndex->GetWord(pBuffer, 2);
 
 	if ((index < 0) || ((size_t)index >= dateTableCapacity)
 	    || (!isLeapYear && ((size_t)index == dateTableCapacity - 1))
@@ -1445,12 +3059,12 @@ DateNode * YearNode::GetDateNodeForwardly(time_t time)
 		if (pDateTable[index] == NULL)
 		{
 			// try to load the specific date node
-			if ((pIndexFile != NULL) && (pBuffer != NULL))
+			if ((pIndex->pFile != NULL) && (pBuffer != NULL))
 			{
-				int dateSeekBase;
-				if ((dateSeekBase = *((int *)(pBuffer + headerSize) + index)) != 0)
+				IndexWord dateSeekBase;
+				if ((dateSeekBase = pIndex->GetWord(pBuffer + headerSize, index)) != 0)
 				{
-					pDateTable[index] = new DateNode(time, 0, dateSeekBase);
+					pDateTable[index] = new DateNode(pIndex, startTime + index * 24 * 60 * 60, 0, dateSeekBase);
 					pDateTable[index]->pParent = this;
 
 					if (pDateTable[index]->isDirty)
@@ -1474,7 +3088,7 @@ DateNode * YearNode::GetDateNodeForwardly(time_t time)
 
 DateNode * YearNode::GetDateNodeBackwardly(time_t time)
 {
-	ForceReloadBuffer();
+	Revalidate();
 
 	if (time < startTime)
 	{
@@ -1483,7 +3097,7 @@ DateNode * YearNode::GetDateNodeBackwardly(time_t time)
 	}
 
 	int index = ((time >= endTime ? endTime - 1 : time) - startTime) / (24 * 60 * 60);
-	int firstIndex = *((int *)pBuffer + 1);
+	int firstIndex = pIndex->GetWord(pBuffer, 1);
 
 	if ((index < 0) || ((size_t)index >= dateTableCapacity)
 	    || (!isLeapYear && ((size_t)index == dateTableCapacity - 1))
@@ -1499,12 +3113,12 @@ DateNode * YearNode::GetDateNodeBackwardly(time_t time)
 		if (pDateTable[index] == NULL)
 		{
 			// try to load the specific date node
-			if ((pIndexFile != NULL) && (pBuffer != NULL))
+			if ((pIndex->pFile != NULL) && (pBuffer != NULL))
 			{
-				int dateSeekBase;
-				if ((dateSeekBase = *((int *)(pBuffer + headerSize) + index)) != 0)
+				IndexWord dateSeekBase;
+				if ((dateSeekBase = pIndex->GetWord(pBuffer + headerSize, index)) != 0)
 				{
-					pDateTable[index] = new DateNode(time, 0, dateSeekBase);
+					pDateTable[index] = new DateNode(pIndex, startTime + index * 24 * 60 * 60, 0, dateSeekBase);
 					pDateTable[index]->pParent = this;
 
 					if (pDateTable[index]->isDirty)
@@ -1526,23 +3140,142 @@ DateNode * YearNode::GetDateNodeBackwardly(time_t time)
 	return NULL;
 }
 
+// unload a date node from the table, it is loaded again when searched
+void YearNode::UnloadDateNode(DateNode *pDateNode)
+{
+	for (size_t i = 0; i < dateTableCapacity; i++)
+	{
+		if (pDateTable[i] == pDateNode)
+		{
+			pDateTable[i] = NULL;
+		}
+	}
+	delete pDateNode;
+}
+
+// for recycling
+bool YearNode::RemoveDateNode(DateNode *pDateNode)
+{
+	int index;
+	for (index = 0; ((size_t)index < dateTableCapacity) && (pDateTable[index] != pDateNode); index++)
+	{
+	}
+
+	if ((size_t)index >= dateTableCapacity)
+	{
+		// error: not in this year
+		return false;
+	}
+
+	pIndex->SetWord(pBuffer + headerSize, index, 0);
+
+	int firstIndex = pIndex->GetWord(pBuffer, 1);
+	int lastIndex  = pIndex->GetWord(pBuffer, 2);
+	for ( ; (firstIndex >= 0) && (firstIndex <= lastIndex) && (pIndex->GetWord(pBuffer + headerSize, firstIndex) == 0); firstIndex++)
+	{
+	}
+	for ( ; (lastIndex >= firstIndex) && (pIndex->GetWord(pBuffer + headerSize, lastIndex) == 0); lastIndex--)
+	{
+	}
+	if ((firstIndex < 0) || (firstIndex > lastIndex))
+	{
+		// no date left
+		firstIndex = lastIndex = -1;
+	}
+	pIndex->SetWord(pBuffer, 1, firstIndex);
+	pIndex->SetWord(pBuffer, 2, lastIndex);
+	isDirty = true;
+
+	UnloadDateNode(pDateNode);
+	return true;
+}
+
+int YearNode::GetDateIndex(time_t time)
+{
+	if ((time < startTime) || (time >= endTime))
+	{
+		// error: wrong time
+		return -1;
+	}
+
+	int index = (time - startTime) / (24 * 60 * 60);
+
+	if ((index < 0) || ((size_t)index >= dateTableCapacity)
+	    || (!isLeapYear && ((size_t)index == dateTableCapacity - 1)))
+	{
+		// error: wrong index
+		return -1;
+	}
+
+	return index;
+}
+
+// for capacity planning
+// only the dates which the change log tells changed are read again
+uint64_t YearNode::GetByteCount()
+{
+	Revalidate();
+
+	if (pUsageTable == NULL)
+	{
+		pUsageTable = new IndexWord[2 * dateTableCapacity];
+		memset(pUsageTable, 0, 2 * dateTableCapacity * sizeof(IndexWord));
+	}
+
+	// the generation is taken first, a change made while reading is read again next time
+	int currentGeneration = pIndex->changeLog.GetGeneration();
+	uint64_t byteCount = 0;
+	for (size_t index = 0; index < dateTableCapacity; index++)
+	{
+		IndexWord dateSeekBase = pIndex->GetWord(pBuffer + headerSize, index);
+		IndexWord *pUsage = pUsageTable + 2 * index;
+		if (dateSeekBase <= 0)
+		{
+			pUsage[0] = pUsage[1] = 0;
+			continue;
+		}
+
+		if ((pUsage[0] != dateSeekBase)
+		    || pIndex->changeLog.IsChangedSince(dateSeekBase, 7 * pIndex->wordSize, usageGeneration))
+		{
+			uint64_t dateByteCount = 0;
+			DateNode::ReadUsage(pIndex, dateSeekBase, dateByteCount, NULL);
+			pUsage[0] = dateSeekBase;
+			pUsage[1] = (IndexWord)dateByteCount;
+		}
+		byteCount += pUsage[1];
+	}
+	usageGeneration = currentGeneration;
+
+	return byteCount;
+}
+
 //---------------------------------------------------------------------------
 //---------------------------------------------------------------------------
-DateNode::DateNode(time_t time, int duration, int seek)
+DateNode::DateNode(IndexFile *_pIndex, time_t time, int duration, IndexWord seek)
 	: extraNodeCount(0),
 	  pFirstFileNode(NULL), pLastFileNode(NULL), pParent(NULL),
-	  seekBase(seek), headerSize(16), isDirty(false)
+	  pIndex(_pIndex), seekBase(seek), isDirty(false), generation(pIndex->changeLog.GetGeneration()),
+	  pDiskTable(NULL), isDiskTableDirty(false), isMinuteTableDirty(false)
 {
+	IndexWord totalCapacityValue;
+	IndexWord durationValue;
 	size_t totalCapacity;
 
+	// the header fills a cache line in the aligned format
+	headerSize = pIndex->alignment > 4 * pIndex->wordSize ? pIndex->alignment : 4 * pIndex->wordSize;
+
 	startTime = (time - TIMEZONE) / (24 * 60 * 60) * (24 * 60 * 60) + TIMEZONE;
 	endTime = startTime + 24 * 60 * 60;
+	memset(minuteTable, 0, sizeof(minuteTable));
 
-	if ((pIndexFile != NULL) && (seekBase > 0)
-	    && (fseek(pIndexFile, seekBase, SEEK_SET) == 0)
-	    && (fread(&totalCapacity, 1, 4, pIndexFile) == 4)
-	    && (fread(&duration, 1, 4, pIndexFile) == 4))
+	if ((pIndex->pFile != NULL) && (seekBase > 0)
+	    && (pIndex->Seek(seekBase) == 0)
+	    && pIndex->ReadWord(totalCapacityValue)
+	    && pIndex->ReadWord(durationValue))
 	{
+		totalCapacity = (size_t)totalCapacityValue;
+		duration = (int)durationValue;
 		fileDuration = duration < 1 ? 1
 		               : duration > 60 * 60 ? 60 * 60 : duration;
 
@@ -1555,24 +3288,30 @@ DateNode::DateNode(time_t time, int duration, int seek)
 		}
 		extraTableCapacity = totalCapacity - fileTableCapacity;
 
-		bufferSize = headerSize + totalCapacity * 4 * 4;
+		bufferSize = headerSize + totalCapacity * 4 * pIndex->wordSize;
 		pBuffer = new char[bufferSize];
 
-		*(int *)pBuffer = totalCapacity;
-		*((int *)pBuffer + 1) = fileDuration;
-		if (IndexFileRead(pBuffer + 8, bufferSize - 8) == false)
+		pIndex->SetWord(pBuffer, 0, totalCapacity);
+		pIndex->SetWord(pBuffer, 1, fileDuration);
+		diskTableSize = totalCapacity;
+		if (pIndex->Read(pBuffer + 2 * pIndex->wordSize, bufferSize - 2 * pIndex->wordSize) == false)
 		{
-			memset(pBuffer + 8, 0, bufferSize - 8);
+			memset(pBuffer + 2 * pIndex->wordSize, 0, bufferSize - 2 * pIndex->wordSize);
 			isDirty = true;
 		}
+		else
+		{
+			LoadDiskTable();
+			LoadMinuteTable();
+		}
 	}
 	else
 	{
 		// error
-		if (pIndexFile != NULL)
+		if (pIndex->pFile != NULL)
 		{
-			//fclose(pIndexFile);
-			//pIndexFile = NULL;
+			//fclose(pIndex->pFile);
+			//pIndex->pFile = NULL;
 		}
 
 		fileDuration = duration < 1 ? 1
@@ -1582,11 +3321,12 @@ DateNode::DateNode(time_t time, int duration, int seek)
 		extraTableCapacity = fileTableCapacity > 24 * 60 ? fileTableCapacity : 24 * 60;
 		totalCapacity = fileTableCapacity + extraTableCapacity;
 
-		bufferSize = headerSize + totalCapacity * 4 * 4;
+		bufferSize = headerSize + totalCapacity * 4 * pIndex->wordSize;
 		pBuffer = new char[bufferSize];
 		memset(pBuffer, 0, bufferSize);
-		*(int *)pBuffer = totalCapacity;
-		*((int *)pBuffer + 1) = fileDuration;
+		pIndex->SetWord(pBuffer, 0, totalCapacity);
+		pIndex->SetWord(pBuffer, 1, fileDuration);
+		diskTableSize = totalCapacity;
 		isDirty = true;
 	}
 
@@ -1610,468 +3350,1525 @@ DateNode::~DateNode()
 		}
 		delete[] pFileTable;
 	}
+
+	if (pDiskTable != NULL)
+	{
+		delete[] pDiskTable;
+	}
 }
 
 bool DateNode::ForceReloadBuffer()
 {
 	bool result = true;
-	size_t reloadedTotalCapacity;
-	size_t reloadedFileDuration;
+	IndexWord reloadedTotalCapacity;
+	IndexWord reloadedFileDuration;
 	size_t reloadedBufferSize;
 
-	if ((pIndexFile != NULL) && (seekBase > 0)
-	    && (fseek(pIndexFile, seekBase, SEEK_SET) == 0)
-	    && (fread(&reloadedTotalCapacity, 1, 4, pIndexFile) == 4)
-	    && (fread(&reloadedFileDuration, 1, 4, pIndexFile) == 4))
+	if ((pIndex->pFile != NULL) && (seekBase > 0)
+	    && (pIndex->Seek(seekBase) == 0)
+	    && pIndex->ReadWord(reloadedTotalCapacity)
+	    && pIndex->ReadWord(reloadedFileDuration))
 	{
 		reloadedFileDuration = reloadedFileDuration < 1 ? 1
 		               : reloadedFileDuration > 60 * 60 ? 60 * 60 : reloadedFileDuration;
 
-		if (reloadedFileDuration != (size_t)fileDuration)
+		if (reloadedFileDuration != fileDuration)
 		{
 			result = false;
 		}
 
-		if (reloadedTotalCapacity != fileTableCapacity + extraTableCapacity)
+		if ((size_t)reloadedTotalCapacity != fileTableCapacity + extraTableCapacity)
 		{
 			result = false;
 
-			if (reloadedTotalCapacity > fileTableCapacity + extraTableCapacity)
+			if ((size_t)reloadedTotalCapacity > fileTableCapacity + extraTableCapacity)
 			{
 				reloadedTotalCapacity = fileTableCapacity + extraTableCapacity;
 			}
 		}
 
 		// recalculate bufferSize
-		reloadedBufferSize = headerSize + reloadedTotalCapacity * 4 * 4;
+		reloadedBufferSize = headerSize + reloadedTotalCapacity * 4 * pIndex->wordSize;
 		if (reloadedBufferSize > bufferSize)
 		{
 			reloadedBufferSize = bufferSize;
 		}
 
-		if (IndexFileRead(pBuffer + 8, reloadedBufferSize - 8) == false)
+		if (pIndex->Read(pBuffer + 2 * pIndex->wordSize, reloadedBufferSize - 2 * pIndex->wordSize) == false)
+		{
+			result = false;
+		}
+		else if (!LoadDiskTable() || !LoadMinuteTable())
 		{
 			result = false;
 		}
 	}
-	else
+	else
+	{
+		result = false;
+	}
+
+	return result;
+}
+
+bool DateNode::Revalidate()
+{
+	if (!pIndex->changeLog.IsChangedSince(seekBase, bufferSize, generation))
+	{
+		// the buffer is up to date
+		return true;
+	}
+
+	generation = pIndex->changeLog.GetGeneration();
+	return ForceReloadBuffer();
+}
+
+bool DateNode::UpdateIndexFile()
+{
+	if (!isDirty || (pBuffer == NULL) || (bufferSize == 0) || (pIndex->pFile == NULL))
+	{
+		// there is nothing to do
+		return true;
+	}
+	isDirty = false;
+
+	// the disk table and the minute table are written first, the header links to them
+	if (!UpdateDiskTable() || !UpdateMinuteTable())
+	{
+		// error:
+		return false;
+	}
+
+	if (seekBase > 0)
+	{
+		if (pIndex->Seek(seekBase) != 0)
+		{
+			// error:
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+			return false;
+		}
+	}
+	else
+	{
+		if (pIndex->SeekToEnd() != 0)
+		{
+			// error:
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+			return false;
+		}
+		seekBase = pIndex->Tell();
+		pParent->SetBufferContent(startTime, seekBase);
+	}
+
+	if (pIndex->Write(pBuffer, bufferSize) == false)
+	{
+		// error:
+		return false;
+	}
+	generation = pIndex->changeLog.RecordChange(seekBase, bufferSize);
+
+	return true;
+}
+
+bool DateNode::SetBufferContent(time_t time, FileNode *currentNode)
+{
+	if ((time < startTime) || (time >= endTime) || (pBuffer == NULL))
+	{
+		// error: wrong time or wrong buffer
+		return false;
+	}
+
+	int index = (time - startTime) / fileDuration;
+
+	if ((index < 0) || ((size_t)index >= fileTableCapacity))
+	{
+		// error: wrong index
+		return false;
+	}
+
+	if (seekBase > 0)
+	{
+		// FIXME: collision list
+		currentNode->seekBase = seekBase + headerSize + index * 4 * pIndex->wordSize;
+	}
+
+	pIndex->SetWord(pBuffer + headerSize, index * 4, currentNode->startTime);
+	pIndex->SetWord(pBuffer + headerSize, index * 4 + 1, currentNode->endTime);
+	SetDiskId(index, currentNode->diskId);
+	if ((currentNode->pPrev != NULL) && (currentNode->pPrev->seekBase > 0))
+	{
+		pIndex->SetWord(pBuffer + headerSize, index * 4 + 2, currentNode->pPrev->seekBase);
+	}
+	else
+	{
+		//pIndex->SetWord(pBuffer + headerSize, index * 4 + 2, 0);
+	}
+	if ((currentNode->pNext != NULL) && (currentNode->pNext->seekBase > 0))
+	{
+		pIndex->SetWord(pBuffer + headerSize, index * 4 + 3, currentNode->pNext->seekBase);
+	}
+	else
+	{
+		//pIndex->SetWord(pBuffer + headerSize, index * 4 + 3, 0);
+	}
+
+	if (currentNode->seekBase > 0)
+	{
+		IndexWord firstSeekBase = pIndex->GetWord(pBuffer, 2);
+		IndexWord lastSeekBase  = pIndex->GetWord(pBuffer, 3);
+		if ((firstSeekBase == 0) || (currentNode->seekBase < firstSeekBase))
+		{
+			pIndex->SetWord(pBuffer, 2, currentNode->seekBase);
+		}
+		if ((lastSeekBase == 0) || (currentNode->seekBase > lastSeekBase))
+		{
+			pIndex->SetWord(pBuffer, 3, currentNode->seekBase);
+		}
+	}
+
+	isDirty = true;
+	return true;
+}
+
+FileNode * DateNode::GetFileNodeForwardly(time_t time)
+{
+	Revalidate();
+
+	if (time >= endTime)
+	{
+		// error: wrong time
+		return NULL;
+	}
+
+	int index = time <= startTime ? 0 : (time - startTime) / fileDuration;
+	IndexWord lastSeekBase;
+	time_t lastStartTime;
+	int lastIndex = fileTableCapacity - 1;
+
+	if (((lastSeekBase = pIndex->GetWord(pBuffer, 3)) - seekBase >= (IndexWord)headerSize)
+	    && ((lastStartTime = pIndex->GetWord(pBuffer + lastSeekBase - seekBase, 0)) > startTime))
+	{
+		lastIndex = (lastStartTime - startTime) / fileDuration;
+	}
+
+	if ((index < 0) || ((size_t)index >= fileTableCapacity) || (index > lastIndex))
+	{
+		// error: wrong index
+		return NULL;
+	}
+
+	// while (valid index && (startTime == 0))
+	for ( ; ((size_t)index < fileTableCapacity) && (index <= lastIndex) && (pIndex->GetWord(pBuffer + headerSize + index * 4 * pIndex->wordSize, 0) == 0); index++)
+	{
+	}
+
+	if (((size_t)index >= fileTableCapacity) || (index > lastIndex))
+	{
+		// error: no index
+		return NULL;
+	}
+
+	FileNode *node = pFileTable[index];
+	time_t upperBound = startTime + (index + 1) * fileDuration;
+
+	if (node == NULL)
+	{
+		// try to load the specific file node
+		if ((pIndex->pFile != NULL) && (pBuffer != NULL))
+		{
+			IndexWord offset = headerSize + index * 4 * pIndex->wordSize;
+
+			// if (prev->startTime != 0) then go through the while-loop from prev
+			if ((pIndex->GetWord(pBuffer + offset, 0) != 0)
+			    && (pIndex->GetWord(pBuffer + offset, 2) != 0)
+			    && (pIndex->GetWord(pBuffer + offset, 2) - seekBase >= (IndexWord)headerSize)
+			    && (pIndex->GetWord(pBuffer + pIndex->GetWord(pBuffer + offset, 2) - seekBase, 0) != 0))
+			{
+				offset = pIndex->GetWord(pBuffer + offset, 2) - seekBase;
+			}
+
+			// if (startTime != 0)
+			while ((offset >= (IndexWord)headerSize) && (pIndex->GetWord(pBuffer + offset, 0) != 0) && (pIndex->GetWord(pBuffer + offset, 0) < upperBound))
+			{
+				// if (time < endTime)
+				if (time < pIndex->GetWord(pBuffer + offset, 1))
+				{
+					// bingo!! load it
+					// FIXME: incorrect list nodes
+					//pFileTable[index] = new FileNode(FileNode::FILE_TYPE_NORMAL, seekBase + headerSize + index * 4 * pIndex->wordSize);
+					//pFileTable[index]->pParent = this;
+					//return pFileTable[index];
+					return LoadFileNode(seekBase + offset);
+				}
+				offset = pIndex->GetWord(pBuffer + offset, 3) - seekBase;
+			}
+		}
+	}
+
+	return node;
+}
+
+FileNode * DateNode::GetFileNodeBackwardly(time_t time)
+{
+	Revalidate();
+
+	if (time < startTime)
+	{
+		// error: wrong time
+		return NULL;
+	}
+
+	int index = ((time >= endTime ? endTime - 1 : time) - startTime) / fileDuration;
+	IndexWord firstSeekBase;
+	time_t firstStartTime;
+	int firstIndex = 0;
+
+	if (((firstSeekBase = pIndex->GetWord(pBuffer, 2)) - seekBase >= (IndexWord)headerSize)
+	    && ((firstStartTime = pIndex->GetWord(pBuffer + firstSeekBase - seekBase, 0)) > startTime))
+	{
+		firstIndex = (firstStartTime - startTime) / fileDuration;
+	}
+
+	if ((index < 0) || ((size_t)index >= fileTableCapacity) || (index < firstIndex))
+	{
+		// error: wrong index
+		return NULL;
+	}
+
+	// while (valid index && (startTime == 0))
+	for ( ; (index >= 0) && (index >= firstIndex) && (pIndex->GetWord(pBuffer + headerSize + index * 4 * pIndex->wordSize, 0) == 0); index--)
+	{
+	}
+
+	if ((index < 0) || (index < firstIndex))
+	{
+		// error: no index
+		return NULL;
+	}
+
+	FileNode *node = pFileTable[index];
+	time_t lowerBound = startTime + index * fileDuration;
+
+	if (node == NULL)
+	{
+		// try to load the specific file node
+		if ((pIndex->pFile != NULL) && (pBuffer != NULL))
+		{
+			IndexWord offset = headerSize + index * 4 * pIndex->wordSize;
+
+			// if (next->startTime != 0) then go through the while-loop from next
+			if ((pIndex->GetWord(pBuffer + offset, 1) != 0)
+			    && (pIndex->GetWord(pBuffer + offset, 3) != 0)
+			    && (pIndex->GetWord(pBuffer + offset, 3) - seekBase < (IndexWord)bufferSize)
+			    && (pIndex->GetWord(pBuffer + pIndex->GetWord(pBuffer + offset, 3) - seekBase, 0) != 0))
+			{
+				offset = pIndex->GetWord(pBuffer + offset, 3) - seekBase;
+			}
+
+			// if (endTime != 0)
+			while ((offset < (IndexWord)bufferSize) && (pIndex->GetWord(pBuffer + offset, 1) != 0) && (pIndex->GetWord(pBuffer + offset, 1) >= lowerBound))
+			{
+				// if (time >= startTime)
+				if (time >= pIndex->GetWord(pBuffer + offset, 0))
+				{
+					// bingo!! load it
+					// FIXME: incorrect list nodes
+					//pFileTable[index] = new FileNode(FileNode::FILE_TYPE_NORMAL, seekBase + headerSize + index * 4 * pIndex->wordSize);
+					//pFileTable[index]->pParent = this;
+					//return pFileTable[index];
+					return LoadFileNode(seekBase + offset);
+				}
+				offset = pIndex->GetWord(pBuffer + offset, 2) - seekBase;
+			}
+		}
+	}
+
+	return node;
+}
+
+// load the node from the table in memory instead of the index file
+FileNode * DateNode::LoadFileNode(IndexWord fileSeekBase)
+{
+	if (!IsInBuffer(fileSeekBase))
+	{
+		// error: not in this date node
+		return NULL;
+	}
+
+	const char *pEntry = pBuffer + fileSeekBase - seekBase;
+	FileNode *pFileNode = new FileNode(FileNode::FILE_TYPE_NORMAL, pIndex);
+	pFileNode->seekBase  = fileSeekBase;
+	pFileNode->startTime = pIndex->GetWord(pEntry, 0);
+	pFileNode->endTime   = pIndex->GetWord(pEntry, 1);
+	pFileNode->isDirty   = false;
+	pFileNode->pParent   = this;
+	pFileNode->diskId    = GetDiskId((fileSeekBase - seekBase - headerSize) / (4 * pIndex->wordSize));
+
+	return pFileNode;
+}
+
+// for recycling
+time_t DateNode::GetFirstStartTime()
+{
+	IndexWord firstSeekBase = pIndex->GetWord(pBuffer, 2);
+	return IsInBuffer(firstSeekBase) ? pIndex->GetWord(pBuffer + firstSeekBase - seekBase, 0) : 0;
+}
+
+// for recycling
+// clear the oldest entries which end before the time, up to the count or to
+// the entry to keep, and return their clips; the bytes of the date are
+// lowered by RootNode::RemoveUsage() once the files are measured
+size_t DateNode::RemoveOldestFiles(int chId, time_t before, size_t maxCount, IndexWord keptSeekBase, std::vector<RootIndexNode::Clip> &clips)
+{
+	size_t entrySize = 4 * pIndex->wordSize;
+	size_t count = 0;
+	size_t index;
+
+	for (index = 0; index < fileTableCapacity; index++)
+	{
+		char *pEntry = pBuffer + headerSize + index * entrySize;
+		if (pIndex->GetWord(pEntry, 0) == 0)
+		{
+			// no file in this period
+			continue;
+		}
+
+		if ((count >= maxCount) || (pIndex->GetWord(pEntry, 1) > before)
+		    || (seekBase + (IndexWord)(headerSize + index * entrySize) == keptSeekBase))
+		{
+			break;
+		}
+
+		FileNode fileNode;
+		fileNode.chId      = chId;
+		fileNode.startTime = pIndex->GetWord(pEntry, 0);
+		fileNode.endTime   = pIndex->GetWord(pEntry, 1);
+		fileNode.diskId    = GetDiskId(index);
+		fileNode.RebuildFileName();
+
+		RootIndexNode::Clip clip;
+		clip.startTime = fileNode.startTime;
+		clip.endTime   = fileNode.endTime;
+		clip.fileName  = fileNode.GetFileName();
+		clips.push_back(clip);
+
+		memset(pEntry, 0, entrySize);
+		count++;
+	}
+
+	if ((count == 0) && (index < fileTableCapacity))
+	{
+		// there is nothing to do
+		return 0;
+	}
+
+	// the next entry becomes the first one
+	for ( ; (index < fileTableCapacity) && (pIndex->GetWord(pBuffer + headerSize + index * entrySize, 0) == 0); index++)
+	{
+	}
+	if (index < fileTableCapacity)
+	{
+		pIndex->SetWord(pBuffer, 2, seekBase + headerSize + index * entrySize);
+	}
+	else
+	{
+		pIndex->SetWord(pBuffer, 2, 0);
+		pIndex->SetWord(pBuffer, 3, 0);
+		if (HasUsage())
+		{
+			pIndex->SetWord(pBuffer, 5, 0);
+		}
+	}
+	RebuildMinuteTable();
+	isDirty = true;
+
+	return count;
+}
+
+// for recycling
+// the first clip of the oldest date has no previous clip any more
+void DateNode::UnlinkFirstFile()
+{
+	IndexWord firstSeekBase = pIndex->GetWord(pBuffer, 2);
+	if (IsInBuffer(firstSeekBase) && (pIndex->GetWord(pBuffer + firstSeekBase - seekBase, 2) != 0))
+	{
+		pIndex->SetWord(pBuffer + firstSeekBase - seekBase, 2, 0);
+		isDirty = true;
+	}
+}
+
+int DateNode::GetDiskId(size_t index)
+{
+	return ((pDiskTable != NULL) && (index < diskTableSize)) ? pDiskTable[index] : 0;
+}
+
+void DateNode::SetDiskId(size_t index, int diskId)
+{
+	if ((headerSize < 5 * pIndex->wordSize) || (index >= diskTableSize) || (diskId < 0))
+	{
+		// no disk table in version 1, or an unknown disk
+		return;
+	}
+
+	if (pDiskTable == NULL)
+	{
+		if (diskId == 0)
+		{
+			// still all on the first disk
+			return;
+		}
+		pDiskTable = new unsigned char[diskTableSize];
+		memset(pDiskTable, 0, diskTableSize);
+	}
+
+	if (pDiskTable[index] != diskId)
+	{
+		pDiskTable[index] = (unsigned char)diskId;
+		isDiskTableDirty = true;
+	}
+}
+
+bool DateNode::LoadDiskTable()
+{
+	IndexWord diskTableSeekBase;
+	if ((headerSize < 5 * pIndex->wordSize) || ((diskTableSeekBase = pIndex->GetWord(pBuffer, 4)) <= 0))
+	{
+		// all on the first disk
+		return true;
+	}
+
+	if (pDiskTable == NULL)
+	{
+		pDiskTable = new unsigned char[diskTableSize];
+	}
+
+	if ((pIndex->pFile == NULL)
+	    || (pIndex->Seek(diskTableSeekBase) != 0)
+	    || (pIndex->Read(pDiskTable, diskTableSize) == false))
+	{
+		// error:
+		memset(pDiskTable, 0, diskTableSize);
+		return false;
+	}
+
+	return true;
+}
+
+bool DateNode::UpdateDiskTable()
+{
+	if (!isDiskTableDirty || (pDiskTable == NULL))
+	{
+		// there is nothing to do
+		return true;
+	}
+	isDiskTableDirty = false;
+
+	IndexWord diskTableSeekBase = pIndex->GetWord(pBuffer, 4);
+	if (diskTableSeekBase > 0)
+	{
+		if (pIndex->Seek(diskTableSeekBase) != 0)
+		{
+			// error:
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+			return false;
+		}
+	}
+	else
+	{
+		if (pIndex->SeekToEnd() != 0)
+		{
+			// error:
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+			return false;
+		}
+		diskTableSeekBase = pIndex->Tell();
+		pIndex->SetWord(pBuffer, 4, diskTableSeekBase);
+	}
+
+	if (pIndex->Write(pDiskTable, diskTableSize) == false)
+	{
+		// error:
+		return false;
+	}
+	pIndex->changeLog.RecordChange(diskTableSeekBase, diskTableSize);
+
+	return true;
+}
+
+// for recording
+// a clip is counted once, when it is linked to the date
+void DateNode::AddUsage(FileNode *pFileNode)
+{
+	if (HasUsage())
+	{
+		pIndex->SetWord(pBuffer, 5, GetByteCount() + pFileNode->fileSize);
+		isDirty = true;
+	}
+	SetMinutes(pFileNode->startTime, pFileNode->endTime);
+}
+
+// for compacting and recycling
+// only the bytes change: a clip rewritten smaller keeps its minutes, and a
+// removed one lost them with its entry
+void DateNode::RemoveUsage(uint64_t byteCount)
+{
+	if (HasUsage() && (byteCount > 0))
+	{
+		uint64_t oldByteCount = GetByteCount();
+		pIndex->SetWord(pBuffer, 5, oldByteCount > byteCount ? oldByteCount - byteCount : 0);
+		isDirty = true;
+	}
+}
+
+// mark the minutes of the date from the start up to the end, a clip across
+// midnight marks only those before
+void DateNode::SetMinutes(time_t start, time_t end)
+{
+	if ((start >= endTime) || (end <= startTime))
+	{
+		// not in this date
+		return;
+	}
+
+	int first = start > startTime ? (int)((start - startTime) / 60) : 0;
+	int last  = end < endTime ? (int)((end - 1 - startTime) / 60) : StreamingMediaLibrary::DayUsage::MINUTE_COUNT - 1;
+	for (int minute = first; minute <= last; minute++)
+	{
+		unsigned char bit = (unsigned char)(1 << (minute % 8));
+		if ((minuteTable[minute / 8] & bit) == 0)
+		{
+			minuteTable[minute / 8] |= bit;
+			isMinuteTableDirty = true;
+		}
+	}
+}
+
+// find the minutes from the entries, after a removal or for a date without the bitmap
+void DateNode::RebuildMinuteTable()
+{
+	unsigned char oldMinuteTable[MINUTE_TABLE_SIZE];
+	memcpy(oldMinuteTable, minuteTable, sizeof(minuteTable));
+	memset(minuteTable, 0, sizeof(minuteTable));
+
+	for (size_t index = 0; index < fileTableCapacity; index++)
+	{
+		const char *pEntry = pBuffer + headerSize + index * 4 * pIndex->wordSize;
+		if (pIndex->GetWord(pEntry, 0) != 0)
+		{
+			SetMinutes(pIndex->GetWord(pEntry, 0), pIndex->GetWord(pEntry, 1));
+		}
+	}
+
+	isMinuteTableDirty = memcmp(oldMinuteTable, minuteTable, sizeof(minuteTable)) != 0;
+}
+
+bool DateNode::LoadMinuteTable()
+{
+	IndexWord minuteTableSeekBase;
+	if (!HasUsage() || ((minuteTableSeekBase = pIndex->GetWord(pBuffer, 6)) <= 0))
+	{
+		// indexed before, written with the next clip
+		RebuildMinuteTable();
+		return true;
+	}
+
+	if ((pIndex->pFile == NULL)
+	    || (pIndex->Seek(minuteTableSeekBase) != 0)
+	    || (pIndex->Read(minuteTable, sizeof(minuteTable)) == false))
+	{
+		// error:
+		RebuildMinuteTable();
+		return false;
+	}
+
+	isMinuteTableDirty = false;
+	return true;
+}
+
+bool DateNode::UpdateMinuteTable()
+{
+	if (!isMinuteTableDirty || !HasUsage())
+	{
+		// there is nothing to do
+		return true;
+	}
+	isMinuteTableDirty = false;
+
+	IndexWord minuteTableSeekBase = pIndex->GetWord(pBuffer, 6);
+	if (minuteTableSeekBase > 0)
+	{
+		if (pIndex->Seek(minuteTableSeekBase) != 0)
+		{
+			// error:
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+			return false;
+		}
+	}
+	else
+	{
+		if (pIndex->SeekToEnd() != 0)
+		{
+			// error:
+			fclose(pIndex->pFile);
+			pIndex->pFile = NULL;
+			return false;
+		}
+		minuteTableSeekBase = pIndex->Tell();
+		pIndex->SetWord(pBuffer, 6, minuteTableSeekBase);
+	}
+
+	if (pIndex->Write(minuteTable, sizeof(minuteTable)) == false)
+	{
+		// error:
+		return false;
+	}
+	pIndex->changeLog.RecordChange(minuteTableSeekBase, sizeof(minuteTable));
+
+	return true;
+}
+
+// for indexing
+// the usage of a date from its header, and its minutes if asked, without
+// loading its entries; false if it has no bitmap yet
+bool DateNode::ReadUsage(IndexFile *pIndex, IndexWord dateSeekBase, uint64_t &byteCount, unsigned char *pMinutes)
+{
+	IndexWord byteCountValue;
+	IndexWord minuteTableSeekBase;
+
+	// the date header has no room for them in version 1
+	if ((pIndex->alignment < 7 * pIndex->wordSize)
+	    || (pIndex->pFile == NULL)
+	    || (pIndex->Seek(dateSeekBase + 5 * pIndex->wordSize) != 0)
+	    || !pIndex->ReadWord(byteCountValue)
+	    || !pIndex->ReadWord(minuteTableSeekBase))
+	{
+		return false;
+	}
+	byteCount = byteCountValue > 0 ? (uint64_t)byteCountValue : 0;
+
+	if (pMinutes == NULL)
+	{
+		return true;
+	}
+
+	if ((minuteTableSeekBase <= 0)
+	    || (pIndex->Seek(minuteTableSeekBase) != 0)
+	    || (pIndex->Read(pMinutes, MINUTE_TABLE_SIZE) == false))
+	{
+		// error: or indexed before
+		return false;
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+FileNode * const FileNode::pUnloadedNode = new FileNode(FILE_TYPE_UNLOADED);
+FileNode * const FileNode::pUnkonwnNode  = new FileNode(FILE_TYPE_UNLOADED);
+
+FileNode::FileNode(FileType _type, IndexFile *_pIndex, IndexWord seek)
+	: diskId(DISK_ID_UNKNOWN), containerId(CONTAINER_ID_UNKNOWN), fileSize(0ull), type(_type), pParent(NULL), pPrev(NULL), pNext(NULL),
+	  pIndex(_pIndex), seekBase(seek), isDirty(false)
+{
+	IndexWord startTimeValue;
+	IndexWord endTimeValue;
+
+	startTime = endTime = 0;
+	if ((pIndex != NULL) && (pIndex->pFile != NULL) && (seekBase > 0)
+	    && (pIndex->Seek(seekBase) == 0)
+	    && pIndex->ReadWord(startTimeValue)
+	    && pIndex->ReadWord(endTimeValue))
+	{
+		startTime = startTimeValue;
+		endTime   = endTimeValue;
+	}
+	else
+	{
+		// error
+		if ((pIndex != NULL) && (pIndex->pFile != NULL))
+		{
+			//fclose(pIndex->pFile);
+			//pIndex->pFile = NULL;
+		}
+		isDirty = true;
+	}
+}
+
+const char * FileNode::GetFileName() const
+{
+	return fileName;
+}
+
+FileNode::~FileNode()
+{
+}
+
+bool FileNode::RebuildFileName()
+{
+	// a clip in a container has no name of its own
+	if ((containerId != CONTAINER_ID_UNKNOWN) || storagePool.FindContainer(chId, startTime, diskId, containerId))
+	{
+		storagePool.GetContainerFileName(diskId, containerId, fileNameBuffer);
+		fileName = fileNameBuffer;
+		return true;
+	}
+
+	struct tm tmBuffer;
+	struct tm *time = LocalTime(&startTime, &tmBuffer);
+	char relativeName[BUFFER_SIZE];
+
+	// chxx/yyyy/MMdd/hhmmss_hhmmss.mkv, chxx/sub/... for a substream
+	int length = GetChannelDirectoryName(chId, relativeName);
+#if 1
+	length += sprintf(relativeName + length, "/%d/%02d%02d/%02d%02d%02d_",
+#else
+	length += sprintf(relativeName + length, "_%d_%02d%02d_%02d%02d%02d_",
+#endif
+	        1900+time->tm_year, 1+time->tm_mon, time->tm_mday,
+	        time->tm_hour, time->tm_min, time->tm_sec);
+
+	time = LocalTime(&endTime, &tmBuffer);
+
+	// chxx/yyyy/MMdd/hhmmss_hhmmss.mkv
+	sprintf(relativeName + length, "%02d%02d%02d.mkv",
+	        time->tm_hour, time->tm_min, time->tm_sec);
+
+	// the disk is kept in the index, except for the clips read across dates
+	if (diskId == DISK_ID_UNKNOWN)
+	{
+		diskId = storagePool.FindDisk(relativeName);
+	}
+	storagePool.GetFileName(diskId, relativeName, fileNameBuffer);
+
+	fileName = fileNameBuffer;
+	return true;
+}
+
+bool FileNode::RenameFrom(const char *old)
+{
+	if (old == NULL)
+	{
+		return false;
+	}
+
+	// the temporary name is usually in the buffer of the final one
+	char oldName[BUFFER_SIZE];
+	strncpy(oldName, old, BUFFER_SIZE - 1);
+	oldName[BUFFER_SIZE - 1] = '\0';
+
+	RebuildFileName();
+
+#if 1
+	// the clip may be on another disk than the current directory
+	char *pSeparator = strrchr(fileNameBuffer, '/');
+	*pSeparator = '\0';
+	boost::filesystem::path dir(fileNameBuffer, boost::filesystem::native);
+	*pSeparator = '/';
+	try
+	{
+		// test dir
+		if (!boost::filesystem::exists(dir))
+		{
+			// create dir
+			if (!boost::filesystem::create_directories(dir))
+			{
+				// error: fail to create dir
+				return false;
+			}
+		}
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: the disk fails
+		return false;
+	}
+#endif
+
+	return rename(oldName, fileNameBuffer) == 0;
+}
+
+// for indexing
+FileNode * FileNode::LoadNextFromFileDirectly()
+{
+	if (pNext != NULL)
+	{
+		return pNext;
+	}
+
+	if ((seekBase <= 0) || (pIndex == NULL))
 	{
-		result = false;
+		return NULL;
 	}
 
-	return result;
-}
+	IndexWord nextSeekBase = 0;
+	if ((pParent != NULL) && pParent->IsInBuffer(seekBase) && pParent->Revalidate())
+	{
+		// the entry is in the table of the date node, which is reloaded only if it changed
+		nextSeekBase = pIndex->GetWord(pParent->pBuffer + seekBase - pParent->seekBase, 3);
+	}
+	else if ((pIndex->pFile == NULL)
+	         || (pIndex->Seek(seekBase + 3 * pIndex->wordSize) != 0)
+	         || !pIndex->ReadWord(nextSeekBase))
+	{
+		// error:
+		return NULL;
+	}
 
-bool DateNode::UpdateIndexFile()
-{
-	if (!isDirty || (pBuffer == NULL) || (bufferSize == 0) || (pIndexFile == NULL))
+	if (nextSeekBase <= 0)
 	{
-		// there is nothing to do
-		return true;
+		return NULL;
 	}
-	isDirty = false;
 
-	if (seekBase > 0)
+	if ((pParent != NULL) && pParent->IsInBuffer(nextSeekBase))
 	{
-		if (fseek(pIndexFile, seekBase, SEEK_SET) != 0)
-		{
-			// error:
-			fclose(pIndexFile);
-			pIndexFile = NULL;
-			return false;
-		}
+		// usually in the same date node
+		pNext = pParent->LoadFileNode(nextSeekBase);
 	}
 	else
 	{
-		if (fseek(pIndexFile, 0, SEEK_END) != 0)
-		{
-			// error:
-			fclose(pIndexFile);
-			pIndexFile = NULL;
-			return false;
-		}
-		seekBase = ftell(pIndexFile);
-		pParent->SetBufferContent(startTime, seekBase);
+		pNext = new FileNode(FileNode::FILE_TYPE_NORMAL, pIndex, nextSeekBase);
 	}
-
-	if (IndexFileWrite(pBuffer, bufferSize) == false)
+	pNext->pPrev = this;
+	if (!pNext->isDirty)
 	{
-		// error:
-		return false;
+		return pNext;
 	}
 
-	return true;
+	return NULL;
 }
 
-bool DateNode::SetBufferContent(time_t time, FileNode *currentNode)
+// for indexing
+FileNode * FileNode::LoadPreviousFromFileDirectly()
 {
-	if ((time < startTime) || (time >= endTime) || (pBuffer == NULL))
+	if (pPrev != NULL)
 	{
-		// error: wrong time or wrong buffer
-		return false;
+		return pPrev;
 	}
 
-	int index = (time - startTime) / fileDuration;
+	if ((seekBase <= 0) || (pIndex == NULL))
+	{
+		return NULL;
+	}
 
-	if ((index < 0) || ((size_t)index >= fileTableCapacity))
+	IndexWord prevSeekBase = 0;
+	if ((pParent != NULL) && pParent->IsInBuffer(seekBase) && pParent->Revalidate())
 	{
-		// error: wrong index
-		return false;
+		// the entry is in the table of the date node, which is reloaded only if it changed
+		prevSeekBase = pIndex->GetWord(pParent->pBuffer + seekBase - pParent->seekBase, 2);
+	}
+	else if ((pIndex->pFile == NULL)
+	         || (pIndex->Seek(seekBase + 2 * pIndex->wordSize) != 0)
+	         || !pIndex->ReadWord(prevSeekBase))
+	{
+		// error:
+		return NULL;
 	}
 
-	if (seekBase > 0)
+	if (prevSeekBase <= 0)
 	{
-		// FIXME: collision list
-		currentNode->seekBase = seekBase + headerSize + index * 4 * 4;
+		return NULL;
 	}
 
-	*((int *)(pBuffer + headerSize) + index * 4) = currentNode->startTime;
-	*((int *)(pBuffer + headerSize) + index * 4 + 1) = currentNode->endTime;
-	if ((currentNode->pPrev != NULL) && (currentNode->pPrev->seekBase > 0))
+	if ((pParent != NULL) && pParent->IsInBuffer(prevSeekBase))
 	{
-		*((int *)(pBuffer + headerSize) + index * 4 + 2) = currentNode->pPrev->seekBase;
+		// usually in the same date node
+		pPrev = pParent->LoadFileNode(prevSeekBase);
 	}
 	else
 	{
-		//*((int *)(pBuffer + headerSize) + index * 4 + 2) = 0;
+		pPrev = new FileNode(FileNode::FILE_TYPE_NORMAL, pIndex, prevSeekBase);
 	}
-	if ((currentNode->pNext != NULL) && (currentNode->pNext->seekBase > 0))
+	pPrev->pNext = this;
+	if (!pPrev->isDirty)
 	{
-		*((int *)(pBuffer + headerSize) + index * 4 + 3) = currentNode->pNext->seekBase;
+		return pPrev;
 	}
-	else
+
+	return NULL;
+}
+
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+// layout of the version 1 nodes, in 4-byte words
+enum
+{
+	V1_ROOT_HEADER_WORDS    = 1,
+	V1_CHANNEL_HEADER_WORDS = 4,
+	V1_YEAR_HEADER_WORDS    = 3,
+	V1_YEAR_TABLE_CAPACITY  = 366,
+	V1_DATE_HEADER_WORDS    = 4,
+	V1_DATE_ENTRY_WORDS     = 4,
+	V1_MAX_TABLE_CAPACITY   = 1 << 20
+};
+
+IndexMigrator::IndexMigrator(const std::string &_oldFileName, unsigned int _writeCount)
+	: isFinished(false), isSucceeded(false), writeCount(_writeCount),
+	  oldFileName(_oldFileName), newFileName(GetNewFileName(_oldFileName)),
+	  pOldFile(NULL), pNewFile(NULL), newFileSize(0)
+{
+	pThread = new boost::thread(&IndexMigrator::Run, this);
+}
+
+IndexMigrator::~IndexMigrator()
+{
+	pThread->join();
+	delete pThread;
+}
+
+bool IndexMigrator::IsFinished()
+{
+	boost::mutex::scoped_lock lock(mutex);
+	return isFinished;
+}
+
+bool IndexMigrator::IsSucceeded()
+{
+	boost::mutex::scoped_lock lock(mutex);
+	return isSucceeded;
+}
+
+void IndexMigrator::Run()
+{
+	bool result = false;
+
+	pOldFile = fopen(oldFileName.c_str(), "rb");
+	pNewFile = fopen(newFileName.c_str(), "wb");
+	if ((pOldFile != NULL) && (pNewFile != NULL))
 	{
-		//*((int *)(pBuffer + headerSize) + index * 4 + 3) = 0;
+		result = Plan() && WriteNewFile();
 	}
 
-	if (currentNode->seekBase > 0)
+	if (pOldFile != NULL)
 	{
-		int firstSeekBase = *((int *)pBuffer + 2);
-		int lastSeekBase  = *((int *)pBuffer + 3);
-		if ((firstSeekBase == 0) || (currentNode->seekBase < firstSeekBase))
-		{
-			*((int *)pBuffer + 2) = currentNode->seekBase;
-		}
-		if ((lastSeekBase == 0) || (currentNode->seekBase > lastSeekBase))
-		{
-			*((int *)pBuffer + 3) = currentNode->seekBase;
-		}
+		fclose(pOldFile);
+		pOldFile = NULL;
+	}
+	if ((pNewFile != NULL) && (fclose(pNewFile) != 0))
+	{
+		// error: not completely written
+		result = false;
 	}
+	pNewFile = NULL;
 
-	isDirty = true;
-	return true;
+	boost::mutex::scoped_lock lock(mutex);
+	isSucceeded = result;
+	isFinished = true;
 }
 
-FileNode * DateNode::GetFileNodeForwardly(time_t time)
+// read a version 1 node, the table capacity is its first word unless given
+bool IndexMigrator::ReadOldNode(IndexWord seek, size_t headerWords, size_t tableCapacity, size_t entryWords, std::vector<int> &words)
 {
-	ForceReloadBuffer();
-
-	if (time >= endTime)
+	words.resize(headerWords);
+	if ((IndexFileSeek(pOldFile, seek) != 0)
+	    || (fread(&words[0], 4, headerWords, pOldFile) != headerWords))
 	{
-		// error: wrong time
-		return NULL;
+		// error: bad file
+		return false;
 	}
 
-	int index = time <= startTime ? 0 : (time - startTime) / fileDuration;
-	int lastSeekBase;
-	time_t lastStartTime;
-	int lastIndex = fileTableCapacity - 1;
-
-	if (((lastSeekBase = *((int *)pBuffer + 3)) - seekBase >= (int)headerSize)
-	    && ((lastStartTime = *(int *)(pBuffer + lastSeekBase - seekBase)) > startTime))
+	if (tableCapacity == 0)
 	{
-		lastIndex = (lastStartTime - startTime) / fileDuration;
+		if ((words[0] <= 0) || (words[0] > V1_MAX_TABLE_CAPACITY))
+		{
+			// error: bad node
+			return false;
+		}
+		tableCapacity = words[0];
 	}
 
-	if ((index < 0) || ((size_t)index >= fileTableCapacity) || (index > lastIndex))
+	if (entryWords == 0)
 	{
-		// error: wrong index
-		return NULL;
+		// header only
+		return true;
 	}
 
-	// while (valid index && (startTime == 0))
-	for ( ; ((size_t)index < fileTableCapacity) && (index <= lastIndex) && (*(int *)(pBuffer + headerSize + index * 4 * 4) == 0); index++)
+	words.resize(headerWords + tableCapacity * entryWords);
+	return fread(&words[headerWords], 4, tableCapacity * entryWords, pOldFile) == tableCapacity * entryWords;
+}
+
+bool IndexMigrator::AddNode(NodeType type, IndexWord oldSeekBase, const std::vector<int> &words)
+{
+	NodeMapping node;
+	node.type        = type;
+	node.oldSeekBase = oldSeekBase;
+
+	switch (type)
 	{
+	case NODE_TYPE_ROOT:
+		node.oldSize = (V1_ROOT_HEADER_WORDS + words[0]) * 4;
+		node.newSize = (V1_ROOT_HEADER_WORDS + words[0]) * sizeof(IndexWord);
+		break;
+
+	case NODE_TYPE_CHANNEL:
+		node.oldSize = (V1_CHANNEL_HEADER_WORDS + words[0]) * 4;
+		node.newSize = (V1_CHANNEL_HEADER_WORDS + words[0]) * sizeof(IndexWord);
+		break;
+
+	case NODE_TYPE_YEAR:
+		node.oldSize = (V1_YEAR_HEADER_WORDS + V1_YEAR_TABLE_CAPACITY) * 4;
+		node.newSize = (V1_YEAR_HEADER_WORDS + V1_YEAR_TABLE_CAPACITY) * sizeof(IndexWord);
+		break;
+
+	case NODE_TYPE_DATE:
+		node.oldSize = (V1_DATE_HEADER_WORDS + words[0] * V1_DATE_ENTRY_WORDS) * 4;
+		node.newSize = IndexFileHeader::ALIGNMENT + words[0] * V1_DATE_ENTRY_WORDS * sizeof(IndexWord);
+		break;
 	}
 
-	if (((size_t)index >= fileTableCapacity) || (index > lastIndex))
+	if (type == NODE_TYPE_ROOT)
 	{
-		// error: no index
-		return NULL;
+		// the root node follows the file header, then comes the change log
+		node.newSeekBase = IndexFileHeader::HEADER_SIZE;
+		newFileSize = node.newSeekBase + node.newSize;
+		newFileSize = (newFileSize + IndexFileHeader::ALIGNMENT - 1) / IndexFileHeader::ALIGNMENT * IndexFileHeader::ALIGNMENT;
+		newFileSize += IndexChangeLog::MAX_LOG_SIZE;
+	}
+	else
+	{
+		node.newSeekBase = (newFileSize + IndexFileHeader::ALIGNMENT - 1) / IndexFileHeader::ALIGNMENT * IndexFileHeader::ALIGNMENT;
+		newFileSize = node.newSeekBase + node.newSize;
 	}
 
-	FileNode *node = pFileTable[index];
-	time_t upperBound = startTime + (index + 1) * fileDuration;
+	return nodes.insert(std::make_pair(oldSeekBase, node)).second;
+}
 
-	if (node == NULL)
+// assign the new seek bases of all nodes reachable from the root
+bool IndexMigrator::Plan()
+{
+	std::vector<int> rootWords;
+	std::vector<int> channelWords;
+	std::vector<int> yearWords;
+	std::vector<int> dateWords;
+
+	if (!ReadOldNode(0, V1_ROOT_HEADER_WORDS, 0, 1, rootWords)
+	    || !AddNode(NODE_TYPE_ROOT, 0, rootWords))
 	{
-		// try to load the specific file node
-		if ((pIndexFile != NULL) && (pBuffer != NULL))
+		return false;
+	}
+
+	for (size_t ch = V1_ROOT_HEADER_WORDS; ch < rootWords.size(); ch++)
+	{
+		if ((rootWords[ch] <= 0) || (nodes.find(rootWords[ch]) != nodes.end()))
 		{
-			int offset = headerSize + index * 4 * 4;
+			continue;
+		}
+		if (!ReadOldNode(rootWords[ch], V1_CHANNEL_HEADER_WORDS, 0, 1, channelWords)
+		    || !AddNode(NODE_TYPE_CHANNEL, rootWords[ch], channelWords))
+		{
+			return false;
+		}
 
-			// if (prev->startTime != 0) then go through the while-loop from prev
-			if ((*(int *)(pBuffer + offset) != 0)
-			    && (*((int *)(pBuffer + offset) + 2) != 0)
-			    && (*((int *)(pBuffer + offset) + 2) - seekBase >= (int)headerSize)
-			    && (*(int *)(pBuffer + *((int *)(pBuffer + offset) + 2) - seekBase) != 0))
+		for (size_t year = V1_CHANNEL_HEADER_WORDS; year < channelWords.size(); year++)
+		{
+			if ((channelWords[year] <= 0) || (nodes.find(channelWords[year]) != nodes.end()))
+			{
+				continue;
+			}
+			if (!ReadOldNode(channelWords[year], V1_YEAR_HEADER_WORDS, V1_YEAR_TABLE_CAPACITY, 1, yearWords)
+			    || !AddNode(NODE_TYPE_YEAR, channelWords[year], yearWords))
 			{
-				offset = *((int *)(pBuffer + offset) + 2) - seekBase;
+				return false;
 			}
 
-			// if (startTime != 0)
-			while ((offset >= (int)headerSize) && (*(int *)(pBuffer + offset) != 0) && (*(int *)(pBuffer + offset) < upperBound))
+			for (size_t date = V1_YEAR_HEADER_WORDS; date < yearWords.size(); date++)
 			{
-				// if (time < endTime)
-				if (time < *((int *)(pBuffer + offset) + 1))
+				if ((yearWords[date] <= 0) || (nodes.find(yearWords[date]) != nodes.end()))
 				{
-					// bingo!! load it
-					// FIXME: incorrect list nodes
-					//pFileTable[index] = new FileNode(FileNode::FILE_TYPE_NORMAL, seekBase + headerSize + index * 4 * 4);
-					//pFileTable[index]->pParent = this;
-					//return pFileTable[index];
-					return new FileNode(FileNode::FILE_TYPE_NORMAL, seekBase + offset);
+					continue;
+				}
+				if (!ReadOldNode(yearWords[date], V1_DATE_HEADER_WORDS, 0, 0, dateWords)
+				    || !AddNode(NODE_TYPE_DATE, yearWords[date], dateWords))
+				{
+					return false;
 				}
-				offset = *((int *)(pBuffer + offset) + 3) - seekBase;
 			}
 		}
 	}
 
-	return node;
+	return true;
 }
 
-FileNode * DateNode::GetFileNodeBackwardly(time_t time)
+// map a version 1 seek base of a node or of a file entry into the new file
+IndexWord IndexMigrator::Translate(IndexWord oldSeekBase)
 {
-	ForceReloadBuffer();
-
-	if (time < startTime)
+	if (oldSeekBase <= 0)
 	{
-		// error: wrong time
-		return NULL;
+		return 0;
 	}
 
-	int index = ((time >= endTime ? endTime - 1 : time) - startTime) / fileDuration;
-	int firstSeekBase;
-	time_t firstStartTime;
-	int firstIndex = 0;
-
-	if (((firstSeekBase = *((int *)pBuffer + 2)) - seekBase >= (int)headerSize)
-	    && ((firstStartTime = *(int *)(pBuffer + firstSeekBase - seekBase)) > startTime))
+	std::map<IndexWord, NodeMapping>::const_iterator it = nodes.upper_bound(oldSeekBase);
+	if (it == nodes.begin())
 	{
-		firstIndex = (firstStartTime - startTime) / fileDuration;
+		return 0;
 	}
+	--it;
 
-	if ((index < 0) || ((size_t)index >= fileTableCapacity) || (index < firstIndex))
+	const NodeMapping &node = it->second;
+	IndexWord offset = oldSeekBase - node.oldSeekBase;
+	if (offset == 0)
 	{
-		// error: wrong index
-		return NULL;
+		return node.newSeekBase;
 	}
-
-	// while (valid index && (startTime == 0))
-	for ( ; (index >= 0) && (index >= firstIndex) && (*(int *)(pBuffer + headerSize + index * 4 * 4) == 0); index--)
+	if ((node.type != NODE_TYPE_DATE) || (offset >= node.oldSize) || (offset < V1_DATE_HEADER_WORDS * 4))
 	{
+		// error: dangling seek base
+		return 0;
 	}
 
-	if ((index < 0) || (index < firstIndex))
+	IndexWord entry = (offset - V1_DATE_HEADER_WORDS * 4) / (V1_DATE_ENTRY_WORDS * 4);
+	return node.newSeekBase + IndexFileHeader::ALIGNMENT + entry * V1_DATE_ENTRY_WORDS * sizeof(IndexWord);
+}
+
+bool IndexMigrator::WriteNewFile()
+{
+	IndexFileHeader header;
+	header.Initialize(IndexFileHeader::CURRENT_VERSION);
+	if (fwrite(&header, 1, sizeof(header), pNewFile) != sizeof(header))
 	{
-		// error: no index
-		return NULL;
+		return false;
 	}
 
-	FileNode *node = pFileTable[index];
-	time_t lowerBound = startTime + index * fileDuration;
-
-	if (node == NULL)
+	std::vector<int> oldWords;
+	std::vector<IndexWord> newWords;
+	for (std::map<IndexWord, NodeMapping>::const_iterator it = nodes.begin(); it != nodes.end(); ++it)
 	{
-		// try to load the specific file node
-		if ((pIndexFile != NULL) && (pBuffer != NULL))
+		const NodeMapping &node = it->second;
+		size_t headerWords = 0;
+		size_t newHeaderWords = 0;
+
+		switch (node.type)
 		{
-			int offset = headerSize + index * 4 * 4;
+		case NODE_TYPE_ROOT:
+			headerWords = newHeaderWords = V1_ROOT_HEADER_WORDS;
+			break;
+
+		case NODE_TYPE_CHANNEL:
+			headerWords = newHeaderWords = V1_CHANNEL_HEADER_WORDS;
+			break;
+
+		case NODE_TYPE_YEAR:
+			headerWords = newHeaderWords = V1_YEAR_HEADER_WORDS;
+			break;
+
+		case NODE_TYPE_DATE:
+			headerWords = V1_DATE_HEADER_WORDS;
+			newHeaderWords = IndexFileHeader::ALIGNMENT / sizeof(IndexWord);
+			break;
+		}
 
-			// if (next->startTime != 0) then go through the while-loop from next
-			if ((*((int *)(pBuffer + offset) + 1) != 0)
-			    && (*((int *)(pBuffer + offset) + 3) != 0)
-			    && (*((int *)(pBuffer + offset) + 3) - seekBase < (int)bufferSize)
-			    && (*(int *)(pBuffer + *((int *)(pBuffer + offset) + 3) - seekBase) != 0))
+		if (!ReadOldNode(node.oldSeekBase, headerWords, node.type == NODE_TYPE_YEAR ? V1_YEAR_TABLE_CAPACITY : 0,
+		                 node.type == NODE_TYPE_DATE ? V1_DATE_ENTRY_WORDS : 1, oldWords))
+		{
+			return false;
+		}
+
+		newWords.assign(node.newSize / sizeof(IndexWord), 0);
+		for (size_t i = 0; i < headerWords; i++)
+		{
+			newWords[i] = oldWords[i];
+		}
+
+		if (node.type == NODE_TYPE_DATE)
+		{
+			// first and last seek bases, then entries of start, end, prev and next
+			newWords[2] = Translate(oldWords[2]);
+			newWords[3] = Translate(oldWords[3]);
+			for (size_t i = headerWords, j = newHeaderWords; i + V1_DATE_ENTRY_WORDS <= oldWords.size(); i += V1_DATE_ENTRY_WORDS, j += V1_DATE_ENTRY_WORDS)
 			{
-				offset = *((int *)(pBuffer + offset) + 3) - seekBase;
+				newWords[j]     = oldWords[i];
+				newWords[j + 1] = oldWords[i + 1];
+				newWords[j + 2] = Translate(oldWords[i + 2]);
+				newWords[j + 3] = Translate(oldWords[i + 3]);
 			}
-
-			// if (endTime != 0)
-			while ((offset < (int)bufferSize) && (*((int *)(pBuffer + offset) + 1) != 0) && (*((int *)(pBuffer + offset) + 1) >= lowerBound))
+		}
+		else
+		{
+			// a table of seek bases
+			for (size_t i = headerWords; i < oldWords.size(); i++)
 			{
-				// if (time >= startTime)
-				if (time >= *(int *)(pBuffer + offset))
-				{
-					// bingo!! load it
-					// FIXME: incorrect list nodes
-					//pFileTable[index] = new FileNode(FileNode::FILE_TYPE_NORMAL, seekBase + headerSize + index * 4 * 4);
-					//pFileTable[index]->pParent = this;
-					//return pFileTable[index];
-					return new FileNode(FileNode::FILE_TYPE_NORMAL, seekBase + offset);
-				}
-				offset = *((int *)(pBuffer + offset) + 2) - seekBase;
+				newWords[i] = Translate(oldWords[i]);
 			}
 		}
-	}
-
-	return node;
-}
 
-//---------------------------------------------------------------------------
-//---------------------------------------------------------------------------
-FileNode * const FileNode::pUnloadedNode = new FileNode(FILE_TYPE_UNLOADED);
-FileNode * const FileNode::pUnkonwnNode  = new FileNode(FILE_TYPE_UNLOADED);
+		if ((IndexFileSeek(pNewFile, node.newSeekBase) != 0)
+		    || (fwrite(&newWords[0], sizeof(IndexWord), newWords.size(), pNewFile) != newWords.size()))
+		{
+			return false;
+		}
 
-FileNode::FileNode(FileType _type, int seek)
-	: type(_type), pParent(NULL), pPrev(NULL), pNext(NULL),
-	  seekBase(seek), isDirty(false)
-{
-	startTime = endTime = 0;
-	if ((pIndexFile != NULL) && (seekBase > 0)
-	    && (fseek(pIndexFile, seekBase, SEEK_SET) == 0)
-	    && (fread(&startTime, 1, 4, pIndexFile) == 4)
-	    && (fread(&endTime, 1, 4, pIndexFile) == 4))
-	{
-	}
-	else
-	{
-		// error
-		if (pIndexFile != NULL)
+		if (node.type == NODE_TYPE_ROOT)
 		{
-			//fclose(pIndexFile);
-			//pIndexFile = NULL;
+			// an empty change log follows the root node
+			IndexWord logSeekBase = (node.newSeekBase + node.newSize + IndexFileHeader::ALIGNMENT - 1) / IndexFileHeader::ALIGNMENT * IndexFileHeader::ALIGNMENT;
+			std::vector<IndexWord> logWords(IndexChangeLog::MAX_LOG_SIZE / sizeof(IndexWord), 0);
+			logWords[0] = IndexChangeLog::MAGIC;
+			logWords[2] = IndexChangeLog::CAPACITY;
+			if ((IndexFileSeek(pNewFile, logSeekBase) != 0)
+			    || (fwrite(&logWords[0], sizeof(IndexWord), logWords.size(), pNewFile) != logWords.size()))
+			{
+				return false;
+			}
 		}
-		isDirty = true;
 	}
+
+	return fflush(pNewFile) == 0;
 }
 
-const char * FileNode::GetFileName() const
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+LiveClipFile::LiveClipFile(int chId)
+	: isWritable(false), openTime(0), pMapping(NULL), pRegion(NULL), pWords(NULL), pClipFileName(NULL), pClusters(NULL)
 {
-	return fileName;
+	char name[32];
+	strcpy(name + GetChannelDirectoryName(chId, name), "/.live");
+	fileName = name;
 }
 
-FileNode::~FileNode()
+LiveClipFile::~LiveClipFile()
 {
+	Unmap();
 }
 
-bool FileNode::RebuildFileName()
+// for recording, a new clip once the file or the start time changes
+bool LiveClipFile::Publish(const char *clipFileName, uint64_t startTime, uint64_t endTime, uint64_t endPosition, uint64_t clusterPosition, uint64_t clusterTime)
 {
-	struct tm *time;
-	time = localtime(&startTime);
-
-	// chxx/yyyy/MMdd/hhmmss_hhmmss.mkv
-#if 1
-	sprintf(fileNameBuffer, "ch%02d/%d/%02d%02d/%02d%02d%02d_",
-#else
-	sprintf(fileNameBuffer, "ch%02d_%d_%02d%02d_%02d%02d%02d_",
-#endif
-	        chId, 1900+time->tm_year, 1+time->tm_mon, time->tm_mday,
-	        time->tm_hour, time->tm_min, time->tm_sec);
+	boost::mutex::scoped_lock lock(mutex);
 
-	time = localtime(&endTime);
+	if (!isWritable && !Map(true))
+	{
+		// error: the readers of this process only
+		return false;
+	}
 
-	// chxx/yyyy/MMdd/hhmmss_hhmmss.mkv
-	sprintf(fileNameBuffer + 22, "%02d%02d%02d.mkv",
-	        time->tm_hour, time->tm_min, time->tm_sec);
+	BeginChange();
+	if ((pWords[WORD_START_TIME] != (IndexWord)startTime) || (strcmp(pClipFileName, clipFileName) != 0))
+	{
+		memset(pClipFileName, 0, FileNode::BUFFER_SIZE);
+		strcpy(pClipFileName, clipFileName);
+		pWords[WORD_START_TIME]    = startTime;
+		pWords[WORD_CLUSTER_COUNT] = 0;
+	}
 
-	fileName = fileNameBuffer;
+	IndexWord count = pWords[WORD_CLUSTER_COUNT];
+	if ((count < CAPACITY) && ((count == 0) || (pClusters[(count - 1) * 2] < (IndexWord)clusterPosition)))
+	{
+		pClusters[count * 2]     = clusterPosition;
+		pClusters[count * 2 + 1] = clusterTime;
+		pWords[WORD_CLUSTER_COUNT] = count + 1;
+	}
+	pWords[WORD_END_TIME]     = endTime;
+	pWords[WORD_END_POSITION] = endPosition;
+	EndChange();
 	return true;
 }
 
-bool FileNode::RenameFrom(const char *old)
+// for recording
+bool LiveClipFile::Withdraw()
 {
-	RebuildFileName();
+	boost::mutex::scoped_lock lock(mutex);
 
-#if 1
-	fileNameBuffer[14] = '\0';
-	boost::filesystem::path dir(fileNameBuffer, boost::filesystem::native);
-	fileNameBuffer[14] = '/';
-	// test dir
-	if (!boost::filesystem::exists(dir))
+	if (!isWritable)
 	{
-		// create dir
-		if (!boost::filesystem::create_directories(dir))
-		{
-			// error: fail to create dir
-			return false;
-		}
+		return false;
 	}
-#endif
 
-	return rename(old, fileNameBuffer) == 0;
+	BeginChange();
+	pWords[WORD_START_TIME]    = 0;
+	pWords[WORD_END_TIME]      = 0;
+	pWords[WORD_END_POSITION]  = 0;
+	pWords[WORD_CLUSTER_COUNT] = 0;
+	pClipFileName[0] = '\0';
+	EndChange();
+	return true;
 }
 
-// for indexing
-FileNode * FileNode::LoadNextFromFileDirectly()
+// for live reading, the clusters of the same clip already in the list are kept
+bool LiveClipFile::Read(std::string &clipFileName, uint64_t &startTime, uint64_t &endTime, StreamingMediaLiveClusters *pLiveClusters)
 {
-	if (pNext != NULL)
-	{
-		return pNext;
-	}
+	boost::mutex::scoped_lock lock(mutex);
 
-	// force to reload file
-	if (pIndexFile != NULL)
+	if ((pWords == NULL) && !Map(false))
 	{
-		fclose(pIndexFile);
+		// no clip published yet
+		return false;
 	}
-	pIndexFile = fopen(".index", "rb+");
 
-	if ((pIndexFile == NULL) || (seekBase <= 0))
+	char name[FileNode::BUFFER_SIZE];
+	size_t keptCount = pLiveClusters != NULL ? pLiveClusters->positions.size() : 0;
+	for (int i = 0; i < RETRY_COUNT; i++)
 	{
-		return NULL;
-	}
+		IndexWord generation = pWords[WORD_GENERATION];
+		LIVE_MEMORY_BARRIER();
+		if ((generation & 1) != 0)
+		{
+			// being changed
+			boost::this_thread::yield();
+			continue;
+		}
 
-	int nextSeekBase;
-	if ((fseek(pIndexFile, seekBase + 12, SEEK_SET) == 0)
-	    && (fread(&nextSeekBase, 1, 4, pIndexFile) == 4)
-		&& (nextSeekBase > 0))
-	{
-		pNext = new FileNode(FileNode::FILE_TYPE_NORMAL, nextSeekBase);
-		pNext->pPrev = this;
-		if (!pNext->isDirty)
+		IndexWord start = pWords[WORD_START_TIME];
+		IndexWord end   = pWords[WORD_END_TIME];
+		IndexWord endPosition = pWords[WORD_END_POSITION];
+		IndexWord count = std::min(pWords[WORD_CLUSTER_COUNT], (IndexWord)CAPACITY);
+		memcpy(name, pClipFileName, sizeof(name));
+		if ((pLiveClusters != NULL) && (endPosition != 0))
+		{
+			size_t firstCount = (pLiveClusters->startTime == (uint64_t)start) ? std::min(keptCount, (size_t)count) : 0;
+			pLiveClusters->positions.resize((size_t)count);
+			pLiveClusters->timecodes.resize((size_t)count);
+			for (size_t j = firstCount; j < (size_t)count; j++)
+			{
+				pLiveClusters->positions[j] = pClusters[j * 2];
+				pLiveClusters->timecodes[j] = pClusters[j * 2 + 1];
+			}
+		}
+
+		LIVE_MEMORY_BARRIER();
+		if (pWords[WORD_GENERATION] != generation)
 		{
-			return pNext;
+			// changed meanwhile
+			continue;
 		}
+
+		name[sizeof(name) - 1] = '\0';
+		if ((endPosition == 0) || (name[0] == '\0'))
+		{
+			// withdrawn
+			return false;
+		}
+
+		clipFileName = name;
+		startTime    = start;
+		endTime      = end;
+		if (pLiveClusters != NULL)
+		{
+			pLiveClusters->startTime   = start;
+			pLiveClusters->endTime     = end;
+			pLiveClusters->endPosition = endPosition;
+		}
+		return true;
 	}
 
-	return NULL;
+	// error: the recorder keeps changing it, or died while changing it
+	return false;
 }
 
-// for indexing
-FileNode * FileNode::LoadPreviousFromFileDirectly()
+bool LiveClipFile::Map(bool isWriter)
 {
-	if (pPrev != NULL)
+	if (isWriter)
 	{
-		return pPrev;
-	}
+		try
+		{
+			boost::filesystem::create_directories(fileName.substr(0, fileName.find('/')));
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// error: the disk fails
+			return false;
+		}
 
-	// force to reload file
-	if (pIndexFile != NULL)
+		// the readers may have it mapped already, it's never truncated
+		if (!PreallocateFile(fileName.c_str(), FILE_SIZE))
+		{
+			return false;
+		}
+	}
+	else
 	{
-		fclose(pIndexFile);
+		time_t now = time(NULL);
+		if (now - openTime < REOPEN_PERIOD)
+		{
+			return false;
+		}
+		openTime = now;
+
+		try
+		{
+			if (boost::filesystem::file_size(fileName) < FILE_SIZE)
+			{
+				// not yet
+				return false;
+			}
+		}
+		catch (boost::filesystem::filesystem_error &)
+		{
+			// no clip recorded yet
+			return false;
+		}
 	}
-	pIndexFile = fopen(".index", "rb+");
 
-	if ((pIndexFile == NULL) || (seekBase <= 0))
+	Unmap();
+	try
 	{
-		return NULL;
+		boost::interprocess::mode_t mode = isWriter ? boost::interprocess::read_write : boost::interprocess::read_only;
+		pMapping = new boost::interprocess::file_mapping(fileName.c_str(), mode);
+		pRegion = new boost::interprocess::mapped_region(*pMapping, mode, 0, FILE_SIZE);
+	}
+	catch (boost::interprocess::interprocess_exception &)
+	{
+		// error:
+		Unmap();
+		return false;
 	}
 
-	int prevSeekBase;
-	if ((fseek(pIndexFile, seekBase + 8, SEEK_SET) == 0)
-	    && (fread(&prevSeekBase, 1, 4, pIndexFile) == 4)
-		&& (prevSeekBase > 0))
+	pWords        = (IndexWord *)pRegion->get_address();
+	pClipFileName = (char *)(pWords + HEADER_WORDS);
+	pClusters     = (IndexWord *)(pClipFileName + FileNode::BUFFER_SIZE);
+	if (isWriter)
 	{
-		pPrev = new FileNode(FileNode::FILE_TYPE_NORMAL, prevSeekBase);
-		pPrev->pNext = this;
-		if (!pPrev->isDirty)
+		if (pWords[WORD_MAGIC] != MAGIC)
 		{
-			return pPrev;
+			memset(pWords, 0, FILE_SIZE);
+			pWords[WORD_MAGIC] = MAGIC;
 		}
+		else
+		{
+			// the clip of the last run is over, even if it stopped in the middle of a change
+			pWords[WORD_GENERATION] |= 1;
+			LIVE_MEMORY_BARRIER();
+			pWords[WORD_END_POSITION] = 0;
+			pClipFileName[0] = '\0';
+			LIVE_MEMORY_BARRIER();
+			pWords[WORD_GENERATION]++;
+		}
+		isWritable = true;
 	}
+	return true;
+}
 
-	return NULL;
+void LiveClipFile::Unmap()
+{
+	pWords        = NULL;
+	pClipFileName = NULL;
+	pClusters     = NULL;
+	if (pRegion != NULL)
+	{
+		delete pRegion;
+		pRegion = NULL;
+	}
+	if (pMapping != NULL)
+	{
+		delete pMapping;
+		pMapping = NULL;
+	}
+}
+
+void LiveClipFile::BeginChange()
+{
+	pWords[WORD_GENERATION]++;
+	LIVE_MEMORY_BARRIER();
+}
+
+void LiveClipFile::EndChange()
+{
+	LIVE_MEMORY_BARRIER();
+	pWords[WORD_GENERATION]++;
 }
 
 //---------------------------------------------------------------------------
@@ -2081,7 +4878,7 @@ class StreamingMediaLibraryImpl
 public:
 	enum
 	{
-		TEMPORARY_FILE_NAME_COUNT = 128,
+		EVICTION_BATCH_SIZE = 32,  // older clips removed with the clip of a reused container
 	};
 
 	StreamingMediaLibraryImpl();
@@ -2093,13 +4890,31 @@ public:
 	static bool isInitialized;
 	static RootIndexNode *pIndexRoot;
 	static unsigned int temporaryFileNameIndex;
-	static char **temporaryFileNames;
+	static boost::mutex temporaryFileNameMutex;
+	static StorageRecycler *pRecycler;
+	static boost::mutex recyclerMutex;
+	static StorageCompactor *pCompactor;
+	static boost::mutex compactorMutex;
+
+	// the clips being recorded by channel, shared with the live readers of every process
+	static LiveClipFile * GetLiveClip(int chId);
+	static std::map<int, LiveClipFile *> liveClips;
+	static boost::mutex liveClipMutex;
+
+	static ThumbnailCache thumbnailCache;
 };
 
 bool StreamingMediaLibraryImpl::isInitialized = false;
 RootIndexNode *StreamingMediaLibraryImpl::pIndexRoot;
 unsigned int StreamingMediaLibraryImpl::temporaryFileNameIndex = -1;
-char **StreamingMediaLibraryImpl::temporaryFileNames;
+boost::mutex StreamingMediaLibraryImpl::temporaryFileNameMutex;
+StorageRecycler *StreamingMediaLibraryImpl::pRecycler;
+boost::mutex StreamingMediaLibraryImpl::recyclerMutex;
+StorageCompactor *StreamingMediaLibraryImpl::pCompactor;
+boost::mutex StreamingMediaLibraryImpl::compactorMutex;
+std::map<int, LiveClipFile *> StreamingMediaLibraryImpl::liveClips;
+boost::mutex StreamingMediaLibraryImpl::liveClipMutex;
+ThumbnailCache StreamingMediaLibraryImpl::thumbnailCache;
 
 StreamingMediaLibraryImpl::StreamingMediaLibraryImpl()
 {
@@ -2123,22 +4938,35 @@ bool StreamingMediaLibraryImpl::Initialize()
 		t.tm_hour = 0;
 		t.tm_min  = 0;
 		t.tm_sec  = 0;
+		t.tm_isdst = -1;
 		TIMEZONE = mktime(&t) - 24 * 60 * 60;
 
 		pIndexRoot = RootIndexNode::GetRootIndexNode(FileNode::DEFAULT_CHANNEL_COUNT);  // FIXME: MUST check the status
 
 		// initialize root node
 
-		temporaryFileNames = new char *[TEMPORARY_FILE_NAME_COUNT];
-		for (int i = 0; i < TEMPORARY_FILE_NAME_COUNT; i++)
-		{
-			temporaryFileNames[i] = new char[8];
-			sprintf(temporaryFileNames[i], "%03d.mkv", i);
-		}
+		storagePool.Load();
 	}
 	return true;
 }
 
+LiveClipFile * StreamingMediaLibraryImpl::GetLiveClip(int chId)
+{
+	if (chId <= 0)
+	{
+		// error: wrong id
+		return NULL;
+	}
+
+	boost::mutex::scoped_lock lock(liveClipMutex);
+	LiveClipFile *&pLiveClip = liveClips[chId];
+	if (pLiveClip == NULL)
+	{
+		pLiveClip = new LiveClipFile(chId);
+	}
+	return pLiveClip;
+}
+
 //---------------------------------------------------------------------------
 //---------------------------------------------------------------------------
 StreamingMediaChannelHelper::StreamingMediaChannelHelper(StreamingMediaLibrary &_library, int chId)
@@ -2146,8 +4974,10 @@ StreamingMediaChannelHelper::StreamingMediaChannelHelper(StreamingMediaLibrary &
 {
 	pRecordingMediaFile = new StreamingMediaFileImpl();
 	pLocatingMediaFile  = new StreamingMediaFileImpl();
+	pLiveMediaFile      = new StreamingMediaFileImpl();
 	pRecordingMediaFile->chId = chId;
 	pLocatingMediaFile->chId  = chId;
+	pLiveMediaFile->chId      = chId;
 }
 
 StreamingMediaChannelHelper::~StreamingMediaChannelHelper()
@@ -2179,24 +5009,259 @@ bool StreamingMediaLibrary::AddMediaFile(const char *fileName, StreamingMediaFil
 		return false;
 	}
 
-	if (pFileNode->RenameFrom(fileName))
+	bool isFinished;
+	if (pFileNode->containerId != FileNode::CONTAINER_ID_UNKNOWN)
+	{
+		// written in place, only its ring and the index change
+		ContainerRing::Clip clip;
+		clip.chId      = pFileNode->chId;
+		clip.startTime = pFileNode->startTime;
+		clip.endTime   = pFileNode->endTime;
+		isFinished = (fileName != NULL)
+		             && storagePool.SetContainerClip(pFileNode->diskId, pFileNode->containerId, clip)
+		             && pFileNode->RebuildFileName();
+	}
+	else
+	{
+		isFinished = pFileNode->RenameFrom(fileName);
+	}
+
+	if (isFinished)
 	{
 		// create file node
 		FileNode *pCurrentNode = new FileNode(FileNode::FILE_TYPE_NORMAL);
 		*pCurrentNode = *pFileNode;
 		pCurrentNode->fileName = pCurrentNode->fileNameBuffer;
 
+		pCurrentNode->fileSize = storagePool.FinishWriting(pCurrentNode->chId, pCurrentNode->fileName, true);
+
+		if (pCurrentNode->containerId == FileNode::CONTAINER_ID_UNKNOWN)
+		{
+			boost::mutex::scoped_lock lock(pImpl->recyclerMutex);
+			if (pImpl->pRecycler != NULL)
+			{
+				pImpl->pRecycler->AddFile(pCurrentNode->chId, pCurrentNode->fileName);
+			}
+		}
+
 		return pImpl->pIndexRoot->InsertIndex(pCurrentNode);
 	}
 	else
 	{
-		// error: fail to rename the file
+		// error: fail to rename the file, the disk fails unless no file was written
 		// FIXME:
+		storagePool.FinishWriting(pFileNode->chId, NULL, fileName == NULL);
 		pFileNode->fileName = NULL;
 		return false;
 	}
 }
 
+// for the writer only, after a crash and before recording
+size_t StreamingMediaLibrary::RecoverIndex()
+{
+	IndexRecovery recovery(pImpl->pIndexRoot);
+	return recovery.Run();
+}
+
+bool StreamingMediaLibrary::GetDayUsage(int chId, time_t date, DayUsage &usage)
+{
+	return pImpl->pIndexRoot->GetDayUsage(chId, date, usage);
+}
+
+// the dates of the channels at once, for a timeline of several cameras
+size_t StreamingMediaLibrary::GetDayUsages(time_t date, const std::vector<int> &chIds, std::vector<DayUsage> &usages)
+{
+	size_t count = 0;
+	usages.resize(chIds.size());
+	for (size_t i = 0; i < chIds.size(); i++)
+	{
+		if (pImpl->pIndexRoot->GetDayUsage(chIds[i], date, usages[i]))
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+bool StreamingMediaLibrary::GetYearUsage(int chId, int year, YearUsage &usage)
+{
+	return pImpl->pIndexRoot->GetYearUsage(chId, year, usage);
+}
+
+uint64_t StreamingMediaLibrary::GetChannelUsage(int chId)
+{
+	return pImpl->pIndexRoot->GetChannelUsage(chId);
+}
+
+// the range of the channel, cut at the key frame before the start time
+bool StreamingMediaLibrary::ExportClips(int chId, time_t startTime, time_t endTime, const char *fileName)
+{
+	if ((chId <= 0) || (startTime >= endTime) || (fileName == NULL))
+	{
+		// error: invalid parameter
+		return false;
+	}
+
+	Exporter *pExporter = ExporterUtilities::CreateMkvExporter();
+	if (!pExporter->StartExporting(fileName, startTime * 1000000000ull, endTime * 1000000000ull))
+	{
+		delete pExporter;
+		return false;
+	}
+
+	// the clips are copied out of the index one by one, a clip recycled
+	// meanwhile is skipped by the exporter
+	RootIndexNode::Clip clip;
+	for (bool isFound = pImpl->pIndexRoot->GetNextClip(chId, startTime, clip, true);
+	     isFound && (clip.startTime < endTime);
+	     isFound = pImpl->pIndexRoot->GetNextClip(chId, clip.startTime + 1, clip))
+	{
+		pExporter->AppendFile(clip.fileName.c_str());
+	}
+
+	bool result = pExporter->StopExporting();
+	delete pExporter;
+	return result;
+}
+
+// the stride times in a gap get nothing, except the one before a clip
+// starting within the stride, which gets the first key frame of the clip; a
+// key frame found for several times is taken once
+size_t StreamingMediaLibrary::GetThumbnails(int chId, time_t startTime, time_t endTime, int stride, std::vector<Thumbnail> &thumbnails)
+{
+	thumbnails.clear();
+	if ((chId <= 0) || (startTime >= endTime) || (stride <= 0))
+	{
+		// error: invalid parameter
+		return 0;
+	}
+
+	time_t time = startTime;  // the next stride time
+	RootIndexNode::Clip clip;  // copied out of the index, no node is kept while the recycler runs
+	for (bool isFound = pImpl->pIndexRoot->GetNextClip(chId, startTime, clip, true);
+	     isFound && (clip.startTime < endTime) && (time < endTime);
+	     isFound = pImpl->pIndexRoot->GetNextClip(chId, clip.startTime + 1, clip))
+	{
+		std::vector<uint64_t> times;
+		if (time < clip.startTime)
+		{
+			// the stride time before the clip is in a gap
+			time += (clip.startTime - time) / stride * stride;
+			if (time < clip.startTime)
+			{
+				times.push_back(clip.startTime * 1000000000ull);
+				time += stride;
+			}
+		}
+		for ( ; (time < clip.endTime) && (time < endTime); time += stride)
+		{
+			times.push_back(time * 1000000000ull);
+		}
+
+		std::vector<Thumbnail> clipThumbnails;
+		pImpl->thumbnailCache.GetThumbnails(clip.fileName, times, clipThumbnails);
+		for (size_t i = 0; i < clipThumbnails.size(); i++)
+		{
+			if (thumbnails.empty() || (clipThumbnails[i].time != thumbnails.back().time))
+			{
+				thumbnails.push_back(clipThumbnails[i]);
+			}
+		}
+	}
+
+	return thumbnails.size();
+}
+
+// the clips go to the added disks, the current directory is no longer used for them
+bool StreamingMediaLibrary::AddStorage(const char *mountPoint)
+{
+	return storagePool.AddDisk(mountPoint) >= 0;
+}
+
+// a clip per preallocated container from now on, reused in ring order
+bool StreamingMediaLibrary::SetContainerPool(uint64_t containerSize, int containerCount)
+{
+	if ((containerCount < 0) || ((containerCount > 0) && (containerSize == 0)))
+	{
+		// error: wrong config
+		return false;
+	}
+
+	return storagePool.SetContainers((IndexWord)containerSize, containerCount);
+}
+
+// the recycler starts with the first config and keeps running
+bool StreamingMediaLibrary::SetRetentionConfig(const RetentionConfig &config)
+{
+	if ((config.minRetentionDays < 0) || (config.maxRetentionDays < 0)
+	    || ((config.maxRetentionDays > 0) && (config.maxRetentionDays < config.minRetentionDays))
+	    || (config.highWatermark < 0) || (config.highWatermark > 100)
+	    || (config.lowWatermark < 0) || ((config.highWatermark > 0) && (config.lowWatermark > config.highWatermark))
+	    || (config.batchSize <= 0) || (config.maxDeletionRate < 0))
+	{
+		// error: wrong config
+		return false;
+	}
+
+	boost::mutex::scoped_lock lock(pImpl->recyclerMutex);
+	if (pImpl->pRecycler == NULL)
+	{
+		pImpl->pRecycler = new StorageRecycler(pImpl->pIndexRoot, config);
+	}
+	else
+	{
+		pImpl->pRecycler->SetConfig(config);
+	}
+	return true;
+}
+
+bool StreamingMediaLibrary::SetChannelQuota(int chId, uint64_t quota)
+{
+	boost::mutex::scoped_lock lock(pImpl->recyclerMutex);
+	if ((chId <= 0) || (pImpl->pRecycler == NULL))
+	{
+		// error: wrong id or no retention config
+		return false;
+	}
+
+	pImpl->pRecycler->SetChannelQuota(chId, quota);
+	return true;
+}
+
+// the compactor starts with the first config and keeps running
+bool StreamingMediaLibrary::SetCompactionConfig(const CompactionConfig &config)
+{
+	if ((config.compactionDays < 0) || (config.keptGopInterval <= 0) || (config.maxByteRate < 0))
+	{
+		// error: wrong config
+		return false;
+	}
+
+	boost::mutex::scoped_lock lock(pImpl->compactorMutex);
+	if (pImpl->pCompactor == NULL)
+	{
+		pImpl->pCompactor = new StorageCompactor(pImpl->pIndexRoot, config, pImpl->pRecycler, pImpl->recyclerMutex);
+	}
+	else
+	{
+		pImpl->pCompactor->SetConfig(config);
+	}
+	return true;
+}
+
+bool StreamingMediaLibrary::SetChannelCompaction(int chId, int compactionDays)
+{
+	boost::mutex::scoped_lock lock(pImpl->compactorMutex);
+	if ((chId <= 0) || (compactionDays < 0) || (pImpl->pCompactor == NULL))
+	{
+		// error: wrong id or no compaction config
+		return false;
+	}
+
+	pImpl->pCompactor->SetChannelDays(chId, compactionDays);
+	return true;
+}
+
 // params: ch id, start time
 bool StreamingMediaLibrary::AllocateRecordingFile(StreamingMediaFile &mediaFile)
 {
@@ -2206,13 +5271,56 @@ bool StreamingMediaLibrary::AllocateRecordingFile(StreamingMediaFile &mediaFile)
 		return false;
 	}
 
+	// the clip is renamed on the same disk
+	pFileNode->diskId = storagePool.AllocateDisk(pFileNode->chId);
+
+	// or written in place in the next container of the disk
+	ContainerRing::Clip evictedClip;
+	pFileNode->containerId = storagePool.AllocateContainer(pFileNode->diskId, evictedClip);
+	pFileNode->isPreallocated = pFileNode->containerId != FileNode::CONTAINER_ID_UNKNOWN;
+	if (pFileNode->isPreallocated)
+	{
+		if (evictedClip.chId > 0)
+		{
+			// the clip in the container is gone, and so are the older clips of its channel
+			std::vector<RootIndexNode::Clip> clips;
+			pImpl->pIndexRoot->RemoveOldestFiles((int)evictedClip.chId, (time_t)evictedClip.endTime, StreamingMediaLibraryImpl::EVICTION_BATCH_SIZE, clips);
+			for (size_t i = 0; i < clips.size(); i++)
+			{
+				try
+				{
+					clips[i].fileSize = boost::filesystem::file_size(clips[i].fileName);
+				}
+				catch (boost::filesystem::filesystem_error &)
+				{
+					// error: the file is lost, nothing to count
+				}
+				if (!storagePool.IsContainer(clips[i].fileName))
+				{
+					remove(clips[i].fileName.c_str());
+				}
+				else
+				{
+					storagePool.RemoveContainerClip((int)evictedClip.chId, clips[i].startTime);
+				}
+			}
+			pImpl->pIndexRoot->RemoveUsage((int)evictedClip.chId, clips);
+		}
+
+		storagePool.GetContainerFileName(pFileNode->diskId, pFileNode->containerId, pFileNode->fileNameBuffer);
+		pFileNode->fileName = pFileNode->fileNameBuffer;
+		return true;
+	}
+
 	// cyclically reuse these file names
-	if (++pImpl->temporaryFileNameIndex >= pImpl->TEMPORARY_FILE_NAME_COUNT)
+	boost::mutex::scoped_lock lock(pImpl->temporaryFileNameMutex);
+	if (++pImpl->temporaryFileNameIndex >= StoragePool::TEMPORARY_FILE_NAME_COUNT)
 	{
 		pImpl->temporaryFileNameIndex = 0;
 	}
 
-	pFileNode->fileName = pImpl->temporaryFileNames[pImpl->temporaryFileNameIndex];
+	storagePool.GetTemporaryFileName(pFileNode->diskId, pFileNode->chId, pImpl->temporaryFileNameIndex, pFileNode->fileNameBuffer);
+	pFileNode->fileName = pFileNode->fileNameBuffer;
 	return true;
 }
 
@@ -2227,12 +5335,55 @@ uint64_t StreamingMediaLibrary::GetSuggestedDuration(int chId, uint64_t startTim
 	time_t duration = pImpl->pIndexRoot->GetCurrentDuration(chId);
 
 	time_t _start = startTime / 1000000000ull;
-	struct tm *start;
-	start = localtime(&_start);
+	struct tm tmBuffer;
+	struct tm *start = LocalTime(&_start, &tmBuffer);
 
 	return (duration - (start->tm_min * 60 + start->tm_sec) % duration) * 1000000000ull - startTime % 1000000000ull;
 }
 
+// params: ch id, file, start time, end time, end position, cluster position, cluster time
+bool StreamingMediaLibrary::PublishLiveClip(int chId, const char *fileName, uint64_t startTime, uint64_t endTime,
+                                            uint64_t endPosition, uint64_t clusterPosition, uint64_t clusterTime)
+{
+	if ((fileName == NULL) || (fileName[0] == '\0') || (strlen(fileName) >= FileNode::BUFFER_SIZE) || (endPosition == 0ull))
+	{
+		// error: invalid parameter
+		return false;
+	}
+
+	LiveClipFile *pLiveClip = pImpl->GetLiveClip(chId);
+	return (pLiveClip != NULL) && pLiveClip->Publish(fileName, startTime, endTime, endPosition, clusterPosition, clusterTime);
+}
+
+// params: ch id
+bool StreamingMediaLibrary::WithdrawLiveClip(int chId)
+{
+	LiveClipFile *pLiveClip = pImpl->GetLiveClip(chId);
+	return (pLiveClip != NULL) && pLiveClip->Withdraw();
+}
+
+// params: MediaFile, clusters
+StreamingMediaFile & StreamingMediaLibrary::LocateLiveMediaFile(StreamingMediaFile &fileNode, StreamingMediaLiveClusters *pClusters)
+{
+	// a node of the helper, out of the index
+	StreamingMediaFileImpl *pFileNode = dynamic_cast<StreamingMediaFileImpl *>(&fileNode);
+	LiveClipFile *pLiveClip = pImpl->GetLiveClip(fileNode.chId);
+	std::string fileName;
+	uint64_t startTime, endTime;
+	if ((pFileNode != NULL) && (pLiveClip != NULL) && pLiveClip->Read(fileName, startTime, endTime, pClusters))
+	{
+		strcpy(pFileNode->fileNameBuffer, fileName.c_str());
+		pFileNode->fileName  = pFileNode->fileNameBuffer;
+		pFileNode->startTime = startTime / 1000000000ull;
+		pFileNode->endTime   = (endTime + 999999999ull) / 1000000000ull;
+		return *pFileNode;
+	}
+
+	// error:
+	fileNode.startTime = fileNode.endTime = 0;
+	return fileNode;
+}
+
 // params: ch id, time, or MediaFile
 StreamingMediaFile & StreamingMediaLibrary::LocateMediaFile(StreamingMediaFile &fileNode, LocatingOption option)
 {
@@ -2292,6 +5443,9 @@ StreamingMediaFile & StreamingMediaLibrary::LocateMediaFile(StreamingMediaFile &
 			}
 		}
 		break;
+
+	case LIVE_ONE:
+		return LocateLiveMediaFile(fileNode, NULL);
 	}
 
 	// error:
@@ -3,7 +3,9 @@
 #define STREAMING_MEDIA_LIBRARY_HPP
 
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <vector>
 
 typedef unsigned long long uint64_t;
 
@@ -13,13 +15,29 @@ class StreamingMediaLibrary;
 class StreamingMediaFile
 {
 public:
-	StreamingMediaFile() : startTime(0), endTime(0) {}
+	StreamingMediaFile() : startTime(0), endTime(0), isPreallocated(false) {}
 	virtual ~StreamingMediaFile() {}
 	virtual const char * GetFileName() const = 0;
 
 	int    chId;
 	time_t startTime;
 	time_t endTime;
+	bool   isPreallocated;  // a container to write in place, see StreamingMediaLibrary::SetContainerPool()
+};
+
+// the clusters of the clip being recorded which its recorder committed so far,
+// to demux it up to there while it's written; a live reader keeps it across
+// locatings, and only the clusters after those of the same clip are added
+class StreamingMediaLiveClusters
+{
+public:
+	StreamingMediaLiveClusters() : startTime(0), endTime(0), endPosition(0) {}
+
+	uint64_t              startTime;    // nanosec, the first frame of the clip
+	uint64_t              endTime;      // nanosec, the last frame of the last cluster
+	uint64_t              endPosition;  // bytes, the end of the last cluster
+	std::vector<uint64_t> positions;    // bytes, of every cluster in order
+	std::vector<uint64_t> timecodes;    // nanosec, of every cluster
 };
 
 class StreamingMediaChannelHelper
@@ -32,6 +50,9 @@ public:
 	const StreamingMediaFile & AllocateRecordingFile(time_t time);
 	bool                       ExtendRecordingClip(time_t time);
 	uint64_t                   GetSuggestedDuration(uint64_t startTime);
+	bool                       PublishLiveClip(const char *fileName, uint64_t startTime, uint64_t endTime,  // nanosec, up to the last cluster written
+	                                           uint64_t endPosition, uint64_t clusterPosition, uint64_t clusterTime);  // bytes, bytes, nanosec
+	bool                       WithdrawLiveClip();
 
 	// for retrievers
 	const StreamingMediaFile & LocateMediaFileExactly(time_t time);
@@ -39,11 +60,13 @@ public:
 	const StreamingMediaFile & LocateMediaFileBackwardly(time_t time);
 	const StreamingMediaFile & LocateNextMediaFile();
 	const StreamingMediaFile & LocatePreviousMediaFile();
+	const StreamingMediaFile & LocateLiveMediaFile(StreamingMediaLiveClusters *pClusters = NULL);  // the clip being recorded, not indexed yet
 
 private:
 	StreamingMediaLibrary &library;
 	StreamingMediaFile    *pRecordingMediaFile;
 	StreamingMediaFile    *pLocatingMediaFile;
+	StreamingMediaFile    *pLiveMediaFile;
 
 	friend class StreamingMediaLibrary;  // for StreamingMediaLibrary::CreateChannelHelper(chId)
 	StreamingMediaChannelHelper(StreamingMediaLibrary &_library, int chId);
@@ -52,10 +75,134 @@ private:
 class StreamingMediaLibrary
 {
 public:
+	class RetentionConfig
+	{
+	public:
+		RetentionConfig()
+			: globalQuota(0ull), channelQuota(0ull), minRetentionDays(0), maxRetentionDays(0),
+			  highWatermark(DEFAULT_HIGH_WATERMARK), lowWatermark(DEFAULT_LOW_WATERMARK),
+			  batchSize(DEFAULT_BATCH_SIZE), maxDeletionRate(DEFAULT_MAX_DELETION_RATE)
+		{}
+
+		uint64_t globalQuota;       // bytes of all the channels, 0 for no quota
+		uint64_t channelQuota;      // bytes of every channel, 0 for no quota
+		int      minRetentionDays;  // the quotas never recycle younger clips
+		int      maxRetentionDays;  // older clips are always recycled, 0 for no limit
+		int      highWatermark;     // % of the disk in use to start recycling, 0 for never
+		int      lowWatermark;      // % of the disk in use to stop recycling
+		int      batchSize;         // clips removed from the index at once
+		int      maxDeletionRate;   // files deleted per sec
+
+	protected:
+		enum
+		{
+			DEFAULT_HIGH_WATERMARK    = 95,
+			DEFAULT_LOW_WATERMARK     = 90,
+			DEFAULT_BATCH_SIZE        = 32,
+			DEFAULT_MAX_DELETION_RATE = 8
+		};
+	};
+
+	// the aged clips are rewritten with their key frames only, in place of the originals
+	class CompactionConfig
+	{
+	public:
+		CompactionConfig()
+			: compactionDays(0), keptGopInterval(1), hasAudio(true), maxByteRate(DEFAULT_MAX_BYTE_RATE)
+		{}
+
+		int  compactionDays;   // older clips are thinned, 0 for never
+		int  keptGopInterval;  // the key frame of every nth GOP is kept
+		bool hasAudio;         // the audio of the thinned clips is kept
+		int  maxByteRate;      // KB per sec read and written, 0 for no limit
+
+	protected:
+		enum
+		{
+			DEFAULT_MAX_BYTE_RATE = 4096
+		};
+	};
+
+	// what the index knows of a date of a channel, without loading its clips
+	class DayUsage
+	{
+	public:
+		enum
+		{
+			MINUTE_COUNT = 24 * 60
+		};
+
+		DayUsage() : byteCount(0ull) { memset(minuteBitmap, 0, sizeof(minuteBitmap)); }
+		bool IsRecorded(int minute) const { return (minuteBitmap[minute / 8] & (1 << (minute % 8))) != 0; }
+
+		uint64_t      byteCount;                      // of the clips started on the date
+		unsigned char minuteBitmap[MINUTE_COUNT / 8];  // bit n for the minute n after midnight
+	};
+
+	class YearUsage
+	{
+	public:
+		enum
+		{
+			DAY_COUNT = 366
+		};
+
+		YearUsage() : byteCount(0ull) { memset(dayBitmap, 0, sizeof(dayBitmap)); }
+		bool IsRecorded(int day) const { return (dayBitmap[day / 8] & (1 << (day % 8))) != 0; }
+
+		uint64_t      byteCount;
+		unsigned char dayBitmap[(DAY_COUNT + 7) / 8];  // bit n for the day n after January 1
+	};
+
+	// a key frame as it was recorded, e.g. a JPEG for MJPEG, or an IDR frame
+	// for H.264 with the SPS and PPS recorded along
+	class Thumbnail
+	{
+	public:
+		Thumbnail() : time(0ull), codec(0) {}
+
+		uint64_t time;   // nanosec, of the key frame
+		int      codec;  // Demuxer::VideoStream::VideoCodecId
+		std::vector<unsigned char> data;
+	};
+
+	enum
+	{
+		MAX_CHANNEL_ID         = 255,  // chxx
+		SUBSTREAM_CHANNEL_BASE = 256   // the substream of the channel n is indexed as 256 + n, in chxx/sub
+	};
+
 	StreamingMediaLibrary();
 	virtual ~StreamingMediaLibrary();
 	StreamingMediaChannelHelper & CreateChannelHelper(int chId);
 
+	// a substream is indexed as a parallel set of clips under an id of its own, 0 for none
+	static int GetSubstreamChannelId(int chId) { return ((chId > 0) && (chId <= MAX_CHANNEL_ID)) ? chId + SUBSTREAM_CHANNEL_BASE : 0; }
+	static bool IsChannelId(int chId) { return ((chId > 0) && (chId <= MAX_CHANNEL_ID))
+	                                           || ((chId > SUBSTREAM_CHANNEL_BASE) && (chId <= SUBSTREAM_CHANNEL_BASE + MAX_CHANNEL_ID)); }
+
+	// for storage management
+	bool AddStorage(const char *mountPoint);  // a disk for new clips, the current directory until the first one
+	bool SetContainerPool(uint64_t containerSize, int containerCount);  // bytes, per disk, 0 for a file per clip
+	bool SetRetentionConfig(const RetentionConfig &);
+	bool SetChannelQuota(int chId, uint64_t quota);  // bytes, overrides RetentionConfig::channelQuota
+	bool SetCompactionConfig(const CompactionConfig &);
+	bool SetChannelCompaction(int chId, int compactionDays);  // overrides CompactionConfig::compactionDays
+	size_t RecoverIndex();  // clips indexed from the disks, those left out by a crash
+
+	// for timelines and capacity planning, kept by the index as the clips are added
+	bool GetDayUsage(int chId, time_t date, DayUsage &);  // any time of the date
+	size_t GetDayUsages(time_t date, const std::vector<int> &chIds, std::vector<DayUsage> &);  // in the order of the ids
+	bool GetYearUsage(int chId, int year, YearUsage &);
+	uint64_t GetChannelUsage(int chId);  // bytes
+
+	// for exporting, the clips indexed so far are copied into a single file cluster by cluster
+	bool ExportClips(int chId, time_t startTime, time_t endTime, const char *fileName);
+
+	// for timeline scrubbing, the key frame at the cue point before every stride from the start time,
+	// cached per clip, and the first one of a clip starting within a stride after a gap
+	size_t GetThumbnails(int chId, time_t startTime, time_t endTime, int stride, std::vector<Thumbnail> &);  // sec
+
 protected:
 	friend class StreamingMediaChannelHelper;
 
@@ -65,7 +212,8 @@ protected:
 		PREVIOUS_ONE,
 		EXACTLY_MATCH,
 		FORWARD_SEARCH,
-		BACKWARD_SEARCH
+		BACKWARD_SEARCH,
+		LIVE_ONE
 	};
 
 	// for recorders
@@ -73,9 +221,12 @@ protected:
 	virtual bool AllocateRecordingFile(StreamingMediaFile &);
 	virtual bool ExtendRecordingClip(int chId, time_t);
 	virtual uint64_t GetSuggestedDuration(int chId, uint64_t);
+	virtual bool PublishLiveClip(int chId, const char *, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+	virtual bool WithdrawLiveClip(int chId);
 
 	// for retrievers
 	virtual StreamingMediaFile & LocateMediaFile(StreamingMediaFile &, LocatingOption);
+	virtual StreamingMediaFile & LocateLiveMediaFile(StreamingMediaFile &, StreamingMediaLiveClusters *);
 
 	StreamingMediaLibraryImpl *pImpl;
 };
@@ -109,6 +260,17 @@ inline uint64_t StreamingMediaChannelHelper::GetSuggestedDuration(uint64_t start
 	return library.GetSuggestedDuration(pRecordingMediaFile->chId, startTime);
 }
 
+inline bool StreamingMediaChannelHelper::PublishLiveClip(const char *fileName, uint64_t startTime, uint64_t endTime,
+                                                         uint64_t endPosition, uint64_t clusterPosition, uint64_t clusterTime)
+{
+	return library.PublishLiveClip(pRecordingMediaFile->chId, fileName, startTime, endTime, endPosition, clusterPosition, clusterTime);
+}
+
+inline bool StreamingMediaChannelHelper::WithdrawLiveClip()
+{
+	return library.WithdrawLiveClip(pRecordingMediaFile->chId);
+}
+
 inline const StreamingMediaFile & StreamingMediaChannelHelper::LocateMediaFileExactly(time_t time)
 {
 	pLocatingMediaFile->startTime = pLocatingMediaFile->endTime = time;
@@ -142,4 +304,9 @@ inline const StreamingMediaFile & StreamingMediaChannelHelper::LocatePreviousMed
 	return *pLocatingMediaFile;
 }
 
+inline const StreamingMediaFile & StreamingMediaChannelHelper::LocateLiveMediaFile(StreamingMediaLiveClusters *pClusters)
+{
+	return library.LocateLiveMediaFile(*pLiveMediaFile, pClusters);
+}
+
 #endif  // STREAMING_MEDIA_LIBRARY_HPP
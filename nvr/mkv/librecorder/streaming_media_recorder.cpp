@@ -3,10 +3,38 @@
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#if defined(WIN32)
+#include <windows.h>
+#endif
+#include <deque>
+#include <boost/thread/mutex.hpp>
 #include <muxer.hpp>
+#include <ebml/HotTrace.h>
 #include "streaming_media_recorder.hpp"
 #include "streaming_media_library.hpp"
 
+// orders the accesses to the published statistics, a compiler barrier is enough on x86 for MSVC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define STATS_MEMORY_BARRIER() _ReadWriteBarrier()
+#else
+#define STATS_MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+static uint64_t GetMonotonicTime()  // nanosec
+{
+#if defined(WIN32)
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
 class Recorder
 {
 public:
@@ -16,13 +44,32 @@ public:
 	bool StartRecording(const StreamingMediaRecorder::RecordingConfig &);
 	bool StopRecording();
 	bool AppendFrame(const StreamingMediaRecorder::Frame &);
+	bool TriggerEvent();
+	bool EndEvent();
+	void GetStats(StreamingMediaRecorder::ChannelStats &) const;
+	bool IsRecording() const { return isRecording; }
 
 protected:
+	enum
+	{
+		STATS_PERIOD = 1000000000,  // nanosec of ingest the rates are taken over
+		STATS_IDLE_TIMEOUT = 2  // sec without frames before the rates drop to 0
+	};
+
+	bool RecordFrame(const StreamingMediaRecorder::Frame &);
+	void HandleEventRequests();
+	bool WriteFrame(const StreamingMediaRecorder::Frame &);
+	bool BufferFrame(const StreamingMediaRecorder::Frame &);
+	void FlushPreEventFrames();
+	void ReleasePreEventFrame();
 	void RestartRecording();
 	void AppendOsdFrameIfExist();
 	void BackupExtraBuffer(const StreamingMediaRecorder::RecordingConfig &);
 	void BackupOsdBuffer(const StreamingMediaRecorder::Frame &);
-	const char * GetFileName() { return fileHelper.AllocateRecordingFile(pMuxerStreams->dateUTC).GetFileName(); }
+	const char * GetFileName();
+	void ResetStats();
+	void UpdateStats(const StreamingMediaRecorder::Frame &, bool isRecorded, uint64_t startTime, uint64_t endTime);
+	void PublishStats();
 
 private:
 	friend class MyEventListener;
@@ -31,6 +78,7 @@ private:
 	public:
 		MyEventListener(Recorder *_pRecorder) : pRecorder(_pRecorder) {}
 		virtual void FileClosed(const Muxer::FileClosedEvent &) const;
+		virtual void ClusterWritten(const Muxer::ClusterWrittenEvent &) const;
 		virtual void SuggestSplitting() const;
 
 		Recorder *pRecorder;
@@ -45,7 +93,7 @@ private:
 	Muxer::Frame          *pMuxerFrame;
 	MyEventListener       *pMuxerEventListener;
 
-	bool isRecording;
+	volatile bool isRecording;  // also read by GetStats()
 	bool isWaitingForFirstFrame;
 	bool isSplitting;
 
@@ -59,6 +107,36 @@ private:
 	bool         (*pFreeOsdBuffer) (void *pParam, unsigned char *pBuffer);
 	void          *pFreeOsdBufferParam;
 
+	// the latest GOPs before an event, owned through their pFreeBuffer
+	std::deque<StreamingMediaRecorder::Frame> preEventFrames;
+	std::deque<uint64_t> preEventKeyTimecodes;
+	size_t   preEventBytes;
+	uint64_t maxPreEventDuration;  // nanosec, 0 to record at once
+	size_t   maxPreEventBytes;
+	bool     isBuffering;
+
+	// the event requests of other threads, handled in order by the next frame
+	boost::mutex      eventMutex;
+	std::deque<bool>  eventRequests;  // true to trigger, false to end
+	volatile bool     hasEventRequests;
+
+	// kept by the thread appending the frames, and published by it once a period for the
+	// others without a lock: statsSequence is odd while publishedStats is being written,
+	// readers retry then. StartRecording() only asks that thread to reset the counters
+	StreamingMediaRecorder::ChannelStats stats;
+	StreamingMediaRecorder::ChannelStats publishedStats;
+	uint64_t publishedFrameTime;
+	volatile unsigned int statsSequence;
+	volatile bool isStatsResetPending;
+	uint64_t lastFrameTime;  // nanosec, monotonic
+	uint64_t lastKeyTimecode;
+	uint64_t periodStartTime;
+	uint64_t periodVideoCount;
+	uint64_t periodByteCount;
+	uint64_t periodFrameCount;
+	uint64_t periodLatency;
+	uint64_t periodMaxLatency;
+
 	StreamingMediaChannelHelper &fileHelper;
 };
 
@@ -66,8 +144,13 @@ Recorder::Recorder(StreamingMediaChannelHelper &_fileHelper)
 	: isRecording(false), isWaitingForFirstFrame(false), isSplitting(false),
 	  extraBufferSize(0), pExtraBuffer(NULL), pFreeExtraBuffer(NULL), pFreeExtraBufferParam(NULL),
 	  osdBufferSize(0), pOsdBuffer(NULL), pFreeOsdBuffer(NULL), pFreeOsdBufferParam(NULL),
+	  preEventBytes(0), maxPreEventDuration(0ull), maxPreEventBytes(0),
+	  isBuffering(false), hasEventRequests(false),
+	  publishedFrameTime(0ull), statsSequence(0), isStatsResetPending(false),
 	  fileHelper(_fileHelper)
 {
+	ResetStats();
+
 	// create objects
 	pMuxer              = Muxer::GetInstance(Muxer::CONTAINER_FORMAT_MKV);
 	pMuxerConfig        = new Muxer::FileConfig();
@@ -187,17 +270,25 @@ bool Recorder::StartRecording(const StreamingMediaRecorder::RecordingConfig &con
 	isWaitingForFirstFrame = true;
 	isSplitting = false;
 
+	// keep the frames in memory until an event if asked
+	maxPreEventDuration = (uint64_t)(config.preEventDuration * 1000000000.0);
+	maxPreEventBytes = config.preEventBufferSize;
+	isBuffering = maxPreEventDuration != 0ull;
+
 	// backup the extra buffer for the future use
 	BackupExtraBuffer(config);
 
+	// the counters start over with the next frame
+	isStatsResetPending = true;
 	return true;
 }
 
 void Recorder::RestartRecording()
 {
-	StopRecording();
+	// only the clip is closed: a split may come while the pre-event frames are
+	// flushed, they and the event requests are kept
+	pMuxer->StopMuxing();
 
-	isRecording = true;
 	isWaitingForFirstFrame = true;
 	isSplitting = false;
 
@@ -213,20 +304,77 @@ bool Recorder::StopRecording()
 	}
 
 	pMuxer->StopMuxing();
+	while (!preEventFrames.empty())
+	{
+		ReleasePreEventFrame();
+	}
 
 	isRecording = false;
 	isWaitingForFirstFrame = false;
 	isSplitting = false;
+	isBuffering = false;
 
+	{
+		boost::mutex::scoped_lock lock(eventMutex);
+		eventRequests.clear();
+		hasEventRequests = false;
+	}
+	return true;
+}
+
+bool Recorder::TriggerEvent()
+{
+	if (!isRecording || (maxPreEventDuration == 0ull))
+	{
+		// error: not waiting for any event
+		return false;
+	}
+
+	boost::mutex::scoped_lock lock(eventMutex);
+	eventRequests.push_back(true);
+	hasEventRequests = true;
+	return true;
+}
+
+bool Recorder::EndEvent()
+{
+	if (!isRecording || (maxPreEventDuration == 0ull))
+	{
+		// error: not waiting for any event
+		return false;
+	}
+
+	boost::mutex::scoped_lock lock(eventMutex);
+	eventRequests.push_back(false);
+	hasEventRequests = true;
 	return true;
 }
 
 bool Recorder::AppendFrame(const StreamingMediaRecorder::Frame &frame)
 {
+	HOT_TRACE_SCOPE("rec.append_frame");
+	HOT_TRACE_ARG(frame.size);
+
+	uint64_t startTime = GetMonotonicTime();
+	bool isRecorded = RecordFrame(frame);
+	UpdateStats(frame, isRecorded, startTime, GetMonotonicTime());
+	return isRecorded;
+}
+
+bool Recorder::RecordFrame(const StreamingMediaRecorder::Frame &frame)
+{
+	const StreamingMediaRecorder::Frame *pFrame = &frame;
+	StreamingMediaRecorder::Frame osdFrame;
+
 	if (frame.type == StreamingMediaRecorder::FRAME_TYPE_OSD)
 	{
 		// backup the osd buffer for the future use
 		BackupOsdBuffer(frame);
+
+		// the backup owns the data from now on, the muxer writes a copy of it
+		osdFrame = StreamingMediaRecorder::Frame(frame.type, frame.timecode, osdBufferSize, pOsdBuffer);
+		osdFrame.needCopyBuffer = true;
+		pFrame = &osdFrame;
 	}
 
 	if (!isRecording)
@@ -235,6 +383,46 @@ bool Recorder::AppendFrame(const StreamingMediaRecorder::Frame &frame)
 		return false;
 	}
 
+	if (hasEventRequests)
+	{
+		HandleEventRequests();
+	}
+
+	return isBuffering ? BufferFrame(*pFrame) : WriteFrame(*pFrame);
+}
+
+void Recorder::HandleEventRequests()
+{
+	std::deque<bool> requests;
+	{
+		boost::mutex::scoped_lock lock(eventMutex);
+		requests.swap(eventRequests);
+		hasEventRequests = false;
+	}
+
+	// a short event may be triggered and ended between two frames: its clip
+	// still gets the buffered frames before it is closed
+	for (size_t i = 0; i < requests.size(); i++)
+	{
+		if (requests[i] && isBuffering)
+		{
+			// the clip starts with the buffered frames
+			isBuffering = false;
+			FlushPreEventFrames();
+		}
+		else if (!requests[i] && !isBuffering)
+		{
+			// close the clip of the event, and then buffer again
+			pMuxer->StopMuxing();
+			isWaitingForFirstFrame = true;
+			isSplitting = false;
+			isBuffering = true;
+		}
+	}
+}
+
+bool Recorder::WriteFrame(const StreamingMediaRecorder::Frame &frame)
+{
 	if (isSplitting && (frame.type == StreamingMediaRecorder::FRAME_TYPE_VIDEO) && frame.isKey)
 	{
 		// do splitting
@@ -300,19 +488,272 @@ bool Recorder::AppendFrame(const StreamingMediaRecorder::Frame &frame)
 		pMuxerStreams->dateUTC = frame.timecode / 1000000000ull;
 		pMuxerConfig->maxDuration = (double)fileHelper.GetSuggestedDuration(frame.timecode) * 2 / 1000000000.0;
 		pMuxer->SetFileConfig(*pMuxerConfig);
-		pMuxer->StartMuxing(*pMuxerStreams, *pMuxerFrame, GetFileName());
+		if (!pMuxer->StartMuxing(*pMuxerStreams, *pMuxerFrame, GetFileName()))
+		{
+			// error: fail to start a new clip
+			stats.droppedFrameCount++;
+		}
 
 		AppendOsdFrameIfExist();
 	}
-	else
+	else if (!pMuxer->AppendFrame(*pMuxerFrame))
 	{
-		// append one frame
-		pMuxer->AppendFrame(*pMuxerFrame);
+		// error: the muxer refused the frame
+		stats.droppedFrameCount++;
+	}
+
+	return true;
+}
+
+static bool MyFreeBuffer(void *pParam, unsigned char *pBuffer);
+
+bool Recorder::BufferFrame(const StreamingMediaRecorder::Frame &frame)
+{
+	bool isKeyVideo = (frame.type == StreamingMediaRecorder::FRAME_TYPE_VIDEO) && frame.isKey;
+
+	if (frame.type == StreamingMediaRecorder::FRAME_TYPE_OSD)
+	{
+		// the backup is appended at the start of the clip
+		return true;
+	}
+
+	if ((frame.type != StreamingMediaRecorder::FRAME_TYPE_VIDEO)
+	    && ((frame.type != StreamingMediaRecorder::FRAME_TYPE_AUDIO) || (pMuxerStreams->pAudio == NULL)))
+	{
+		// warning: invalid frame type, DROP it!!
+		return false;
+	}
+
+	if (preEventFrames.empty() && !isKeyVideo)
+	{
+		// warning: the clip must start with a key frame, DROP it!!
+		return false;
+	}
+
+	// own the frame data until it is written or dropped
+	StreamingMediaRecorder::Frame myFrame = frame;
+	if (frame.needCopyBuffer || (frame.pFreeBuffer == NULL))
+	{
+		myFrame.data = new unsigned char[frame.size];
+		memcpy(myFrame.data, frame.data, frame.size);
+		myFrame.pFreeBuffer = MyFreeBuffer;
+		myFrame.pFreeBufferParam = NULL;
+
+		if (frame.pFreeBuffer != NULL)
+		{
+			frame.pFreeBuffer(frame.pFreeBufferParam, frame.data);
+		}
+	}
+	myFrame.needCopyBuffer = false;
+
+	preEventFrames.push_back(myFrame);
+	preEventBytes += myFrame.size;
+	if (isKeyVideo)
+	{
+		preEventKeyTimecodes.push_back(myFrame.timecode);
+	}
+
+	// drop the oldest GOP once the next one covers the duration, or over the size,
+	// but the latest GOP is always kept
+	while ((preEventKeyTimecodes.size() > 1)
+	       && ((frame.timecode - preEventKeyTimecodes[1] >= maxPreEventDuration) || (preEventBytes > maxPreEventBytes)))
+	{
+		do
+		{
+			ReleasePreEventFrame();
+		} while (!preEventFrames.empty()
+		         && ((preEventFrames.front().type != StreamingMediaRecorder::FRAME_TYPE_VIDEO) || !preEventFrames.front().isKey));
 	}
 
 	return true;
 }
 
+void Recorder::FlushPreEventFrames()
+{
+	while (!preEventFrames.empty())
+	{
+		StreamingMediaRecorder::Frame frame = preEventFrames.front();
+		preEventFrames.pop_front();
+		preEventBytes -= frame.size;
+
+		// the muxer takes the data, unless it is dropped
+		if (!WriteFrame(frame) && (frame.pFreeBuffer != NULL))
+		{
+			frame.pFreeBuffer(frame.pFreeBufferParam, frame.data);
+		}
+	}
+	preEventKeyTimecodes.clear();
+}
+
+void Recorder::ReleasePreEventFrame()
+{
+	StreamingMediaRecorder::Frame &frame = preEventFrames.front();
+	if ((frame.type == StreamingMediaRecorder::FRAME_TYPE_VIDEO) && frame.isKey)
+	{
+		preEventKeyTimecodes.pop_front();
+	}
+	preEventBytes -= frame.size;
+	if (frame.pFreeBuffer != NULL)
+	{
+		frame.pFreeBuffer(frame.pFreeBufferParam, frame.data);
+	}
+	preEventFrames.pop_front();
+}
+
+const char * Recorder::GetFileName()
+{
+	const StreamingMediaFile &file = fileHelper.AllocateRecordingFile(pMuxerStreams->dateUTC);
+
+	// a container of the library is written in place
+	pMuxerConfig->isPreallocated = file.isPreallocated;
+	pMuxer->SetFileConfig(*pMuxerConfig);
+	return file.GetFileName();
+}
+
+void Recorder::ResetStats()
+{
+	stats = StreamingMediaRecorder::ChannelStats();
+	lastFrameTime = 0ull;
+	lastKeyTimecode = 0ull;
+	periodStartTime = 0ull;
+	periodVideoCount = 0ull;
+	periodByteCount = 0ull;
+	periodFrameCount = 0ull;
+	periodLatency = 0ull;
+	periodMaxLatency = 0ull;
+}
+
+void Recorder::UpdateStats(const StreamingMediaRecorder::Frame &frame, bool isRecorded, uint64_t startTime, uint64_t endTime)
+{
+	// only the header of the frame is used, its data may be gone
+	uint64_t latency = endTime - startTime;
+	bool isPublished = false;
+
+	if (isStatsResetPending)
+	{
+		// the first frame since StartRecording()
+		isStatsResetPending = false;
+		ResetStats();
+		isPublished = true;
+	}
+
+	stats.frameCount++;
+	stats.byteCount += frame.size;
+	if (!isRecorded)
+	{
+		stats.droppedFrameCount++;
+	}
+
+	if ((frame.type == StreamingMediaRecorder::FRAME_TYPE_VIDEO) && frame.isKey)
+	{
+		if ((lastKeyTimecode != 0ull) && (frame.timecode > lastKeyTimecode))
+		{
+			stats.keyFrameInterval = (double)(frame.timecode - lastKeyTimecode) / 1000000000.0;
+		}
+		lastKeyTimecode = frame.timecode;
+	}
+
+	if (periodStartTime == 0ull)
+	{
+		periodStartTime = startTime;
+	}
+	periodFrameCount++;
+	periodByteCount += frame.size;
+	periodLatency += latency;
+	periodMaxLatency = (latency > periodMaxLatency) ? latency : periodMaxLatency;
+	if (frame.type == StreamingMediaRecorder::FRAME_TYPE_VIDEO)
+	{
+		periodVideoCount++;
+	}
+	lastFrameTime = endTime;
+
+	if (endTime - periodStartTime >= STATS_PERIOD)
+	{
+		double period = (double)(endTime - periodStartTime) / 1000000000.0;
+		stats.fps = periodVideoCount / period;
+		stats.bitrate = periodByteCount * 8 / 1000.0 / period;
+		stats.writeLatency = periodLatency / 1000000.0 / periodFrameCount;
+		stats.maxWriteLatency = periodMaxLatency / 1000000.0;
+
+		periodStartTime = endTime;
+		periodVideoCount = 0ull;
+		periodByteCount = 0ull;
+		periodFrameCount = 0ull;
+		periodLatency = 0ull;
+		periodMaxLatency = 0ull;
+		isPublished = true;
+	}
+
+	if (isPublished)
+	{
+		Muxer::FileStats fileStats;
+		if (!isBuffering && pMuxer->GetFileStats(fileStats))
+		{
+			stats.clipSize = fileStats.fileSize;
+			stats.clipDuration = (double)fileStats.duration / 1000000000.0;
+		}
+		else
+		{
+			stats.clipSize = 0ull;
+			stats.clipDuration = .0;
+		}
+
+		stats.isRecording = isRecording;
+		PublishStats();
+	}
+}
+
+void Recorder::PublishStats()
+{
+	statsSequence++;
+	STATS_MEMORY_BARRIER();
+	publishedStats = stats;
+	publishedFrameTime = lastFrameTime;
+	STATS_MEMORY_BARRIER();
+	statsSequence++;
+}
+
+void Recorder::GetStats(StreamingMediaRecorder::ChannelStats &snapshot) const
+{
+	uint64_t frameTime;
+	unsigned int sequence;
+	do
+	{
+		sequence = statsSequence;
+		STATS_MEMORY_BARRIER();
+		snapshot = publishedStats;
+		frameTime = publishedFrameTime;
+		STATS_MEMORY_BARRIER();
+	} while ((sequence & 1) || (sequence != statsSequence));
+
+	// the state follows StartRecording()/StopRecording() at once, not at the next period
+	if (isStatsResetPending)
+	{
+		// no frame yet since the recording started
+		snapshot = StreamingMediaRecorder::ChannelStats();
+		frameTime = 0ull;
+	}
+	snapshot.isRecording = isRecording;
+	if (!snapshot.isRecording)
+	{
+		snapshot.clipSize = 0ull;
+		snapshot.clipDuration = .0;
+	}
+
+	if (frameTime != 0ull)
+	{
+		snapshot.idleTime = (double)(GetMonotonicTime() - frameTime) / 1000000000.0;
+		if (snapshot.idleTime >= STATS_IDLE_TIMEOUT)
+		{
+			// the last period is stale, nothing comes in
+			snapshot.fps = .0;
+			snapshot.bitrate = .0;
+			snapshot.writeLatency = .0;
+			snapshot.maxWriteLatency = .0;
+		}
+	}
+}
+
 void Recorder::MyEventListener::FileClosed(const Muxer::FileClosedEvent &event) const
 {
 	if (pRecorder->fileHelper.AddMediaFile(event.fileName, event.startTime, event.endTime) == false)
@@ -320,6 +761,15 @@ void Recorder::MyEventListener::FileClosed(const Muxer::FileClosedEvent &event)
 		// error: fail to add the media file into the library
 		// FIXME: delete temporal file
 	}
+
+	// the live readers go on with the clip in the index
+	pRecorder->fileHelper.WithdrawLiveClip();
+}
+
+void Recorder::MyEventListener::ClusterWritten(const Muxer::ClusterWrittenEvent &event) const
+{
+	pRecorder->fileHelper.PublishLiveClip(event.fileName, event.startTimecode, event.endTimecode,
+	                                      event.endPosition, event.clusterPosition, event.clusterTimecode);
 }
 
 void Recorder::MyEventListener::SuggestSplitting() const
@@ -449,6 +899,12 @@ public:
 	virtual bool StopRecording(int chId);
 	virtual bool StopAllChannels();
 	virtual bool AppendFrame(int chId, const Frame &);
+	virtual bool TriggerEvent(int chId);
+	virtual bool EndEvent(int chId);
+
+	// statistics APIs
+	virtual bool GetChannelStats(int chId, ChannelStats &);
+	virtual bool GetAllStats(std::vector<ChannelStats> &);
 
 	// streaming APIs
 	virtual int StartStreaming(const StreamingRequest &) { return -1; }  // return reqId
@@ -469,6 +925,7 @@ private:
 	static bool writeLock;
 	static StreamingMediaLibrary *pLibrary;
 	static Recorder **pRecorders;
+	static Recorder **pSubstreamRecorders;
 	static int **pRetrievers;
 
 	// constructor
@@ -488,6 +945,7 @@ bool IdStreamingMediaRecorder::isInitialized = false;
 bool IdStreamingMediaRecorder::writeLock = false;
 StreamingMediaLibrary *IdStreamingMediaRecorder::pLibrary;
 Recorder **IdStreamingMediaRecorder::pRecorders;
+Recorder **IdStreamingMediaRecorder::pSubstreamRecorders;
 int **IdStreamingMediaRecorder::pRetrievers;
 
 // global methods
@@ -510,6 +968,10 @@ IdStreamingMediaRecorder * IdStreamingMediaRecorder::GetInstance(ACCESSIBILITY _
 	{
 		pStreamingMediaRecorder->mode = READ_WRITE;
 		writeLock = true;
+
+		// the writer indexes the clips left out by a crash, the disks are scanned only if an index was lost
+		// note: nothing is recycled until the application sets a RetentionConfig
+		pLibrary->RecoverIndex();
 	}
 	else
 	{
@@ -530,9 +992,11 @@ void IdStreamingMediaRecorder::Initialize()
 
 		recorderCount = 8;
 		pRecorders = new Recorder *[recorderCount];
+		pSubstreamRecorders = new Recorder *[recorderCount];
 		for (i = 0; i < recorderCount; i++)
 		{
 			pRecorders[i] = new Recorder(pLibrary->CreateChannelHelper(i+1));
+			pSubstreamRecorders[i] = new Recorder(pLibrary->CreateChannelHelper(StreamingMediaLibrary::GetSubstreamChannelId(i+1)));
 		}
 
 		maxRetrieverCount = 8;
@@ -564,7 +1028,22 @@ bool IdStreamingMediaRecorder::StartRecording(int chId, const RecordingConfig &c
 		return false;
 	}
 
-	return pRecorders[chId - 1]->StartRecording(config);
+	if (!pRecorders[chId - 1]->StartRecording(config))
+	{
+		pSubstreamRecorders[chId - 1]->StopRecording();
+		return false;
+	}
+
+	// the substream goes into clips of its own, along with the audio
+	RecordingConfig substreamConfig = config;
+	substreamConfig.videoCodec    = config.subVideoCodec;
+	substreamConfig.extraSize     = config.subExtraSize;
+	substreamConfig.extraData     = config.subExtraData;
+	substreamConfig.subVideoCodec = VIDEO_CODEC_ID_NONE;
+	substreamConfig.subExtraSize  = 0ul;
+	substreamConfig.subExtraData  = NULL;
+	pSubstreamRecorders[chId - 1]->StartRecording(substreamConfig);  // just stopped without a substream
+	return true;
 }
 
 bool IdStreamingMediaRecorder::StopRecording(int chId)
@@ -574,6 +1053,7 @@ bool IdStreamingMediaRecorder::StopRecording(int chId)
 		return false;
 	}
 
+	pSubstreamRecorders[chId - 1]->StopRecording();
 	return pRecorders[chId - 1]->StopRecording();
 }
 
@@ -590,6 +1070,10 @@ bool IdStreamingMediaRecorder::StopAllChannels()
 		{
 			pRecorders[i]->StopRecording();
 		}
+		if (pSubstreamRecorders[i] != NULL)
+		{
+			pSubstreamRecorders[i]->StopRecording();
+		}
 	}
 
 	delete pLibrary;  // FIXME: just for debug
@@ -603,5 +1087,86 @@ bool IdStreamingMediaRecorder::AppendFrame(int chId, const Frame & frame)
 		return false;
 	}
 
+	Recorder *pSubstreamRecorder = pSubstreamRecorders[chId - 1];
+	if (frame.type == FRAME_TYPE_SUBSTREAM)
+	{
+		Frame videoFrame = frame;
+		videoFrame.type = FRAME_TYPE_VIDEO;
+		return pSubstreamRecorder->AppendFrame(videoFrame);
+	}
+
+	if ((frame.type != FRAME_TYPE_VIDEO) && pSubstreamRecorder->IsRecording())
+	{
+		// the substream keeps a copy of the audio and the osd, the channel owns the data
+		Frame copiedFrame = frame;
+		copiedFrame.needCopyBuffer = true;
+		copiedFrame.pFreeBuffer = NULL;
+		copiedFrame.pFreeBufferParam = NULL;
+		pSubstreamRecorder->AppendFrame(copiedFrame);
+	}
+
 	return pRecorders[chId - 1]->AppendFrame(frame);
 }
+
+bool IdStreamingMediaRecorder::TriggerEvent(int chId)
+{
+	if ((mode == READ_ONLY) || (chId <= 0) || (chId > recorderCount) || (pRecorders == NULL) || (pRecorders[chId - 1] == NULL))
+	{
+		return false;
+	}
+
+	pSubstreamRecorders[chId - 1]->TriggerEvent();
+	return pRecorders[chId - 1]->TriggerEvent();
+}
+
+bool IdStreamingMediaRecorder::EndEvent(int chId)
+{
+	if ((mode == READ_ONLY) || (chId <= 0) || (chId > recorderCount) || (pRecorders == NULL) || (pRecorders[chId - 1] == NULL))
+	{
+		return false;
+	}
+
+	pSubstreamRecorders[chId - 1]->EndEvent();
+	return pRecorders[chId - 1]->EndEvent();
+}
+
+// statistics APIs, for the read-only instances too
+bool IdStreamingMediaRecorder::GetChannelStats(int chId, ChannelStats &stats)
+{
+	// the substream of a channel goes by the id of its clips
+	Recorder **pChannelRecorders = pRecorders;
+	int index = chId - 1;
+	if (chId > StreamingMediaLibrary::SUBSTREAM_CHANNEL_BASE)
+	{
+		pChannelRecorders = pSubstreamRecorders;
+		index = chId - StreamingMediaLibrary::SUBSTREAM_CHANNEL_BASE - 1;
+	}
+
+	if ((index < 0) || (index >= recorderCount) || (pChannelRecorders == NULL) || (pChannelRecorders[index] == NULL))
+	{
+		return false;
+	}
+
+	pChannelRecorders[index]->GetStats(stats);
+	stats.chId = chId;
+	return true;
+}
+
+bool IdStreamingMediaRecorder::GetAllStats(std::vector<ChannelStats> &allStats)
+{
+	if (pRecorders == NULL)
+	{
+		return false;
+	}
+
+	allStats.clear();
+	for (int i = 0; i < recorderCount; i++)
+	{
+		ChannelStats stats;
+		if (GetChannelStats(i + 1, stats))
+		{
+			allStats.push_back(stats);
+		}
+	}
+	return true;
+}
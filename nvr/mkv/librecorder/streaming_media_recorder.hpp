@@ -3,6 +3,7 @@
 #define STREAMING_MEDIA_RECORDER_HPP
 
 #include <stdlib.h>
+#include <vector>
 
 typedef unsigned long long uint64_t;
 
@@ -11,11 +12,12 @@ class StreamingMediaRecorder
 public:
 	enum FrameType
 	{
-		FRAME_TYPE_UNKNOWN = 0,
-		FRAME_TYPE_AUDIO   = 1,
-		FRAME_TYPE_VIDEO   = 2,
-		FRAME_TYPE_OSD     = 3,
-		FRAME_TYPE_DEFAULT = FRAME_TYPE_UNKNOWN
+		FRAME_TYPE_UNKNOWN   = 0,
+		FRAME_TYPE_AUDIO     = 1,
+		FRAME_TYPE_VIDEO     = 2,
+		FRAME_TYPE_OSD       = 3,
+		FRAME_TYPE_SUBSTREAM = 4,  // video of the low resolution stream, see RecordingConfig::subVideoCodec
+		FRAME_TYPE_DEFAULT   = FRAME_TYPE_UNKNOWN
 	};
 
 	enum VideoCodecId
@@ -91,7 +93,9 @@ public:
 	public:
 		RecordingConfig(VideoCodecId _videoCodec = VIDEO_CODEC_ID_DEFAULT, AudioCodecId _audioCodec = AUDIO_CODEC_ID_DEFAULT)
 			: videoCodec(_videoCodec), audioCodec(_audioCodec), extraSize(0ul), extraData(NULL),
-		      needCopyBuffer(false), pFreeBuffer(NULL), pFreeBufferParam(NULL)
+		      subVideoCodec(VIDEO_CODEC_ID_NONE), subExtraSize(0ul), subExtraData(NULL),
+		      needCopyBuffer(false), pFreeBuffer(NULL), pFreeBufferParam(NULL),
+		      preEventDuration(.0), preEventBufferSize(DEFAULT_PRE_EVENT_BUFFER_SIZE)
 		{
 		}
 
@@ -100,9 +104,55 @@ public:
 		size_t         extraSize;
 		unsigned char *extraData;  // for H.264 sps & pps
 
+		// the substream is recorded into clips of its own with a copy of the audio and the osd,
+		// the playback serves it for low resolutions and fast speeds
+		VideoCodecId   subVideoCodec;  // none for no substream
+		size_t         subExtraSize;
+		unsigned char *subExtraData;  // owned as extraData is
+
 		bool           needCopyBuffer;
 		bool         (*pFreeBuffer) (void *pParam, unsigned char *pBuffer);
 		void          *pFreeBufferParam;
+
+		double         preEventDuration;  // sec of frames kept in memory until TriggerEvent(), 0 to record at once
+		size_t         preEventBufferSize;  // bytes at most of those frames
+
+	protected:
+		enum
+		{
+			DEFAULT_PRE_EVENT_BUFFER_SIZE = 8 * 1024 * 1024
+		};
+	};
+
+	class ChannelStats
+	{
+	public:
+		ChannelStats()
+			: chId(0), isRecording(false), frameCount(0ull), droppedFrameCount(0ull), byteCount(0ull),
+			  fps(.0), bitrate(.0), keyFrameInterval(.0), writeLatency(.0), maxWriteLatency(.0), idleTime(.0),
+			  clipSize(0ull), clipDuration(.0)
+		{
+		}
+
+		int            chId;
+		bool           isRecording;
+
+		// since the recording started
+		uint64_t       frameCount;  // frames given to AppendFrame()
+		uint64_t       droppedFrameCount;  // of those, the ones not recorded
+		uint64_t       byteCount;
+
+		// over the last second of ingest
+		double         fps;  // video frames per sec
+		double         bitrate;  // kbit per sec of all the frames
+		double         keyFrameInterval;  // sec between the last two key frames
+		double         writeLatency;  // msec, the average time AppendFrame() took
+		double         maxWriteLatency;  // msec
+		double         idleTime;  // sec since the last period with frames, the figures above drop to 0 after 2 sec
+
+		// the clip being written, 0 while the frames are kept before an event
+		uint64_t       clipSize;  // bytes on disk
+		double         clipDuration;  // sec
 	};
 
 	class StreamingRequest
@@ -124,6 +174,12 @@ public:
 	virtual bool StopRecording(int chId)                           { return true; }
 	virtual bool StopAllChannels()                                 { return true; }
 	virtual bool AppendFrame(int chId, const Frame &)              { return false; }
+	virtual bool TriggerEvent(int chId)                            { return false; }  // write the pre-event frames and go on
+	virtual bool EndEvent(int chId)                                { return false; }  // close the clip, back to the pre-event frames
+
+	// statistics APIs, they never wait for the recording
+	virtual bool GetChannelStats(int chId, ChannelStats &)         { return false; }  // or by StreamingMediaLibrary::GetSubstreamChannelId()
+	virtual bool GetAllStats(std::vector<ChannelStats> &)          { return false; }
 
 	// streaming APIs
 	static StreamingMediaRecorder * GetReadOnlyStreamingMediaRecorder();
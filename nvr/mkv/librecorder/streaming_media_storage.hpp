@@ -0,0 +1,620 @@
+
+#ifndef STREAMING_MEDIA_STORAGE_HPP
+#define STREAMING_MEDIA_STORAGE_HPP
+
+#include <stdio.h>
+#include <time.h>
+#if defined(WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/xtime.hpp>
+#include "streaming_media_library.hpp"
+
+class Demuxer;
+class DateNode;
+class FileNode;
+class IndexFile;
+
+typedef FileNode StreamingMediaFileImpl;
+
+class RootIndexNode
+{
+public:
+	// a clip copied out of the index, the nodes stay with the root and its lock
+	struct Clip
+	{
+		Clip() : startTime(0), endTime(0), fileSize(0ull) {}
+
+		time_t      startTime;
+		time_t      endTime;
+		std::string fileName;
+		uint64_t    fileSize;  // bytes, known by the caller only
+	};
+
+	virtual ~RootIndexNode() {}
+	virtual int GetCurrentDuration(int chId) = 0;
+	virtual bool SetDefaultDuration(int chId, int duration) = 0;
+	virtual bool InsertIndex(StreamingMediaFileImpl *pCurrentNode) = 0;
+	virtual size_t InsertIndexes(std::vector<StreamingMediaFileImpl *> &nodes) = 0;
+	virtual StreamingMediaFileImpl * SearchForwardlyAndLoad(int chId, time_t time) = 0;
+	virtual StreamingMediaFileImpl * SearchBackwardlyAndLoad(int chId, time_t time) = 0;
+	virtual time_t GetOldestTime(int chId) = 0;
+	virtual bool GetNextClip(int chId, time_t time, Clip &clip, bool isAcross = false) = 0;  // isAcross for the clip across the time too
+	virtual size_t RemoveOldestFiles(int chId, time_t before, size_t maxCount, std::vector<Clip> &clips) = 0;
+	virtual void RemoveUsage(int chId, const std::vector<Clip> &clips) = 0;
+	virtual bool ReplaceFile(int chId, time_t startTime, const char *newFileName, uint64_t savedBytes) = 0;
+	virtual bool GetDayUsage(int chId, time_t time, StreamingMediaLibrary::DayUsage &usage) = 0;
+	virtual bool GetYearUsage(int chId, int year, StreamingMediaLibrary::YearUsage &usage) = 0;
+	virtual uint64_t GetChannelUsage(int chId) = 0;
+	virtual bool IsIntact(int chId) = 0;  // loaded from its file, neither created nor broken
+
+	static RootIndexNode * GetRootIndexNode(size_t channelCount);
+};
+
+typedef long long IndexWord;
+
+// localtime() returns a buffer shared by all the channel threads
+static inline struct tm * LocalTime(const time_t *time, struct tm *result)
+{
+#if defined(WIN32)
+	return localtime_s(result, time) == 0 ? result : NULL;
+#else
+	return localtime_r(time, result);
+#endif
+}
+
+static inline int IndexFileSeek(FILE *pFile, IndexWord offset, int origin = SEEK_SET)
+{
+#if defined(WIN32)
+	return _fseeki64(pFile, offset, origin);
+#else
+	return fseeko(pFile, offset, origin);
+#endif
+}
+
+static inline IndexWord IndexFileTell(FILE *pFile)
+{
+#if defined(WIN32)
+	return _ftelli64(pFile);
+#else
+	return ftello(pFile);
+#endif
+}
+
+// reserve all the blocks of a file at once, so that it is written contiguously
+static inline bool PreallocateFile(const char *fileName, IndexWord size)
+{
+#if defined(WIN32)
+	FILE *pFile = fopen(fileName, "ab");
+	if (pFile == NULL)
+	{
+		return false;
+	}
+	bool result = _chsize_s(_fileno(pFile), size) == 0;
+	return (fclose(pFile) == 0) && result;
+#else
+	int fd = open(fileName, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		return false;
+	}
+	bool result = posix_fallocate(fd, 0, size) == 0;
+	return (close(fd) == 0) && result;
+#endif
+}
+
+// chxx for a channel and chxx/sub for its substream, the length as sprintf() gives it
+static inline int GetChannelDirectoryName(int chId, char *buffer)
+{
+	if (chId > StreamingMediaLibrary::SUBSTREAM_CHANNEL_BASE)
+	{
+		return sprintf(buffer, "ch%02d/sub", chId - StreamingMediaLibrary::SUBSTREAM_CHANNEL_BASE);
+	}
+	return sprintf(buffer, "ch%02d", chId);
+}
+
+// for the background threads, which wait between their rounds
+static inline void SleepMilliseconds(int msec)
+{
+	boost::xtime xt;
+	boost::xtime_get(&xt, boost::TIME_UTC);
+	xt.nsec += (msec % 1000) * 1000000;
+	xt.sec  += msec / 1000 + xt.nsec / 1000000000;
+	xt.nsec %= 1000000000;
+	boost::thread::sleep(xt);
+}
+
+class FileNode : public StreamingMediaFile
+{
+public:
+	enum FileType
+	{
+		FILE_TYPE_NULL,
+		FILE_TYPE_UNLOADED,
+		FILE_TYPE_TEMPORARY,
+		FILE_TYPE_NORMAL,
+	};
+
+	// config
+	enum
+	{
+		DEFAULT_CHANNEL_COUNT = 16,
+		DEFAULT_MEDIA_DURATION = 10,//600,  // sec
+	};
+
+	enum
+	{
+		BUFFER_SIZE = 128,
+	};
+
+	enum
+	{
+		DISK_ID_UNKNOWN      = -1,  // looked for on the disks
+		CONTAINER_ID_UNKNOWN = -1,  // looked for in the containers, or a file of its own
+	};
+
+	FileNode(FileType _type = FILE_TYPE_NULL, IndexFile *_pIndex = NULL, IndexWord seek = -1);
+	virtual ~FileNode();
+
+	const char * GetFileName() const;
+	bool RebuildFileName();
+	bool RenameFrom(const char *old);
+	FileNode * GetNext() { return pNext; }
+	FileNode * GetPrev() { return pPrev; }
+	FileNode * LoadNext() { return LoadNextFromFileDirectly(); }
+	FileNode * LoadPrev() { return LoadPreviousFromFileDirectly(); }
+
+	FileNode * LoadNextFromFileDirectly();
+	FileNode * LoadPreviousFromFileDirectly();
+
+	// private members
+	int serial;
+	int diskId;
+	int containerId;
+	uint64_t fileSize;  // bytes, counted by its date when linked
+	char *fullPath;
+	const char *fileName;
+
+	// file node members
+	char fileNameBuffer[BUFFER_SIZE];
+
+	FileType type;
+
+	// index tree
+	DateNode *pParent;
+	FileNode *pPrev;
+	FileNode *pNext;
+
+	IndexFile *pIndex;
+	IndexWord seekBase;
+	bool isDirty;
+
+	// static const
+	static FileNode * const pUnloadedNode;
+	static FileNode * const pUnkonwnNode;
+};
+
+// The preallocated containers of a disk, which hold a clip each and are
+// reused in ring order, so that steady recording neither creates nor renames
+// any file. The index keeps only the times of the clips; containers/.ring
+// keeps the clip in every container and the next one, so that the ring goes
+// on after a restart and the readers find the clips.
+class ContainerRing
+{
+public:
+	struct Clip
+	{
+		Clip() : chId(0), startTime(0), endTime(0) {}
+
+		IndexWord chId;
+		IndexWord startTime;
+		IndexWord endTime;
+	};
+
+	ContainerRing(const std::string &_dirName);
+	virtual ~ContainerRing();
+
+	bool Resize(IndexWord _containerSize, int containerCount);
+	IndexWord GetAllocatedSize();
+
+	// for recording
+	int  Allocate(Clip &evictedClip);
+	bool SetClip(int containerId, const Clip &clip);
+
+	// for indexing
+	int  FindClip(int chId, time_t startTime);
+	std::string GetFileName(int containerId);
+	bool IsContainer(const std::string &fileName);
+
+	// for recycling and recovery
+	bool RemoveClip(int chId, time_t startTime);
+	void GetClips(std::vector<Clip> &ringClips);
+
+protected:
+	enum
+	{
+		HEADER_WORDS = 4,  // generation, container size, container count, next container
+		REOPEN_PERIOD = 1,  // sec
+	};
+
+	bool Reload();
+	bool WriteClip(int containerId);
+	bool WriteHeader();
+
+	boost::mutex mutex;
+	std::string dirName;
+	FILE *pFile;
+	bool isWritable;  // by the only writer
+	time_t openTime;
+
+	IndexWord generation;  // of the changes
+	IndexWord containerSize;
+	IndexWord allocatedSize;
+	int next;
+	std::vector<Clip> clips;
+	std::map<std::pair<IndexWord, IndexWord>, int> containerIds;  // of the clips
+};
+
+// The disks where the clips are recorded. Disk 0 is the current directory,
+// which keeps the clips of a library without any added disk; the added mount
+// points are numbered in the file .storage, so that the disk ids in the index
+// stay valid across restarts. A channel stays on its disk for a while to keep
+// its writes sequential, and then moves to the disk with the least load. A
+// disk which fails or fills up gets no new clip until it recovers.
+class StoragePool
+{
+public:
+	enum
+	{
+		MAX_DISK_COUNT            = 255,  // a disk id takes a byte in the index
+		MAX_MOUNT_POINT_LENGTH    = 64,   // and the clip name fits in FileNode::BUFFER_SIZE
+		MAX_CHANNEL_COUNT         = StreamingMediaLibrary::MAX_CHANNEL_ID,  // chxx, and chxx/sub for the substreams
+		TEMPORARY_FILE_NAME_COUNT = 128,
+	};
+
+	struct ChannelDirectory
+	{
+		int         diskId;
+		int         chId;
+		std::string dirName;  // chxx or chxx/sub on the disk
+	};
+
+	StoragePool();
+	virtual ~StoragePool();
+
+	bool Load();
+	int  AddDisk(const char *mountPoint);
+
+	// for recording
+	int  AllocateDisk(int chId);
+	uint64_t FinishWriting(int chId, const char *fileName, bool isSucceeded);  // bytes written
+	void GetTemporaryFileName(int diskId, int chId, size_t index, char *buffer);
+
+	// for indexing
+	void GetFileName(int diskId, const char *relativeName, char *buffer);
+	int  FindDisk(const char *relativeName);
+
+	// for containers
+	bool SetContainers(IndexWord containerSize, int containerCount);
+	int  AllocateContainer(int diskId, ContainerRing::Clip &evictedClip);
+	bool SetContainerClip(int diskId, int containerId, const ContainerRing::Clip &clip);
+	bool FindContainer(int chId, time_t startTime, int &diskId, int &containerId);
+	void GetContainerFileName(int diskId, int containerId, char *buffer);
+	bool IsContainer(const std::string &fileName);
+	bool RemoveContainerClip(int chId, time_t startTime);
+	void GetContainerClips(int diskId, std::vector<ContainerRing::Clip> &clips);
+
+	// for recycling, compacting and recovery
+	std::vector<std::string> GetDirectories();
+	void GetChannelDirectories(std::vector<ChannelDirectory> &directories);
+	int  GetDiskUsage();
+
+protected:
+	enum
+	{
+		STICKY_PERIOD  = 30 * 60,  // sec
+		RETRY_PERIOD   = 60,       // sec
+		RATE_PERIOD    = 60,       // sec
+		MIN_FREE_SPACE = 1024,     // MB, a fuller disk is drained
+		BASE_WRITE_RATE = 1024 * 1024,  // bytes per sec, lower rates hardly count
+	};
+
+	class Disk
+	{
+	public:
+		Disk(const std::string &_mountPoint);
+		~Disk();
+
+		std::string mountPoint;
+		std::string prefix;  // of the file names, empty for the current directory
+		ContainerRing *pRing;
+
+		bool     isPooled;      // takes new clips
+		bool     isFailed;
+		time_t   failureTime;
+		int      writingCount;  // clips being written
+		uint64_t writtenBytes;  // since the rate was measured
+		uint64_t writeRate;     // bytes per sec
+		time_t   rateTime;
+	};
+
+	struct Channel
+	{
+		Channel() : diskId(-1), allocationTime(0), isWriting(false) {}
+
+		int    diskId;
+		time_t allocationTime;  // of the disk
+		bool   isWriting;
+	};
+
+	bool     IsPooled(int diskId);
+	bool     IsAvailable(int diskId, time_t now, uint64_t &freeSpace);
+	void     UpdateWriteRate(Disk &disk, time_t now);
+	uint64_t GetFreeSpace(const std::string &mountPoint, uint64_t *pCapacity = NULL);
+
+	boost::mutex mutex;
+	std::vector<Disk *> disks;  // never deleted, their rings are used without the lock
+	std::map<int, Channel> channels;
+	bool hasPooledDisk;
+	IndexWord containerSize;
+	int containerCount;  // of every disk, 0 for a file per clip
+};
+
+extern StoragePool storagePool;
+
+// Keeps the key frames taken for the timelines. The frames of a clip go to a
+// file next to it, chxx/yyyy/MMdd/hhmmss_hhmmss.thm, so that they outlive the
+// process, and the clips used lately stay in memory as well, so that a
+// timeline loaded again reads neither the clips nor their caches. A cache
+// keeps the size and the time of its clip, which a thinned clip or a reused
+// container no longer matches, and a broken cache is taken from the clip
+// again. A time resolves to the seek point which the cues give for it, and
+// the key frame is the first one from there, so that only the blocks up to it
+// are read, and a cache holds a key frame per seek point whatever the times
+// asked. The clips are read without the lock.
+class ThumbnailCache
+{
+public:
+	typedef StreamingMediaLibrary::Thumbnail Thumbnail;
+
+	ThumbnailCache();
+	virtual ~ThumbnailCache();
+
+	size_t GetThumbnails(const std::string &fileName, const std::vector<uint64_t> &times, std::vector<Thumbnail> &thumbnails);
+	static std::string GetCacheFileName(const std::string &fileName);
+
+protected:
+	enum
+	{
+		VERSION         = 2,
+		MAX_MEMORY_SIZE = 16 * 1024 * 1024,  // bytes of the frames of all the clips in memory
+		MAX_CLIP_COUNT  = 4096,              // clips in memory
+		MAX_FRAME_SIZE  = 4 * 1024 * 1024
+	};
+
+	struct ClipCache
+	{
+		ClipCache() : fileSize(0ull), modifiedTime(0), byteCount(0), lastUse(0) {}
+
+		uint64_t fileSize;      // of the clip when cached
+		time_t   modifiedTime;
+		std::vector<uint64_t>         seekPoints;  // nanosec, of the clip, known with the first key frame
+		std::map<uint64_t, uint64_t>  keyTimes;    // nanosec, the key frame for every seek point taken, 0 for none
+		std::map<uint64_t, Thumbnail> frames;      // by their times
+		size_t   byteCount;     // of the frames
+		unsigned int lastUse;
+	};
+
+	// the file is the header, the seek points, the key times and then the frames
+	struct FileHeader
+	{
+		char         magic[8];  // "NVRTHUMB"
+		int          version;
+		int          reserved;
+		uint64_t     fileSize;
+		IndexWord    modifiedTime;
+		unsigned int pointCount;
+		unsigned int timeCount;
+		unsigned int frameCount;
+		unsigned int reserved2;
+	};
+
+	struct FrameHeader
+	{
+		uint64_t     time;
+		int          codec;
+		unsigned int size;
+	};
+
+	ClipCache &GetClip(const std::string &fileName, uint64_t fileSize, time_t modifiedTime, bool isPersistent);
+	bool Load(const std::string &cacheFileName, ClipCache &clip);
+	bool Save(const std::string &cacheFileName, const ClipCache &clip);
+	bool TakeSeekPoints(Demuxer &demuxer, const std::string &fileName, std::vector<uint64_t> &seekPoints);
+	bool TakeKeyFrame(Demuxer &demuxer, const std::string &fileName, uint64_t seekTime, Thumbnail &thumbnail);
+	void Evict();
+
+	static uint64_t GetSeekPoint(const std::vector<uint64_t> &seekPoints, uint64_t time);
+	static uint64_t GetSeekTime(const std::vector<uint64_t> &seekPoints, uint64_t seekPoint);
+
+	boost::mutex mutex;  // for the clips in memory and their files
+	std::map<std::string, ClipCache> clips;
+	size_t       byteCount;
+	unsigned int useCount;
+};
+
+// Recycles the oldest clips in a background thread. A batch of clips is
+// removed from the index under the lock of its root node, and their files are
+// deleted afterwards without any lock and at a limited rate, so that neither
+// the recorders nor the disk wait for the recycler.
+class StorageRecycler
+{
+public:
+	typedef StreamingMediaLibrary::RetentionConfig RetentionConfig;
+
+	StorageRecycler(RootIndexNode *_pIndexRoot, const RetentionConfig &_config);
+	virtual ~StorageRecycler();
+
+	void SetConfig(const RetentionConfig &_config);
+	void SetChannelQuota(int chId, uint64_t quota);
+	void AddFile(int chId, const char *fileName);
+	void ReduceUsage(int chId, uint64_t byteCount);
+
+protected:
+	enum
+	{
+		CHECK_PERIOD    = 1000,     // msec
+		RECOUNT_PERIOD  = 60 * 60,  // sec
+		SECONDS_PER_DAY = 24 * 60 * 60
+	};
+
+	struct ChannelUsage
+	{
+		ChannelUsage() : usage(0ull), quota(0ull), hasQuota(false) {}
+
+		uint64_t usage;  // bytes
+		uint64_t quota;  // bytes
+		bool     hasQuota;
+	};
+
+	void   Run();
+	bool   IsStopping();
+	bool   CountUsage();
+	int    GetDiskUsage();
+	int    SelectChannel(time_t now, const std::set<int> &skippedChannels, time_t &before);
+	size_t Recycle(int chId, time_t before);
+	void   RemoveEmptyDirectory(const std::string &dirName);
+
+	RootIndexNode *pIndexRoot;
+	boost::thread *pThread;
+	boost::mutex   mutex;  // for the config and the usage
+	bool           isStopping;
+
+	RetentionConfig config;
+	std::map<int, ChannelUsage> channels;
+	uint64_t totalUsage;   // counted again from time to time
+	bool     isRecycling;  // the disk usage is between the watermarks
+};
+
+// Thins the aged clips in a background thread. A clip older than the days of
+// its channel is exported into a file next to it with only its key frames,
+// its timecodes as they were, and the file replaces the clip under the lock
+// of its root node, so that a reader finds either the whole clip or the
+// thinned one. The clips are read and written at a limited rate, which
+// leaves the disks to the recorders, and every channel gets a clip in turn.
+class StorageCompactor
+{
+public:
+	typedef StreamingMediaLibrary::CompactionConfig CompactionConfig;
+
+	StorageCompactor(RootIndexNode *_pIndexRoot, const CompactionConfig &_config, StorageRecycler *&_pRecycler, boost::mutex &_recyclerMutex);
+	virtual ~StorageCompactor();
+
+	void SetConfig(const CompactionConfig &_config);
+	void SetChannelDays(int chId, int days);
+
+protected:
+	enum
+	{
+		CHECK_PERIOD     = 1000,     // msec
+		IDLE_PERIOD      = 60,       // sec
+		RESCAN_PERIOD    = 60 * 60,  // sec
+		SECONDS_PER_DAY  = 24 * 60 * 60,
+		MAX_KEPT_PERCENT = 90        // a clip thinned to more of its size is left as it is
+	};
+
+	struct ChannelState
+	{
+		ChannelState() : days(0), hasDays(false), compactedTime(0) {}
+
+		int    days;
+		bool   hasDays;
+		time_t compactedTime;  // the clips before are done, since the start
+	};
+
+	void Run();
+	bool IsStopping();
+	void FindChannels();
+	bool CompactNextFile(int chId, time_t before, const CompactionConfig &currentConfig);
+	bool CompactFile(int chId, time_t startTime, time_t endTime, const std::string &fileName, const CompactionConfig &currentConfig);
+
+	RootIndexNode    *pIndexRoot;
+	StorageRecycler *&pRecycler;      // told of the bytes saved
+	boost::mutex     &recyclerMutex;
+	boost::thread    *pThread;
+	boost::mutex      mutex;  // for the config and the channels
+	bool              isStopping;
+
+	CompactionConfig config;
+	std::map<int, ChannelState> channels;
+};
+
+// Indexes the clips which a crash or a lost index file left out, those newer
+// than the last clip indexed for their channel. The directories of the
+// channels on all the disks are scanned by a few threads at once, all the
+// dates if the index of the channel was created or broken, only those from
+// the last clip indexed otherwise. A finished clip takes its times from its
+// name, chxx/yyyy/MMdd/hhmmss_hhmmss.mkv; a clip which was being recorded,
+// chxx/nnn.mkv, is parsed for the times of its first and last clusters and
+// renamed. The clips of a channel are inserted in time order as a single
+// batch, which writes every date node once.
+class IndexRecovery
+{
+public:
+	IndexRecovery(RootIndexNode *_pIndexRoot);
+	virtual ~IndexRecovery();
+
+	size_t Run();  // clips indexed
+
+protected:
+	enum
+	{
+		MAX_THREAD_COUNT = 8,
+		SECONDS_PER_DAY  = 24 * 60 * 60
+	};
+
+	struct Job
+	{
+		int diskId;
+		int chId;
+		std::string dirName;  // chxx or chxx/sub on the disk
+		int lastYear;  // of the last clip indexed, the older directories are not scanned, 0 for all
+		int lastDate;  // MMdd
+	};
+
+	struct Clip
+	{
+		Clip() : startTime(0), endTime(0), diskId(0), containerId(FileNode::CONTAINER_ID_UNKNOWN) {}
+		bool operator<(const Clip &clip) const { return startTime < clip.startTime; }
+
+		time_t      startTime;
+		time_t      endTime;
+		int         diskId;
+		int         containerId;        // of a clip written in place, or CONTAINER_ID_UNKNOWN
+		std::string temporaryFileName;  // of a clip never finished, or empty
+	};
+
+	void   GetLastDate(int chId, int &year, int &date);
+	void   ScanJobs();
+	void   ScanContainers(int diskId);
+	void   ScanChannel(const Job &job, std::vector<Clip> &clips);
+	bool   ParseFileName(const std::string &fileName, Clip &clip);
+	bool   ParseTemporaryFile(const std::string &fileName, Clip &clip);
+	size_t IndexChannel(int chId, std::vector<Clip> &clips);
+
+	RootIndexNode *pIndexRoot;
+	boost::mutex   mutex;  // for the jobs and the clips found
+	std::vector<Job> jobs;
+	size_t           nextJob;
+	std::map<int, std::vector<Clip> > channels;
+};
+
+#endif  // STREAMING_MEDIA_STORAGE_HPP
@@ -0,0 +1,358 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <boost/filesystem.hpp>
+#include <demuxer.hpp>
+#include <ebml/HotTrace.h>
+#include "streaming_media_storage.hpp"
+
+ThumbnailCache::ThumbnailCache()
+	: byteCount(0), useCount(0)
+{
+}
+
+ThumbnailCache::~ThumbnailCache()
+{
+}
+
+// chxx/yyyy/MMdd/hhmmss_hhmmss.mkv --> chxx/yyyy/MMdd/hhmmss_hhmmss.thm
+std::string ThumbnailCache::GetCacheFileName(const std::string &fileName)
+{
+	if ((fileName.size() > 4) && (fileName.compare(fileName.size() - 4, 4, ".mkv") == 0))
+	{
+		return fileName.substr(0, fileName.size() - 4) + ".thm";
+	}
+	return fileName + ".thm";
+}
+
+// the key frames for the times of the clip, in their order, without the times
+// for which the clip has none
+size_t ThumbnailCache::GetThumbnails(const std::string &fileName, const std::vector<uint64_t> &times, std::vector<Thumbnail> &thumbnails)
+{
+	HOT_TRACE_SCOPE("thumbnail.get");
+
+	uint64_t fileSize;
+	time_t   modifiedTime;
+	try
+	{
+		fileSize     = boost::filesystem::file_size(fileName);
+		modifiedTime = boost::filesystem::last_write_time(fileName);
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: the clip is gone, e.g. recycled
+		return 0;
+	}
+
+	// a container is reused by its ring, its frames are kept in memory only
+	bool isPersistent = !storagePool.IsContainer(fileName);
+
+	// what is cached already, copied out under the lock
+	std::vector<uint64_t>         seekPoints;
+	std::map<uint64_t, uint64_t>  keyTimes;
+	std::map<uint64_t, Thumbnail> frames;
+	bool hasSeekPoints;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+
+		ClipCache &clip = GetClip(fileName, fileSize, modifiedTime, isPersistent);
+		clip.lastUse  = ++useCount;
+		hasSeekPoints = !clip.keyTimes.empty();
+		seekPoints    = clip.seekPoints;
+		for (size_t i = 0; hasSeekPoints && (i < times.size()); i++)
+		{
+			std::map<uint64_t, uint64_t>::const_iterator it = clip.keyTimes.find(GetSeekPoint(seekPoints, times[i]));
+			std::map<uint64_t, Thumbnail>::const_iterator frame = (it != clip.keyTimes.end()) ? clip.frames.find(it->second) : clip.frames.end();
+			if ((it != clip.keyTimes.end()) && ((it->second == 0ull) || (frame != clip.frames.end())))
+			{
+				keyTimes.insert(*it);
+				if (it->second != 0ull)
+				{
+					frames.insert(*frame);
+				}
+			}
+		}
+		Evict();
+	}
+
+	// the missing key frames are taken from the clip without the lock
+	std::map<uint64_t, uint64_t> takenKeyTimes;
+	Demuxer *pDemuxer = NULL;
+	for (size_t i = 0; i < times.size(); i++)
+	{
+		if (!hasSeekPoints)
+		{
+			pDemuxer = DemuxerUtilities::CreateMkvDemuxer();
+			TakeSeekPoints(*pDemuxer, fileName, seekPoints);
+			hasSeekPoints = true;
+		}
+
+		uint64_t seekPoint = GetSeekPoint(seekPoints, times[i]);
+		if (keyTimes.find(seekPoint) == keyTimes.end())
+		{
+			if (pDemuxer == NULL)
+			{
+				pDemuxer = DemuxerUtilities::CreateMkvDemuxer();
+			}
+
+			Thumbnail thumbnail;
+			uint64_t keyTime = TakeKeyFrame(*pDemuxer, fileName, GetSeekTime(seekPoints, seekPoint), thumbnail) ? thumbnail.time : 0ull;
+			keyTimes[seekPoint]      = keyTime;
+			takenKeyTimes[seekPoint] = keyTime;
+			if (keyTime != 0ull)
+			{
+				frames[keyTime] = thumbnail;
+			}
+		}
+	}
+	if (pDemuxer != NULL)
+	{
+		delete pDemuxer;
+	}
+
+	if (!takenKeyTimes.empty())
+	{
+		boost::mutex::scoped_lock lock(mutex);
+
+		// the clip may have left the memory meanwhile
+		ClipCache &clip = GetClip(fileName, fileSize, modifiedTime, isPersistent);
+		if (clip.keyTimes.empty())
+		{
+			clip.seekPoints = seekPoints;
+		}
+		for (std::map<uint64_t, uint64_t>::const_iterator it = takenKeyTimes.begin(); it != takenKeyTimes.end(); ++it)
+		{
+			clip.keyTimes.insert(*it);
+			if ((it->second != 0ull) && (clip.frames.find(it->second) == clip.frames.end()))
+			{
+				const Thumbnail &thumbnail = frames[it->second];
+				clip.byteCount += thumbnail.data.size();
+				byteCount      += thumbnail.data.size();
+				clip.frames[it->second] = thumbnail;
+			}
+		}
+
+		if (isPersistent)
+		{
+			Save(GetCacheFileName(fileName), clip);
+		}
+		Evict();
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < times.size(); i++)
+	{
+		uint64_t keyTime = keyTimes[GetSeekPoint(seekPoints, times[i])];
+		if (keyTime != 0ull)
+		{
+			thumbnails.push_back(frames[keyTime]);
+			count++;
+		}
+	}
+	return count;
+}
+
+// the cache of the clip in memory, taken from its file if not there yet, and
+// started again if the clip was rewritten since
+ThumbnailCache::ClipCache &ThumbnailCache::GetClip(const std::string &fileName, uint64_t fileSize, time_t modifiedTime, bool isPersistent)
+{
+	ClipCache &clip = clips[fileName];
+	if ((clip.fileSize != fileSize) || (clip.modifiedTime != modifiedTime))
+	{
+		byteCount -= clip.byteCount;
+		clip = ClipCache();
+		if (!isPersistent || !Load(GetCacheFileName(fileName), clip) || (clip.fileSize != fileSize) || (clip.modifiedTime != modifiedTime))
+		{
+			clip = ClipCache();
+			clip.fileSize     = fileSize;
+			clip.modifiedTime = modifiedTime;
+		}
+		byteCount += clip.byteCount;
+	}
+	return clip;
+}
+
+// a cache cut short or of another version is not taken
+bool ThumbnailCache::Load(const std::string &cacheFileName, ClipCache &clip)
+{
+	FILE *pFile = fopen(cacheFileName.c_str(), "rb");
+	if (pFile == NULL)
+	{
+		// not cached yet
+		return false;
+	}
+
+	FileHeader header;
+	bool result = (fread(&header, sizeof(header), 1, pFile) == 1)
+	              && (memcmp(header.magic, "NVRTHUMB", sizeof(header.magic)) == 0)
+	              && (header.version == VERSION);
+	if (result)
+	{
+		clip.fileSize     = header.fileSize;
+		clip.modifiedTime = (time_t)header.modifiedTime;
+		clip.seekPoints.resize(header.pointCount);
+		result = (header.pointCount == 0) || (fread(&clip.seekPoints[0], sizeof(uint64_t) * header.pointCount, 1, pFile) == 1);
+	}
+
+	for (unsigned int i = 0; result && (i < header.timeCount); i++)
+	{
+		uint64_t times[2];
+		result = fread(times, sizeof(times), 1, pFile) == 1;
+		if (result)
+		{
+			clip.keyTimes[times[0]] = times[1];
+		}
+	}
+
+	for (unsigned int i = 0; result && (i < header.frameCount); i++)
+	{
+		FrameHeader frameHeader;
+		result = (fread(&frameHeader, sizeof(frameHeader), 1, pFile) == 1) && (frameHeader.size <= MAX_FRAME_SIZE);
+		if (result)
+		{
+			Thumbnail &thumbnail = clip.frames[frameHeader.time];
+			thumbnail.time  = frameHeader.time;
+			thumbnail.codec = frameHeader.codec;
+			thumbnail.data.resize(frameHeader.size);
+			result = (frameHeader.size == 0) || (fread(&thumbnail.data[0], frameHeader.size, 1, pFile) == 1);
+			clip.byteCount += frameHeader.size;
+		}
+	}
+
+	fclose(pFile);
+	return result;
+}
+
+// into a temporary file first, so that a reader finds the old cache or the new one
+bool ThumbnailCache::Save(const std::string &cacheFileName, const ClipCache &clip)
+{
+	std::string temporaryFileName = cacheFileName + ".tmp";
+	FILE *pFile = fopen(temporaryFileName.c_str(), "wb");
+	if (pFile == NULL)
+	{
+		// error: the disk fails, taken from the clip next time
+		return false;
+	}
+
+	FileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "NVRTHUMB", sizeof(header.magic));
+	header.version      = VERSION;
+	header.fileSize     = clip.fileSize;
+	header.modifiedTime = clip.modifiedTime;
+	header.pointCount   = (unsigned int)clip.seekPoints.size();
+	header.timeCount    = (unsigned int)clip.keyTimes.size();
+	header.frameCount   = (unsigned int)clip.frames.size();
+	bool result = (fwrite(&header, sizeof(header), 1, pFile) == 1)
+	              && (clip.seekPoints.empty() || (fwrite(&clip.seekPoints[0], sizeof(uint64_t) * clip.seekPoints.size(), 1, pFile) == 1));
+
+	for (std::map<uint64_t, uint64_t>::const_iterator it = clip.keyTimes.begin(); result && (it != clip.keyTimes.end()); ++it)
+	{
+		uint64_t times[2] = { it->first, it->second };
+		result = fwrite(times, sizeof(times), 1, pFile) == 1;
+	}
+
+	for (std::map<uint64_t, Thumbnail>::const_iterator it = clip.frames.begin(); result && (it != clip.frames.end()); ++it)
+	{
+		FrameHeader frameHeader;
+		memset(&frameHeader, 0, sizeof(frameHeader));
+		frameHeader.time  = it->first;
+		frameHeader.codec = it->second.codec;
+		frameHeader.size  = (unsigned int)it->second.data.size();
+		result = (fwrite(&frameHeader, sizeof(frameHeader), 1, pFile) == 1)
+		         && (it->second.data.empty() || (fwrite(&it->second.data[0], it->second.data.size(), 1, pFile) == 1));
+	}
+
+	result = (fclose(pFile) == 0) && result;
+
+	try
+	{
+		if (result)
+		{
+			boost::filesystem::rename(temporaryFileName, cacheFileName);
+		}
+		else
+		{
+			boost::filesystem::remove(temporaryFileName);
+		}
+	}
+	catch (boost::filesystem::filesystem_error &)
+	{
+		// error: taken from the clip next time
+		result = false;
+	}
+	return result;
+}
+
+// the cues are read with the head of the clip, no cluster is
+bool ThumbnailCache::TakeSeekPoints(Demuxer &demuxer, const std::string &fileName, std::vector<uint64_t> &seekPoints)
+{
+	seekPoints.clear();
+	bool result = (demuxer.StartDemuxing(fileName.c_str()) != NULL) && demuxer.GetSeekPoints(seekPoints);
+	demuxer.StopDemuxing();
+	return result;
+}
+
+// the first key frame from where the demuxer seeks to for the time
+bool ThumbnailCache::TakeKeyFrame(Demuxer &demuxer, const std::string &fileName, uint64_t seekTime, Thumbnail &thumbnail)
+{
+	HOT_TRACE_SCOPE("thumbnail.take_key_frame");
+
+	const Demuxer::Streams *pStreams = demuxer.StartDemuxing(fileName.c_str(), seekTime);
+	bool result = false;
+	if ((pStreams != NULL) && pStreams->HasVideo())
+	{
+		const Demuxer::Frame *pFrame;
+		while ((pFrame = demuxer.GetOneFrame()) != NULL)
+		{
+			if ((pFrame->pStream->codecType == Demuxer::Stream::CODEC_TYPE_VIDEO) && pFrame->isKey)
+			{
+				thumbnail.time  = pFrame->timecode;
+				thumbnail.codec = pFrame->pStream->codec;
+				thumbnail.data.assign(pFrame->data, pFrame->data + pFrame->size);
+				result = pFrame->size <= MAX_FRAME_SIZE;
+				break;
+			}
+		}
+	}
+	demuxer.StopDemuxing();
+	return result;
+}
+
+// the last seek point at or before the time, 0 for the first frame of the clip
+uint64_t ThumbnailCache::GetSeekPoint(const std::vector<uint64_t> &seekPoints, uint64_t time)
+{
+	std::vector<uint64_t>::const_iterator it = std::upper_bound(seekPoints.begin(), seekPoints.end(), time);
+	return (it == seekPoints.begin()) ? 0ull : *(it - 1);
+}
+
+// a time which the demuxer seeks to the seek point for: just before the next
+// one, as the cues are taken strictly before the time
+uint64_t ThumbnailCache::GetSeekTime(const std::vector<uint64_t> &seekPoints, uint64_t seekPoint)
+{
+	if (seekPoint == 0ull)
+	{
+		return 0ull;
+	}
+
+	std::vector<uint64_t>::const_iterator it = std::upper_bound(seekPoints.begin(), seekPoints.end(), seekPoint);
+	return (it == seekPoints.end()) ? ~0ull : *it - 1;
+}
+
+// the clips used least lately leave the memory first
+void ThumbnailCache::Evict()
+{
+	while (((byteCount > MAX_MEMORY_SIZE) || (clips.size() > MAX_CLIP_COUNT)) && (clips.size() > 1))
+	{
+		std::map<std::string, ClipCache>::iterator oldest = clips.begin();
+		for (std::map<std::string, ClipCache>::iterator it = clips.begin(); it != clips.end(); ++it)
+		{
+			if (it->second.lastUse < oldest->second.lastUse)
+			{
+				oldest = it;
+			}
+		}
+		byteCount -= oldest->second.byteCount;
+		clips.erase(oldest);
+	}
+}
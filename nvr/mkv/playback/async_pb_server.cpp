@@ -31,6 +31,7 @@
 //#include <util/packet_buf.hpp>
 //#include <hdvr/avfm/channel_storage_reader_wrapper.hpp>
 #include <id_mkv_pb_reader.hpp>
+#include <ebml/HotTrace.h>
 
 #define PLAYBACK_VER 2
 #define DEFAULT_PB_HANDLER_NUM 2
@@ -71,6 +72,10 @@ using asio::ip::tcp;
 static asio::io_service PB_IO_SERVICE;
 static bool service_running = true;
 
+// -trace: record the session stages, dump them on SIGUSR2 and on exit
+static const char *trace_path = NULL;
+static volatile bool trace_dump_requested = false;
+
 thread_id_type main_thread_tid;
 
 class pb_handler: public boost::enable_shared_from_this<pb_handler>
@@ -86,6 +91,7 @@ private:
 	void run()
 	{
 		detach_current_thread();
+		libebml::HotTrace::SetThreadName("pb_handler");
 		asio_error_code ec;
 		int try_num = 0;
 
@@ -184,13 +190,15 @@ private:
 	char buffer_[256]; // 0-227 for send, 228-255 for read.
 	std::vector<asio::const_buffer> packet_buffers_;
 	int camera_id_;
+	int resolution_;  // CommonResolution asked at login, 0 for the main stream
 	CTimeValue seek_tv_;
 	PlayDirection::retval play_direction_;
 	PlaySpeed::retval play_speed_;
 	boost::scoped_ptr<PBReader> reader_;
 	bool seek_packet_;
+	uint64_t send_begin_;
 
-	pb_session(): socket_(PB_IO_SERVICE), seek_packet_(false)
+	pb_session(): socket_(PB_IO_SERVICE), resolution_(0), seek_packet_(false), send_begin_(0)
 	{
 		packet_buffers_.push_back(asio::buffer(buffer_, 28));
 		//trivial buffer. it will be replaced in live_packet().
@@ -238,11 +246,10 @@ public:
 	{
 		if(!err)
 		{
-			size_t request_type, len;
+			int len;
 
-			memcpy(&request_type, buffer_, 4);
 			memcpy(&len, buffer_ + 4, 4);
-			if (request_type != PACKET_TYPE_AVT_REQ && len <= 0)
+			if (len <= 0 || len > (int)sizeof(buffer_))
 			{
 				exit_session();
 				return;
@@ -290,6 +297,8 @@ public:
 
 			this->camera_id_ = *((int*)(buffer_ + nread));
 			//nread += 12; //camera_id:4, resolution:4 and streaming_mode:4
+			if (nread + 8 <= (int)sizeof(buffer_))
+				memcpy(&this->resolution_, buffer_ + nread + 4, 4);
 
 			int nwrite = 0;
 			int var = PACKET_TYPE_AVT_RESP;
@@ -337,7 +346,9 @@ public:
 			if (login_flag)
 			{
 				//this->reader_.reset(new PBChannelStorageReader(this->camera_id_, "../repos"));
-				this->reader_.reset(new idmkv::Reader(this->camera_id_));
+				// thumbnail walls and slow links ask for less than D1, the substream serves them
+				bool is_low_resolution = (this->resolution_ != 0) && (this->resolution_ != CommonResolution::D1);
+				this->reader_.reset(new idmkv::Reader(this->camera_id_, is_low_resolution));
 				asio::async_read(socket_,
 				asio::buffer(buffer_, 28),
 				boost::bind(&pb_session::handle_seek_request, shared_from_this(),
@@ -354,6 +365,8 @@ public:
 	{
 		if (!err)
 		{
+			HOT_TRACE_SCOPE("pb.seek");
+
 			//skip pkt_type:4, pkt_size:4, PB_VER:4
 			int* ts_sec = (int*) (buffer_ + 12);
 			int* ts_msec = (int*) (buffer_ + 16);
@@ -508,17 +521,23 @@ public:
 
 	void handle_data_msg(const asio_error_code& err)
 	{
+		HOT_TRACE_RECORD("pb.send", send_begin_);
+		send_begin_ = 0;
+
 		if (!err)
 		{
 			if (seek_packet_)
 			{
 				seek_packet_ = false;
 				this->reader_->stop();
+				memcpy(buffer_, buffer_ + 228, 28); // received apart from the packets sent
 				handle_seek_request(err);
 				return;
 			}
 
+			uint64_t next_begin = HOT_TRACE_NOW();
 			boost::shared_ptr<PBReader::Frame> frame_ptr = this->reader_->next(); //use frame itself to judge the return condition
+			HOT_TRACE_RECORD("pb.next_frame", next_begin);
 			if (frame_ptr.get())
 			{
 				if(frame_ptr->GetFrameHeader().GetFrameType() == PacketType::CSH)
@@ -564,6 +583,7 @@ public:
 
 				memcpy(buffer_ + 28, &frame_tv_sec, 4);
 				memcpy(buffer_ + 32, &frame_tv_msec, 4);
+				send_begin_ = HOT_TRACE_NOW();
 				asio::async_write(socket_, packet_buffers_,
 						boost::bind(&pb_session::handle_data_msg, shared_from_this(),
 							asio::placeholders::error));
@@ -743,17 +763,39 @@ void SignalHandler(int signum)
 	PB_IO_SERVICE.stop();
 }
 
-static void CatchSignal(int sigNum)
+void TraceSignalHandler(int)
+{
+	trace_dump_requested = true;
+}
+
+static void CatchSignal(int sigNum, void (*handler)(int) = SignalHandler)
 {
         struct sigaction sa;
         memset(&sa, 0, sizeof(sa));
 
-        sa.sa_handler = SignalHandler;
+        sa.sa_handler = handler;
         if (sigaction(sigNum, &sa, NULL))
                 ::exit(1);
 }
 #endif
 
+// the signal only raises a flag, the dump is written from an io thread
+static void poll_trace_dump(asio::deadline_timer *timer, const asio_error_code& err)
+{
+	if (err)
+		return;
+
+	if (trace_dump_requested)
+	{
+		trace_dump_requested = false;
+		if (libebml::HotTrace::Dump(trace_path))
+			slog("[Playback] trace dumped to %s\n", trace_path);
+	}
+
+	timer->expires_from_now(boost::posix_time::seconds(1));
+	timer->async_wait(boost::bind(&poll_trace_dump, timer, asio::placeholders::error));
+}
+
 int main(int argc,char *argv[])
 {
 	//SystemLog::open("pb_server");
@@ -773,6 +815,23 @@ int main(int argc,char *argv[])
 
 		main_thread_tid = get_current_thread_id();
 
+		for (int i = 1; i < argc - 1; i++)
+		{
+			if (strcmp(argv[i], "-trace") == 0)
+				trace_path = argv[i + 1];
+		}
+
+		asio::deadline_timer trace_timer(PB_IO_SERVICE);
+		if (trace_path != NULL)
+		{
+			libebml::HotTrace::SetThreadName("pb_main");
+			libebml::HotTrace::Enable();
+#ifndef WIN32
+			CatchSignal(SIGUSR2, TraceSignalHandler);
+#endif
+			poll_trace_dump(&trace_timer, asio_error_code());
+		}
+
 		pb_server server;
 
 		{
@@ -819,6 +878,12 @@ int main(int argc,char *argv[])
 	xt.sec += 1;
 	boost::thread::sleep(xt);
 
+	if (trace_path != NULL)
+	{
+		libebml::HotTrace::Disable();
+		libebml::HotTrace::Dump(trace_path);
+	}
+
 #ifndef WIN32
 	::system("rm -rf /dev/shm/*.idb");
 #endif
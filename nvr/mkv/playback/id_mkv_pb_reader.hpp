@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <list>
+#include <algorithm>
 #include "pb_reader.hpp"
 #include "streaming_media_library.hpp"
 #include "demuxer.hpp"
@@ -67,6 +68,9 @@ private:
 
 	StreamingMediaLibrary     *pLibrary_;
 	StreamingMediaChannelHelper *pHelper_;
+	StreamingMediaChannelHelper *pSubstreamHelper_;  // the clips of the substream, if the channel has any
+	StreamingMediaChannelHelper *pLocator_;          // the one of the two the current clip comes from
+	bool                       isLowResolution_;     // the client asked for less than the main stream
 	PlayDirection::retval      direction_;
 	PlaySpeed::retval          speed_;
 	CTimeValue                 seek_tv_;
@@ -76,11 +80,21 @@ private:
 	const Demuxer::Streams    *pStreams_;
 	instek::Codec::retval      codec_;
 
+	uint64_t                   lastTimecode_;  // nanosec, the last frame returned forwardly
+	uint64_t                   skipTimecode_;  // nanosec, frames returned before the file was reopened
+	bool                       isLive_;        // reading the clip being recorded
+	StreamingMediaLiveClusters liveClusters_;  // of the clip being recorded, committed so far
+
 	bool                                   isBackwardFrameListReady_;
 	std::list<boost::shared_ptr<MyFrame> > backwardFrameList_;
 	std::list<boost::shared_ptr<MyFrame> > backwardOsdList_;
 	unsigned char                         *lastBackwardFrameData_;
 
+	enum
+	{
+		SUBSTREAM_TOLERANCE = 2  // sec, the substream clips may start and end after the main ones
+	};
+
 	#define INPUT_FILE_NAME   "test.mkv"
 	char                       filename_[256];
 
@@ -89,6 +103,28 @@ private:
 	size_t                     bufferSize_;
 	unsigned char             *pBuffer_;
 
+	void ReleaseBackwardFrames()
+	{
+		while (!backwardFrameList_.empty())
+		{
+			if (lastBackwardFrameData_ != NULL)
+			{
+				delete[] lastBackwardFrameData_;
+			}
+			lastBackwardFrameData_ = backwardFrameList_.back()->data_;
+			backwardFrameList_.pop_back();
+		}
+		backwardFrameList_.clear();
+		backwardOsdList_.clear();
+		isBackwardFrameListReady_ = false;
+
+		if (lastBackwardFrameData_ != NULL)
+		{
+			delete[] lastBackwardFrameData_;
+			lastBackwardFrameData_ = NULL;
+		}
+	}
+
 	unsigned char * GetBuffer(size_t size)
 	{
 		if (size <= bufferSize_)
@@ -105,14 +141,20 @@ private:
 	}
 
 public:
-	Reader(int channel)
-		: channel_(channel),
+	Reader(int channel, bool isLowResolution = false)
+		: channel_(channel), pSubstreamHelper_(NULL), isLowResolution_(isLowResolution),
 		  direction_(PlayDirection::FORWARD), speed_(PlaySpeed::X1), seek_tv_(0),
 		  isStopped_(false), pDemuxer_(NULL), pStreams_(NULL), codec_(instek::Codec::NONE),
+		  lastTimecode_(0ull), skipTimecode_(0ull), isLive_(false),
 		  isBackwardFrameListReady_(false), lastBackwardFrameData_(NULL), bufferSize_(0), pBuffer_(NULL)
 	{
 		pLibrary_ = new StreamingMediaLibrary();
 		pHelper_ = &pLibrary_->CreateChannelHelper(channel);
+		if (StreamingMediaLibrary::GetSubstreamChannelId(channel) != 0)
+		{
+			pSubstreamHelper_ = &pLibrary_->CreateChannelHelper(StreamingMediaLibrary::GetSubstreamChannelId(channel));
+		}
+		pLocator_ = pHelper_;
 		filename_[0] = '\0';
 	}
 
@@ -130,22 +172,7 @@ public:
 			delete pBuffer_;
 		}
 
-		while (!backwardFrameList_.empty())
-		{
-			if (lastBackwardFrameData_ != NULL)
-			{
-				delete[] lastBackwardFrameData_;
-			}
-			lastBackwardFrameData_ = backwardFrameList_.back()->data_;
-			backwardFrameList_.pop_back();
-		}
-		backwardFrameList_.clear();
-		backwardOsdList_.clear();
-
-		if (lastBackwardFrameData_ != NULL)
-		{
-			delete[] lastBackwardFrameData_;
-		}
+		ReleaseBackwardFrames();
 	}
 
 	virtual void start() {}
@@ -157,11 +184,29 @@ public:
 		direction_ = direction;
 		speed_     = speed;
 
-		const StreamingMediaFile &media = (direction_ != PlayDirection::BACKWARD) ? pHelper_->LocateMediaFileForwardly(seek_tv_.sec()) : pHelper_->LocateMediaFileBackwardly(seek_tv_.sec());
+		lastTimecode_ = 0ull;
+		skipTimecode_ = 0ull;
+		isLive_       = false;
+
+		// a seek within a session starts over from the file it locates
+		if (pDemuxer_ != NULL)
+		{
+			delete pDemuxer_;
+			pDemuxer_ = NULL;
+		}
+		pStreams_  = NULL;
+		isStopped_ = false;
+		ReleaseBackwardFrames();
+
+		const StreamingMediaFile &media = LocateMediaFile(seek_tv_.sec());
 		if ((media.startTime != 0) && (media.GetFileName() != NULL))
 		{
 			strcpy(filename_, media.GetFileName());
 		}
+		else if ((direction_ != PlayDirection::BACKWARD) && LocateLiveMediaFile())
+		{
+			// time-shift within the clip being recorded
+		}
 		else
 		{
 			strcpy(filename_, INPUT_FILE_NAME);
@@ -197,8 +242,25 @@ public:
 
 restart:
 			pDemuxer_->StopDemuxing();
+			if (!isLive_)
+			{
+				// playback only reads: serve the frames straight from the page cache
+				pDemuxer_->SetReadMode(Demuxer::READ_MODE_MMAP);
+			}
+			else
+			{
+				// a mapping doesn't grow with the clip being recorded, demux what was committed
+				pDemuxer_->SetReadMode(Demuxer::READ_MODE_DEFAULT);
+				pDemuxer_->SetLiveSegment(liveClusters_.endPosition, liveClusters_.endTime, liveClusters_.positions, liveClusters_.timecodes);
+			}
 			pStreams_ = pDemuxer_->StartDemuxing(filename_, direction_ == PlayDirection::BACKWARD ? 0ull : (uint64_t)seek_tv_.sec() * 1000000000ull + (uint64_t)seek_tv_.usec() * 1000ull);
-			if ((pStreams_ == NULL) || !pStreams_->HasVideo())
+			if ((pStreams_ == NULL) && isLive_)
+			{
+				// the clip being recorded was closed and renamed meanwhile,
+				// the stopped demuxer runs into the end of file and locates it again
+				return nullFrame_;
+			}
+			else if ((pStreams_ == NULL) || !pStreams_->HasVideo())
 			{
 				// error: fail to open file or bad mkv file format
 				isStopped_ = true;
@@ -315,8 +377,15 @@ restart:
 		{
 			// get one frame by demuxer
 			const Demuxer::Frame *pFrame;
+read_on:
 			while ((pFrame = pDemuxer_->GetOneFrame()) != NULL)
 			{
+				if ((direction_ != PlayDirection::BACKWARD) && (pFrame->timecode <= skipTimecode_))
+				{
+					// returned before the file was reopened
+					continue;
+				}
+
 				// initialize the result object
 				boost::shared_ptr<MyFrame> frame(new MyFrame());
 
@@ -356,6 +425,7 @@ restart:
 						continue;
 					}*/
 
+					lastTimecode_ = pFrame->timecode;
 					return frame;
 				}
 				else
@@ -381,14 +451,30 @@ restart:
 			{
 				// something wrong
 				// try to seek to the next file
-				const StreamingMediaFile &media = pHelper_->LocateNextMediaFile();
+				bool isSameClip = false;
+				skipTimecode_ = lastTimecode_;
+				const StreamingMediaFile &media = isLive_ ? LocateClosedLiveMediaFile() : LocateNextMediaFile();
 				if ((media.startTime != 0) && (media.GetFileName() != NULL))
 				{
+					// the clip being recorded may have been closed and indexed meanwhile
 					strcpy(filename_, media.GetFileName());
-					seek_tv_.set(media.startTime, 0);
+					seek_tv_.set(isLive_ ? lastTimecode_ / 1000000000ull : media.startTime, isLive_ ? lastTimecode_ / 1000ull % 1000000ull : 0);
+					isLive_ = false;
 					goto restart;
 				}
-				else
+				else if (LocateLiveMediaFile(&isSameClip))
+				{
+					if (isSameClip && pDemuxer_->ExtendLiveSegment(liveClusters_.endPosition, liveClusters_.endTime, liveClusters_.positions, liveClusters_.timecodes))
+					{
+						// read on up to the last cluster committed, the demuxer waits at the one before
+						goto read_on;
+					}
+
+					// go on with the clip being recorded, up to its last cluster written
+					seek_tv_.set(lastTimecode_ / 1000000000ull, lastTimecode_ / 1000ull % 1000000ull);
+					goto restart;
+				}
+				else if (!isLive_)
 				{
 					strcpy(filename_, INPUT_FILE_NAME);
 				}
@@ -433,7 +519,7 @@ restart:
 		backwardOsdList_.clear();
 
 		// try to seek to the next file
-		const StreamingMediaFile &media = pHelper_->LocatePreviousMediaFile();
+		const StreamingMediaFile &media = pLocator_->LocatePreviousMediaFile();
 		if ((media.startTime != 0) && (media.GetFileName() != NULL))
 		{
 			strcpy(filename_, media.GetFileName());
@@ -449,6 +535,119 @@ restart:
 		return nullFrame_;
 	}
 
+private:
+	// the substream serves the low resolutions and the fastest speed
+	bool IsSubstreamPreferred() const
+	{
+		return (pSubstreamHelper_ != NULL) && (isLowResolution_ || (speed_ == PlaySpeed::X8));
+	}
+
+	// the clip of the substream if it covers the time as the main stream does
+	const StreamingMediaFile & LocateMediaFile(time_t time)
+	{
+		bool isBackward = direction_ == PlayDirection::BACKWARD;
+		const StreamingMediaFile &media = isBackward ? pHelper_->LocateMediaFileBackwardly(time) : pHelper_->LocateMediaFileForwardly(time);
+		pLocator_ = pHelper_;
+		if (!IsSubstreamPreferred())
+		{
+			return media;
+		}
+
+		const StreamingMediaFile &substream = isBackward ? pSubstreamHelper_->LocateMediaFileBackwardly(time) : pSubstreamHelper_->LocateMediaFileForwardly(time);
+		if ((substream.startTime == 0) || (substream.GetFileName() == NULL))
+		{
+			// no substream recorded there
+			return media;
+		}
+
+		if ((media.startTime == 0)
+		    || (!isBackward && (substream.startTime <= std::max(time, media.startTime) + SUBSTREAM_TOLERANCE))
+		    || (isBackward && (substream.endTime + SUBSTREAM_TOLERANCE >= std::min(time, media.endTime))))
+		{
+			pLocator_ = pSubstreamHelper_;
+			return substream;
+		}
+
+		// the main stream was recorded before the substream
+		return media;
+	}
+
+	// the next clip of the stream in use, the other one takes over where it has a gap
+	const StreamingMediaFile & LocateNextMediaFile()
+	{
+		const StreamingMediaFile &media = pLocator_->LocateNextMediaFile();
+		if (!IsSubstreamPreferred())
+		{
+			return media;
+		}
+
+		time_t time = lastTimecode_ / 1000000000ull;
+		bool isSubstream = pLocator_ == pSubstreamHelper_;
+		StreamingMediaChannelHelper *pOther = isSubstream ? pHelper_ : pSubstreamHelper_;
+		const StreamingMediaFile &other = pOther->LocateMediaFileForwardly(time);
+		if ((other.startTime == 0) || (other.GetFileName() == NULL))
+		{
+			return media;
+		}
+
+		// back to the substream as soon as it covers the time, away from it only over its gaps
+		if ((media.startTime == 0)
+		    || (!isSubstream && (other.startTime <= std::max(time, media.startTime) + SUBSTREAM_TOLERANCE))
+		    || (isSubstream && (media.startTime > time + SUBSTREAM_TOLERANCE) && (other.startTime + SUBSTREAM_TOLERANCE < media.startTime)))
+		{
+			pLocator_ = pOther;
+			return other;
+		}
+
+		return media;
+	}
+
+	// the clip being recorded once it was closed and indexed, as long as it goes
+	// past the last frame read, otherwise the one after it
+	const StreamingMediaFile & LocateClosedLiveMediaFile()
+	{
+		time_t time = lastTimecode_ / 1000000000ull;
+		const StreamingMediaFile &media = pLocator_->LocateMediaFileBackwardly(time);
+		if ((media.startTime != 0) && ((uint64_t)media.endTime * 1000000000ull > lastTimecode_))
+		{
+			return media;
+		}
+
+		return pLocator_->LocateMediaFileForwardly(time);
+	}
+
+	// the clip being recorded, unless nothing was committed since it was located
+	bool LocateLiveMediaFile(bool *pIsSameClip = NULL)
+	{
+		if (!isLive_ && (pLocator_ != pHelper_) && (pLocator_->LocateLiveMediaFile().startTime == 0))
+		{
+			// no substream is being recorded
+			pLocator_ = pHelper_;
+		}
+
+		uint64_t startTime   = liveClusters_.startTime;
+		uint64_t endPosition = liveClusters_.endPosition;
+		const StreamingMediaFile &media = pLocator_->LocateLiveMediaFile(&liveClusters_);
+		if ((media.startTime == 0) || (media.GetFileName() == NULL))
+		{
+			return false;
+		}
+
+		bool isSameClip = isLive_ && (strcmp(filename_, media.GetFileName()) == 0) && (liveClusters_.startTime == startTime);
+		if (isSameClip && (liveClusters_.endPosition == endPosition))
+		{
+			return false;
+		}
+
+		if (pIsSameClip != NULL)
+		{
+			*pIsSameClip = isSameClip;
+		}
+		strcpy(filename_, media.GetFileName());
+		isLive_ = true;
+		return true;
+	}
+
 	#undef INPUT_FILE_NAME
 };
 
@@ -0,0 +1,685 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#if (BOOST_VERSION > 104000)
+	#include <boost/asio.hpp>
+	#define asio boost::asio
+	typedef boost::system::error_code asio_error_code;
+#else
+	#include <asio.hpp>
+	typedef asio::error_code asio_error_code;
+#endif
+
+#include <domain.hpp>
+
+// A load generator for pbserver: it keeps a number of playback sessions busy
+// with random seeks, directions and speeds against a recorded library, and
+// raises the number stage by stage until the server falls behind. POSIX only.
+//
+// usage: pbloadgen -from sec -to sec [-host addr] [-port n] [-sessions n] [-step n]
+//                  [-stage sec] [-play sec] [-channels n] [-backward %] [-reseek %]
+//                  [-paced] [-pid n] [-threads n]
+//
+// A session logs in, seeks and plays for -play sec or up to the end of the
+// data, and then seeks again on the same connection (-reseek % of the plays)
+// or over a new one. With -paced it reads the frames at their timestamps as
+// a real client does, otherwise as fast as the server sends them. -pid gives
+// the process of the server to sample its cpu time.
+
+#define PLAYBACK_VER 2
+
+using namespace std;
+using namespace instek;
+using asio::ip::tcp;
+
+static asio::io_service IO_SERVICE;
+
+static uint64_t GetMonotonicTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000ull;  // usec
+}
+
+class LoadConfig
+{
+public:
+	LoadConfig()
+		: host("127.0.0.1"), port(60006), maxSessions(256), step(16), stageDuration(20), playDuration(15),
+		  channelCount(1), from(0), to(0), backwardPercent(25), reseekPercent(50), isPaced(false),
+		  serverPid(0), threadCount(2), maxLateness(500.0), maxFailureRate(0.01)
+	{}
+
+	const char *host;
+	int         port;
+	int         maxSessions;
+	int         step;  // sessions added at every stage
+	int         stageDuration;  // sec
+	int         playDuration;  // sec of a play before the next seek
+	int         channelCount;  // the sessions are spread over channels 1 to n
+	int         from;  // sec, the recorded range to seek in
+	int         to;
+	int         backwardPercent;
+	int         reseekPercent;  // seek on the same connection instead of a new one
+	bool        isPaced;
+	int         serverPid;
+	int         threadCount;
+	double      maxLateness;  // ms of the 99th percentile, when paced
+	double      maxFailureRate;  // of the plays started in a stage
+};
+
+static LoadConfig config;
+static volatile bool isRunning = true;
+static volatile int  targetCount = 0;
+
+// the samples of a stage, from all the sessions
+class LoadStats
+{
+public:
+	LoadStats() : startedCount(0), completedCount(0), failedCount(0) {}
+
+	void Reset()
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		ttffs.clear();
+		gaps.clear();
+		latenesses.clear();
+		startedCount = completedCount = failedCount = 0;
+	}
+
+	boost::mutex   mutex;
+	vector<double> ttffs;  // ms from the seek to the first video frame
+	vector<double> gaps;  // ms between two video frames
+	vector<double> latenesses;  // ms after the time a frame was due, when paced
+	int            startedCount;
+	int            completedCount;
+	int            failedCount;
+};
+
+static LoadStats stats;
+
+class pb_client_session : public boost::enable_shared_from_this<pb_client_session>
+{
+private:
+	tcp::socket socket_;
+	asio::deadline_timer timer_;
+	int index_;
+	int camera_id_;
+	unsigned int seed_;
+	char header_[8];
+	char request_[64];
+	vector<unsigned char> payload_;
+
+	// the current play
+	bool     is_seeking_;
+	int      speed_;
+	bool     is_backward_;
+	uint64_t seek_time_;
+	uint64_t first_frame_time_;
+	uint64_t last_frame_time_;
+	long long first_frame_tv_;  // msec of the media
+	uint64_t frame_count_;
+
+	vector<double> gaps_;
+	vector<double> latenesses_;
+
+	pb_client_session(int index)
+		: socket_(IO_SERVICE), timer_(IO_SERVICE), index_(index),
+		  camera_id_(index % config.channelCount + 1), seed_(index * 2654435761u + 1), frame_count_(0)
+	{
+	}
+
+	unsigned int random()
+	{
+		seed_ = seed_ * 1103515245u + 12345u;
+		return seed_ >> 8;
+	}
+
+public:
+	typedef boost::shared_ptr<pb_client_session> pointer;
+
+	static pointer create(int index)
+	{
+		return pointer(new pb_client_session(index));
+	}
+
+	// video frames received so far, over all the plays
+	uint64_t frame_count()
+	{
+		boost::mutex::scoped_lock lock(stats.mutex);
+		return frame_count_;
+	}
+
+	void start()
+	{
+		asio_error_code ec;
+		socket_.close(ec);
+		if (!isRunning || (index_ >= targetCount))
+		{
+			return;
+		}
+
+		seek_time_ = GetMonotonicTime();
+		tcp::endpoint endpoint(asio::ip::address::from_string(config.host, ec), config.port);
+		socket_.async_connect(endpoint,
+				boost::bind(&pb_client_session::handle_connect, shared_from_this(), asio::placeholders::error));
+	}
+
+	void stop()
+	{
+		asio_error_code ec;
+		socket_.close(ec);
+		timer_.cancel(ec);
+	}
+
+private:
+	void handle_connect(const asio_error_code& err)
+	{
+		if (err)
+		{
+			end_play(true);
+			return;
+		}
+
+		// login: protocol_ver, user name and password in UTF-16LE, timestamp, camera_id, resolution, streaming_mode
+		static const char user_name[] = { 'a', 0, 'd', 0, 'm', 0, 'i', 0, 'n', 0 };
+		int nwrite = 8;
+		int var = PLAYBACK_VER;
+		memcpy(request_ + nwrite, &var, 4);
+		nwrite += 4;
+		var = sizeof(user_name) / 2;
+		memcpy(request_ + nwrite, &var, 4);
+		nwrite += 4;
+		memcpy(request_ + nwrite, user_name, sizeof(user_name));
+		nwrite += sizeof(user_name);
+		var = 0;
+		memcpy(request_ + nwrite, &var, 4);
+		nwrite += 4;
+		memset(request_ + nwrite, 0, 8);
+		nwrite += 8;
+		memcpy(request_ + nwrite, &camera_id_, 4);
+		nwrite += 4;
+		memset(request_ + nwrite, 0, 8);
+		nwrite += 8;
+
+		var = PACKET_TYPE_AVT_REQ;
+		memcpy(request_, &var, 4);
+		var = nwrite - 8;
+		memcpy(request_ + 4, &var, 4);
+
+		asio::async_write(socket_, asio::buffer(request_, nwrite),
+				boost::bind(&pb_client_session::handle_login_request, shared_from_this(), asio::placeholders::error));
+	}
+
+	void handle_login_request(const asio_error_code& err)
+	{
+		if (err)
+		{
+			end_play(true);
+			return;
+		}
+
+		asio::async_read(socket_, asio::buffer(request_, 16),
+				boost::bind(&pb_client_session::handle_login_response, shared_from_this(), asio::placeholders::error));
+	}
+
+	void handle_login_response(const asio_error_code& err)
+	{
+		int packet_type, status;
+		memcpy(&packet_type, request_, 4);
+		memcpy(&status, request_ + 12, 4);
+		if (err || (packet_type != PACKET_TYPE_AVT_RESP) || (status != AVREQ_RESPONCE_OK))
+		{
+			end_play(true);
+			return;
+		}
+
+		send_seek_request(false);
+	}
+
+	// pkt_type, pkt_size, PB_VER, ts_sec, ts_msec, speed, direction
+	void send_seek_request(bool is_reseek)
+	{
+		static const int speeds[] = { 1, 1, 1, 2, 4, 8 };
+
+		int var = PACKET_TYPE_AVT_SEEK;
+		memcpy(request_, &var, 4);
+		var = 20;
+		memcpy(request_ + 4, &var, 4);
+		var = PLAYBACK_VER;
+		memcpy(request_ + 8, &var, 4);
+		var = config.from + (int)(random() % (unsigned int)(config.to - config.from));
+		memcpy(request_ + 12, &var, 4);
+		var = 0;
+		memcpy(request_ + 16, &var, 4);
+		speed_ = speeds[random() % (sizeof(speeds) / sizeof(speeds[0]))];
+		memcpy(request_ + 20, &speed_, 4);
+		is_backward_ = (int)(random() % 100) < config.backwardPercent;
+		var = is_backward_ ? 1 : 0;
+		memcpy(request_ + 24, &var, 4);
+
+		is_seeking_ = true;
+		seek_time_ = GetMonotonicTime();
+		first_frame_time_ = 0ull;
+		{
+			boost::mutex::scoped_lock lock(stats.mutex);
+			stats.startedCount++;
+		}
+
+		if (is_reseek)
+		{
+			// the server reads it while it is streaming, the packets go on up to its response
+			asio::async_write(socket_, asio::buffer(request_, 28),
+					boost::bind(&pb_client_session::handle_reseek_request, shared_from_this(), asio::placeholders::error));
+		}
+		else
+		{
+			asio::async_write(socket_, asio::buffer(request_, 28),
+					boost::bind(&pb_client_session::handle_seek_request, shared_from_this(), asio::placeholders::error));
+		}
+	}
+
+	void handle_seek_request(const asio_error_code& err)
+	{
+		if (err)
+		{
+			end_play(true);
+			return;
+		}
+
+		read_packet();
+	}
+
+	void handle_reseek_request(const asio_error_code& err)
+	{
+		if (err)
+		{
+			end_play(true);
+		}
+	}
+
+	void read_packet()
+	{
+		asio::async_read(socket_, asio::buffer(header_, 8),
+				boost::bind(&pb_client_session::read_header, shared_from_this(), asio::placeholders::error));
+	}
+
+	void read_header(const asio_error_code& err)
+	{
+		int packet_type, payload_length;
+		memcpy(&packet_type, header_, 4);
+		memcpy(&payload_length, header_ + 4, 4);
+		if (err || (payload_length < 4) || (payload_length > 16 * 1024 * 1024))
+		{
+			end_play(true);
+			return;
+		}
+
+		if (payload_.size() < (size_t)payload_length)
+		{
+			payload_.resize(payload_length);
+		}
+		asio::async_read(socket_, asio::buffer(&payload_[0], payload_length),
+				boost::bind(&pb_client_session::read_rest_packet, shared_from_this(), packet_type, payload_length, asio::placeholders::error));
+	}
+
+	void read_rest_packet(int packet_type, int payload_length, const asio_error_code& err)
+	{
+		if (err)
+		{
+			end_play(true);
+			return;
+		}
+
+		if (packet_type == PACKET_TYPE_AVT_SEEK_RESPONSE)
+		{
+			// a new play starts with its stream setup
+			is_seeking_ = false;
+			read_packet();
+			return;
+		}
+		else if ((packet_type == PACKET_TYPE_AVT_STREAM_SETUP) || (packet_type != PACKET_TYPE_AVT_STREAM_DATA) || (payload_length < 28))
+		{
+			read_packet();
+			return;
+		}
+
+		// protocol_ver:4, frame_delay:4, frame_type:4, sub_channel:4, data_length:4, data, tv_sec:4, tv_msec:4
+		int frame_type, data_length, tv_sec, tv_msec;
+		memcpy(&frame_type, &payload_[8], 4);
+		memcpy(&data_length, &payload_[16], 4);
+		memcpy(&tv_sec, &payload_[payload_length - 8], 4);
+		memcpy(&tv_msec, &payload_[payload_length - 4], 4);
+
+		if ((frame_type == PACKET_TYPE_NONE) && is_seeking_)
+		{
+			// the data ended before the server took the seek, and it never reads again then: seek over a new connection
+			{
+				boost::mutex::scoped_lock lock(stats.mutex);
+				stats.startedCount--;
+			}
+			start();
+			return;
+		}
+		else if (frame_type == PACKET_TYPE_NONE)
+		{
+			// no more data or no data at all: the server repeats this packet, so hang up
+			end_play(first_frame_time_ == 0ull);
+			return;
+		}
+		else if (is_seeking_ || ((frame_type != PACKET_TYPE_I) && (frame_type != PACKET_TYPE_P) && (frame_type != PACKET_TYPE_B)))
+		{
+			read_packet();
+			return;
+		}
+
+		uint64_t now = GetMonotonicTime();
+		long long media_time = (long long)tv_sec * 1000ll + tv_msec;
+		uint64_t due_time = now;
+
+		if (first_frame_time_ == 0ull)
+		{
+			first_frame_time_ = now;
+			first_frame_tv_ = media_time;
+
+			boost::mutex::scoped_lock lock(stats.mutex);
+			stats.ttffs.push_back((now - seek_time_) / 1000.0);
+		}
+		else
+		{
+			gaps_.push_back((now - last_frame_time_) / 1000.0);
+			due_time = first_frame_time_ + (uint64_t)(llabs(media_time - first_frame_tv_) * 1000ll / speed_);
+			if (config.isPaced)
+			{
+				latenesses_.push_back(now > due_time ? (now - due_time) / 1000.0 : .0);
+			}
+		}
+		last_frame_time_ = now;
+		{
+			boost::mutex::scoped_lock lock(stats.mutex);
+			frame_count_++;
+		}
+
+		if (now - seek_time_ >= (uint64_t)config.playDuration * 1000000ull)
+		{
+			if ((int)(random() % 100) < config.reseekPercent)
+			{
+				flush_samples(false);
+				send_seek_request(true);
+				read_packet();
+			}
+			else
+			{
+				end_play(false);
+			}
+		}
+		else if (config.isPaced && (due_time > now))
+		{
+			timer_.expires_from_now(boost::posix_time::microseconds(due_time - now));
+			timer_.async_wait(boost::bind(&pb_client_session::handle_pacing, shared_from_this(), asio::placeholders::error));
+		}
+		else
+		{
+			read_packet();
+		}
+	}
+
+	void handle_pacing(const asio_error_code& err)
+	{
+		if (err)
+		{
+			end_play(false);
+			return;
+		}
+
+		read_packet();
+	}
+
+	void flush_samples(bool is_failed)
+	{
+		boost::mutex::scoped_lock lock(stats.mutex);
+		stats.gaps.insert(stats.gaps.end(), gaps_.begin(), gaps_.end());
+		stats.latenesses.insert(stats.latenesses.end(), latenesses_.begin(), latenesses_.end());
+		if (is_failed)
+		{
+			stats.failedCount++;
+		}
+		else
+		{
+			stats.completedCount++;
+		}
+		gaps_.clear();
+		latenesses_.clear();
+	}
+
+	void end_play(bool is_failed)
+	{
+		if (!isRunning)
+		{
+			return;
+		}
+
+		flush_samples(is_failed);
+		if (!is_failed)
+		{
+			start();
+			return;
+		}
+
+		// not to hammer a server that refuses
+		asio_error_code ec;
+		socket_.close(ec);
+		timer_.expires_from_now(boost::posix_time::milliseconds(100));
+		timer_.async_wait(boost::bind(&pb_client_session::handle_retry, shared_from_this(), asio::placeholders::error));
+	}
+
+	void handle_retry(const asio_error_code& err)
+	{
+		if (!err)
+		{
+			start();
+		}
+	}
+};
+
+static double GetPercentile(vector<double> &values, double percentile)
+{
+	if (values.empty())
+	{
+		return .0;
+	}
+	sort(values.begin(), values.end());
+	size_t index = (size_t)(percentile / 100.0 * (double)(values.size() - 1) + 0.5);
+	return values[min(index, values.size() - 1)];
+}
+
+static double GetStandardDeviation(const vector<double> &values)
+{
+	if (values.size() < 2)
+	{
+		return .0;
+	}
+	double sum = .0, squareSum = .0;
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		sum += values[i];
+		squareSum += values[i] * values[i];
+	}
+	double mean = sum / values.size();
+	return sqrt(max(.0, squareSum / values.size() - mean * mean));
+}
+
+// utime + stime of a process, in sec
+static double GetProcessCpuTime(int pid)
+{
+	char fileName[64];
+	sprintf(fileName, "/proc/%d/stat", pid);
+	FILE *pFile = fopen(fileName, "r");
+	if (pFile == NULL)
+	{
+		return -1.0;
+	}
+
+	char line[1024];
+	size_t length = fread(line, 1, sizeof(line) - 1, pFile);
+	fclose(pFile);
+	line[length] = '\0';
+
+	// the fields after the command name, which may contain spaces
+	const char *ptr = strrchr(line, ')');
+	unsigned long utime = 0, stime = 0;
+	if ((ptr == NULL) || (sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2))
+	{
+		return -1.0;
+	}
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static bool ParseArguments(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *pValue = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (strcmp(argv[i], "-paced") == 0)
+		{
+			config.isPaced = true;
+			continue;
+		}
+		else if (pValue == NULL)
+		{
+			return false;
+		}
+		else if (strcmp(argv[i], "-host") == 0)     config.host = pValue;
+		else if (strcmp(argv[i], "-port") == 0)     config.port = atoi(pValue);
+		else if (strcmp(argv[i], "-sessions") == 0) config.maxSessions = atoi(pValue);
+		else if (strcmp(argv[i], "-step") == 0)     config.step = atoi(pValue);
+		else if (strcmp(argv[i], "-stage") == 0)    config.stageDuration = atoi(pValue);
+		else if (strcmp(argv[i], "-play") == 0)     config.playDuration = atoi(pValue);
+		else if (strcmp(argv[i], "-channels") == 0) config.channelCount = atoi(pValue);
+		else if (strcmp(argv[i], "-from") == 0)     config.from = atoi(pValue);
+		else if (strcmp(argv[i], "-to") == 0)       config.to = atoi(pValue);
+		else if (strcmp(argv[i], "-backward") == 0) config.backwardPercent = atoi(pValue);
+		else if (strcmp(argv[i], "-reseek") == 0)   config.reseekPercent = atoi(pValue);
+		else if (strcmp(argv[i], "-pid") == 0)      config.serverPid = atoi(pValue);
+		else if (strcmp(argv[i], "-threads") == 0)  config.threadCount = atoi(pValue);
+		else
+		{
+			return false;
+		}
+		i++;
+	}
+
+	return (config.maxSessions > 0) && (config.step > 0) && (config.stageDuration > 0) && (config.playDuration > 0)
+	       && (config.channelCount > 0) && (config.to > config.from) && (config.threadCount > 0);
+}
+
+int main(int argc, char *argv[])
+{
+	if (!ParseArguments(argc, argv))
+	{
+		printf("usage: %s -from sec -to sec [-host addr] [-port n] [-sessions n] [-step n] [-stage sec] [-play sec]\n"
+		       "       [-channels n] [-backward %%] [-reseek %%] [-paced] [-pid n] [-threads n]\n", argv[0]);
+		return -1;
+	}
+
+	asio_error_code ec;
+	asio::ip::address::from_string(config.host, ec);
+	if (ec)
+	{
+		printf("invalid host address: %s\n", config.host);
+		return -1;
+	}
+
+	// the handlers run on a few threads, the main thread drives the stages
+	asio::io_service::work work(IO_SERVICE);
+	boost::thread_group threads;
+	for (int i = 0; i < config.threadCount; i++)
+	{
+		threads.create_thread(boost::bind(&asio::io_service::run, &IO_SERVICE));
+	}
+
+	vector<pb_client_session::pointer> sessions;
+	int fallenCount = 0;
+
+	printf("sessions,plays,completed,failed,ttff_p50_ms,ttff_p99_ms,fps_p50,fps_min,gap_p99_ms,gap_stddev_ms,late_p99_ms,server_cpu_pct\n");
+	for (int count = config.step; count <= config.maxSessions; count += config.step)
+	{
+		targetCount = count;
+		while ((int)sessions.size() < count)
+		{
+			sessions.push_back(pb_client_session::create((int)sessions.size()));
+			IO_SERVICE.post(boost::bind(&pb_client_session::start, sessions.back()));
+		}
+
+		// let the new sessions settle, then measure the stage
+		sleep(min(config.stageDuration, 2));
+		stats.Reset();
+		vector<uint64_t> frameCounts;
+		for (size_t i = 0; i < sessions.size(); i++)
+		{
+			frameCounts.push_back(sessions[i]->frame_count());
+		}
+		double cpuStart = config.serverPid != 0 ? GetProcessCpuTime(config.serverPid) : -1.0;
+		uint64_t begin = GetMonotonicTime();
+
+		sleep(config.stageDuration);
+
+		double elapsed = (GetMonotonicTime() - begin) / 1000000.0;
+		double cpuEnd = config.serverPid != 0 ? GetProcessCpuTime(config.serverPid) : -1.0;
+		vector<double> fpses;
+		for (size_t i = 0; i < sessions.size(); i++)
+		{
+			fpses.push_back((sessions[i]->frame_count() - frameCounts[i]) / elapsed);
+		}
+
+		boost::mutex::scoped_lock lock(stats.mutex);
+		double latenessP99 = GetPercentile(stats.latenesses, 99.0);
+		printf("%d,%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+		       count, stats.startedCount, stats.completedCount, stats.failedCount,
+		       GetPercentile(stats.ttffs, 50.0), GetPercentile(stats.ttffs, 99.0),
+		       GetPercentile(fpses, 50.0), GetPercentile(fpses, .0),
+		       GetPercentile(stats.gaps, 99.0), GetStandardDeviation(stats.gaps), latenessP99,
+		       ((cpuStart >= .0) && (cpuEnd >= .0)) ? (cpuEnd - cpuStart) * 100.0 / elapsed : -1.0);
+		fflush(stdout);
+
+		// fallen over: plays fail, or paced frames come later and later
+		if ((stats.failedCount > config.maxFailureRate * max(stats.startedCount, 1))
+		    || (config.isPaced && (latenessP99 > config.maxLateness)))
+		{
+			fallenCount = count;
+			break;
+		}
+	}
+
+	if (fallenCount != 0)
+	{
+		printf("# fell over at %d sessions\n", fallenCount);
+	}
+	else
+	{
+		printf("# kept up with %d sessions\n", config.maxSessions);
+	}
+
+	isRunning = false;
+	for (size_t i = 0; i < sessions.size(); i++)
+	{
+		IO_SERVICE.post(boost::bind(&pb_client_session::stop, sessions[i]));
+	}
+	IO_SERVICE.stop();
+	threads.join_all();
+
+	return fallenCount != 0 ? 1 : 0;
+}